@@ -0,0 +1,372 @@
+// Banco de pruebas de rendimiento: cada filtro sobre imagenes sinteticas de varios
+// tamanos y con distinto numero de hilos, y la carga y el guardado en PNG, QOI, PPM y raw. Resultados en JSON (una medicion por linea)
+// para comparar versiones.
+//
+//   gcc -O2 -o img_bench img_bench.c -pthread -lm -lz
+//   ./img_bench [--sizes 1,12,24,100] [--channels 1,3] [--threads 1,2,4,...] [--reps N]
+//               [--json salida.json] [--compare anterior.json] [--tolerance PORCENTAJE]
+
+#define IMG_SIN_MAIN
+#include "img_extendido.c"
+
+#define MAX_LISTA_BENCH 32
+#define VERSION_BENCH 1
+
+typedef enum {
+    BENCH_BRILLO,
+    BENCH_BLUR,
+    BENCH_ROTAR,
+    BENCH_SOBEL,
+    BENCH_RESIZE,
+    BENCH_HISTOGRAMA,
+    BENCH_MEDIANA,
+    BENCH_INTEGRAL,
+    BENCH_CONVOLUCION,
+    BENCH_GUARDAR,
+    BENCH_CARGAR
+} OperacionBench;
+
+typedef struct {
+    OperacionBench op;
+    const char* nombre;
+    const char* parametros;
+    int tamKernel;
+    float sigma;
+} CasoBench;
+
+static const CasoBench casosBench[] = {
+    { BENCH_BRILLO, "brillo", "delta=20", 0, 0.0f },
+    { BENCH_BLUR, "blur", "k=3 s=1.0", 3, 1.0f },
+    { BENCH_BLUR, "blur", "k=7 s=2.0", 7, 2.0f },
+    { BENCH_BLUR, "blur", "k=15 s=3.0", 15, 3.0f },
+    { BENCH_BLUR, "blur", "k=61 s=10.0", 61, 10.0f },
+    { BENCH_ROTAR, "rotar", "30 grados", 0, 0.0f },
+    { BENCH_ROTAR, "rotar", "90 grados", 0, 0.0f },
+    { BENCH_SOBEL, "sobel", "L2", 0, 0.0f },
+    { BENCH_RESIZE, "resize", "50% bilineal", 0, 0.0f },
+    { BENCH_RESIZE, "resize", "200% bilineal", 0, 0.0f },
+    { BENCH_HISTOGRAMA, "ecualizar", "global", 0, 0.0f },
+    { BENCH_HISTOGRAMA, "clahe", "8x8 l=2.0", 8, 2.0f },
+    { BENCH_MEDIANA, "mediana", "r=1", 1, 0.0f },
+    { BENCH_MEDIANA, "mediana", "r=10", 10, 0.0f },
+    { BENCH_INTEGRAL, "caja", "r=50", 50, 0.0f },
+    { BENCH_INTEGRAL, "umbral", "r=15 k=0.2", 15, 0.2f },
+    { BENCH_CONVOLUCION, "convolucion", "sharpen", 0, 0.0f },
+    { BENCH_CONVOLUCION, "convolucion", "motion:15:30", 0, 0.0f },
+    // E/S: cada formato se guarda antes de cargarlo (cargar lee lo que dejo guardar).
+    { BENCH_GUARDAR, "guardar", "png", 0, 0.0f },
+    { BENCH_CARGAR, "cargar", "png", 0, 0.0f },
+    { BENCH_GUARDAR, "guardar", "qoi", 0, 0.0f },
+    { BENCH_CARGAR, "cargar", "qoi", 0, 0.0f },
+    { BENCH_GUARDAR, "guardar", "ppm", 0, 0.0f },
+    { BENCH_CARGAR, "cargar", "ppm", 0, 0.0f },
+    { BENCH_GUARDAR, "guardar", "raw", 0, 0.0f },
+    { BENCH_CARGAR, "cargar", "raw", 0, 0.0f },
+};
+
+// La E/S no usa el pool: se mide una vez, con 1 hilo.
+static int esCasoES(const CasoBench* c) {
+    return c->op == BENCH_GUARDAR || c->op == BENCH_CARGAR;
+}
+
+// PPM/PGM no guardan alfa: sus casos de E/S se omiten con 2 y 4 canales.
+static int casoAdmiteCanales(const CasoBench* c, int canales) {
+    return !(esCasoES(c) && !strcmp(c->parametros, "ppm") && canales % 2 == 0);
+}
+
+// Fichero temporal de cada formato para los casos de E/S.
+static void rutaBench(const CasoBench* c, char* ruta, size_t tam) {
+    const char* dir = getenv("TMPDIR");
+    snprintf(ruta, tam, "%s/img_bench_%d.%s", dir && *dir ? dir : "/tmp", (int)getpid(), c->parametros);
+}
+
+typedef struct {
+    int mp[MAX_LISTA_BENCH], numMp;
+    int canales[MAX_LISTA_BENCH], numCanales;
+    int hilos[MAX_LISTA_BENCH], numHilos;
+    int repeticiones;
+    const char* json;
+    const char* comparar;
+    double tolerancia;          // porcentaje de empeoramiento admitido en la mediana
+} OpcionesBench;
+
+// Contenido pseudoaleatorio con gradiente, igual en cada ejecucion.
+static int generarImagenSintetica(ImagenInfo* img, int mp, int canales) {
+    img->ancho = (int)lround(sqrt(mp * 1e6 * 4.0 / 3.0));
+    img->alto = (int)lround(img->ancho * 3.0 / 4.0);
+    img->canales = canales;
+    img->profundidad = 8;
+    img->pixeles = asignarPixeles(img->alto, img->ancho, canales, &img->stride);
+    if (!img->pixeles) return 0;
+    uint32_t estado = 2463534242u;
+    for (int y = 0; y < img->alto; y++) {
+        unsigned char* p = PIXEL(img, y, 0);
+        for (int x = 0; x < img->ancho * canales; x++) {
+            estado ^= estado << 13;
+            estado ^= estado >> 17;
+            estado ^= estado << 5;
+            p[x] = (unsigned char)(((x / canales) * 255 / img->ancho + y * 255 / img->alto) / 2 + (estado & 63));
+        }
+    }
+    return 1;
+}
+
+static int copiarImagen(const ImagenInfo* src, ImagenInfo* dst) {
+    *dst = *src;
+    dst->pixeles = asignarPixeles(src->alto, src->ancho, src->canales, &dst->stride);
+    if (!dst->pixeles) return 0;
+    for (int y = 0; y < src->alto; y++) memcpy(PIXEL(dst, y, 0), PIXEL(src, y, 0), (size_t)src->ancho * src->canales);
+    return 1;
+}
+
+static int ejecutarCasoBench(const CasoBench* c, ImagenInfo* img, int hilos) {
+    switch (c->op) {
+        case BENCH_BRILLO: {
+            // Misma cadena que ajustarBrilloConcurrente, pero con el numero de hilos elegido.
+            CadenaPuntual cadena;
+            iniciarCadenaPuntual(&cadena);
+            componerBrillo(&cadena, 20);
+            aplicarCadenaPuntual(img, &cadena, hilos);
+            return 1;
+        }
+        case BENCH_BLUR:
+            return aplicarConvolucionGaussianaModo(img, c->tamKernel, c->sigma, hilos, BLUR_AUTO);
+        case BENCH_ROTAR:
+            return rotarImagenRelleno(img, strstr(c->parametros, "90") ? 90.0 : 30.0, hilos,
+                                      (const unsigned char[4]){ 0, 0, 0, 0 });
+        case BENCH_SOBEL:
+            return detectarBordesSobelModo(img, hilos, SOBEL_L2, 0);
+        case BENCH_RESIZE: {
+            int doble = strstr(c->parametros, "200") != NULL;
+            int w = doble ? img->ancho * 2 : img->ancho / 2;
+            int h = doble ? img->alto * 2 : img->alto / 2;
+            return redimensionarImagenFiltro(img, w, h, hilos, FILTRO_BILINEAL);
+        }
+        case BENCH_CONVOLUCION: {
+            KernelConvolucion k;
+            return cargarKernelConvolucion(c->parametros, &k) && aplicarConvolucionGeneral(img, &k, hilos);
+        }
+        case BENCH_INTEGRAL:
+            return aplicarFiltroIntegral(img, c->sigma > 0.0f ? INTEGRAL_UMBRAL : INTEGRAL_CAJA, c->tamKernel,
+                                         c->sigma, hilos);
+        case BENCH_MEDIANA:
+            return aplicarMediana(img, c->tamKernel, hilos);
+        case BENCH_HISTOGRAMA:
+            return aplicarHistograma(img, c->tamKernel ? HIST_CLAHE : HIST_ECUALIZAR, c->tamKernel, c->sigma, hilos);
+        case BENCH_GUARDAR: {
+            char ruta[PATH_MAX];
+            rutaBench(c, ruta, sizeof(ruta));
+            return guardarPNGHilos(img, ruta, hilos);
+        }
+        case BENCH_CARGAR: {
+            char ruta[PATH_MAX];
+            rutaBench(c, ruta, sizeof(ruta));
+            liberarImagen(img);
+            if (!cargarImagen(ruta, img)) return 0;
+            // Un mapeo carga las paginas al tocarlas: se lee un byte por pagina para que
+            // la medicion incluya traer los pixeles, como cuando decodifica stb.
+            volatile unsigned char suma = 0;
+            size_t bytes = (size_t)(img->alto - 1) * img->stride + (size_t)img->ancho * BYTES_PIXEL(img);
+            for (size_t i = 0; i < bytes; i += 4096) suma += img->pixeles[i];
+            (void)suma;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int parsearListaBench(const char* s, int* lista, int* n) {
+    char buf[256];
+    char* campos[MAX_LISTA_BENCH];
+    int k = partirCampos(s, ',', buf, sizeof(buf), campos, MAX_LISTA_BENCH);
+    if (k <= 0) return 0;
+    for (int i = 0; i < k; i++) {
+        if (!leerEntero(campos[i], &lista[i]) || lista[i] < 1) return 0;
+    }
+    *n = k;
+    return 1;
+}
+
+static void mostrarUsoBench(const char* prog) {
+    printf("Uso: %s [opciones]\n", prog);
+    printf("  --sizes L        megapixeles separados por comas (defecto 1,12,24,100)\n");
+    printf("  --channels L     canales de 1 a 4, 2 y 4 con alfa (defecto 1,3)\n");
+    printf("  --threads L      hilos (defecto 1, 2, 4, ... hasta todos los nucleos)\n");
+    printf("  --reps N         repeticiones por medicion (defecto 5)\n");
+    printf("  --json RUTA      escribe los resultados en RUTA (defecto salida estandar)\n");
+    printf("  --compare RUTA   compara con un JSON anterior; sale con 1 si alguna mediana empeora\n");
+    printf("  --tolerance P    empeoramiento admitido en %% (defecto 10)\n");
+}
+
+static int parsearOpcionesBench(int argc, char* argv[], OpcionesBench* op) {
+    for (int i = 1; i < argc; i++) {
+        const char* a = argv[i];
+        if (!strcmp(a, "-h") || !strcmp(a, "--help")) {
+            mostrarUsoBench(argv[0]);
+            exit(EXIT_SUCCESS);
+        }
+        if (i + 1 >= argc) { fprintf(stderr, "Falta el valor de %s\n", a); return 0; }
+        const char* v = argv[++i];
+        int ok;
+        if (!strcmp(a, "--sizes")) ok = parsearListaBench(v, op->mp, &op->numMp);
+        else if (!strcmp(a, "--channels")) ok = parsearListaBench(v, op->canales, &op->numCanales);
+        else if (!strcmp(a, "--threads")) ok = parsearListaBench(v, op->hilos, &op->numHilos);
+        else if (!strcmp(a, "--reps")) ok = leerEntero(v, &op->repeticiones) && op->repeticiones > 0;
+        else if (!strcmp(a, "--json")) ok = (op->json = v) != NULL;
+        else if (!strcmp(a, "--compare")) ok = (op->comparar = v) != NULL;
+        else if (!strcmp(a, "--tolerance")) ok = leerReal(v, &op->tolerancia) && op->tolerancia >= 0.0;
+        else { fprintf(stderr, "Opcion desconocida: %s\n", a); return 0; }
+        if (!ok) { fprintf(stderr, "Valor invalido para %s: %s\n", a, v); return 0; }
+    }
+    for (int i = 0; i < op->numCanales; i++) {
+        if (op->canales[i] < 1 || op->canales[i] > 4) { fprintf(stderr, "Canales: de 1 a 4.\n"); return 0; }
+    }
+    return 1;
+}
+
+// Clave que identifica una medicion entre versiones.
+static void claveMedicion(char* clave, size_t tam, const char* op, const char* parametros, int mp, int canales,
+                          int hilos) {
+    snprintf(clave, tam, "%s|%s|%d|%d|%d", op, parametros, mp, canales, hilos);
+}
+
+// Lee las medianas de un JSON escrito por este programa (una medicion por linea).
+static int compararConAnterior(const char* ruta, const char* const* claves, const double* medianas, int n,
+                               double tolerancia) {
+    FILE* f = fopen(ruta, "r");
+    if (!f) { fprintf(stderr, "No se puede leer %s\n", ruta); return -1; }
+    char linea[1024];
+    int peores = 0, comparadas = 0;
+    while (fgets(linea, sizeof(linea), f)) {
+        char op[64], parametros[64];
+        int mp, canales, hilos;
+        double mediana;
+        const char* p = linea + strspn(linea, " ,");
+        if (sscanf(p, "{\"operacion\": \"%63[^\"]\", \"parametros\": \"%63[^\"]\", \"mp\": %d, \"canales\": %d, "
+                   "\"hilos\": %d, \"repeticiones\": %*d, \"mediana_s\": %lf",
+                   op, parametros, &mp, &canales, &hilos, &mediana) != 6) {
+            continue;
+        }
+        char clave[256];
+        claveMedicion(clave, sizeof(clave), op, parametros, mp, canales, hilos);
+        for (int i = 0; i < n; i++) {
+            if (strcmp(clave, claves[i])) continue;
+            comparadas++;
+            double cambio = 100.0 * (medianas[i] - mediana) / mediana;
+            if (cambio > tolerancia) {
+                fprintf(stderr, "REGRESION %s: %.4f s -> %.4f s (%+.1f%%)\n", clave, mediana, medianas[i], cambio);
+                peores++;
+            }
+        }
+    }
+    fclose(f);
+    fprintf(stderr, "Comparadas %d mediciones con %s: %d regresion(es) por encima del %.0f%%.\n", comparadas, ruta,
+            peores, tolerancia);
+    return peores;
+}
+
+int main(int argc, char* argv[]) {
+    OpcionesBench op = { { 1, 12, 24, 100 }, 4, { 1, 3 }, 2, { 0 }, 0, 5, NULL, NULL, 10.0 };
+    if (!parsearOpcionesBench(argc, argv, &op)) return SALIDA_USO;
+    int nucleos = hilosPorDefecto();
+    if (op.numHilos == 0) {
+        for (int h = 1; h < nucleos && op.numHilos < MAX_LISTA_BENCH - 1; h *= 2) op.hilos[op.numHilos++] = h;
+        op.hilos[op.numHilos++] = nucleos;
+    }
+    FILE* salida = op.json ? fopen(op.json, "w") : stdout;
+    if (!salida) { fprintf(stderr, "No se puede escribir %s\n", op.json); return SALIDA_ERROR; }
+
+    int numCasos = (int)(sizeof(casosBench) / sizeof(casosBench[0]));
+    int total = op.numMp * op.numCanales * numCasos * op.numHilos;
+    char** claves = (char**)calloc(total, sizeof(char*));
+    double* medianas = (double*)calloc(total, sizeof(double));
+    double* tiempos = (double*)malloc(op.repeticiones * sizeof(double));
+    if (!claves || !medianas || !tiempos) { fprintf(stderr, "Error de memoria.\n"); return SALIDA_ERROR; }
+
+    iniciarPoolHilos(nucleos);
+    silencioso = 1;
+    time_t ahora = time(NULL);
+    char fecha[32];
+    strftime(fecha, sizeof(fecha), "%Y-%m-%dT%H:%M:%S", localtime(&ahora));
+    fprintf(salida, "{\"version\": %d, \"fecha\": \"%s\", \"nucleos\": %d, \"avx2\": %s, \"resultados\": [\n",
+            VERSION_BENCH, fecha, nucleos, cpuUsaAVX2() ? "true" : "false");
+    fprintf(stderr, "%-7s %-14s %4s %3s %5s %10s %10s %9s %6s\n", "op", "parametros", "MP", "can", "hilos",
+            "mediana s", "p95 s", "MP/s", "efic");
+
+    int n = 0, codigo = EXIT_SUCCESS;
+    for (int im = 0; im < op.numMp; im++) {
+        for (int ic = 0; ic < op.numCanales; ic++) {
+            ImagenInfo base = {0, 0, 0, 0, NULL, 8};
+            if (!generarImagenSintetica(&base, op.mp[im], op.canales[ic])) {
+                fprintf(stderr, "Sin memoria para %d MP x %d canales; se omite.\n", op.mp[im], op.canales[ic]);
+                codigo = SALIDA_ERROR;
+                continue;
+            }
+            double mpx = (double)base.ancho * base.alto / 1e6;
+            for (int c = 0; c < numCasos; c++) {
+                double medianaUnHilo = 0.0;
+                if (!casoAdmiteCanales(&casosBench[c], op.canales[ic])) continue;
+                int es = esCasoES(&casosBench[c]);
+                for (int ih = 0; ih < (es ? 1 : op.numHilos); ih++) {
+                    int hilos = es ? 1 : op.hilos[ih];
+                    int ok = 1;
+                    for (int r = 0; r < op.repeticiones && ok; r++) {
+                        ImagenInfo img;
+                        if (!copiarImagen(&base, &img)) { ok = 0; break; }
+                        double t0 = ahoraSeg();
+                        ok = ejecutarCasoBench(&casosBench[c], &img, hilos);
+                        tiempos[r] = ahoraSeg() - t0;
+                        liberarImagen(&img);
+                    }
+                    if (!ok) {
+                        fprintf(stderr, "Fallo %s %s con %d MP.\n", casosBench[c].nombre, casosBench[c].parametros,
+                                op.mp[im]);
+                        codigo = SALIDA_ERROR;
+                        continue;
+                    }
+                    qsort(tiempos, op.repeticiones, sizeof(double), compararDobles);
+                    double mediana = percentil(tiempos, op.repeticiones, 50.0);
+                    double p95 = percentil(tiempos, op.repeticiones, 95.0);
+                    if (hilos == 1) medianaUnHilo = mediana;
+                    // Eficiencia = aceleracion respecto a 1 hilo / hilos (solo si se midio 1 hilo).
+                    double eficiencia = medianaUnHilo > 0.0 ? medianaUnHilo / (mediana * hilos) : 0.0;
+
+                    char clave[256];
+                    claveMedicion(clave, sizeof(clave), casosBench[c].nombre, casosBench[c].parametros, op.mp[im],
+                                  op.canales[ic], hilos);
+                    claves[n] = strdup(clave);
+                    medianas[n++] = mediana;
+                    fprintf(salida, "%s  {\"operacion\": \"%s\", \"parametros\": \"%s\", \"mp\": %d, \"canales\": %d, "
+                            "\"hilos\": %d, \"repeticiones\": %d, \"mediana_s\": %.6f, \"p95_s\": %.6f, "
+                            "\"mp_s\": %.2f, \"eficiencia\": %.3f}\n",
+                            n > 1 ? "," : " ", casosBench[c].nombre, casosBench[c].parametros, op.mp[im],
+                            op.canales[ic], hilos, op.repeticiones, mediana, p95, mpx / mediana, eficiencia);
+                    fflush(salida);
+                    fprintf(stderr, "%-7s %-14s %4d %3d %5d %10.4f %10.4f %9.1f %6.2f\n", casosBench[c].nombre,
+                            casosBench[c].parametros, op.mp[im], op.canales[ic], hilos, mediana, p95, mpx / mediana,
+                            eficiencia);
+                }
+            }
+            liberarImagen(&base);
+        }
+    }
+    for (int c = 0; c < numCasos; c++) {
+        char ruta[PATH_MAX];
+        rutaBench(&casosBench[c], ruta, sizeof(ruta));
+        if (casosBench[c].op == BENCH_GUARDAR) unlink(ruta);
+    }
+    fprintf(salida, "]}\n");
+    if (op.json) fclose(salida);
+    silencioso = 0;
+
+    if (op.comparar) {
+        int peores = compararConAnterior(op.comparar, (const char* const*)claves, medianas, n, op.tolerancia);
+        if (peores != 0) codigo = SALIDA_ERROR;
+    }
+    for (int i = 0; i < n; i++) free(claves[i]);
+    free(claves);
+    free(medianas);
+    free(tiempos);
+    destruirPoolHilos();
+    return codigo;
+}
@@ -1,661 +1,7478 @@
+// pthread_setaffinity_np, sched_getcpu y CPU_SET para fijar los trabajadores a nucleos.
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <math.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <semaphore.h>
+#include <zlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
 
 typedef struct {
     int ancho;       
     int alto;    
     int canales;     
-    unsigned char*** pixeles; 
+    size_t stride;          // bytes por fila (>= ancho * canales * bytes por muestra)
+    unsigned char* pixeles; // buffer contiguo entrelazado, fila y en pixeles + y * stride
+    int profundidad;        // bits por canal: 8 o 16 (uint16_t en el orden de la maquina)
 } ImagenInfo;
 
-// UTILIDADES DE MEMORIA
+// 1 o 3 canales son grises o RGB; 2 y 4 llevan ademas alfa (no premultiplicado) al final.
+#define TIENE_ALFA(img) ((img)->canales == 2 || (img)->canales == 4)
+#define BYTES_MUESTRA(img) ((img)->profundidad == 16 ? 2 : 1)
+#define BYTES_PIXEL(img) ((size_t)(img)->canales * BYTES_MUESTRA(img))
+
+// Puntero al pixel (y, x) de una imagen de 8 bits; los canales quedan consecutivos.
+#define PIXEL(img, y, x) ((img)->pixeles + (size_t)(y) * (img)->stride + (size_t)(x) * (img)->canales)
+// Fila y de una imagen de 16 bits.
+#define FILA16(img, y) ((uint16_t*)((img)->pixeles + (size_t)(y) * (img)->stride))
+
+// Muestra de 16 bits redondeada a 8 (v / 257) y de 8 a 16 (v * 257, exacto en los extremos).
+#define MUESTRA_A_8(v) ((unsigned char)(((uint32_t)(v) * 255 + 32895) >> 16))
+#define MUESTRA_A_16(v) ((uint16_t)((v) * 257))
+
+// Nombre de la disposicion de canales para los mensajes.
+static const char* nombreCanales(const ImagenInfo* img) {
+    static const char* nombres[] = { "?", "grises", "grises+alfa", "RGB", "RGBA" };
+    return img->canales >= 1 && img->canales <= 4 ? nombres[img->canales] : nombres[0];
+}
+
+#define ALINEACION_FILAS 64
+#define MAX_HILOS_POOL 256
+
+//  MEDICION 
+
+static double ahoraSeg(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compararDobles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : (x > y);
+}
+
+// Percentil por rango mas cercano sobre tiempos ya ordenados.
+static double percentil(const double* t, int n, double p) {
+    int i = (int)ceil(p / 100.0 * n) - 1;
+    return t[i < 0 ? 0 : (i >= n ? n - 1 : i)];
+}
+
+// Mensajes de progreso de las operaciones; el procesamiento por lotes los silencia.
+static int silencioso = 0;
+
+static void informar(const char* formato, ...) {
+    if (silencioso) return;
+    va_list args;
+    va_start(args, formato);
+    vprintf(formato, args);
+    va_end(args);
+}
 
-unsigned char*** asignarPixeles(int alto, int ancho, int canales) {
-    unsigned char*** pix = (unsigned char***)malloc(alto * sizeof(unsigned char**));
-    if (!pix) return NULL;
-    for (int y = 0; y < alto; y++) {
-        pix[y] = (unsigned char**)malloc(ancho * sizeof(unsigned char*));
-        if (!pix[y]) {
-            for (int yy = 0; yy < y; yy++) free(pix[yy]);
-            free(pix);
-            return NULL;
+// Pico de memoria residente del proceso en KB.
+static long picoRSSKb(void) {
+    struct rusage uso;
+    if (getrusage(RUSAGE_SELF, &uso) != 0) return -1;
+    return uso.ru_maxrss;
+}
+
+// Fallos de pagina menores del proceso: cada pagina de memoria nueva que se toca.
+static long fallosPagina(void) {
+    struct rusage uso;
+    if (getrusage(RUSAGE_SELF, &uso) != 0) return 0;
+    return uso.ru_minflt;
+}
+
+//  TOPOLOGIA Y AFINIDAD
+
+// En un servidor con varios sockets cada nodo NUMA tiene su memoria: leer la de otro
+// nodo cuesta mas latencia y comparte el enlace entre sockets. La topologia se lee de
+// /sys/devices/system/node, sin libnuma; si no esta, todas las CPUs son del nodo 0.
+// Con --affinity cada trabajador del pool se fija a una CPU al arrancar, asi que el
+// trabajador i (el que recibe el bloque i de porciones) no cambia de nodo.
+
+#define MAX_NODOS_NUMA 64
+
+typedef enum { AFINIDAD_NO, AFINIDAD_COMPACTA, AFINIDAD_DISPERSA } ModoAfinidad;
+
+static ModoAfinidad modoAfinidad = AFINIDAD_NO;
+
+typedef struct {
+    int numNodos;
+    int numCpus;                        // CPUs permitidas al proceso
+    int cpus[CPU_SETSIZE];              // las permitidas, agrupadas por nodo
+    int nodoCpu[CPU_SETSIZE];           // nodo de cada numero de CPU
+    int primeraNodo[MAX_NODOS_NUMA];    // indice en cpus de la primera de cada nodo
+    int cpusNodo[MAX_NODOS_NUMA];
+} Topologia;
+
+static Topologia topologia;
+static pthread_once_t topologiaUnaVez = PTHREAD_ONCE_INIT;
+
+// Marca con nodo las CPUs de una lista de sysfs ("0-3,8-11").
+static void leerListaCpus(const char* ruta, int nodo, int* nodoCpu) {
+    FILE* f = fopen(ruta, "r");
+    if (!f) return;
+    char linea[4096];
+    if (fgets(linea, sizeof(linea), f)) {
+        char* p = linea;
+        while (*p && *p != '\n') {
+            char* fin;
+            long a = strtol(p, &fin, 10), b = a;
+            if (fin == p) break;
+            if (*fin == '-') {
+                p = fin + 1;
+                b = strtol(p, &fin, 10);
+            }
+            for (long c = a < 0 ? 0 : a; c <= b && c < CPU_SETSIZE; c++) nodoCpu[c] = nodo;
+            p = *fin == ',' ? fin + 1 : fin;
         }
-        for (int x = 0; x < ancho; x++) {
-            pix[y][x] = (unsigned char*)malloc(canales * sizeof(unsigned char));
-            if (!pix[y][x]) {
-                for (int xx = 0; xx < x; xx++) free(pix[y][xx]);
-                for (int yy = 0; yy <= y; yy++) free(pix[yy]);
-                free(pix);
-                return NULL;
+    }
+    fclose(f);
+}
+
+// Se lee una vez, desde el hilo principal antes de fijar ninguno: sched_getaffinity
+// devuelve entonces las CPUs permitidas al proceso y no las de un trabajador fijado.
+static void cargarTopologia(void) {
+    Topologia* t = &topologia;
+    int maxNodo = 0;
+    DIR* d = opendir("/sys/devices/system/node");
+    if (d) {
+        struct dirent* e;
+        while ((e = readdir(d)) != NULL) {
+            if (strncmp(e->d_name, "node", 4) || !isdigit((unsigned char)e->d_name[4])) continue;
+            char* fin;
+            long n = strtol(e->d_name + 4, &fin, 10);
+            if (*fin || n >= MAX_NODOS_NUMA) continue;
+            char ruta[PATH_MAX];
+            snprintf(ruta, sizeof(ruta), "/sys/devices/system/node/%s/cpulist", e->d_name);
+            leerListaCpus(ruta, (int)n, t->nodoCpu);
+            if (n > maxNodo) maxNodo = (int)n;
+        }
+        closedir(d);
+    }
+    t->numNodos = maxNodo + 1;
+
+    cpu_set_t permitidas;
+    CPU_ZERO(&permitidas);
+    if (sched_getaffinity(0, sizeof(permitidas), &permitidas) != 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        for (long c = 0; c < n && c < CPU_SETSIZE; c++) CPU_SET(c, &permitidas);
+    }
+    for (int n = 0; n < t->numNodos; n++) {
+        t->primeraNodo[n] = t->numCpus;
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &permitidas) && t->nodoCpu[c] == n) t->cpus[t->numCpus++] = c;
+        }
+        t->cpusNodo[n] = t->numCpus - t->primeraNodo[n];
+    }
+}
+
+// "dispersa" (o vacio), "compacta" o "0"; devuelve 0 si no es ninguno de ellos.
+int fijarModoAfinidad(const char* valor) {
+    if (!valor || !*valor || !strcasecmp(valor, "dispersa") || !strcasecmp(valor, "scatter")) {
+        modoAfinidad = AFINIDAD_DISPERSA;
+    } else if (!strcasecmp(valor, "compacta") || !strcasecmp(valor, "compact")) {
+        modoAfinidad = AFINIDAD_COMPACTA;
+    } else if (!strcmp(valor, "0")) {
+        modoAfinidad = AFINIDAD_NO;
+    } else {
+        return 0;
+    }
+    pthread_once(&topologiaUnaVez, cargarTopologia);
+    return 1;
+}
+
+static int numNodosNUMA(void) {
+    pthread_once(&topologiaUnaVez, cargarTopologia);
+    return topologia.numNodos;
+}
+
+static int nodoDeCpu(int cpu) {
+    pthread_once(&topologiaUnaVez, cargarTopologia);
+    return cpu >= 0 && cpu < CPU_SETSIZE ? topologia.nodoCpu[cpu] : -1;
+}
+
+// Nodo en el que corre ahora el hilo que llama (-1 si no se sabe).
+static int nodoActual(void) {
+    return nodoDeCpu(sched_getcpu());
+}
+
+// CPU del trabajador id. Compacta llena un nodo antes de pasar al siguiente; dispersa
+// alterna nodos entre trabajadores consecutivos, para sumar el ancho de banda de todos
+// aunque haya pocos hilos.
+static int cpuDeTrabajador(int id) {
+    pthread_once(&topologiaUnaVez, cargarTopologia);
+    const Topologia* t = &topologia;
+    if (t->numCpus == 0) return -1;
+    if (modoAfinidad == AFINIDAD_COMPACTA) return t->cpus[id % t->numCpus];
+    int conCpus[MAX_NODOS_NUMA], k = 0;
+    for (int n = 0; n < t->numNodos; n++) {
+        if (t->cpusNodo[n]) conCpus[k++] = n;
+    }
+    int nodo = conCpus[id % k];
+    return t->cpus[t->primeraNodo[nodo] + (id / k) % t->cpusNodo[nodo]];
+}
+
+// Fija el hilo que llama a la CPU del trabajador id; devuelve la CPU o -1.
+static int fijarAfinidadHilo(int id) {
+    int cpu = cpuDeTrabajador(id);
+    if (cpu < 0) return -1;
+    cpu_set_t s;
+    CPU_ZERO(&s);
+    CPU_SET(cpu, &s);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(s), &s) != 0) return -1;
+    return cpu;
+}
+
+//  ESTADISTICAS
+
+// Con --stats (o IMG_STATS en el entorno) cada operacion registra donde se le va el
+// tiempo: reservas, arranque de hilos del pool, calculo de las porciones, espera hasta
+// que el que llama se entera de que acabaron, y liberaciones. Apagado, el coste es
+// comprobar un puntero por porcion y un entero por reserva.
+
+typedef enum { ESTADISTICAS_NO, ESTADISTICAS_TABLA, ESTADISTICAS_JSON } ModoEstadisticas;
+
+static ModoEstadisticas modoEstadisticas = ESTADISTICAS_NO;
+
+typedef struct {
+    char nombre[96];
+    double inicio;
+    atomic_llong nsAsignar, nsLiberar, nsArranque, nsCalculo, nsEspera;
+    atomic_llong bytesAsignados;       // memoria nueva para pixeles
+    atomic_llong bytesReutilizados;    // servida por la arena sin pedir memoria nueva
+    long fallosInicio;                 // fallos de pagina menores del proceso al abrir
+    atomic_int porciones;
+    atomic_llong nsPorcionMax;
+    atomic_llong nsOcupado[MAX_HILOS_POOL + 1];   // por id de trabajador; el ultimo es el hilo que llama
+    atomic_int nodoHilo[MAX_HILOS_POOL + 1];      // nodo + 1 donde corrio cada uno (0 = no corrio)
+    atomic_llong nsNodo[MAX_NODOS_NUMA], filasNodo[MAX_NODOS_NUMA];
+    long long bytesTrafico;            // entrada + salida de la operacion (0 = no se sabe)
+} EstadisticasOp;
+
+// Operacion en curso del hilo que la lanzo (NULL si no se mide).
+static __thread EstadisticasOp* estadisticasActuales = NULL;
+
+// "tabla" (o vacio, o 1), "json" o "0"; devuelve 0 si no es ninguno de ellos.
+int fijarModoEstadisticas(const char* valor) {
+    if (!valor || !*valor || !strcmp(valor, "1") || !strcasecmp(valor, "tabla") || !strcasecmp(valor, "table")) {
+        modoEstadisticas = ESTADISTICAS_TABLA;
+    } else if (!strcasecmp(valor, "json")) {
+        modoEstadisticas = ESTADISTICAS_JSON;
+    } else if (!strcmp(valor, "0")) {
+        modoEstadisticas = ESTADISTICAS_NO;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static inline long long nsDesde(double t0) {
+    return (long long)((ahoraSeg() - t0) * 1e9);
+}
+
+void abrirEstadisticas(const char* nombre) {
+    if (modoEstadisticas == ESTADISTICAS_NO) return;
+    EstadisticasOp* st = (EstadisticasOp*)calloc(1, sizeof(EstadisticasOp));
+    if (!st) return;
+    snprintf(st->nombre, sizeof(st->nombre), "%s", nombre);
+    st->inicio = ahoraSeg();
+    st->fallosInicio = fallosPagina();
+    estadisticasActuales = st;
+}
+
+// Bytes leidos y escritos por la operacion en curso, para el ancho de banda por nodo.
+void anotarTrafico(long long bytes) {
+    if (estadisticasActuales) estadisticasActuales->bytesTrafico = bytes;
+}
+
+static void registrarPorcion(EstadisticasOp* st, int id, long long ns, int filas) {
+    int i = id >= 0 && id < MAX_HILOS_POOL ? id : MAX_HILOS_POOL;
+    atomic_fetch_add(&st->nsOcupado[i], ns);
+    atomic_fetch_add(&st->porciones, 1);
+    int nodo = nodoActual();
+    if (nodo >= 0 && nodo < MAX_NODOS_NUMA) {
+        atomic_fetch_add(&st->nsNodo[nodo], ns);
+        atomic_fetch_add(&st->filasNodo[nodo], filas);
+        atomic_store(&st->nodoHilo[i], nodo + 1);
+    }
+    long long previo = atomic_load(&st->nsPorcionMax);
+    while (ns > previo && !atomic_compare_exchange_weak(&st->nsPorcionMax, &previo, ns)) {}
+}
+
+// Cadena JSON entre comillas. El nombre de la operacion puede llevar texto del usuario
+// (la ruta de un kernel), asi que se escapan comillas, barras y caracteres de control.
+static void escribirCadenaJSON(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c == '\n') fputs("\\n", f);
+        else if (c == '\t') fputs("\\t", f);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+void cerrarEstadisticas(void) {
+    EstadisticasOp* st = estadisticasActuales;
+    if (!st) return;
+    estadisticasActuales = NULL;
+    double total = ahoraSeg() - st->inicio;
+    double asignar = atomic_load(&st->nsAsignar) / 1e9, liberar = atomic_load(&st->nsLiberar) / 1e9;
+    double arranque = atomic_load(&st->nsArranque) / 1e9, calculo = atomic_load(&st->nsCalculo) / 1e9;
+    double espera = atomic_load(&st->nsEspera) / 1e9;
+    double otros = total - asignar - liberar - arranque - calculo - espera;
+    int porciones = atomic_load(&st->porciones);
+
+    // Desequilibrio: hilo mas ocupado / media de los que trabajaron, y lo mismo por porcion.
+    int hilos = 0;
+    double suma = 0.0, maximo = 0.0;
+    for (int i = 0; i <= MAX_HILOS_POOL; i++) {
+        double o = atomic_load(&st->nsOcupado[i]) / 1e9;
+        if (o <= 0.0) continue;
+        hilos++;
+        suma += o;
+        if (o > maximo) maximo = o;
+    }
+    double desHilos = hilos ? maximo / (suma / hilos) : 0.0;
+    double desPorciones = porciones && suma > 0.0 ? (atomic_load(&st->nsPorcionMax) / 1e9) / (suma / porciones) : 0.0;
+    long long bytes = atomic_load(&st->bytesAsignados), reutilizados = atomic_load(&st->bytesReutilizados);
+    long pico = picoRSSKb();
+    long fallos = fallosPagina() - st->fallosInicio;
+
+    // Ancho de banda por nodo: la parte del trafico que toca a sus filas entre el tiempo
+    // ocupado de sus hilos (por hilo), y por los hilos que corrieron en el nodo (total).
+    long long filasTotal = 0;
+    int hilosNodo[MAX_NODOS_NUMA] = { 0 };
+    for (int n = 0; n < MAX_NODOS_NUMA; n++) filasTotal += atomic_load(&st->filasNodo[n]);
+    for (int i = 0; i <= MAX_HILOS_POOL; i++) {
+        int nodo = atomic_load(&st->nodoHilo[i]);
+        if (nodo > 0) hilosNodo[nodo - 1]++;
+    }
+    double mbHiloNodo[MAX_NODOS_NUMA] = { 0 };
+    for (int n = 0; n < MAX_NODOS_NUMA; n++) {
+        long long ns = atomic_load(&st->nsNodo[n]);
+        if (ns > 0 && filasTotal > 0) {
+            double parte = (double)st->bytesTrafico * atomic_load(&st->filasNodo[n]) / filasTotal;
+            mbHiloNodo[n] = parte / (ns / 1e9) / 1e6;
+        }
+    }
+    int porNodos = st->bytesTrafico > 0 && filasTotal > 0;
+
+    // Con varios hilos de lote midiendo a la vez, cada informe sale entero.
+    flockfile(stderr);
+    if (modoEstadisticas == ESTADISTICAS_JSON) {
+        fprintf(stderr, "{\"operacion\": ");
+        escribirCadenaJSON(stderr, st->nombre);
+        fprintf(stderr, ", \"total_s\": %.6f, \"asignar_s\": %.6f, \"arranque_s\": %.6f, \"calculo_s\": %.6f, "
+                "\"espera_s\": %.6f, \"liberar_s\": %.6f, \"otros_s\": %.6f, \"hilos\": %d, \"porciones\": %d, "
+                "\"ocupado_s\": [", total, asignar, arranque, calculo, espera, liberar, otros, hilos, porciones);
+        int k = 0;
+        for (int i = 0; i <= MAX_HILOS_POOL; i++) {
+            long long ns = atomic_load(&st->nsOcupado[i]);
+            if (ns > 0) fprintf(stderr, "%s%.6f", k++ ? ", " : "", ns / 1e9);
+        }
+        fprintf(stderr, "], \"desequilibrio_hilos\": %.3f, \"desequilibrio_porciones\": %.3f, "
+                "\"bytes_asignados\": %lld, \"bytes_reutilizados\": %lld, \"fallos_pagina\": %ld, "
+                "\"pico_rss_kb\": %ld, \"nodos\": [", desHilos, desPorciones, bytes, reutilizados, fallos, pico);
+        k = 0;
+        for (int n = 0; n < MAX_NODOS_NUMA && porNodos; n++) {
+            if (!hilosNodo[n]) continue;
+            fprintf(stderr, "%s{\"nodo\": %d, \"hilos\": %d, \"filas\": %lld, \"ocupado_s\": %.6f, "
+                    "\"mb_s_hilo\": %.1f, \"mb_s\": %.1f}", k++ ? ", " : "", n, hilosNodo[n],
+                    (long long)atomic_load(&st->filasNodo[n]), atomic_load(&st->nsNodo[n]) / 1e9, mbHiloNodo[n],
+                    mbHiloNodo[n] * hilosNodo[n]);
+        }
+        fprintf(stderr, "]}\n");
+    } else {
+        fprintf(stderr, "[stats] %-28s total %8.4f s | asignar %.4f arranque %.4f calculo %.4f espera %.4f "
+                "liberar %.4f otros %.4f\n", st->nombre, total, asignar, arranque, calculo, espera, liberar, otros);
+        fprintf(stderr, "        ");
+        if (porciones) {
+            fprintf(stderr, "%d hilo(s), %d porciones | ocupado (s):", hilos, porciones);
+            for (int i = 0; i <= MAX_HILOS_POOL; i++) {
+                long long ns = atomic_load(&st->nsOcupado[i]);
+                if (ns > 0) fprintf(stderr, " %.3f", ns / 1e9);
+            }
+            fprintf(stderr, " | desequilibrio hilos %.2f porciones %.2f | ", desHilos, desPorciones);
+        }
+        fprintf(stderr, "asignado %.1f MB, reutilizado %.1f MB | fallos de pagina %ld | pico RSS %.1f MB\n",
+                bytes / 1e6, reutilizados / 1e6, fallos, pico / 1024.0);
+        for (int n = 0; n < MAX_NODOS_NUMA && porNodos; n++) {
+            if (!hilosNodo[n]) continue;
+            fprintf(stderr, "        nodo %d: %d hilo(s), %.0f%% de las filas, ocupado %.3f s | %.1f MB/s "
+                    "(%.1f por hilo)\n", n, hilosNodo[n], 100.0 * atomic_load(&st->filasNodo[n]) / filasTotal,
+                    atomic_load(&st->nsNodo[n]) / 1e9, mbHiloNodo[n] * hilosNodo[n], mbHiloNodo[n]);
+        }
+    }
+    funlockfile(stderr);
+    free(st);
+}
+
+// UTILIDADES DE MEMORIA
+
+// Arena de imagenes de una sesion (menu, pipeline o un hilo de filtros del lote). Cada
+// operacion reserva el destino y libera el origen, asi que con la arena activa los
+// pixeles van y vienen entre unos pocos buffers que ya tienen sus paginas en memoria,
+// en lugar de pedir y devolver la imagen entera al sistema en cada paso. Los buffers
+// se redondean a clases de tamano (multiplos de 2 MB, cuatro clases por potencia de
+// dos) alineadas para paginas enormes, y solo crecen cuando la salida no cabe en
+// ninguno libre (rotar, redimensionar). No se pide MADV_HUGEPAGE: con la configuracion
+// habitual del kernel (defrag=madvise) eso compacta memoria en cada fallo y el primer
+// uso sale mas caro; con THP en always las paginas enormes llegan solas. Un buffer vuelve a la arena que lo dio aunque
+// lo libere otro hilo, como el de guardado del lote.
+
+#define MAX_BUFFERS_ARENA 8
+#define PAGINA_ENORME ((size_t)2 << 20)
+
+typedef struct {
+    unsigned char* mem;
+    size_t capacidad;
+    int ocupado;
+} BufferArena;
+
+typedef struct ArenaImagenes {
+    BufferArena buffers[MAX_BUFFERS_ARENA];
+    int numBuffers;
+    long servidas, reutilizadas, crecimientos;
+    size_t bytesReservados, picoReservado;
+    struct ArenaImagenes* siguiente;
+} ArenaImagenes;
+
+// Todas las arenas comparten un cerrojo: se toca una vez por imagen, no por porcion.
+static ArenaImagenes* arenas = NULL;
+static atomic_int numArenas = 0;
+static pthread_mutex_t arenasM = PTHREAD_MUTEX_INITIALIZER;
+
+// Arena de la que toma asignarPixeles en este hilo (NULL: posix_memalign directo).
+static __thread ArenaImagenes* arenaActual = NULL;
+
+ArenaImagenes* crearArena(void) {
+    ArenaImagenes* a = (ArenaImagenes*)calloc(1, sizeof(ArenaImagenes));
+    if (!a) return NULL;
+    pthread_mutex_lock(&arenasM);
+    a->siguiente = arenas;
+    arenas = a;
+    atomic_fetch_add(&numArenas, 1);
+    pthread_mutex_unlock(&arenasM);
+    return a;
+}
+
+void usarArena(ArenaImagenes* a) {
+    arenaActual = a;
+}
+
+// Los buffers que siguen ocupados dejan de ser de la arena: como salen de
+// posix_memalign, liberarPixelesMem los devuelve con free() cuando les toque.
+void destruirArena(ArenaImagenes* a) {
+    if (!a) return;
+    if (arenaActual == a) arenaActual = NULL;
+    pthread_mutex_lock(&arenasM);
+    ArenaImagenes** p = &arenas;
+    while (*p && *p != a) p = &(*p)->siguiente;
+    if (*p) *p = a->siguiente;
+    atomic_fetch_sub(&numArenas, 1);
+    pthread_mutex_unlock(&arenasM);
+    for (int i = 0; i < a->numBuffers; i++) {
+        if (!a->buffers[i].ocupado) free(a->buffers[i].mem);
+    }
+    if (modoEstadisticas != ESTADISTICAS_NO && a->servidas) {
+        fprintf(stderr, "[stats] arena: %ld reserva(s), %ld reutilizada(s), %ld crecimiento(s), %d buffer(s), "
+                "pico %.1f MB\n", a->servidas, a->reutilizadas, a->crecimientos, a->numBuffers,
+                a->picoReservado / 1e6);
+    }
+    free(a);
+}
+
+// Multiplo de 2 MB redondeado a la clase siguiente: 1, 1.25, 1.5 o 1.75 por potencia de dos.
+static size_t claseArena(size_t bytes) {
+    size_t paginas = (bytes + PAGINA_ENORME - 1) / PAGINA_ENORME;
+    size_t base = 1;
+    while (base * 2 <= paginas) base *= 2;
+    size_t paso = base >= 4 ? base / 4 : 1;
+    return (paginas + paso - 1) / paso * paso * PAGINA_ENORME;
+}
+
+// Buffer libre de la arena con al menos bytes; NULL si no hay hueco (se reserva fuera).
+// *nuevos dice cuantos bytes hubo que pedir al sistema.
+static unsigned char* tomarDeArena(ArenaImagenes* a, size_t bytes, size_t* nuevos) {
+    *nuevos = 0;
+    pthread_mutex_lock(&arenasM);
+    // El libre mas pequeno que quepa; si ninguno cabe, se agranda el libre mas grande.
+    int mejor = -1, mayor = -1;
+    for (int i = 0; i < a->numBuffers; i++) {
+        BufferArena* b = &a->buffers[i];
+        if (b->ocupado) continue;
+        if (b->capacidad >= bytes && (mejor < 0 || b->capacidad < a->buffers[mejor].capacidad)) mejor = i;
+        if (mayor < 0 || b->capacidad > a->buffers[mayor].capacidad) mayor = i;
+    }
+    unsigned char* pix = NULL;
+    if (mejor >= 0) {
+        a->reutilizadas++;
+    } else {
+        mejor = mayor >= 0 ? mayor : a->numBuffers < MAX_BUFFERS_ARENA ? a->numBuffers++ : -1;
+    }
+    if (mejor >= 0) {
+        BufferArena* b = &a->buffers[mejor];
+        if (b->capacidad < bytes) {
+            size_t cap = claseArena(bytes);
+            void* mem = NULL;
+            if (b->mem) a->crecimientos++;
+            free(b->mem);
+            a->bytesReservados -= b->capacidad;
+            b->mem = NULL;
+            b->capacidad = 0;
+            if (posix_memalign(&mem, PAGINA_ENORME, cap) == 0) {
+                b->mem = (unsigned char*)mem;
+                b->capacidad = cap;
+                a->bytesReservados += cap;
+                if (a->bytesReservados > a->picoReservado) a->picoReservado = a->bytesReservados;
+                *nuevos = cap;
             }
         }
+        if (b->mem) {
+            b->ocupado = 1;
+            pix = b->mem;
+            a->servidas++;
+        }
     }
+    pthread_mutex_unlock(&arenasM);
     return pix;
 }
 
-void liberarPixelesMem(unsigned char*** pix, int alto, int ancho) {
-    if (!pix) return;
-    for (int y = 0; y < alto; y++) {
-        for (int x = 0; x < ancho; x++) {
-            free(pix[y][x]);
+// Devuelve pix a su arena; 0 si no es de ninguna.
+static int devolverAArena(const unsigned char* pix) {
+    if (atomic_load(&numArenas) == 0) return 0;
+    int encontrado = 0;
+    pthread_mutex_lock(&arenasM);
+    for (ArenaImagenes* a = arenas; a && !encontrado; a = a->siguiente) {
+        for (int i = 0; i < a->numBuffers; i++) {
+            if (a->buffers[i].ocupado && a->buffers[i].mem == pix) {
+                a->buffers[i].ocupado = 0;
+                encontrado = 1;
+                break;
+            }
         }
-        free(pix[y]);
     }
-    free(pix);
+    pthread_mutex_unlock(&arenasM);
+    return encontrado;
+}
+
+static int primerToque(unsigned char* pix, size_t stride, int alto, size_t bytes);
+
+// Reserva un buffer unico alineado; cada fila empieza en un multiplo de ALINEACION_FILAS.
+// Con una arena activa en el hilo, sale de ella si puede. Para 16 bits, canales es el
+// numero de bytes por pixel (BYTES_PIXEL). Con --numa las paginas nuevas se tocan por
+// franjas desde los trabajadores (primerToque).
+unsigned char* asignarPixeles(int alto, int ancho, int canales, size_t* stride) {
+    EstadisticasOp* st = estadisticasActuales;
+    double t0 = st ? ahoraSeg() : 0.0;
+    size_t filaBytes = (size_t)ancho * canales;
+    size_t s = (filaBytes + ALINEACION_FILAS - 1) & ~(size_t)(ALINEACION_FILAS - 1);
+    size_t bytes = s * (size_t)alto;
+    size_t nuevos = bytes;
+    void* pix = arenaActual ? tomarDeArena(arenaActual, bytes, &nuevos) : NULL;
+    if (!pix) {
+        nuevos = bytes;
+        if (posix_memalign(&pix, ALINEACION_FILAS, bytes) != 0) return NULL;
+    }
+    *stride = s;
+    if (nuevos) primerToque((unsigned char*)pix, s, alto, bytes);
+    if (st) {
+        atomic_fetch_add(&st->nsAsignar, nsDesde(t0));
+        atomic_fetch_add(&st->bytesAsignados, (long long)nuevos);
+        atomic_fetch_add(&st->bytesReutilizados, (long long)(nuevos ? 0 : bytes));
+    }
+    return (unsigned char*)pix;
+}
+
+// Imagenes cargadas con mmap: sus pixeles apuntan dentro del mapeo del fichero y
+// liberarPixelesMem las reconoce por el puntero para deshacer el mapeo.
+typedef struct Mapeo {
+    const unsigned char* pixeles;
+    void* base;
+    size_t largo;
+    struct Mapeo* siguiente;
+} Mapeo;
+
+static Mapeo* mapeos = NULL;
+static atomic_int numMapeos = 0;
+static pthread_mutex_t mapeosM = PTHREAD_MUTEX_INITIALIZER;
+
+static int registrarMapeo(const unsigned char* pixeles, void* base, size_t largo) {
+    Mapeo* m = (Mapeo*)malloc(sizeof(Mapeo));
+    if (!m) return 0;
+    m->pixeles = pixeles;
+    m->base = base;
+    m->largo = largo;
+    pthread_mutex_lock(&mapeosM);
+    m->siguiente = mapeos;
+    mapeos = m;
+    atomic_fetch_add(&numMapeos, 1);
+    pthread_mutex_unlock(&mapeosM);
+    return 1;
+}
+
+// Deshace el mapeo de pixeles si lo hay; devuelve 0 si pixeles no viene de un mapeo.
+static int quitarMapeo(const unsigned char* pixeles) {
+    if (atomic_load(&numMapeos) == 0) return 0;
+    pthread_mutex_lock(&mapeosM);
+    Mapeo** m = &mapeos;
+    while (*m && (*m)->pixeles != pixeles) m = &(*m)->siguiente;
+    Mapeo* encontrado = *m;
+    if (encontrado) {
+        *m = encontrado->siguiente;
+        atomic_fetch_sub(&numMapeos, 1);
+    }
+    pthread_mutex_unlock(&mapeosM);
+    if (!encontrado) return 0;
+    munmap(encontrado->base, encontrado->largo);
+    free(encontrado);
+    return 1;
+}
+
+// Sirve para buffers de asignarPixeles (de una arena o no), para los adoptados de
+// stbi_load (stbi_image_free es free() con la configuracion por defecto de stb) y para
+// los pixeles mapeados.
+void liberarPixelesMem(unsigned char* pix) {
+    EstadisticasOp* st = estadisticasActuales;
+    double t0 = st ? ahoraSeg() : 0.0;
+    if (pix && !devolverAArena(pix) && !quitarMapeo(pix)) free(pix);
+    if (st) atomic_fetch_add(&st->nsLiberar, nsDesde(t0));
 }
 
 
 void liberarImagen(ImagenInfo* info) {
     if (info->pixeles) {
-        liberarPixelesMem(info->pixeles, info->alto, info->ancho);
+        liberarPixelesMem(info->pixeles);
         info->pixeles = NULL;
     }
     info->ancho = 0;
     info->alto = 0;
     info->canales = 0;
+    info->stride = 0;
 }
 
-//  CARGA Y GUARDADO 
+// Sustituye los pixeles de info por los de nueva, liberando los anteriores.
+static void reemplazarImagen(ImagenInfo* info, ImagenInfo* nueva) {
+    liberarPixelesMem(info->pixeles);
+    *info = *nueva;
+    nueva->pixeles = NULL;
+}
 
-int cargarImagen(const char* ruta, ImagenInfo* info) {
-    int canales;
-    unsigned char* datos = stbi_load(ruta, &info->ancho, &info->alto, &canales, 0);
-    if (!datos) {
-        fprintf(stderr, "Error al cargar imagen: %s\n", ruta);
-        return 0;
+//  E/S MAPEADA
+
+// PPM/PGM binario (P6/P5, 8 bits) y un formato crudo con cabecera (.raw) se leen con
+// mmap y los pixeles se usan donde estan, sin copiarlos ni descomprimir nada: sirven
+// de intermedio rapido entre etapas. El mapeo es privado, asi que un filtro que escriba
+// en la imagen solo copia las paginas que toca y el fichero no cambia. Para escribir se
+// reserva el fichero con su tamano final y se copian las filas al mapeo.
+//
+// Cabecera .raw (64 bytes, enteros little-endian): "IMGRAW1\n", ancho, alto, canales y
+// bits por canal (u32; 0 en ficheros antiguos equivale a 8), stride y desplazamiento de
+// los pixeles (u64). Las muestras de 16 bits van en little-endian. El escritor deja las
+// filas alineadas a ALINEACION_FILAS, como asignarPixeles.
+//
+// Los PNM de 16 bits (maximo > 255) guardan las muestras en big-endian: al cargarlos se
+// reordenan (y reescalan a 65535) sobre el propio mapeo privado.
+
+#define MAGIA_RAW "IMGRAW1\n"
+#define TAM_CABECERA_RAW 64
+
+typedef enum { FORMATO_STB, FORMATO_PNM, FORMATO_RAW, FORMATO_QOI } FormatoImagen;
+
+static FormatoImagen formatoPorExtension(const char* ruta) {
+    const char* ext = strrchr(ruta, '.');
+    if (!ext) return FORMATO_STB;
+    if (!strcasecmp(ext, ".ppm") || !strcasecmp(ext, ".pgm") || !strcasecmp(ext, ".pnm")) return FORMATO_PNM;
+    if (!strcasecmp(ext, ".raw")) return FORMATO_RAW;
+    if (!strcasecmp(ext, ".qoi")) return FORMATO_QOI;
+    return FORMATO_STB;
+}
+
+static uint64_t leerLE(const unsigned char* p, int bytes) {
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static void escribirLE(unsigned char* p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+// Como leerEnteroPNM, pero sobre la cabecera mapeada; avanza *pos tras el separador.
+static int leerEnteroPNMMem(const unsigned char* d, size_t largo, size_t* pos, int* valor) {
+    size_t i = *pos;
+    while (i < largo && (d[i] == '#' || strchr(" \t\r\n", d[i]))) {
+        if (d[i] == '#') while (i < largo && d[i] != '\n') i++;
+        i++;
+    }
+    if (i >= largo || d[i] < '0' || d[i] > '9') return 0;
+    long v = 0;
+    for (; i < largo && d[i] >= '0' && d[i] <= '9'; i++) {
+        v = v * 10 + (d[i] - '0');
+        if (v > INT_MAX) return 0;
+    }
+    // Cada numero de la cabecera va seguido de un separador; sin el, no hay pixeles.
+    if (i >= largo) return 0;
+    *valor = (int)v;
+    *pos = i + 1;
+    return 1;
+}
+
+// Pasa una fila PNM de 16 bits (big-endian, valores hasta maximo) a muestras nativas
+// de 0 a 65535, en el sitio.
+static void filaPNM16ANativa(unsigned char* p, size_t muestras, int maximo) {
+    uint16_t* d = (uint16_t*)p;
+    for (size_t i = 0; i < muestras; i++) {
+        uint32_t v = (uint32_t)p[2 * i] << 8 | p[2 * i + 1];
+        if (v > (uint32_t)maximo) v = (uint32_t)maximo;
+        d[i] = (uint16_t)(maximo == 65535 ? v : (v * 65535 + (uint32_t)maximo / 2) / (uint32_t)maximo);
     }
-    info->canales = (canales == 1 || canales == 3) ? canales : 1;
+}
 
-    info->pixeles = (unsigned char***)malloc(info->alto * sizeof(unsigned char**));
-    if (!info->pixeles) {
-        fprintf(stderr, "Error de memoria al asignar filas\n");
-        stbi_image_free(datos);
-        return 0;
+// Devuelve 1 si la imagen quedo mapeada en info, 0 si es un PNM que no se mapea (ASCII,
+// maximo menor que 255...) y debe cargarlo stb, y -1 si hubo un error ya informado.
+static int cargarMapeada(const char* ruta, ImagenInfo* info, FormatoImagen formato) {
+    int fd = open(ruta, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "No se pudo abrir %s: %s\n", ruta, strerror(errno));
+        return -1;
     }
-    for (int y = 0; y < info->alto; y++) {
-        info->pixeles[y] = (unsigned char**)malloc(info->ancho * sizeof(unsigned char*));
-        if (!info->pixeles[y]) {
-            fprintf(stderr, "Error de memoria al asignar columnas\n");
-            liberarImagen(info);
-            stbi_image_free(datos);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (formato == FORMATO_RAW ? TAM_CABECERA_RAW : 3)) {
+        // Un PNM tan corto esta roto: que lo diga stb.
+        close(fd);
+        if (formato == FORMATO_PNM) return 0;
+        fprintf(stderr, "%s no es un .raw valido (demasiado corto).\n", ruta);
+        return -1;
+    }
+    size_t largo = (size_t)st.st_size;
+    unsigned char* d = (unsigned char*)mmap(NULL, largo, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (d == MAP_FAILED) {
+        fprintf(stderr, "No se pudo mapear %s: %s\n", ruta, strerror(errno));
+        return -1;
+    }
+
+    int ancho = 0, alto = 0, canales = 0, profundidad = 8, maximo = 0;
+    size_t stride = 0, desplazamiento = 0;
+    if (formato == FORMATO_PNM) {
+        size_t pos = 2;
+        if (d[0] != 'P' || (d[1] != '5' && d[1] != '6') || !leerEnteroPNMMem(d, largo, &pos, &ancho) ||
+            !leerEnteroPNMMem(d, largo, &pos, &alto) || !leerEnteroPNMMem(d, largo, &pos, &maximo) ||
+            maximo < 255 || maximo > 65535 || ancho < 1 || alto < 1) {
+            munmap(d, largo);
             return 0;
         }
-        for (int x = 0; x < info->ancho; x++) {
-            info->pixeles[y][x] = (unsigned char*)malloc(info->canales * sizeof(unsigned char));
-            if (!info->pixeles[y][x]) {
-                fprintf(stderr, "Error de memoria al asignar canales\n");
-                liberarImagen(info);
-                stbi_image_free(datos);
-                return 0;
-            }
-            for (int c = 0; c < info->canales; c++) {
-                info->pixeles[y][x][c] = datos[(y * info->ancho + x) * info->canales + c];
-            }
+        canales = d[1] == '6' ? 3 : 1;
+        profundidad = maximo > 255 ? 16 : 8;
+        stride = (size_t)ancho * canales * (profundidad / 8);
+        desplazamiento = pos;
+    } else {
+        uint64_t a = 0, h = 0, c = 0, b = 0, s = 0, o = 0;
+        if (!memcmp(d, MAGIA_RAW, 8)) {
+            a = leerLE(d + 8, 4);
+            h = leerLE(d + 12, 4);
+            c = leerLE(d + 16, 4);
+            b = leerLE(d + 20, 4);
+            s = leerLE(d + 24, 8);
+            o = leerLE(d + 32, 8);
+        }
+        if (b == 0) b = 8;
+        if (a < 1 || a > INT_MAX || h < 1 || h > INT_MAX || c < 1 || c > 4 || (b != 8 && b != 16) ||
+            s < a * c * (b / 8) || o < TAM_CABECERA_RAW || o > largo || (b == 16 && (o | s) % 2)) {
+            fprintf(stderr, "%s no es un .raw valido (cabecera %s, 1 a 4 canales de 8 o 16 bits).\n", ruta,
+                    MAGIA_RAW);
+            munmap(d, largo);
+            return -1;
+        }
+        ancho = (int)a;
+        alto = (int)h;
+        canales = (int)c;
+        profundidad = (int)b;
+        stride = (size_t)s;
+        desplazamiento = (size_t)o;
+    }
+    // La ultima fila no necesita el relleno del stride.
+    size_t necesario = (size_t)(alto - 1) * stride + (size_t)ancho * canales * (profundidad / 8);
+    if ((size_t)(alto - 1) > SIZE_MAX / stride || desplazamiento > largo ||
+        necesario > largo - desplazamiento) {
+        fprintf(stderr, "Fichero truncado: faltan filas de pixeles en %s.\n", ruta);
+        munmap(d, largo);
+        return -1;
+    }
+    // La cabecera de un PNM tiene largo arbitrario: si las muestras de 16 bits no quedan
+    // alineadas a 2 se desplazan un byte hacia atras, sobre el separador de la cabecera.
+    if (profundidad == 16 && desplazamiento % 2) {
+        memmove(d + desplazamiento - 1, d + desplazamiento, necesario);
+        desplazamiento--;
+    }
+    if (!registrarMapeo(d + desplazamiento, d, largo)) {
+        fprintf(stderr, "Error de memoria al cargar %s\n", ruta);
+        munmap(d, largo);
+        return -1;
+    }
+    // Los filtros recorren la imagen entera enseguida: lectura anticipada del fichero.
+    madvise(d, largo, MADV_WILLNEED);
+    info->ancho = ancho;
+    info->alto = alto;
+    info->canales = canales;
+    info->profundidad = profundidad;
+    info->stride = stride;
+    info->pixeles = d + desplazamiento;
+    if (formato == FORMATO_PNM && profundidad == 16) {
+        for (int y = 0; y < alto; y++) {
+            filaPNM16ANativa(info->pixeles + (size_t)y * stride, (size_t)ancho * canales, maximo);
         }
     }
-    stbi_image_free(datos);
-    printf("Imagen cargada: %dx%d, %d canales (%s)\n", info->ancho, info->alto,
-           info->canales, info->canales == 1 ? "grises" : "RGB");
     return 1;
 }
 
-int guardarPNG(const ImagenInfo* info, const char* rutaSalida) {
-    if (!info->pixeles) {
-        fprintf(stderr, "No hay imagen para guardar.\n");
+// Permisos de los ficheros nuevos: 0666 menos la umask. La umask solo se puede leer
+// cambiandola, asi que se lee una vez y no mientras otros hilos crean ficheros.
+static pthread_once_t umaskLeida = PTHREAD_ONCE_INIT;
+static mode_t modoFicheros = 0644;
+
+static void leerUmask(void) {
+    mode_t m = umask(0);
+    umask(m);
+    modoFicheros = 0666 & ~m;
+}
+
+// Todas las salidas se escriben en un temporal junto a ruta que publicarSalida pone en su
+// lugar al terminar: quien tenga abierto o mapeado el fichero anterior lo sigue viendo
+// entero (truncarlo en el sitio tiraria con SIGBUS a un lector mapeado) y dos trabajos
+// del servidor que guardan en la misma ruta no mezclan sus bytes. Si ruta existe y no es
+// un fichero regular (/dev/null, una FIFO) se escribe en ella y temporal queda vacio.
+// Devuelve el descriptor o -1 con errno.
+static int abrirSalida(const char* ruta, char* temporal, size_t tam) {
+    pthread_once(&umaskLeida, leerUmask);
+    struct stat st;
+    temporal[0] = 0;
+    if (stat(ruta, &st) == 0 && !S_ISREG(st.st_mode)) return open(ruta, O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (snprintf(temporal, tam, "%s.XXXXXX", ruta) >= (int)tam) {
+        temporal[0] = 0;
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = mkostemp(temporal, O_CLOEXEC);
+    if (fd < 0) temporal[0] = 0;
+    else fchmod(fd, modoFicheros);
+    return fd;
+}
+
+// Con ok, el temporal sustituye a ruta; si no, se borra. Devuelve si ruta quedo escrita.
+static int publicarSalida(const char* temporal, const char* ruta, int ok) {
+    if (!temporal[0]) return ok;
+    if (ok && rename(temporal, ruta) != 0) {
+        fprintf(stderr, "No se pudo reemplazar %s: %s\n", ruta, strerror(errno));
+        ok = 0;
+    }
+    if (!ok) unlink(temporal);
+    return ok;
+}
+
+// Crea ruta con su tamano final ya reservado y copia cabecera y filas a traves de un
+// mapeo compartido. Reservar antes evita que un disco lleno aparezca como SIGBUS al
+// escribir en el mapeo.
+static int guardarMapeada(const ImagenInfo* info, const char* ruta, FormatoImagen formato) {
+    if (formato == FORMATO_PNM && info->canales != 1 && info->canales != 3) {
+        fprintf(stderr, "PPM/PGM no guardan alfa: usa .png, .qoi o .raw para %s.\n", nombreCanales(info));
         return 0;
     }
-    unsigned char* datos1D = (unsigned char*)malloc(info->ancho * info->alto * info->canales);
-    if (!datos1D) {
-        fprintf(stderr, "Error de memoria al aplanar imagen\n");
+    unsigned char cab[TAM_CABECERA_RAW];
+    size_t tamCab;
+    size_t bytesFila = (size_t)info->ancho * BYTES_PIXEL(info);
+    size_t stride = bytesFila;
+    int pnm16 = formato == FORMATO_PNM && info->profundidad == 16;
+    if (formato == FORMATO_PNM) {
+        tamCab = (size_t)snprintf((char*)cab, sizeof(cab), "P%c\n%d %d\n%d\n", info->canales == 3 ? '6' : '5',
+                                  info->ancho, info->alto, pnm16 ? 65535 : 255);
+    } else {
+        stride = (bytesFila + ALINEACION_FILAS - 1) & ~(size_t)(ALINEACION_FILAS - 1);
+        tamCab = TAM_CABECERA_RAW;
+        memset(cab, 0, sizeof(cab));
+        memcpy(cab, MAGIA_RAW, 8);
+        escribirLE(cab + 8, (uint64_t)info->ancho, 4);
+        escribirLE(cab + 12, (uint64_t)info->alto, 4);
+        escribirLE(cab + 16, (uint64_t)info->canales, 4);
+        escribirLE(cab + 20, (uint64_t)(info->profundidad == 16 ? 16 : 8), 4);
+        escribirLE(cab + 24, stride, 8);
+        escribirLE(cab + 32, TAM_CABECERA_RAW, 8);
+    }
+    size_t largo = tamCab + stride * (size_t)info->alto;
+
+    char temporal[PATH_MAX];
+    int fd = abrirSalida(ruta, temporal, sizeof(temporal));
+    if (fd < 0) {
+        fprintf(stderr, "No se pudo crear %s: %s\n", ruta, strerror(errno));
         return 0;
     }
-    for (int y = 0; y < info->alto; y++) {
-        for (int x = 0; x < info->ancho; x++) {
-            for (int c = 0; c < info->canales; c++) {
-                datos1D[(y * info->ancho + x) * info->canales + c] = info->pixeles[y][x][c];
+    int r = posix_fallocate(fd, 0, (off_t)largo);
+    // Sistemas de ficheros sin reserva: basta con fijar el tamano.
+    if (r == EINVAL || r == EOPNOTSUPP) r = ftruncate(fd, (off_t)largo) == 0 ? 0 : errno;
+    unsigned char* d = r == 0 ? (unsigned char*)mmap(NULL, largo, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                              : (unsigned char*)MAP_FAILED;
+    if (d == MAP_FAILED) {
+        fprintf(stderr, "No se pudo preparar %s: %s\n", ruta, strerror(r ? r : errno));
+        close(fd);
+        publicarSalida(temporal, ruta, 0);
+        return 0;
+    }
+    madvise(d, largo, MADV_SEQUENTIAL);
+    memcpy(d, cab, tamCab);
+    unsigned char* pix = d + tamCab;
+    if (pnm16) {
+        for (int y = 0; y < info->alto; y++) {
+            const uint16_t* s = FILA16(info, y);
+            unsigned char* o = pix + (size_t)y * stride;
+            for (size_t i = 0; i < bytesFila / 2; i++) {
+                o[2 * i] = (unsigned char)(s[i] >> 8);
+                o[2 * i + 1] = (unsigned char)s[i];
             }
         }
+    } else if (info->stride == stride) {
+        memcpy(pix, info->pixeles, stride * (size_t)info->alto);
+    } else {
+        for (int y = 0; y < info->alto; y++) memcpy(pix + (size_t)y * stride, PIXEL(info, y, 0), bytesFila);
     }
-    int resultado = stbi_write_png(rutaSalida, info->ancho, info->alto, info->canales,
-                                   datos1D, info->ancho * info->canales);
-    free(datos1D);
-    if (resultado) {
-        printf("Imagen guardada en: %s (%s)\n", rutaSalida,
-               info->canales == 1 ? "grises" : "RGB");
+    int ok = munmap(d, largo) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok) fprintf(stderr, "Error al escribir %s: %s\n", ruta, strerror(errno));
+    return publicarSalida(temporal, ruta, ok);
+}
+
+//  CARGA Y GUARDADO 
+
+static int cargarQOI(const char* ruta, ImagenInfo* info);
+static int guardarQOI(const ImagenInfo* info, const char* ruta);
+
+// "shm:NOMBRE" es el objeto de memoria compartida NOMBRE (el de shm_open), que Linux
+// expone como /dev/shm/NOMBRE; con extension .raw o .ppm se lee y escribe por mmap.
+static const char* resolverRuta(const char* ruta, char* buf, size_t tam) {
+    if (strncmp(ruta, "shm:", 4)) return ruta;
+    const char* nombre = ruta + 4;
+    while (*nombre == '/') nombre++;
+    snprintf(buf, tam, "/dev/shm/%s", nombre);
+    return buf;
+}
+
+// El formato se elige por la extension: .ppm/.pgm/.pnm y .raw se mapean, .qoi se
+// decodifica aqui; el resto (y los PNM que no son P5/P6 binarios) los decodifica stb.
+// Se conservan los canales del fichero (con alfa si lo tiene) y sus 8 o 16 bits.
+int cargarImagen(const char* ruta, ImagenInfo* info) {
+    char compartida[PATH_MAX];
+    ruta = resolverRuta(ruta, compartida, sizeof(compartida));
+    double t0 = ahoraSeg();
+    FormatoImagen formato = formatoPorExtension(ruta);
+    info->profundidad = 8;
+    if (formato == FORMATO_QOI) {
+        if (!cargarQOI(ruta, info)) return 0;
+        informar("Imagen cargada: %dx%d, %d canales (%s, QOI) en %.3f s, pico RSS %ld KB\n", info->ancho, info->alto,
+                 info->canales, nombreCanales(info), ahoraSeg() - t0, picoRSSKb());
         return 1;
-    } else {
-        fprintf(stderr, "Error al guardar PNG: %s\n", rutaSalida);
-        return 0;
     }
+    int mapeada = formato == FORMATO_STB ? 0 : cargarMapeada(ruta, info, formato);
+    if (mapeada < 0) return 0;
+    if (!mapeada) {
+        int canales;
+        int bits16 = stbi_is_16_bit(ruta);
+        unsigned char* datos = bits16 ? (unsigned char*)stbi_load_16(ruta, &info->ancho, &info->alto, &canales, 0)
+                                      : stbi_load(ruta, &info->ancho, &info->alto, &canales, 0);
+        if (!datos) {
+            fprintf(stderr, "Error al cargar imagen: %s\n", ruta);
+            return 0;
+        }
+        // Se adopta el buffer de stb tal cual: sin copia, filas empaquetadas.
+        info->canales = canales;
+        info->profundidad = bits16 ? 16 : 8;
+        info->stride = (size_t)info->ancho * BYTES_PIXEL(info);
+        info->pixeles = datos;
+    }
+    informar("Imagen cargada: %dx%d, %d canales (%s, %d bits%s) en %.3f s, pico RSS %ld KB\n", info->ancho,
+             info->alto, info->canales, nombreCanales(info), info->profundidad, mapeada ? ", mmap" : "",
+             ahoraSeg() - t0, picoRSSKb());
+    return 1;
 }
 
-//  MOSTRAR MATRIZ 
+static int guardarPNGFranjas(const ImagenInfo* info, const char* ruta, int numHilos);
 
-void mostrarMatriz(const ImagenInfo* info) {
+// Pese al nombre, .ppm/.pgm/.pnm y .raw se escriben sin comprimir por un mapeo y .qoi
+// en QOI; con cualquier otra extension se escribe PNG, comprimido por franjas en paralelo
+// con numHilos hilos (<= 0: uno por nucleo).
+int guardarPNGHilos(const ImagenInfo* info, const char* rutaSalida, int numHilos) {
     if (!info->pixeles) {
-        printf("No hay imagen cargada.\n");
-        return;
+        fprintf(stderr, "No hay imagen para guardar.\n");
+        return 0;
     }
-    printf("Matriz de la imagen (primeras 10 filas):\n");
-    for (int y = 0; y < info->alto && y < 10; y++) {
-        for (int x = 0; x < info->ancho; x++) {
-            if (info->canales == 1) {
-                printf("%3u ", info->pixeles[y][x][0]);
-            } else {
-                printf("(%3u,%3u,%3u) ", info->pixeles[y][x][0], info->pixeles[y][x][1],
-                       info->pixeles[y][x][2]);
-            }
+    char compartida[PATH_MAX];
+    rutaSalida = resolverRuta(rutaSalida, compartida, sizeof(compartida));
+    double t0 = ahoraSeg();
+    FormatoImagen formato = formatoPorExtension(rutaSalida);
+    int resultado;
+    if (formato == FORMATO_STB) {
+        resultado = guardarPNGFranjas(info, rutaSalida, numHilos);
+    } else if (formato == FORMATO_QOI) {
+        resultado = guardarQOI(info, rutaSalida);
+    } else {
+        resultado = guardarMapeada(info, rutaSalida, formato);
+    }
+    if (!resultado) return 0;
+    informar("Imagen guardada en: %s (%s, %d bits) en %.3f s, pico RSS %ld KB\n", rutaSalida, nombreCanales(info),
+             formato == FORMATO_QOI ? 8 : info->profundidad, ahoraSeg() - t0, picoRSSKb());
+    return 1;
+}
+
+int guardarPNG(const ImagenInfo* info, const char* rutaSalida) {
+    return guardarPNGHilos(info, rutaSalida, 0);
+}
+
+//  E/S POR FILAS
+
+// Lectura y escritura secuencial de filas para procesar imagenes que no caben en
+// memoria: PPM/PGM binario (P6/P5, 8 bits) de entrada; PPM/PGM o PNG de salida.
+
+typedef struct {
+    FILE* f;
+    int ancho, alto, canales;
+} LectorFilas;
+
+// Siguiente entero de la cabecera PNM, saltando blancos y comentarios. Consume el
+// caracter que lo termina, asi que tras el ultimo valor quedan justo los pixeles.
+static int leerEnteroPNM(FILE* f, int* valor) {
+    int c = fgetc(f);
+    while (c == '#' || (c != EOF && strchr(" \t\r\n", c))) {
+        if (c == '#') while (c != EOF && c != '\n') c = fgetc(f);
+        c = fgetc(f);
+    }
+    if (c < '0' || c > '9') return 0;
+    long v = 0;
+    for (; c >= '0' && c <= '9'; c = fgetc(f)) {
+        v = v * 10 + (c - '0');
+        if (v > INT_MAX) return 0;
+    }
+    *valor = (int)v;
+    return 1;
+}
+
+int abrirLectorPNM(const char* ruta, LectorFilas* l) {
+    memset(l, 0, sizeof(*l));
+    l->f = fopen(ruta, "rb");
+    if (!l->f) {
+        fprintf(stderr, "No se pudo abrir %s: %s\n", ruta, strerror(errno));
+        return 0;
+    }
+    char magia[2];
+    int maximo = 0;
+    if (fread(magia, 1, 2, l->f) != 2 || magia[0] != 'P' || (magia[1] != '5' && magia[1] != '6') ||
+        !leerEnteroPNM(l->f, &l->ancho) || !leerEnteroPNM(l->f, &l->alto) || !leerEnteroPNM(l->f, &maximo) ||
+        l->ancho < 1 || l->alto < 1 || maximo != 255) {
+        fprintf(stderr, "%s no es un PPM/PGM binario de 8 bits (P6/P5, maximo 255).\n", ruta);
+        fclose(l->f);
+        l->f = NULL;
+        return 0;
+    }
+    l->canales = magia[1] == '6' ? 3 : 1;
+    return 1;
+}
+
+// Lee las n filas siguientes en filas, separadas stride bytes.
+int leerFilas(LectorFilas* l, unsigned char* filas, size_t stride, int n) {
+    size_t bytes = (size_t)l->ancho * l->canales;
+    for (int i = 0; i < n; i++) {
+        if (fread(filas + (size_t)i * stride, 1, bytes, l->f) != bytes) {
+            fprintf(stderr, "Fichero truncado: faltan filas de pixeles.\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void cerrarLectorFilas(LectorFilas* l) {
+    if (l->f) fclose(l->f);
+    l->f = NULL;
+}
+
+#define TAM_IDAT 65536
+
+// Nivel de deflate de todos los PNG que se escriben (0 = sin comprimir, 1 = el mas rapido).
+static int nivelPNG = 6;
+
+int fijarNivelPNG(int nivel) {
+    if (nivel < 0 || nivel > 9) return 0;
+    nivelPNG = nivel;
+    return 1;
+}
+
+typedef struct {
+    FILE* f;
+    const char* ruta;
+    char temporal[PATH_MAX];   // se escribe aqui y sustituye a ruta al cerrar
+    int ancho, alto, canales;
+    int png;
+    z_stream z;
+    unsigned char* previa;     // fila anterior sin filtrar (PNG)
+    unsigned char* filtradas;  // un byte de tipo + fila por cada filtro candidato
+    unsigned char* idat;
+} EscritorFilas;
+
+static void escribirU32BE(unsigned char* p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static int escribirChunkPNG(FILE* f, const char* tipo, const unsigned char* datos, uint32_t largo) {
+    unsigned char cab[8];
+    escribirU32BE(cab, largo);
+    memcpy(cab + 4, tipo, 4);
+    uLong crc = crc32(crc32(0L, Z_NULL, 0), cab + 4, 4);
+    if (largo) crc = crc32(crc, datos, largo);
+    unsigned char pie[4];
+    escribirU32BE(pie, (uint32_t)crc);
+    return fwrite(cab, 1, 8, f) == 8 && (!largo || fwrite(datos, 1, largo, f) == largo) &&
+           fwrite(pie, 1, 4, f) == 4;
+}
+
+// Saca a IDAT lo que haya producido deflate hasta ahora si el buffer se lleno (o si forzar).
+static int vaciarIDAT(EscritorFilas* w, int forzar) {
+    uint32_t usado = TAM_IDAT - w->z.avail_out;
+    if (!usado || (!forzar && w->z.avail_out)) return 1;
+    int ok = escribirChunkPNG(w->f, "IDAT", w->idat, usado);
+    w->z.next_out = w->idat;
+    w->z.avail_out = TAM_IDAT;
+    return ok;
+}
+
+static int paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Filtra una fila de n bytes con Sub, Up y Paeth ademas de sin filtro y devuelve la de
+// menor suma de valores absolutos (la heuristica habitual de los codificadores PNG).
+// filtradas tiene sitio para las cuatro candidatas: 4 * (n + 1) bytes.
+static const unsigned char* filtrarFilaPNG(const unsigned char* fila, const unsigned char* previa, size_t n, int bpp,
+                                           unsigned char* filtradas) {
+    static const unsigned char tipos[4] = { 0, 1, 2, 4 };
+    const unsigned char* mejor = NULL;
+    unsigned long mejorSuma = ULONG_MAX;
+    for (int t = 0; t < 4; t++) {
+        unsigned char* out = filtradas + (size_t)t * (n + 1);
+        unsigned long suma = 0;
+        out[0] = tipos[t];
+        for (size_t i = 0; i < n; i++) {
+            int a = i >= (size_t)bpp ? fila[i - bpp] : 0;
+            int b = previa[i];
+            int c = i >= (size_t)bpp ? previa[i - bpp] : 0;
+            int pred = tipos[t] == 0 ? 0 : tipos[t] == 1 ? a : tipos[t] == 2 ? b : paeth(a, b, c);
+            unsigned char v = (unsigned char)(fila[i] - pred);
+            out[i + 1] = v;
+            suma += v < 128 ? v : 256 - v;
+        }
+        if (suma < mejorSuma) {
+            mejorSuma = suma;
+            mejor = out;
+        }
+    }
+    return mejor;
+}
+
+// Abre la salida segun la extension: .png, o PPM/PGM (segun canales) en otro caso.
+int abrirEscritorFilas(const char* ruta, int ancho, int alto, int canales, EscritorFilas* w) {
+    memset(w, 0, sizeof(*w));
+    const char* ext = strrchr(ruta, '.');
+    w->png = ext && !strcasecmp(ext, ".png");
+    w->ancho = ancho;
+    w->alto = alto;
+    w->canales = canales;
+    if (canales != 1 && canales != 3) {
+        fprintf(stderr, "Solo se escriben filas en grises o RGB.\n");
+        return 0;
+    }
+    w->ruta = ruta;
+    int fd = abrirSalida(ruta, w->temporal, sizeof(w->temporal));
+    w->f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (!w->f) {
+        fprintf(stderr, "No se pudo crear %s: %s\n", ruta, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            publicarSalida(w->temporal, ruta, 0);
+        }
+        return 0;
+    }
+    if (!w->png) {
+        if (fprintf(w->f, "P%c\n%d %d\n255\n", canales == 3 ? '6' : '5', ancho, alto) > 0) return 1;
+        fclose(w->f);
+        w->f = NULL;
+        publicarSalida(w->temporal, ruta, 0);
+        return 0;
+    }
+    size_t n = (size_t)ancho * canales;
+    w->previa = (unsigned char*)calloc(n, 1);
+    w->filtradas = (unsigned char*)malloc(4 * (n + 1));
+    w->idat = (unsigned char*)malloc(TAM_IDAT);
+    unsigned char ihdr[13];
+    escribirU32BE(ihdr, (uint32_t)ancho);
+    escribirU32BE(ihdr + 4, (uint32_t)alto);
+    ihdr[8] = 8;
+    ihdr[9] = canales == 3 ? 2 : 0;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    int ok = w->previa && w->filtradas && w->idat && deflateInit(&w->z, nivelPNG) == Z_OK;
+    if (ok) {
+        w->z.next_out = w->idat;
+        w->z.avail_out = TAM_IDAT;
+        ok = fwrite("\x89PNG\r\n\x1a\n", 1, 8, w->f) == 8 && escribirChunkPNG(w->f, "IHDR", ihdr, 13);
+        if (!ok) deflateEnd(&w->z);
+    }
+    if (!ok) {
+        fprintf(stderr, "No se pudo iniciar la escritura de %s\n", ruta);
+        free(w->previa);
+        free(w->filtradas);
+        free(w->idat);
+        fclose(w->f);
+        w->f = NULL;
+        publicarSalida(w->temporal, ruta, 0);
+    }
+    return ok;
+}
+
+int escribirFilas(EscritorFilas* w, const unsigned char* filas, size_t stride, int n) {
+    size_t bytes = (size_t)w->ancho * w->canales;
+    for (int i = 0; i < n; i++) {
+        const unsigned char* fila = filas + (size_t)i * stride;
+        if (!w->png) {
+            if (fwrite(fila, 1, bytes, w->f) != bytes) return 0;
+            continue;
+        }
+        w->z.next_in = (Bytef*)filtrarFilaPNG(fila, w->previa, bytes, w->canales, w->filtradas);
+        memcpy(w->previa, fila, bytes);
+        w->z.avail_in = (uInt)(bytes + 1);
+        while (w->z.avail_in) {
+            if (deflate(&w->z, Z_NO_FLUSH) != Z_OK || !vaciarIDAT(w, 0)) return 0;
+        }
+    }
+    return 1;
+}
+
+// Termina el fichero; con ok = 0 (error anterior) solo libera. Devuelve 1 si todo se escribio.
+int cerrarEscritorFilas(EscritorFilas* w, int ok) {
+    if (!w->f) return 0;
+    if (w->png) {
+        int r = Z_OK;
+        while (ok && r == Z_OK) {
+            r = deflate(&w->z, Z_FINISH);
+            ok = (r == Z_OK || r == Z_STREAM_END) && vaciarIDAT(w, r == Z_STREAM_END);
+        }
+        ok = ok && escribirChunkPNG(w->f, "IEND", NULL, 0);
+        deflateEnd(&w->z);
+        free(w->previa);
+        free(w->filtradas);
+        free(w->idat);
+    }
+    ok = fclose(w->f) == 0 && ok;
+    w->f = NULL;
+    return publicarSalida(w->temporal, w->ruta, ok);
+}
+
+//  QOI
+
+// Formato sin perdida de https://qoiformat.org: cada pixel se codifica contra el
+// anterior (repeticion, diferencia pequena, diferencia de luma) o contra una tabla de
+// 64 colores vistos, en una sola pasada y sin entropia. Comprime menos que PNG pero se
+// lee y escribe varias veces mas rapido, asi que sirve de intermedio. Se leen QOI de 3
+// y 4 canales decodificando directamente al buffer de la imagen; se escribe RGB o RGBA
+// (los grises se expanden) recorriendo las filas. QOI es de 8 bits: las imagenes de 16
+// se redondean al escribir.
+
+#define QOI_INDICE 0x00
+#define QOI_DIFF 0x40
+#define QOI_LUMA 0x80
+#define QOI_RUN 0xc0
+#define QOI_RGB 0xfe
+#define QOI_RGBA 0xff
+#define QOI_MASCARA 0xc0
+#define TAM_CABECERA_QOI 14
+#define TAM_BUFFER_QOI 65536
+
+static const unsigned char finQOI[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+typedef struct {
+    unsigned char r, g, b, a;
+} PixelQOI;
+
+static inline int hashQOI(PixelQOI p) {
+    return (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) & 63;
+}
+
+static inline int igualQOI(PixelQOI p, PixelQOI q) {
+    return p.r == q.r && p.g == q.g && p.b == q.b && p.a == q.a;
+}
+
+static uint32_t leerU32BE(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int cargarQOI(const char* ruta, ImagenInfo* info) {
+    int fd = open(ruta, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "No se pudo abrir %s: %s\n", ruta, strerror(errno));
+        return 0;
+    }
+    struct stat st;
+    size_t largo = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    const unsigned char* d = largo >= TAM_CABECERA_QOI + sizeof(finQOI)
+                           ? (const unsigned char*)mmap(NULL, largo, PROT_READ, MAP_PRIVATE, fd, 0)
+                           : (const unsigned char*)MAP_FAILED;
+    close(fd);
+    uint32_t ancho = 0, alto = 0;
+    if (d != MAP_FAILED && !memcmp(d, "qoif", 4)) {
+        ancho = leerU32BE(d + 4);
+        alto = leerU32BE(d + 8);
+    }
+    if (ancho < 1 || ancho > INT_MAX / 4 || alto < 1 || alto > INT_MAX || (d[12] != 3 && d[12] != 4)) {
+        fprintf(stderr, "%s no es un QOI valido.\n", ruta);
+        if (d != MAP_FAILED) munmap((void*)d, largo);
+        return 0;
+    }
+    madvise((void*)d, largo, MADV_SEQUENTIAL);
+
+    int can = d[12];
+    ImagenInfo img = { (int)ancho, (int)alto, can, 0, NULL, 8 };
+    img.pixeles = asignarPixeles(img.alto, img.ancho, can, &img.stride);
+    if (!img.pixeles) {
+        fprintf(stderr, "Error de memoria al cargar %s\n", ruta);
+        munmap((void*)d, largo);
+        return 0;
+    }
+    PixelQOI indice[64];
+    memset(indice, 0, sizeof(indice));
+    PixelQOI px = { 0, 0, 0, 255 };
+    const unsigned char* p = d + TAM_CABECERA_QOI;
+    // Sin el marcador final, ningun codigo puede leer mas alla del fichero.
+    const unsigned char* fin = d + largo - sizeof(finQOI);
+    int repetir = 0, ok = 1;
+    for (int y = 0; y < img.alto && ok; y++) {
+        unsigned char* fila = PIXEL(&img, y, 0);
+        for (int x = 0; x < img.ancho; x++) {
+            if (repetir > 0) {
+                repetir--;
+            } else if (p < fin) {
+                int b1 = *p++;
+                if (b1 == QOI_RGB) {
+                    px.r = p[0];
+                    px.g = p[1];
+                    px.b = p[2];
+                    p += 3;
+                } else if (b1 == QOI_RGBA) {
+                    px.r = p[0];
+                    px.g = p[1];
+                    px.b = p[2];
+                    px.a = p[3];
+                    p += 4;
+                } else if ((b1 & QOI_MASCARA) == QOI_INDICE) {
+                    px = indice[b1];
+                } else if ((b1 & QOI_MASCARA) == QOI_DIFF) {
+                    px.r += ((b1 >> 4) & 3) - 2;
+                    px.g += ((b1 >> 2) & 3) - 2;
+                    px.b += (b1 & 3) - 2;
+                } else if ((b1 & QOI_MASCARA) == QOI_LUMA) {
+                    int b2 = *p++;
+                    int dg = (b1 & 0x3f) - 32;
+                    px.r += dg - 8 + ((b2 >> 4) & 0x0f);
+                    px.g += dg;
+                    px.b += dg - 8 + (b2 & 0x0f);
+                } else {
+                    repetir = b1 & 0x3f;
+                }
+                indice[hashQOI(px)] = px;
+            } else {
+                ok = 0;
+                break;
+            }
+            unsigned char* q = fila + (size_t)x * can;
+            q[0] = px.r;
+            q[1] = px.g;
+            q[2] = px.b;
+            if (can == 4) q[3] = px.a;
+        }
+    }
+    munmap((void*)d, largo);
+    if (!ok || p > fin) {
+        fprintf(stderr, "Fichero truncado: faltan pixeles en %s.\n", ruta);
+        liberarPixelesMem(img.pixeles);
+        return 0;
+    }
+    *info = img;
+    return 1;
+}
+
+// Mete un byte en el buffer de salida, vaciandolo al fichero cuando se llena.
+typedef struct {
+    FILE* f;
+    unsigned char buf[TAM_BUFFER_QOI];
+    size_t n;
+    int ok;
+} SalidaQOI;
+
+static inline void emitirQOI(SalidaQOI* s, const unsigned char* bytes, size_t n) {
+    if (s->n + n > sizeof(s->buf)) {
+        s->ok = s->ok && fwrite(s->buf, 1, s->n, s->f) == s->n;
+        s->n = 0;
+    }
+    memcpy(s->buf + s->n, bytes, n);
+    s->n += n;
+}
+
+static int guardarQOI(const ImagenInfo* info, const char* ruta) {
+    SalidaQOI* s = (SalidaQOI*)malloc(sizeof(SalidaQOI));
+    if (!s) {
+        fprintf(stderr, "Error de memoria al guardar %s\n", ruta);
+        return 0;
+    }
+    char temporal[PATH_MAX];
+    int fd = abrirSalida(ruta, temporal, sizeof(temporal));
+    s->f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    s->n = 0;
+    s->ok = 1;
+    if (!s->f) {
+        fprintf(stderr, "No se pudo crear %s: %s\n", ruta, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            publicarSalida(temporal, ruta, 0);
+        }
+        free(s);
+        return 0;
+    }
+    unsigned char cab[TAM_CABECERA_QOI] = { 'q', 'o', 'i', 'f' };
+    escribirU32BE(cab + 4, (uint32_t)info->ancho);
+    escribirU32BE(cab + 8, (uint32_t)info->alto);
+    cab[12] = TIENE_ALFA(info) ? 4 : 3;
+    cab[13] = 0;   // sRGB con alfa lineal
+    emitirQOI(s, cab, sizeof(cab));
+
+    PixelQOI indice[64];
+    memset(indice, 0, sizeof(indice));
+    PixelQOI previo = { 0, 0, 0, 255 };
+    int repetir = 0, c = info->canales, bits16 = info->profundidad == 16;
+    // Posicion de verde, azul y alfa en el pixel; en grises se repite el canal 0.
+    int cg = c >= 3 ? 1 : 0, cb = c >= 3 ? 2 : 0, ca = TIENE_ALFA(info) ? c - 1 : -1;
+    unsigned char q[4];
+    for (int y = 0; y < info->alto; y++) {
+        const unsigned char* fila = info->pixeles + (size_t)y * info->stride;
+        for (int x = 0; x < info->ancho; x++) {
+            for (int k = 0; k < c; k++) {
+                size_t i = (size_t)x * c + k;
+                q[k] = bits16 ? MUESTRA_A_8(((const uint16_t*)fila)[i]) : fila[i];
+            }
+            PixelQOI px = { q[0], q[cg], q[cb], ca >= 0 ? q[ca] : 255 };
+            if (igualQOI(px, previo)) {
+                if (++repetir == 62) {
+                    unsigned char b = (unsigned char)(QOI_RUN | (repetir - 1));
+                    emitirQOI(s, &b, 1);
+                    repetir = 0;
+                }
+                continue;
+            }
+            if (repetir > 0) {
+                unsigned char b = (unsigned char)(QOI_RUN | (repetir - 1));
+                emitirQOI(s, &b, 1);
+                repetir = 0;
+            }
+            int h = hashQOI(px);
+            if (igualQOI(indice[h], px)) {
+                unsigned char b = (unsigned char)(QOI_INDICE | h);
+                emitirQOI(s, &b, 1);
+            } else if (px.a != previo.a) {
+                // Los codigos de diferencia no cambian el alfa.
+                indice[h] = px;
+                unsigned char b[5] = { QOI_RGBA, px.r, px.g, px.b, px.a };
+                emitirQOI(s, b, 5);
+            } else {
+                indice[h] = px;
+                signed char dr = (signed char)(px.r - previo.r);
+                signed char dg = (signed char)(px.g - previo.g);
+                signed char db = (signed char)(px.b - previo.b);
+                signed char drg = (signed char)(dr - dg), dbg = (signed char)(db - dg);
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    unsigned char b = (unsigned char)(QOI_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                    emitirQOI(s, &b, 1);
+                } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+                    unsigned char b[2] = { (unsigned char)(QOI_LUMA | (dg + 32)), (unsigned char)((drg + 8) << 4 | (dbg + 8)) };
+                    emitirQOI(s, b, 2);
+                } else {
+                    unsigned char b[4] = { QOI_RGB, px.r, px.g, px.b };
+                    emitirQOI(s, b, 4);
+                }
+            }
+            previo = px;
+        }
+    }
+    if (repetir > 0) {
+        unsigned char b = (unsigned char)(QOI_RUN | (repetir - 1));
+        emitirQOI(s, &b, 1);
+    }
+    emitirQOI(s, finQOI, sizeof(finQOI));
+    int ok = s->ok && fwrite(s->buf, 1, s->n, s->f) == s->n;
+    ok = fclose(s->f) == 0 && ok;
+    free(s);
+    if (!ok) fprintf(stderr, "Error al escribir %s\n", ruta);
+    return publicarSalida(temporal, ruta, ok);
+}
+
+//  MOSTRAR MATRIZ 
+
+void mostrarMatriz(const ImagenInfo* info) {
+    if (!info->pixeles) {
+        printf("No hay imagen cargada.\n");
+        return;
+    }
+    printf("Matriz de la imagen (primeras 10 filas):\n");
+    for (int y = 0; y < info->alto && y < 10; y++) {
+        const unsigned char* fila = info->pixeles + (size_t)y * info->stride;
+        for (int x = 0; x < info->ancho; x++) {
+            printf(info->canales == 1 ? "" : "(");
+            for (int c = 0; c < info->canales; c++) {
+                size_t i = (size_t)x * info->canales + c;
+                unsigned v = info->profundidad == 16 ? ((const uint16_t*)fila)[i] : fila[i];
+                printf(info->profundidad == 16 ? "%5u" : "%3u", v);
+                if (c + 1 < info->canales) printf(",");
+            }
+            printf(info->canales == 1 ? " " : ") ");
+        }
+        printf("\n");
+    }
+    if (info->alto > 10) printf("... (más filas)\n");
+}
+
+//  POOL DE HILOS
+
+// Pool unico del proceso. Cada operacion se parte en porciones de filas que se
+// reparten entre las colas de los trabajadores; el que vacia la suya roba de las demas.
+
+#define CAPACIDAD_INICIAL_COLA 64
+
+typedef void (*FuncionPorcion)(void* args, int inicio, int fin);
+
+typedef struct {
+    FuncionPorcion fn;
+    void* args;
+    int hilos;                 // solo los trabajadores con id < hilos ejecutan este trabajo
+    atomic_int pendientes;
+    EstadisticasOp* estadisticas;   // de la operacion que lanzo el trabajo, o NULL
+    atomic_llong finNs;             // fin de la ultima porcion (solo con estadisticas)
+} TrabajoPool;
+
+typedef struct {
+    TrabajoPool* trabajo;
+    int inicio, fin;
+} Porcion;
+
+// Cola doble por trabajador: el dueno saca del final, los ladrones del principio.
+typedef struct {
+    pthread_mutex_t m;
+    Porcion* items;
+    int cap, cabeza, cola;
+} ColaPorciones;
+
+typedef struct {
+    atomic_int n;               // trabajadores arrancados (solo crece con pool.m tomado)
+    int iniciado;
+    int salir;
+    atomic_int elegibles[MAX_HILOS_POOL];  // porciones encoladas que puede ejecutar cada id
+    pthread_mutex_t m;
+    pthread_cond_t hayTrabajo;
+    pthread_cond_t terminado;
+    pthread_t hilos[MAX_HILOS_POOL];
+    ColaPorciones colas[MAX_HILOS_POOL];
+    atomic_int cpuFijada[MAX_HILOS_POOL];  // CPU + 1 de cada trabajador con --affinity (0 = libre)
+} PoolHilos;
+
+static PoolHilos pool = { .m = PTHREAD_MUTEX_INITIALIZER,
+                          .hayTrabajo = PTHREAD_COND_INITIALIZER,
+                          .terminado = PTHREAD_COND_INITIALIZER };
+static __thread int idTrabajadorActual = -1;
+
+static int meterEnCola(ColaPorciones* q, Porcion p) {
+    pthread_mutex_lock(&q->m);
+    if (q->cola - q->cabeza == q->cap || !q->items) {
+        int nuevaCap = q->cap ? q->cap * 2 : CAPACIDAD_INICIAL_COLA;
+        Porcion* nuevos = (Porcion*)malloc(nuevaCap * sizeof(Porcion));
+        if (!nuevos) {
+            pthread_mutex_unlock(&q->m);
+            return 0;
+        }
+        for (int i = q->cabeza; i < q->cola; i++) nuevos[i - q->cabeza] = q->items[i % q->cap];
+        q->cola -= q->cabeza;
+        q->cabeza = 0;
+        free(q->items);
+        q->items = nuevos;
+        q->cap = nuevaCap;
+    }
+    q->items[q->cola % q->cap] = p;
+    q->cola++;
+    pthread_mutex_unlock(&q->m);
+    return 1;
+}
+
+// Saca la primera porcion que admite al trabajador id, desde el final (propia) o desde
+// el principio (robo). Con trabajos de distinto numero de hilos a la vez, las porciones
+// que id puede ejecutar pueden estar detras de otras que no: hay que saltarlas, o el
+// trabajador daria vueltas sin dormir mientras elegibles[id] > 0.
+static int sacarDeCola(ColaPorciones* q, int id, int robar, Porcion* p) {
+    int ok = 0;
+    pthread_mutex_lock(&q->m);
+    int n = q->cola - q->cabeza;
+    for (int k = 0; k < n && !ok; k++) {
+        int idx = robar ? q->cabeza + k : q->cola - 1 - k;
+        Porcion cand = q->items[idx % q->cap];
+        if (id >= 0 && id >= cand.trabajo->hilos) continue;
+        *p = cand;
+        // Cierra el hueco desplazando las porciones saltadas.
+        if (robar) {
+            for (int j = idx; j > q->cabeza; j--) q->items[j % q->cap] = q->items[(j - 1) % q->cap];
+            q->cabeza++;
+        } else {
+            for (int j = idx; j < q->cola - 1; j++) q->items[j % q->cap] = q->items[(j + 1) % q->cap];
+            q->cola--;
+        }
+        if (q->cabeza == q->cola) q->cabeza = q->cola = 0;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&q->m);
+    if (ok) {
+        for (int i = 0; i < p->trabajo->hilos; i++) atomic_fetch_sub(&pool.elegibles[i], 1);
+    }
+    return ok;
+}
+
+static int tomarPorcion(int id, Porcion* p) {
+    int n = atomic_load(&pool.n);
+    if (id >= 0 && sacarDeCola(&pool.colas[id], id, 0, p)) return 1;
+    int desde = id >= 0 ? id + 1 : 0;
+    for (int k = 0; k < n; k++) {
+        int victima = (desde + k) % n;
+        if (victima == id) continue;
+        if (sacarDeCola(&pool.colas[victima], id, 1, p)) return 1;
+    }
+    return 0;
+}
+
+static void ejecutarPorcion(Porcion* p) {
+    TrabajoPool* t = p->trabajo;
+    EstadisticasOp* st = t->estadisticas;
+    double t0 = st ? ahoraSeg() : 0.0;
+    t->fn(t->args, p->inicio, p->fin);
+    if (st) {
+        registrarPorcion(st, idTrabajadorActual, nsDesde(t0), p->fin - p->inicio);
+        long long fin = (long long)(ahoraSeg() * 1e9), previo = atomic_load(&t->finNs);
+        while (fin > previo && !atomic_compare_exchange_weak(&t->finNs, &previo, fin)) {}
+    }
+    if (atomic_fetch_sub(&t->pendientes, 1) == 1) {
+        pthread_mutex_lock(&pool.m);
+        pthread_cond_broadcast(&pool.terminado);
+        pthread_mutex_unlock(&pool.m);
+    }
+}
+
+static void* trabajadorPool(void* arg) {
+    int id = (int)(intptr_t)arg;
+    idTrabajadorActual = id;
+    if (modoAfinidad != AFINIDAD_NO) atomic_store(&pool.cpuFijada[id], fijarAfinidadHilo(id) + 1);
+    Porcion p;
+    while (1) {
+        if (tomarPorcion(id, &p)) {
+            ejecutarPorcion(&p);
+            continue;
+        }
+        pthread_mutex_lock(&pool.m);
+        while (!pool.salir && atomic_load(&pool.elegibles[id]) == 0) pthread_cond_wait(&pool.hayTrabajo, &pool.m);
+        int salir = pool.salir;
+        pthread_mutex_unlock(&pool.m);
+        if (salir) break;
+    }
+    return NULL;
+}
+
+int hilosPorDefecto(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > MAX_HILOS_POOL) n = MAX_HILOS_POOL;
+    return (int)n;
+}
+
+// Garantiza al menos minimo trabajadores (el pool solo crece). Llamar con pool.m tomado.
+static int asegurarTrabajadores(int minimo) {
+    if (minimo > MAX_HILOS_POOL) minimo = MAX_HILOS_POOL;
+    int n = atomic_load(&pool.n);
+    while (n < minimo) {
+        ColaPorciones* q = &pool.colas[n];
+        pthread_mutex_init(&q->m, NULL);
+        q->items = NULL;
+        q->cap = q->cabeza = q->cola = 0;
+        // La cola queda visible para los ladrones antes de que arranque su dueno.
+        atomic_store(&pool.n, n + 1);
+        if (pthread_create(&pool.hilos[n], NULL, trabajadorPool, (void*)(intptr_t)n) != 0) {
+            fprintf(stderr, "Error al crear hilo %d del pool\n", n);
+            atomic_store(&pool.n, n);
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
+// Arranca el pool con numHilos trabajadores (<= 0: uno por nucleo en linea).
+int iniciarPoolHilos(int numHilos) {
+    pthread_mutex_lock(&pool.m);
+    if (!pool.iniciado) {
+        pool.iniciado = 1;
+        asegurarTrabajadores(numHilos > 0 ? numHilos : hilosPorDefecto());
+    }
+    int n = atomic_load(&pool.n);
+    pthread_mutex_unlock(&pool.m);
+    return n;
+}
+
+void destruirPoolHilos(void) {
+    pthread_mutex_lock(&pool.m);
+    pool.salir = 1;
+    pthread_cond_broadcast(&pool.hayTrabajo);
+    int n = atomic_load(&pool.n);
+    pthread_mutex_unlock(&pool.m);
+    for (int i = 0; i < n; i++) pthread_join(pool.hilos[i], NULL);
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_destroy(&pool.colas[i].m);
+        free(pool.colas[i].items);
+        atomic_store(&pool.cpuFijada[i], 0);
+    }
+    atomic_store(&pool.n, 0);
+    pool.iniciado = 0;
+    pool.salir = 0;
+}
+
+// Filas por porcion: unos 64 KB de salida, sin bajar del minimo que pida la operacion.
+int granoFilas(int ancho, int canales, int minimo) {
+    int bytesFila = ancho * canales > 0 ? ancho * canales : 1;
+    int g = 65536 / bytesFila;
+    if (g < 1) g = 1;
+    if (g > 64) g = 64;
+    return g < minimo ? minimo : g;
+}
+
+// Ejecuta fn sobre [0, total) en porciones de grano filas con numHilos trabajadores
+// del pool y vuelve cuando han terminado todas. Devuelve los hilos usados.
+int paraleloFilas(int total, int grano, int numHilos, FuncionPorcion fn, void* args) {
+    if (total <= 0) return 0;
+    if (grano < 1) grano = 1;
+    if (numHilos < 1) numHilos = 1;
+    int porciones = (total + grano - 1) / grano;
+    if (numHilos > porciones) numHilos = porciones;
+    // Con un hilo se ejecuta en el que llama: varias imagenes pueden procesarse a la vez
+    // desde hilos propios sin pasar todas por el trabajador 0.
+    EstadisticasOp* st = estadisticasActuales;
+    if (numHilos == 1) {
+        for (int i = 0; i < total; i += grano) {
+            double t0 = st ? ahoraSeg() : 0.0;
+            int fin = i + grano < total ? i + grano : total;
+            fn(args, i, fin);
+            if (st) {
+                long long ns = nsDesde(t0);
+                registrarPorcion(st, idTrabajadorActual, ns, fin - i);
+                atomic_fetch_add(&st->nsCalculo, ns);
+            }
+        }
+        return 1;
+    }
+
+    double tArranque = st ? ahoraSeg() : 0.0;
+    pthread_mutex_lock(&pool.m);
+    pool.iniciado = 1;
+    int disponibles = asegurarTrabajadores(numHilos);
+    pthread_mutex_unlock(&pool.m);
+    if (st) atomic_fetch_add(&st->nsArranque, nsDesde(tArranque));
+    if (disponibles < numHilos) numHilos = disponibles;
+    if (numHilos < 1) {
+        fn(args, 0, total);
+        return 1;
+    }
+
+    TrabajoPool t = { fn, args, numHilos, porciones, st, 0 };
+    double tInicio = st ? ahoraSeg() : 0.0;
+    for (int i = 0; i < numHilos; i++) atomic_fetch_add(&pool.elegibles[i], porciones);
+    for (int i = 0; i < porciones; i++) {
+        Porcion p = { &t, i * grano, (i + 1) * grano < total ? (i + 1) * grano : total };
+        // Reparto en bloques contiguos: cada trabajador empieza con filas vecinas.
+        int dueno = (int)((long)i * numHilos / porciones);
+        if (!meterEnCola(&pool.colas[dueno], p)) {
+            for (int k = 0; k < numHilos; k++) atomic_fetch_sub(&pool.elegibles[k], 1);
+            fn(args, p.inicio, p.fin);
+            atomic_fetch_sub(&t.pendientes, 1);
+        }
+    }
+    pthread_mutex_lock(&pool.m);
+    pthread_cond_broadcast(&pool.hayTrabajo);
+    pthread_mutex_unlock(&pool.m);
+
+    // Un trabajador que lanza trabajo anidado ayuda en lugar de bloquearse.
+    Porcion p;
+    while (atomic_load(&t.pendientes) > 0) {
+        if (idTrabajadorActual >= 0 && tomarPorcion(idTrabajadorActual, &p)) {
+            ejecutarPorcion(&p);
+            continue;
+        }
+        pthread_mutex_lock(&pool.m);
+        if (atomic_load(&t.pendientes) > 0) pthread_cond_wait(&pool.terminado, &pool.m);
+        pthread_mutex_unlock(&pool.m);
+    }
+    if (st) {
+        // Calculo hasta que termina la ultima porcion; espera, lo que tarda en enterarse el que llama.
+        double fin = atomic_load(&t.finNs) / 1e9;
+        if (fin < tInicio) fin = tInicio;
+        atomic_fetch_add(&st->nsCalculo, (long long)((fin - tInicio) * 1e9));
+        atomic_fetch_add(&st->nsEspera, nsDesde(fin));
+    }
+    return numHilos;
+}
+
+//  COLOCACION POR NODOS
+
+// Linux coloca cada pagina en el nodo del hilo que la toca primero. Con --numa una
+// imagen nueva no la toca el hilo que la reserva: cada trabajador toca primero la
+// franja de filas que despues le da paraleloFilas (bloques contiguos por orden de
+// trabajador), y con --affinity esa franja queda en el nodo que la calcula. Con paginas
+// enormes se coloca por bloques de 2 MB, asi que solo se hace con al menos uno por
+// trabajador. La imagen cargada, decodificada o mapeada desde el hilo principal, se
+// copia una vez por franjas con reubicarImagen.
+
+#define PAGINA_PEQUENA 4096
+
+// Trabajadores entre los que se reparten las franjas (0 = apagado).
+static int hilosPrimerToque = 0;
+
+void fijarPrimerToque(int numHilos) {
+    hilosPrimerToque = numHilos;
+}
+
+static int conPrimerToque(size_t bytes) {
+    int n = hilosPrimerToque;
+    return n > 1 && idTrabajadorActual < 0 && bytes >= (size_t)n * PAGINA_ENORME;
+}
+
+typedef struct {
+    unsigned char* pix;
+    size_t stride;
+    const ImagenInfo* origen;   // reubicarImagen: filas que se copian (NULL: solo tocar)
+    size_t bytesFila;
+} ToqueArgs;
+
+// Basta una escritura por pagina; la que empieza en la franja anterior es de aquella.
+static void hiloPrimerToque(void* args, int inicio, int fin) {
+    ToqueArgs* a = (ToqueArgs*)args;
+    if (a->origen) {
+        for (int y = inicio; y < fin; y++) {
+            memcpy(a->pix + (size_t)y * a->stride, a->origen->pixeles + (size_t)y * a->origen->stride, a->bytesFila);
+        }
+        return;
+    }
+    uintptr_t desde = (uintptr_t)(a->pix + (size_t)inicio * a->stride);
+    uintptr_t hasta = (uintptr_t)(a->pix + (size_t)fin * a->stride);
+    desde = (desde + PAGINA_PEQUENA - 1) & ~(uintptr_t)(PAGINA_PEQUENA - 1);
+    for (uintptr_t p = desde; p < hasta; p += PAGINA_PEQUENA) *(volatile unsigned char*)p = 0;
+}
+
+// Una porcion por trabajador: la fila y cae en la franja y / grano.
+static void repartirFranjas(int alto, ToqueArgs* a) {
+    int n = hilosPrimerToque;
+    paraleloFilas(alto, (alto + n - 1) / n, n, hiloPrimerToque, a);
+}
+
+// Toca las paginas nuevas de pix por franjas; su tiempo cuenta como reserva, no como calculo.
+static int primerToque(unsigned char* pix, size_t stride, int alto, size_t bytes) {
+    if (!conPrimerToque(bytes)) return 0;
+    EstadisticasOp* st = estadisticasActuales;
+    estadisticasActuales = NULL;
+    ToqueArgs a = { pix, stride, NULL, 0 };
+    repartirFranjas(alto, &a);
+    estadisticasActuales = st;
+    return 1;
+}
+
+// Copia la imagen a un buffer colocado por franjas; sin efecto si --numa esta apagado.
+int reubicarImagen(ImagenInfo* img) {
+    size_t bytesFila = (size_t)img->ancho * BYTES_PIXEL(img);
+    if (!img->pixeles || !conPrimerToque(bytesFila * img->alto)) return 1;
+    ImagenInfo dst = *img;
+    dst.pixeles = asignarPixeles(img->alto, img->ancho, (int)BYTES_PIXEL(img), &dst.stride);
+    if (!dst.pixeles) {
+        fprintf(stderr, "Sin memoria para reubicar la imagen.\n");
+        return 0;
+    }
+    ToqueArgs a = { dst.pixeles, dst.stride, img, bytesFila };
+    repartirFranjas(img->alto, &a);
+    anotarTrafico(2 * (long long)bytesFila * img->alto);
+    reemplazarImagen(img, &dst);
+    return 1;
+}
+
+// CPU y nodo de cada trabajador con --affinity y, con --numa, en que nodo estan las
+// paginas de la imagen (una muestra) frente al del trabajador de su franja.
+void informarColocacion(const ImagenInfo* img) {
+    int n = atomic_load(&pool.n);
+    if (modoAfinidad != AFINIDAD_NO) {
+        int fallidos = 0;
+        informar("Afinidad %s (%d nodo(s)), trabajador->cpu/nodo:",
+                 modoAfinidad == AFINIDAD_COMPACTA ? "compacta" : "dispersa", numNodosNUMA());
+        for (int i = 0; i < n; i++) {
+            int cpu = atomic_load(&pool.cpuFijada[i]) - 1;
+            if (cpu < 0) fallidos++;
+            else informar(" %d->%d/%d", i, cpu, nodoDeCpu(cpu));
+        }
+        if (fallidos) informar(" (%d sin fijar)", fallidos);
+        informar("\n");
+    }
+    if (hilosPrimerToque < 2 || !img->pixeles) return;
+
+    enum { MUESTRAS_PAGINAS = 256 };
+    void* paginas[MUESTRAS_PAGINAS];
+    int estado[MUESTRAS_PAGINAS], esperado[MUESTRAS_PAGINAS];
+    int m = 0, grano = (img->alto + hilosPrimerToque - 1) / hilosPrimerToque;
+    size_t total = (size_t)img->alto * img->stride;
+    for (int k = 0; k < MUESTRAS_PAGINAS; k++) {
+        uintptr_t p = (uintptr_t)img->pixeles + total * k / MUESTRAS_PAGINAS;
+        p = (p + PAGINA_PEQUENA - 1) & ~(uintptr_t)(PAGINA_PEQUENA - 1);
+        size_t desp = p - (uintptr_t)img->pixeles;
+        if (desp >= total) break;
+        int trabajador = (int)(desp / img->stride) / grano;
+        int cpu = trabajador < n ? atomic_load(&pool.cpuFijada[trabajador]) - 1 : -1;
+        esperado[m] = cpu >= 0 ? nodoDeCpu(cpu) : -1;
+        paginas[m++] = (void*)p;
+    }
+    if (m == 0 || syscall(SYS_move_pages, 0, (unsigned long)m, paginas, NULL, estado, 0) != 0) {
+        informar("Colocacion: no se pudo consultar el nodo de las paginas (%s).\n", strerror(errno));
+        return;
+    }
+    int porNodo[MAX_NODOS_NUMA] = { 0 }, comparables = 0, enSuNodo = 0, sinPagina = 0;
+    for (int i = 0; i < m; i++) {
+        if (estado[i] < 0 || estado[i] >= MAX_NODOS_NUMA) {
+            sinPagina++;
+            continue;
+        }
+        porNodo[estado[i]]++;
+        if (esperado[i] < 0) continue;
+        comparables++;
+        enSuNodo += estado[i] == esperado[i];
+    }
+    informar("Colocacion: %d paginas muestreadas, por nodo:", m);
+    for (int i = 0; i < MAX_NODOS_NUMA; i++) {
+        if (porNodo[i]) informar(" %d=%d", i, porNodo[i]);
+    }
+    if (sinPagina) informar(", %d sin asignar", sinPagina);
+    if (comparables) informar("; %d de %d en el nodo del trabajador de su franja", enSuNodo, comparables);
+    informar("\n");
+}
+
+//  ALFA Y 16 BITS
+
+// Las imagenes con alfa se guardan sin premultiplicar. Los filtros que mezclan pixeles
+// vecinos (desenfoque, convolucion, caja, redimensionado y rotacion bilineal) lo
+// premultiplican antes y lo deshacen despues, para que el color de los pixeles
+// transparentes no se cuele en el borde de los opacos; los que tratan cada pixel por
+// separado se saltan el alfa.
+//
+// Los bucles por pixel se escriben una vez como funciones always_inline con canales y
+// profundidad como ultimos parametros, y SEGUN_FORMATO las instancia con constantes:
+// en cada variante el bucle de canales se desenrolla y la lectura de la muestra es fija.
+
+#define SEGUN_FORMATO(can, bits16, fn, ...) do {                         \
+        switch ((can) * 2 + ((bits16) ? 1 : 0)) {                       \
+            case 2: fn(__VA_ARGS__, 1, 0); break;                        \
+            case 3: fn(__VA_ARGS__, 1, 1); break;                        \
+            case 4: fn(__VA_ARGS__, 2, 0); break;                        \
+            case 5: fn(__VA_ARGS__, 2, 1); break;                        \
+            case 6: fn(__VA_ARGS__, 3, 0); break;                        \
+            case 7: fn(__VA_ARGS__, 3, 1); break;                        \
+            case 8: fn(__VA_ARGS__, 4, 0); break;                        \
+            default: fn(__VA_ARGS__, 4, 1); break;                       \
+        }                                                                \
+    } while (0)
+
+#define CANALES_COLOR(img) (TIENE_ALFA(img) ? (img)->canales - 1 : (img)->canales)
+
+static inline __attribute__((always_inline)) int leerMuestra(const void* p, size_t i, int bits16) {
+    return bits16 ? ((const uint16_t*)p)[i] : ((const unsigned char*)p)[i];
+}
+
+static inline __attribute__((always_inline)) void escribirMuestra(void* p, size_t i, int v, int bits16) {
+    if (bits16) ((uint16_t*)p)[i] = (uint16_t)v;
+    else ((unsigned char*)p)[i] = (unsigned char)v;
+}
+
+// Premultiplica (o deshace) los n pixeles de una fila: color * alfa / maximo, redondeado.
+// Deshacer no recupera lo que se perdio al redondear colores casi transparentes.
+static inline __attribute__((always_inline))
+void alfaFila(void* fila, int n, int deshacer, int can, int bits16) {
+    const uint32_t maximo = bits16 ? 65535 : 255;
+    for (int x = 0; x < n; x++) {
+        size_t base = (size_t)x * can;
+        uint32_t a = (uint32_t)leerMuestra(fila, base + can - 1, bits16);
+        for (int c = 0; c < can - 1; c++) {
+            uint32_t v = (uint32_t)leerMuestra(fila, base + c, bits16);
+            if (deshacer) {
+                v = a ? (v * maximo + a / 2) / a : 0;
+                if (v > maximo) v = maximo;
+            } else {
+                v = (v * a + maximo / 2) / maximo;
+            }
+            escribirMuestra(fila, base + c, (int)v, bits16);
+        }
+    }
+}
+
+typedef struct {
+    ImagenInfo* img;
+    int deshacer;
+} AlfaArgs;
+
+void hiloAlfa(void* arg, int inicio, int fin) {
+    AlfaArgs* a = (AlfaArgs*)arg;
+    ImagenInfo* img = a->img;
+    for (int y = inicio; y < fin; y++) {
+        void* fila = img->pixeles + (size_t)y * img->stride;
+        SEGUN_FORMATO(img->canales, img->profundidad == 16, alfaFila, fila, img->ancho, a->deshacer);
+    }
+}
+
+// No hace nada en imagenes sin alfa.
+static void premultiplicarAlfa(ImagenInfo* info, int deshacer, int numHilos) {
+    if (!TIENE_ALFA(info)) return;
+    AlfaArgs args = { info, deshacer };
+    paraleloFilas(info->alto, granoFilas(info->ancho, (int)BYTES_PIXEL(info), 1), numHilos, hiloAlfa, &args);
+}
+
+void hiloReducirA8(void* arg, int inicio, int fin) {
+    ImagenInfo** imgs = (ImagenInfo**)arg;
+    size_t n = (size_t)imgs[0]->ancho * imgs[0]->canales;
+    for (int y = inicio; y < fin; y++) {
+        const uint16_t* s = FILA16(imgs[0], y);
+        unsigned char* d = PIXEL(imgs[1], y, 0);
+        for (size_t i = 0; i < n; i++) d[i] = MUESTRA_A_8(s[i]);
+    }
+}
+
+// Para las operaciones que solo trabajan con 8 bits por canal: redondea una imagen de
+// 16 bits a 8 y lo avisa. Devuelve 0 si no hubo memoria.
+static int reducirA8Bits(ImagenInfo* info, const char* operacion, int numHilos) {
+    if (info->profundidad != 16) return 1;
+    ImagenInfo dst = { info->ancho, info->alto, info->canales, 0, NULL, 8 };
+    dst.pixeles = asignarPixeles(dst.alto, dst.ancho, dst.canales, &dst.stride);
+    if (!dst.pixeles) {
+        fprintf(stderr, "Error de memoria al pasar la imagen a 8 bits.\n");
+        return 0;
+    }
+    ImagenInfo* imgs[2] = { info, &dst };
+    paraleloFilas(info->alto, granoFilas(info->ancho, info->canales, 1), numHilos, hiloReducirA8, imgs);
+    reemplazarImagen(info, &dst);
+    informar("%s trabaja con 8 bits por canal: la imagen se ha reducido de 16 a 8 bits.\n", operacion);
+    return 1;
+}
+
+//  PNG POR FRANJAS
+
+// La imagen se parte en franjas de filas que se filtran y comprimen a la vez, cada una
+// en su propio deflate crudo. Las franjas intermedias terminan con Z_SYNC_FLUSH (bloque
+// cerrado y alineado a byte) y la ultima con Z_FINISH, asi que concatenadas forman un
+// unico flujo deflate valido; la cabecera zlib va delante de la primera y el adler32,
+// combinado a partir del de cada franja, detras de la ultima. Cada franja arranca con
+// los ultimos 32 KB filtrados de la anterior como diccionario (se vuelven a filtrar,
+// el filtro es determinista), asi que apenas se pierde compresion frente a una sola
+// pasada. Cada franja se escribe como un chunk IDAT.
+
+#define BYTES_FRANJA_PNG (256 * 1024)
+#define VENTANA_DEFLATE 32768
+
+typedef struct {
+    const ImagenInfo* img;
+    int filasFranja, numFranjas;
+    unsigned char** datos;     // por franja: 2 bytes libres, deflate crudo, 4 bytes libres
+    size_t* largos;            // bytes de deflate de cada franja
+    uLong* adlers;             // adler32 de los bytes filtrados de cada franja
+    size_t* filtrados;
+    atomic_int error;
+} PNGFranjasArgs;
+
+// Tipo de color PNG segun los canales: grises, grises+alfa, RGB y RGBA.
+static const unsigned char tipoColorPNG[5] = { 0, 0, 4, 2, 6 };
+
+// Fila y tal como va en el PNG: la propia fila con 8 bits; con 16, en big-endian sobre tmp.
+static const unsigned char* filaPNG(const ImagenInfo* img, int y, unsigned char* tmp) {
+    if (img->profundidad != 16) return PIXEL(img, y, 0);
+    const uint16_t* s = FILA16(img, y);
+    size_t n = (size_t)img->ancho * img->canales;
+    for (size_t i = 0; i < n; i++) {
+        tmp[2 * i] = (unsigned char)(s[i] >> 8);
+        tmp[2 * i + 1] = (unsigned char)s[i];
+    }
+    return tmp;
+}
+
+// filas: dos filas de trabajo de n bytes para filaPNG (actual y anterior).
+static int comprimirFranjaPNG(PNGFranjasArgs* a, int k, unsigned char* filtradas, const unsigned char* ceros,
+                              unsigned char* filas) {
+    const ImagenInfo* img = a->img;
+    size_t n = (size_t)img->ancho * BYTES_PIXEL(img);
+    int bpp = (int)BYTES_PIXEL(img);
+    int y0 = k * a->filasFranja;
+    int y1 = y0 + a->filasFranja < img->alto ? y0 + a->filasFranja : img->alto;
+    int ultima = k == a->numFranjas - 1;
+
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, nivelPNG, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return 0;
+    int ok = 1;
+    if (y0 > 0 && nivelPNG > 0) {
+        // Diccionario: las filas filtradas de la franja anterior que caben en la ventana.
+        int filasDic = (int)((VENTANA_DEFLATE + n) / (n + 1));
+        if (filasDic > y0) filasDic = y0;
+        unsigned char* dic = (unsigned char*)malloc((size_t)filasDic * (n + 1));
+        ok = dic != NULL;
+        for (int i = 0; ok && i < filasDic; i++) {
+            int y = y0 - filasDic + i;
+            const unsigned char* previa = y ? filaPNG(img, y - 1, filas + n) : ceros;
+            memcpy(dic + (size_t)i * (n + 1), filtrarFilaPNG(filaPNG(img, y, filas), previa, n, bpp, filtradas), n + 1);
+        }
+        size_t largoDic = (size_t)filasDic * (n + 1);
+        size_t usar = largoDic < VENTANA_DEFLATE ? largoDic : VENTANA_DEFLATE;
+        ok = ok && deflateSetDictionary(&z, dic + largoDic - usar, (uInt)usar) == Z_OK;
+        free(dic);
+    }
+    size_t filtrados = (size_t)(y1 - y0) * (n + 1);
+    size_t cap = deflateBound(&z, filtrados) + 64;
+    unsigned char* out = ok ? (unsigned char*)malloc(cap + 6) : NULL;
+    ok = out != NULL;
+    uLong adler = adler32(0L, Z_NULL, 0);
+    if (ok) {
+        z.next_out = out + 2;
+        z.avail_out = (uInt)cap;
+    }
+    for (int y = y0; ok && y < y1; y++) {
+        const unsigned char* previa = y ? filaPNG(img, y - 1, filas + n) : ceros;
+        const unsigned char* f = filtrarFilaPNG(filaPNG(img, y, filas), previa, n, bpp, filtradas);
+        adler = adler32(adler, f, (uInt)(n + 1));
+        z.next_in = (Bytef*)f;
+        z.avail_in = (uInt)(n + 1);
+        while (ok && z.avail_in) ok = deflate(&z, Z_NO_FLUSH) == Z_OK && z.avail_out > 0;
+    }
+    if (ok) {
+        int r = deflate(&z, ultima ? Z_FINISH : Z_SYNC_FLUSH);
+        ok = ultima ? r == Z_STREAM_END : r == Z_OK && z.avail_out > 0;
+    }
+    deflateEnd(&z);
+    if (!ok) {
+        free(out);
+        return 0;
+    }
+    a->datos[k] = out;
+    a->largos[k] = cap - z.avail_out;
+    a->adlers[k] = adler;
+    a->filtrados[k] = filtrados;
+    return 1;
+}
+
+// Las porciones cuentan franjas, no filas.
+void hiloFranjasPNG(void* arg, int inicio, int fin) {
+    PNGFranjasArgs* a = (PNGFranjasArgs*)arg;
+    size_t n = (size_t)a->img->ancho * BYTES_PIXEL(a->img);
+    unsigned char* filtradas = (unsigned char*)malloc(4 * (n + 1));
+    unsigned char* ceros = (unsigned char*)calloc(n, 1);
+    unsigned char* filas = (unsigned char*)malloc(2 * n);
+    for (int k = inicio; k < fin; k++) {
+        if (!filtradas || !ceros || !filas || !comprimirFranjaPNG(a, k, filtradas, ceros, filas)) {
+            atomic_store(&a->error, 1);
+        }
+    }
+    free(filtradas);
+    free(ceros);
+    free(filas);
+}
+
+static int guardarPNGFranjas(const ImagenInfo* info, const char* ruta, int numHilos) {
+    PNGFranjasArgs a;
+    memset(&a, 0, sizeof(a));
+    a.img = info;
+    size_t n = (size_t)info->ancho * BYTES_PIXEL(info);
+    a.filasFranja = (int)(BYTES_FRANJA_PNG / (n + 1));
+    if (a.filasFranja < 1) a.filasFranja = 1;
+    a.numFranjas = (info->alto + a.filasFranja - 1) / a.filasFranja;
+    a.datos = (unsigned char**)calloc(a.numFranjas, sizeof(unsigned char*));
+    a.largos = (size_t*)calloc(a.numFranjas, sizeof(size_t));
+    a.adlers = (uLong*)calloc(a.numFranjas, sizeof(uLong));
+    a.filtrados = (size_t*)calloc(a.numFranjas, sizeof(size_t));
+    int ok = a.datos && a.largos && a.adlers && a.filtrados;
+    if (ok) {
+        paraleloFilas(a.numFranjas, 1, numHilos > 0 ? numHilos : hilosPorDefecto(), hiloFranjasPNG, &a);
+        ok = !atomic_load(&a.error);
+    }
+    if (!ok) fprintf(stderr, "Error de memoria al comprimir %s\n", ruta);
+
+    char temporal[PATH_MAX] = "";
+    int fd = ok ? abrirSalida(ruta, temporal, sizeof(temporal)) : -1;
+    FILE* f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (ok && !f) {
+        fprintf(stderr, "No se pudo crear %s: %s\n", ruta, strerror(errno));
+        if (fd >= 0) close(fd);
+        ok = 0;
+    }
+    if (ok) {
+        // Cabecera zlib: ventana de 32 KB y FLEVEL segun el nivel, con FCHECK multiplo de 31.
+        int flevel = nivelPNG <= 1 ? 0 : nivelPNG <= 5 ? 1 : nivelPNG == 6 ? 2 : 3;
+        int flg = flevel << 6;
+        flg += 31 - (0x78 * 256 + flg) % 31;
+        uLong adler = adler32(0L, Z_NULL, 0);
+        for (int k = 0; k < a.numFranjas; k++) adler = adler32_combine(adler, a.adlers[k], (z_off_t)a.filtrados[k]);
+
+        unsigned char ihdr[13];
+        escribirU32BE(ihdr, (uint32_t)info->ancho);
+        escribirU32BE(ihdr + 4, (uint32_t)info->alto);
+        ihdr[8] = (unsigned char)(info->profundidad == 16 ? 16 : 8);
+        ihdr[9] = tipoColorPNG[info->canales];
+        ihdr[10] = ihdr[11] = ihdr[12] = 0;
+        ok = fwrite("\x89PNG\r\n\x1a\n", 1, 8, f) == 8 && escribirChunkPNG(f, "IHDR", ihdr, 13);
+        for (int k = 0; ok && k < a.numFranjas; k++) {
+            unsigned char* d = a.datos[k];
+            size_t largo = a.largos[k];
+            if (k == 0) {
+                d[0] = 0x78;
+                d[1] = (unsigned char)flg;
+            }
+            if (k == a.numFranjas - 1) {
+                escribirU32BE(d + 2 + largo, (uint32_t)adler);
+                largo += 4;
+            }
+            ok = k == 0 ? escribirChunkPNG(f, "IDAT", d, (uint32_t)(largo + 2))
+                        : escribirChunkPNG(f, "IDAT", d + 2, (uint32_t)largo);
+        }
+        ok = ok && escribirChunkPNG(f, "IEND", NULL, 0);
+        ok = fclose(f) == 0 && ok;
+        if (!ok) fprintf(stderr, "Error al guardar PNG: %s\n", ruta);
+    }
+    ok = publicarSalida(temporal, ruta, ok);
+    for (int k = 0; a.datos && k < a.numFranjas; k++) free(a.datos[k]);
+    free(a.datos);
+    free(a.largos);
+    free(a.adlers);
+    free(a.filtrados);
+    return ok;
+}
+
+// BRILLO Y AJUSTES PUNTUALES
+
+// Cada ajuste se compone sobre una tabla de 256 entradas, asi que una cadena de
+// ajustes cuesta una sola pasada por la imagen.
+
+typedef struct {
+    unsigned char lut[256];
+    int numAjustes;
+} CadenaPuntual;
+
+void iniciarCadenaPuntual(CadenaPuntual* cadena) {
+    for (int i = 0; i < 256; i++) cadena->lut[i] = (unsigned char)i;
+    cadena->numAjustes = 0;
+}
+
+static inline unsigned char clampRedondeo(double v) {
+    if (v <= 0.0) return 0;
+    if (v >= 255.0) return 255;
+    return (unsigned char)lround(v);
+}
+
+void componerBrillo(CadenaPuntual* cadena, int delta) {
+    for (int i = 0; i < 256; i++) {
+        int v = cadena->lut[i] + delta;
+        cadena->lut[i] = (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+    }
+    cadena->numAjustes++;
+}
+
+// factor 1.0 deja la imagen igual; se escala alrededor del gris medio.
+void componerContraste(CadenaPuntual* cadena, double factor) {
+    for (int i = 0; i < 256; i++) cadena->lut[i] = clampRedondeo((cadena->lut[i] - 128.0) * factor + 128.0);
+    cadena->numAjustes++;
+}
+
+// gamma > 1 aclara los medios tonos.
+void componerGamma(CadenaPuntual* cadena, double gamma) {
+    for (int i = 0; i < 256; i++) cadena->lut[i] = clampRedondeo(255.0 * pow(cadena->lut[i] / 255.0, 1.0 / gamma));
+    cadena->numAjustes++;
+}
+
+void componerInvertir(CadenaPuntual* cadena) {
+    for (int i = 0; i < 256; i++) cadena->lut[i] = (unsigned char)(255 - cadena->lut[i]);
+    cadena->numAjustes++;
+}
+
+// Lleva [negroEnt, blancoEnt] a [negroSal, blancoSal] con una gamma intermedia.
+void componerNiveles(CadenaPuntual* cadena, int negroEnt, int blancoEnt, double gamma,
+                     int negroSal, int blancoSal) {
+    double rango = blancoEnt > negroEnt ? blancoEnt - negroEnt : 1;
+    for (int i = 0; i < 256; i++) {
+        double t = (cadena->lut[i] - negroEnt) / rango;
+        t = t < 0.0 ? 0.0 : (t > 1.0 ? 1.0 : t);
+        cadena->lut[i] = clampRedondeo(negroSal + pow(t, 1.0 / gamma) * (blancoSal - negroSal));
+    }
+    cadena->numAjustes++;
+}
+
+//  KERNELS PUNTUALES 
+
+typedef enum {
+    LUT_IDENTIDAD,
+    LUT_SUMA,        // lut[i] = clamp(i + delta): suma/resta saturada
+    LUT_INVERTIR,    // lut[i] = 255 - i: xor con 0xFF
+    LUT_GENERAL
+} TipoLUT;
+
+static TipoLUT clasificarLUT(const unsigned char lut[256], int* delta) {
+    int esInversa = 1;
+    for (int i = 0; i < 256 && esInversa; i++) esInversa = lut[i] == 255 - i;
+    if (esInversa) return LUT_INVERTIR;
+    // El delta se lee en la zona donde la suma nunca satura.
+    int d = lut[128] - 128;
+    for (int i = 0; i < 256; i++) {
+        int v = i + d;
+        if (lut[i] != (v < 0 ? 0 : (v > 255 ? 255 : v))) return LUT_GENERAL;
+    }
+    *delta = d;
+    return d == 0 ? LUT_IDENTIDAD : LUT_SUMA;
+}
+
+typedef struct {
+    const char* nombre;
+    void (*suma)(unsigned char* p, size_t n, int delta);
+    void (*invertir)(unsigned char* p, size_t n);
+    void (*lut)(unsigned char* p, size_t n, const unsigned char* lut);
+} KernelsPuntuales;
+
+static void sumaEscalar(unsigned char* p, size_t n, int delta) {
+    for (size_t i = 0; i < n; i++) {
+        int v = p[i] + delta;
+        p[i] = (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+    }
+}
+
+static void invertirEscalar(unsigned char* p, size_t n) {
+    for (size_t i = 0; i < n; i++) p[i] = (unsigned char)~p[i];
+}
+
+static void lutEscalar(unsigned char* p, size_t n, const unsigned char* lut) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        unsigned char a = lut[p[i]], b = lut[p[i + 1]], c = lut[p[i + 2]], d = lut[p[i + 3]];
+        p[i] = a; p[i + 1] = b; p[i + 2] = c; p[i + 3] = d;
+    }
+    for (; i < n; i++) p[i] = lut[p[i]];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse2")))
+static void sumaSSE2(unsigned char* p, size_t n, int delta) {
+    __m128i d = _mm_set1_epi8((char)(delta < 0 ? -delta : delta));
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        v = delta < 0 ? _mm_subs_epu8(v, d) : _mm_adds_epu8(v, d);
+        _mm_storeu_si128((__m128i*)(p + i), v);
+    }
+    sumaEscalar(p + i, n - i, delta);
+}
+
+__attribute__((target("sse2")))
+static void invertirSSE2(unsigned char* p, size_t n) {
+    __m128i unos = _mm_set1_epi8((char)0xFF);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        _mm_storeu_si128((__m128i*)(p + i), _mm_xor_si128(v, unos));
+    }
+    invertirEscalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void sumaAVX2(unsigned char* p, size_t n, int delta) {
+    __m256i d = _mm256_set1_epi8((char)(delta < 0 ? -delta : delta));
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        v = delta < 0 ? _mm256_subs_epu8(v, d) : _mm256_adds_epu8(v, d);
+        _mm256_storeu_si256((__m256i*)(p + i), v);
+    }
+    sumaEscalar(p + i, n - i, delta);
+}
+
+__attribute__((target("avx2")))
+static void invertirAVX2(unsigned char* p, size_t n) {
+    __m256i unos = _mm256_set1_epi8((char)0xFF);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        _mm256_storeu_si256((__m256i*)(p + i), _mm256_xor_si256(v, unos));
+    }
+    invertirEscalar(p + i, n - i);
+}
+
+// Tabla de 256 entradas como 16 tablas de 16 para vpshufb. En la vuelta k el indice es
+// v - 16k; sumandole 0x70 con saturacion, los que no caen en [0, 16) activan el bit 7
+// y vpshufb devuelve 0, asi que basta con acumular con OR.
+__attribute__((target("avx2")))
+static void lutAVX2(unsigned char* p, size_t n, const unsigned char* lut) {
+    __m256i tablas[16];
+    for (int k = 0; k < 16; k++) {
+        tablas[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(lut + 16 * k)));
+    }
+    const __m256i dieciseis = _mm256_set1_epi8(16);
+    const __m256i desplaza = _mm256_set1_epi8(0x70);
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p + i + 32));
+        __m256i ra = _mm256_setzero_si256();
+        __m256i rb = _mm256_setzero_si256();
+        for (int k = 0; k < 16; k++) {
+            ra = _mm256_or_si256(ra, _mm256_shuffle_epi8(tablas[k], _mm256_adds_epu8(a, desplaza)));
+            rb = _mm256_or_si256(rb, _mm256_shuffle_epi8(tablas[k], _mm256_adds_epu8(b, desplaza)));
+            a = _mm256_sub_epi8(a, dieciseis);
+            b = _mm256_sub_epi8(b, dieciseis);
+        }
+        _mm256_storeu_si256((__m256i*)(p + i), ra);
+        _mm256_storeu_si256((__m256i*)(p + i + 32), rb);
+    }
+    lutEscalar(p + i, n - i, lut);
+}
+
+#endif
+
+// 1 si cpuid reporta AVX2 y no se ha pedido IMG_SIN_SIMD.
+static int cpuUsaAVX2(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return !getenv("IMG_SIN_SIMD") && __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+static int cpuUsaSSE2(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return !getenv("IMG_SIN_SIMD") && __builtin_cpu_supports("sse2");
+#else
+    return 0;
+#endif
+}
+
+static KernelsPuntuales kernelsPuntuales;
+static pthread_once_t kernelsPuntualesOnce = PTHREAD_ONCE_INIT;
+
+// Elige los kernels una vez segun lo que reporte cpuid.
+static void elegirKernelsPuntuales(void) {
+    KernelsPuntuales k = { "escalar", sumaEscalar, invertirEscalar, lutEscalar };
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpuUsaAVX2()) {
+        k = (KernelsPuntuales){ "AVX2", sumaAVX2, invertirAVX2, lutAVX2 };
+    } else if (cpuUsaSSE2()) {
+        k = (KernelsPuntuales){ "SSE2", sumaSSE2, invertirSSE2, lutEscalar };
+    }
+#endif
+    kernelsPuntuales = k;
+}
+
+// Pixeles por tramo al saltarse el alfa en 8 bits.
+#define TRAMO_ALFA 1024
+
+typedef struct {
+    unsigned char* pixeles;
+    size_t stride;
+    int ancho;
+    int canales;
+    TipoLUT tipo;
+    int delta;
+    const unsigned char* lut;
+    const uint16_t* lut16;  // 65536 entradas si la imagen es de 16 bits
+} PuntualArgs;
+
+static void kernelPuntual(const PuntualArgs* a, unsigned char* p, size_t n) {
+    switch (a->tipo) {
+        case LUT_SUMA: kernelsPuntuales.suma(p, n, a->delta); break;
+        case LUT_INVERTIR: kernelsPuntuales.invertir(p, n); break;
+        case LUT_GENERAL: kernelsPuntuales.lut(p, n, a->lut); break;
+        case LUT_IDENTIDAD: break;
+    }
+}
+
+// 16 bits: tabla completa, saltando el alfa si lo hay (la tabla es por muestra).
+static inline __attribute__((always_inline))
+void lut16Fila(uint16_t* p, int ancho, const uint16_t* lut16, int can, int bits16) {
+    (void)bits16;
+    int color = can == 2 || can == 4 ? can - 1 : can;
+    for (int x = 0; x < ancho; x++, p += can) {
+        for (int c = 0; c < color; c++) p[c] = lut16[p[c]];
+    }
+}
+
+void hiloPuntual(void* args, int inicio, int fin) {
+    PuntualArgs* a = (PuntualArgs*)args;
+    int can = a->canales;
+    size_t n = (size_t)a->ancho * can;
+    unsigned char alfa[TRAMO_ALFA];
+    for (int y = inicio; y < fin; y++) {
+        unsigned char* fila = a->pixeles + (size_t)y * a->stride;
+        if (a->lut16) {
+            SEGUN_FORMATO(can, 1, lut16Fila, (uint16_t*)fila, a->ancho, a->lut16);
+        } else if (can == 2 || can == 4) {
+            // Los kernels recorren bytes seguidos: se aplican al tramo entero y se restaura el alfa.
+            for (int x0 = 0; x0 < a->ancho; x0 += TRAMO_ALFA) {
+                int m = a->ancho - x0 < TRAMO_ALFA ? a->ancho - x0 : TRAMO_ALFA;
+                unsigned char* p = fila + (size_t)x0 * can;
+                for (int i = 0; i < m; i++) alfa[i] = p[i * can + can - 1];
+                kernelPuntual(a, p, (size_t)m * can);
+                for (int i = 0; i < m; i++) p[i * can + can - 1] = alfa[i];
+            }
+        } else {
+            kernelPuntual(a, fila, n);
+        }
+    }
+}
+
+// Tabla de 16 bits interpolando linealmente la de 8: v = 257 * i + f cae entre lut[i] y
+// lut[i + 1]; la identidad sigue siendo exacta.
+static void construirLUT16(const unsigned char lut[256], uint16_t* lut16) {
+    for (int v = 0; v < 65536; v++) {
+        int i = v / 257, f = v % 257;
+        int siguiente = i < 255 ? lut[i + 1] : lut[255];
+        lut16[v] = (uint16_t)(lut[i] * 257 + (siguiente - lut[i]) * f);
+    }
+}
+
+// Aplica la cadena en una pasada; devuelve los GB/s procesados (0 si no hizo nada).
+double aplicarCadenaPuntual(ImagenInfo* info, const CadenaPuntual* cadena, int numHilos) {
+    if (!info->pixeles) {
+        printf("No hay imagen cargada.\n");
+        return 0.0;
+    }
+    pthread_once(&kernelsPuntualesOnce, elegirKernelsPuntuales);
+    PuntualArgs args = { info->pixeles, info->stride, info->ancho, info->canales, LUT_GENERAL, 0, cadena->lut, NULL };
+    args.tipo = clasificarLUT(cadena->lut, &args.delta);
+    if (numHilos < 1) numHilos = iniciarPoolHilos(0);
+
+    double t0 = ahoraSeg();
+    uint16_t* lut16 = NULL;
+    if (info->profundidad == 16 && args.tipo != LUT_IDENTIDAD) {
+        lut16 = (uint16_t*)malloc(65536 * sizeof(uint16_t));
+        if (!lut16) {
+            fprintf(stderr, "Error de memoria en el ajuste puntual.\n");
+            return 0.0;
+        }
+        construirLUT16(cadena->lut, lut16);
+        args.lut16 = lut16;
+    }
+    numHilos = paraleloFilas(info->alto, granoFilas(info->ancho, (int)BYTES_PIXEL(info), 1), numHilos, hiloPuntual,
+                             &args);
+    double t = ahoraSeg() - t0;
+    int tabla16 = lut16 != NULL;
+    free(lut16);
+
+    double bytes = (double)info->alto * info->ancho * BYTES_PIXEL(info);
+    double gbs = t > 0.0 ? bytes / t / 1e9 : 0.0;
+    static const char* tipos[] = { "identidad", "suma saturada", "inversion", "tabla" };
+    informar("%d ajuste(s) puntual(es) en una pasada (%s, kernel %s) con %d hilos: %.3f s, %.2f GB/s (%s, %d bits).\n",
+             cadena->numAjustes, tabla16 ? "tabla de 16 bits" : tipos[args.tipo],
+             tabla16 ? "escalar" : kernelsPuntuales.nombre, numHilos, t, gbs, nombreCanales(info), info->profundidad);
+    return gbs;
+}
+
+void ajustarBrilloConcurrente(ImagenInfo* info, int delta) {
+    CadenaPuntual cadena;
+    iniciarCadenaPuntual(&cadena);
+    componerBrillo(&cadena, delta);
+    aplicarCadenaPuntual(info, &cadena, 0);
+}
+
+//  HISTOGRAMA
+
+// Cada trabajador cuenta en su propio bloque de 256 contadores por canal, alineado a
+// la linea de cache para que dos hilos nunca escriban en la misma; al final se suman
+// los bloques. Dentro de una porcion se cuenta en uint32 sobre la pila (en grises, en
+// cuatro tablas alternas para no encadenar incrementos del mismo contador) y se vuelca
+// al bloque del hilo al terminar la porcion.
+//
+// Ecualizacion, auto-niveles y CLAHE usan el histograma conjunto de los canales y la
+// misma tabla para todos, asi que en RGB no cambian el tono; se aplican con una sola
+// pasada de tabla (CLAHE interpola entre las tablas de las cuatro teselas vecinas).
+
+#define LINEA_CACHE 64
+#define TESELAS_CLAHE 8
+#define LIMITE_CLAHE 2.0
+#define RECORTE_AUTONIVELES 0.5
+
+typedef enum {
+    HIST_ECUALIZAR,
+    HIST_CLAHE,
+    HIST_AUTONIVELES
+} OperacionHistograma;
+
+typedef struct {
+    uint64_t bins[3][256];
+    int canales;
+    uint64_t pixeles;
+} Histograma;
+
+typedef struct {
+    _Alignas(LINEA_CACHE) uint64_t bins[3][256];
+} HistogramaHilo;
+
+typedef struct {
+    const ImagenInfo* img;
+    HistogramaHilo* bloques;   // numHilos + 1: el ultimo es del hilo que llama
+    int numHilos;
+} HistogramaArgs;
+
+static inline __attribute__((always_inline)) int muestra8(const void* p, size_t i, int bits16) {
+    return bits16 ? MUESTRA_A_8(((const uint16_t*)p)[i]) : ((const unsigned char*)p)[i];
+}
+
+// Cuenta las muestras de color de una fila (el alfa no): en RGB tabla c = canal c; en
+// grises las cuatro tablas se reparten los pixeles y luego se suman. Las muestras de 16
+// bits se cuentan redondeadas a 8.
+static inline __attribute__((always_inline))
+void contarFilaBase(const void* p, int ancho, uint32_t cuenta[4][256], int can, int bits16) {
+    int x = 0;
+    if (can <= 2) {
+        for (; x + 4 <= ancho; x += 4) {
+            cuenta[0][muestra8(p, (size_t)x * can, bits16)]++;
+            cuenta[1][muestra8(p, (size_t)(x + 1) * can, bits16)]++;
+            cuenta[2][muestra8(p, (size_t)(x + 2) * can, bits16)]++;
+            cuenta[3][muestra8(p, (size_t)(x + 3) * can, bits16)]++;
+        }
+        for (; x < ancho; x++) cuenta[0][muestra8(p, (size_t)x * can, bits16)]++;
+    } else {
+        for (; x < ancho; x++) {
+            cuenta[0][muestra8(p, (size_t)x * can, bits16)]++;
+            cuenta[1][muestra8(p, (size_t)x * can + 1, bits16)]++;
+            cuenta[2][muestra8(p, (size_t)x * can + 2, bits16)]++;
+        }
+    }
+}
+
+static void contarFila(const void* p, int ancho, int canales, int bits16, uint32_t cuenta[4][256]) {
+    SEGUN_FORMATO(canales, bits16, contarFilaBase, p, ancho, cuenta);
+}
+
+void hiloHistograma(void* arg, int inicio, int fin) {
+    HistogramaArgs* a = (HistogramaArgs*)arg;
+    int id = idTrabajadorActual;
+    HistogramaHilo* h = &a->bloques[id >= 0 && id < a->numHilos ? id : a->numHilos];
+    uint32_t cuenta[4][256];
+    memset(cuenta, 0, sizeof(cuenta));
+    for (int y = inicio; y < fin; y++) {
+        contarFila(PIXEL(a->img, y, 0), a->img->ancho, a->img->canales, a->img->profundidad == 16, cuenta);
+    }
+    if (CANALES_COLOR(a->img) == 1) {
+        for (int v = 0; v < 256; v++) h->bins[0][v] += (uint64_t)cuenta[0][v] + cuenta[1][v] + cuenta[2][v] + cuenta[3][v];
+    } else {
+        for (int c = 0; c < 3; c++) {
+            for (int v = 0; v < 256; v++) h->bins[c][v] += cuenta[c][v];
+        }
+    }
+}
+
+int calcularHistograma(const ImagenInfo* img, int numHilos, Histograma* h) {
+    memset(h, 0, sizeof(*h));
+    h->canales = CANALES_COLOR(img);
+    h->pixeles = (uint64_t)img->ancho * img->alto;
+    if (numHilos < 1) numHilos = iniciarPoolHilos(0);
+    void* mem = NULL;
+    if (posix_memalign(&mem, LINEA_CACHE, (size_t)(numHilos + 1) * sizeof(HistogramaHilo)) != 0) return 0;
+    HistogramaArgs args = { img, (HistogramaHilo*)mem, numHilos };
+    memset(args.bloques, 0, (size_t)(numHilos + 1) * sizeof(HistogramaHilo));
+    // Porciones de al menos 16 filas: vaciar la cuenta de la pila cuesta 3 KB de sumas.
+    paraleloFilas(img->alto, granoFilas(img->ancho, img->canales, 16), numHilos, hiloHistograma, &args);
+    for (int k = 0; k <= numHilos; k++) {
+        for (int c = 0; c < h->canales; c++) {
+            for (int v = 0; v < 256; v++) h->bins[c][v] += args.bloques[k].bins[c][v];
+        }
+    }
+    free(mem);
+    return 1;
+}
+
+// Suma de los canales: el histograma sobre el que trabajan las tablas.
+static void histogramaConjunto(const Histograma* h, uint64_t conjunto[256], uint64_t* total) {
+    *total = 0;
+    for (int v = 0; v < 256; v++) {
+        conjunto[v] = 0;
+        for (int c = 0; c < h->canales; c++) conjunto[v] += h->bins[c][v];
+        *total += conjunto[v];
+    }
+}
+
+// Tabla que reparte los valores presentes por todo el rango segun su frecuencia acumulada.
+void componerEcualizacion(CadenaPuntual* cadena, const uint64_t hist[256]) {
+    uint64_t acumulado[256], suma = 0, minimo = 0;
+    for (int v = 0; v < 256; v++) {
+        suma += hist[v];
+        acumulado[v] = suma;
+        if (!minimo) minimo = suma;
+    }
+    unsigned char eq[256];
+    for (int v = 0; v < 256; v++) {
+        eq[v] = suma > minimo && acumulado[v] > minimo
+              ? clampRedondeo(255.0 * (double)(acumulado[v] - minimo) / (double)(suma - minimo))
+              : (unsigned char)(suma > minimo ? 0 : v);
+    }
+    for (int i = 0; i < 256; i++) cadena->lut[i] = eq[cadena->lut[i]];
+    cadena->numAjustes++;
+}
+
+// Estira al rango completo lo que queda tras descartar porcentaje % de valores por cada extremo.
+void componerAutoNiveles(CadenaPuntual* cadena, const uint64_t hist[256], double porcentaje) {
+    uint64_t total = 0;
+    for (int v = 0; v < 256; v++) total += hist[v];
+    uint64_t recorte = (uint64_t)(total * porcentaje / 100.0);
+    int negro = 0, blanco = 255;
+    for (uint64_t acum = 0; negro < 255 && (acum += hist[negro]) <= recorte; negro++) {}
+    for (uint64_t acum = 0; blanco > 0 && (acum += hist[blanco]) <= recorte; blanco--) {}
+    if (blanco > negro) componerNiveles(cadena, negro, blanco, 1.0, 0, 255);
+}
+
+typedef struct {
+    const ImagenInfo* img;
+    int teselasX, teselasY;
+    double limite;
+    unsigned char (*tablas)[256];   // una por tesela, fila a fila
+    const int* teselaX0;            // por columna: tesela a la izquierda, la de la derecha
+    const int* teselaX1;            // y peso de la derecha en 1/256
+    const int* pesoX;
+} CLAHEArgs;
+
+// Columnas o filas [inicio, fin) de la tesela i de n sobre un lado de tam pixeles.
+static inline int bordeTesela(int i, int n, int tam) {
+    return (int)((long)i * tam / n);
+}
+
+// Las porciones cuentan teselas.
+void hiloTablasCLAHE(void* arg, int inicio, int fin) {
+    CLAHEArgs* a = (CLAHEArgs*)arg;
+    const ImagenInfo* img = a->img;
+    for (int t = inicio; t < fin; t++) {
+        int tx = t % a->teselasX, ty = t / a->teselasX;
+        int x0 = bordeTesela(tx, a->teselasX, img->ancho), x1 = bordeTesela(tx + 1, a->teselasX, img->ancho);
+        int y0 = bordeTesela(ty, a->teselasY, img->alto), y1 = bordeTesela(ty + 1, a->teselasY, img->alto);
+        uint32_t cuenta[4][256];
+        memset(cuenta, 0, sizeof(cuenta));
+        for (int y = y0; y < y1; y++) contarFila(PIXEL(img, y, x0), x1 - x0, img->canales, 0, cuenta);
+        uint64_t hist[256], total = 0;
+        for (int v = 0; v < 256; v++) {
+            hist[v] = (uint64_t)cuenta[0][v] + cuenta[1][v] + cuenta[2][v] + cuenta[3][v];
+            total += hist[v];
+        }
+        // Recorte: lo que pasa del limite se reparte por igual entre todos los valores,
+        // lo que acota la pendiente de la tabla y con ella la amplificacion del ruido.
+        uint64_t tope = (uint64_t)(a->limite * total / 256.0);
+        if (tope < 1) tope = 1;
+        uint64_t exceso = 0;
+        for (int v = 0; v < 256; v++) {
+            if (hist[v] > tope) {
+                exceso += hist[v] - tope;
+                hist[v] = tope;
+            }
+        }
+        uint64_t reparto = exceso / 256, resto = exceso % 256;
+        for (int v = 0; v < 256; v++) hist[v] += reparto + (resto && (uint64_t)v * resto / 256 != (uint64_t)(v + 1) * resto / 256);
+        uint64_t acum = 0;
+        for (int v = 0; v < 256; v++) {
+            acum += hist[v];
+            a->tablas[t][v] = total ? clampRedondeo(255.0 * (double)acum / (double)total) : (unsigned char)v;
+        }
+    }
+}
+
+// Cada pixel pasa por las tablas de las cuatro teselas cuyos centros lo rodean,
+// interpoladas bilinealmente en punto fijo (pesos de 8 bits). El alfa no se toca.
+void hiloAplicarCLAHE(void* arg, int inicio, int fin) {
+    CLAHEArgs* a = (CLAHEArgs*)arg;
+    const ImagenInfo* img = a->img;
+    int c = CANALES_COLOR(img), salto = img->canales - c;
+    for (int y = inicio; y < fin; y++) {
+        double fy = (y + 0.5) * a->teselasY / img->alto - 0.5;
+        int ty0 = fy < 0.0 ? 0 : (int)fy;
+        int ty1 = ty0 + 1 < a->teselasY ? ty0 + 1 : ty0;
+        int wy = fy < 0.0 ? 0 : (int)lround((fy - ty0) * 256.0);
+        if (ty1 == ty0) wy = 0;
+        const unsigned char (*arriba)[256] = a->tablas + (size_t)ty0 * a->teselasX;
+        const unsigned char (*abajo)[256] = a->tablas + (size_t)ty1 * a->teselasX;
+        unsigned char* p = PIXEL(img, y, 0);
+        for (int x = 0; x < img->ancho; x++) {
+            int t0 = a->teselaX0[x], t1 = a->teselaX1[x], wx = a->pesoX[x];
+            for (int k = 0; k < c; k++, p++) {
+                int v = *p;
+                int s = (arriba[t0][v] * (256 - wx) + arriba[t1][v] * wx) * (256 - wy) +
+                        (abajo[t0][v] * (256 - wx) + abajo[t1][v] * wx) * wy;
+                *p = (unsigned char)((s + 32768) >> 16);
+            }
+            p += salto;
+        }
+    }
+}
+
+static int ecualizarCLAHE(ImagenInfo* info, int teselas, double limite, int numHilos) {
+    // Teselas de al menos 8 pixeles por lado.
+    int tx = teselas < info->ancho / 8 ? teselas : info->ancho / 8;
+    int ty = teselas < info->alto / 8 ? teselas : info->alto / 8;
+    if (tx < 1) tx = 1;
+    if (ty < 1) ty = 1;
+    CLAHEArgs args = { info, tx, ty, limite, NULL, NULL, NULL, NULL };
+    args.tablas = (unsigned char (*)[256])malloc((size_t)tx * ty * 256);
+    int* columnas = (int*)malloc((size_t)info->ancho * 3 * sizeof(int));
+    if (!args.tablas || !columnas) {
+        free(args.tablas);
+        free(columnas);
+        fprintf(stderr, "Error de memoria en CLAHE.\n");
+        return 0;
+    }
+    int* x0 = columnas;
+    int* x1 = columnas + info->ancho;
+    int* wx = columnas + 2 * (size_t)info->ancho;
+    for (int x = 0; x < info->ancho; x++) {
+        double fx = (x + 0.5) * tx / info->ancho - 0.5;
+        x0[x] = fx < 0.0 ? 0 : (int)fx;
+        x1[x] = x0[x] + 1 < tx ? x0[x] + 1 : x0[x];
+        wx[x] = fx < 0.0 || x1[x] == x0[x] ? 0 : (int)lround((fx - x0[x]) * 256.0);
+    }
+    args.teselaX0 = x0;
+    args.teselaX1 = x1;
+    args.pesoX = wx;
+    if (numHilos < 1) numHilos = iniciarPoolHilos(0);
+    double t0 = ahoraSeg();
+    paraleloFilas(tx * ty, 1, numHilos, hiloTablasCLAHE, &args);
+    numHilos = paraleloFilas(info->alto, granoFilas(info->ancho, info->canales, 1), numHilos, hiloAplicarCLAHE, &args);
+    informar("CLAHE con %dx%d teselas y limite %.2f aplicado con %d hilos: %.3f s.\n", tx, ty, limite, numHilos,
+             ahoraSeg() - t0);
+    free(args.tablas);
+    free(columnas);
+    return 1;
+}
+
+// Ecualizacion global, CLAHE o auto-niveles; parametro es el limite de CLAHE o el
+// porcentaje recortado de auto-niveles.
+int aplicarHistograma(ImagenInfo* info, OperacionHistograma op, int teselas, double parametro, int numHilos) {
+    if (!info->pixeles) {
+        printf("No hay imagen cargada.\n");
+        return 0;
+    }
+    if (op == HIST_CLAHE) {
+        return reducirA8Bits(info, "CLAHE", numHilos) && ecualizarCLAHE(info, teselas, parametro, numHilos);
+    }
+    Histograma h;
+    if (!calcularHistograma(info, numHilos, &h)) {
+        fprintf(stderr, "No se pudo calcular el histograma.\n");
+        return 0;
+    }
+    uint64_t conjunto[256], total;
+    histogramaConjunto(&h, conjunto, &total);
+    CadenaPuntual cadena;
+    iniciarCadenaPuntual(&cadena);
+    if (op == HIST_ECUALIZAR) componerEcualizacion(&cadena, conjunto);
+    else componerAutoNiveles(&cadena, conjunto, parametro);
+    aplicarCadenaPuntual(info, &cadena, numHilos);
+    return 1;
+}
+
+// Resumen por canal y un histograma conjunto en 16 barras de texto.
+void mostrarHistograma(const ImagenInfo* info, int numHilos) {
+    Histograma h;
+    if (!info->pixeles || !calcularHistograma(info, numHilos, &h)) {
+        printf("No hay imagen cargada.\n");
+        return;
+    }
+    static const char* nombres[3] = { "R", "G", "B" };
+    for (int c = 0; c < h.canales; c++) {
+        int minimo = -1, maximo = 0, mediana = -1;
+        double media = 0.0;
+        uint64_t acum = 0;
+        for (int v = 0; v < 256; v++) {
+            if (!h.bins[c][v]) continue;
+            if (minimo < 0) minimo = v;
+            maximo = v;
+            media += (double)v * h.bins[c][v];
+            acum += h.bins[c][v];
+            if (mediana < 0 && acum * 2 >= h.pixeles) mediana = v;
+        }
+        printf("%-5s min %3d  max %3d  media %6.2f  mediana %3d\n", h.canales == 1 ? "gris" : nombres[c], minimo,
+               maximo, media / (double)h.pixeles, mediana);
+    }
+    uint64_t conjunto[256], total, grupos[16] = { 0 }, mayor = 1;
+    histogramaConjunto(&h, conjunto, &total);
+    for (int v = 0; v < 256; v++) grupos[v / 16] += conjunto[v];
+    for (int g = 0; g < 16; g++) if (grupos[g] > mayor) mayor = grupos[g];
+    for (int g = 0; g < 16; g++) {
+        printf("%3d-%3d |", g * 16, g * 16 + 15);
+        for (int k = 0; k < (int)(50 * grupos[g] / mayor); k++) putchar('#');
+        printf(" %.1f%%\n", 100.0 * grupos[g] / (double)total);
+    }
+}
+
+//  FUNCIONES NUEVAS CONCURRENTE
+
+// Helper: clamp
+static inline unsigned char clamp255(int v) {
+    if (v < 0) return 0;
+    if (v > 255) return 255;
+    return (unsigned char)v;
+}
+
+//  CONVOLUCIÓN GAUSSIANA 
+
+// Pesos en punto fijo: suman exactamente 1 << BITS_PESO.
+#define BITS_PESO 14
+// Bits fraccionarios que conserva la pasada horizontal para la vertical.
+#define BITS_INTERMEDIO 8
+// Precision del reciproco usado para dividir por el ancho de caja.
+#define BITS_RECIPROCO 20
+// En modo automatico, sigma a partir de la cual se aproxima con tres cajas.
+#define SIGMA_MIN_CAJAS 5.0f
+
+typedef enum {
+    BLUR_AUTO,      // cajas si sigma es grande y el kernel cubre la campana, si no exacto
+    BLUR_EXACTO,    // separable en punto fijo, +-1 respecto al kernel 2D en float
+    BLUR_CAJAS      // tres pasadas de caja, coste independiente del tamano
+} ModoBlur;
+
+// Kernel 1D normalizado; el 2D es su producto exterior, asi que el blur es separable.
+float* generarKernelGaussiano(int tamKernel, float sigma) {
+    int centro = tamKernel / 2;
+    float sum = 0.0f;
+    float* kernel = (float*)malloc(tamKernel * sizeof(float));
+    if (!kernel) return NULL;
+    for (int x = 0; x < tamKernel; x++) {
+        int dx = x - centro;
+        float val = expf(-(dx*dx) / (2.0f * sigma * sigma));
+        kernel[x] = val;
+        sum += val;
+    }
+    if (sum != 0.0f) {
+        for (int i = 0; i < tamKernel; i++) kernel[i] /= sum;
+    }
+    return kernel;
+}
+
+static int* kernelAPuntoFijo(const float* kernel, int tamKernel) {
+    int* pesos = (int*)malloc(tamKernel * sizeof(int));
+    if (!pesos) return NULL;
+    int suma = 0;
+    for (int i = 0; i < tamKernel; i++) {
+        pesos[i] = (int)lroundf(kernel[i] * (1 << BITS_PESO));
+        suma += pesos[i];
+    }
+    // El error de redondeo se absorbe en el centro para no alterar el brillo medio.
+    pesos[tamKernel / 2] += (1 << BITS_PESO) - suma;
+    return pesos;
+}
+
+// Copia una fila a pad con r pixeles replicados a cada lado.
+static void rellenarFilaReplicada(const unsigned char* fila, int ancho, int canales, int r,
+                                  unsigned char* pad) {
+    const unsigned char* primero = fila;
+    const unsigned char* ultimo = fila + (size_t)(ancho - 1) * canales;
+    for (int x = 0; x < r; x++) memcpy(pad + (size_t)x * canales, primero, canales);
+    memcpy(pad + (size_t)r * canales, fila, (size_t)ancho * canales);
+    for (int x = 0; x < r; x++) memcpy(pad + (size_t)(r + ancho + x) * canales, ultimo, canales);
+}
+
+static inline int clampInt(int v, int lo, int hi) {
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+typedef struct {
+    ImagenInfo* src;
+    ImagenInfo* dst;
+    uint16_t* tmp;          // resultado horizontal con BITS_INTERMEDIO bits fraccionarios
+    int tamKernel;
+    const int* pesos;
+    atomic_int error;
+} ConvArgs;
+
+
+static inline unsigned char getPixelReplicate(ImagenInfo* src, int y, int x, int c) {
+    if (y < 0) y = 0;
+    if (y >= src->alto) y = src->alto - 1;
+    if (x < 0) x = 0;
+    if (x >= src->ancho) x = src->ancho - 1;
+    return PIXEL(src, y, x)[c];
+}
+
+// Una fila en horizontal: el borde se replica una vez y se acumula sin clamps.
+// pad tiene sitio para ancho + tam - 1 pixeles y acc para ancho * canales enteros.
+static void convolucionFilaH(const unsigned char* fila, int ancho, int can, int tam, const int* pesos,
+                             unsigned char* pad, int32_t* acc, uint16_t* t) {
+    int n = ancho * can;
+    const int desp = BITS_PESO - BITS_INTERMEDIO;
+    rellenarFilaReplicada(fila, ancho, can, tam / 2, pad);
+    memset(acc, 0, (size_t)n * sizeof(int32_t));
+    for (int k = 0; k < tam; k++) {
+        int w = pesos[k];
+        const unsigned char* p = pad + (size_t)k * can;
+        for (int i = 0; i < n; i++) acc[i] += w * p[i];
+    }
+    for (int i = 0; i < n; i++) t[i] = (uint16_t)((acc[i] + (1 << (desp - 1))) >> desp);
+}
+
+// Una fila en vertical a partir de las tam filas horizontales que cubre el kernel.
+static void convolucionFilaV(const uint16_t* const* filas, int n, int tam, const int* pesos,
+                             int32_t* acc, unsigned char* out) {
+    const int desp = BITS_PESO + BITS_INTERMEDIO;
+    memset(acc, 0, (size_t)n * sizeof(int32_t));
+    for (int k = 0; k < tam; k++) {
+        int w = pesos[k];
+        const uint16_t* t = filas[k];
+        for (int i = 0; i < n; i++) acc[i] += w * t[i];
+    }
+    for (int i = 0; i < n; i++) out[i] = (unsigned char)((acc[i] + (1 << (desp - 1))) >> desp);
+}
+
+// Las mismas dos pasadas para 16 bits, en escalar: el intermedio guarda la muestra
+// redondeada, sin bits fraccionarios (con 16 bits el error que acumula es despreciable).
+// Con pesos que suman 1 << BITS_PESO el acumulador no pasa de 2^30.
+static void convolucionFilaH16(const uint16_t* fila, int ancho, int can, int tam, const int* pesos,
+                               unsigned char* pad, int32_t* acc, uint16_t* t) {
+    int n = ancho * can;
+    rellenarFilaReplicada((const unsigned char*)fila, ancho, can * 2, tam / 2, pad);
+    const uint16_t* p16 = (const uint16_t*)pad;
+    memset(acc, 0, (size_t)n * sizeof(int32_t));
+    for (int k = 0; k < tam; k++) {
+        int w = pesos[k];
+        const uint16_t* p = p16 + (size_t)k * can;
+        for (int i = 0; i < n; i++) acc[i] += w * p[i];
+    }
+    for (int i = 0; i < n; i++) t[i] = (uint16_t)((acc[i] + (1 << (BITS_PESO - 1))) >> BITS_PESO);
+}
+
+static void convolucionFilaV16(const uint16_t* const* filas, int n, int tam, const int* pesos,
+                               int32_t* acc, uint16_t* out) {
+    memset(acc, 0, (size_t)n * sizeof(int32_t));
+    for (int k = 0; k < tam; k++) {
+        int w = pesos[k];
+        const uint16_t* t = filas[k];
+        for (int i = 0; i < n; i++) acc[i] += w * t[i];
+    }
+    for (int i = 0; i < n; i++) out[i] = (uint16_t)((acc[i] + (1 << (BITS_PESO - 1))) >> BITS_PESO);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// 16 valores por vuelta: los taps van de dos en dos intercalados para madd (8 bits x 14 bits).
+__attribute__((target("avx2")))
+static void convolucionFilaHAVX2(const unsigned char* fila, int ancho, int can, int tam, const int* pesos,
+                                 unsigned char* pad, int32_t* acc, uint16_t* t) {
+    (void)acc;
+    int n = ancho * can;
+    const int desp = BITS_PESO - BITS_INTERMEDIO;
+    rellenarFilaReplicada(fila, ancho, can, tam / 2, pad);
+    const __m256i redondeo = _mm256_set1_epi32(1 << (desp - 1));
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i lo = redondeo, hi = redondeo;
+        for (int k = 0; k < tam; k += 2) {
+            const unsigned char* p = pad + i + (size_t)k * can;
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));
+            __m256i b = _mm256_setzero_si256();
+            uint32_t par = (uint32_t)pesos[k] & 0xFFFF;
+            if (k + 1 < tam) {
+                b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(p + can)));
+                par |= (uint32_t)pesos[k + 1] << 16;
+            }
+            __m256i w = _mm256_set1_epi32((int)par);
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+        __m256i r = _mm256_packus_epi32(_mm256_srai_epi32(lo, desp), _mm256_srai_epi32(hi, desp));
+        _mm256_storeu_si256((__m256i*)(t + i), r);
+    }
+    for (; i < n; i++) {
+        int32_t s = 0;
+        for (int k = 0; k < tam; k++) s += pesos[k] * pad[i + k * can];
+        t[i] = (uint16_t)((s + (1 << (desp - 1))) >> desp);
+    }
+}
+
+// Igual en vertical; los uint16 se pasan a int16 con sesgo (t ^ 0x8000) y el sesgo
+// se devuelve sumando 32768 * suma de pesos al acumulador inicial.
+__attribute__((target("avx2")))
+static void convolucionFilaVAVX2(const uint16_t* const* filas, int n, int tam, const int* pesos,
+                                 int32_t* acc, unsigned char* out) {
+    (void)acc;
+    const int desp = BITS_PESO + BITS_INTERMEDIO;
+    int32_t suma = 0;
+    for (int k = 0; k < tam; k++) suma += pesos[k];
+    const __m256i base = _mm256_set1_epi32((1 << (desp - 1)) + 32768 * suma);
+    const __m256i sesgo = _mm256_set1_epi16((short)0x8000);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i lo = base, hi = base;
+        for (int k = 0; k < tam; k += 2) {
+            __m256i a = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(filas[k] + i)), sesgo);
+            __m256i b = _mm256_setzero_si256();
+            uint32_t par = (uint32_t)pesos[k] & 0xFFFF;
+            if (k + 1 < tam) {
+                b = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(filas[k + 1] + i)), sesgo);
+                par |= (uint32_t)pesos[k + 1] << 16;
+            }
+            __m256i w = _mm256_set1_epi32((int)par);
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+        __m256i r = _mm256_packus_epi32(_mm256_srai_epi32(lo, desp), _mm256_srai_epi32(hi, desp));
+        __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(r, r), 0x08);
+        _mm_storeu_si128((__m128i*)(out + i), _mm256_castsi256_si128(bytes));
+    }
+    for (; i < n; i++) {
+        int32_t s = 0;
+        for (int k = 0; k < tam; k++) s += pesos[k] * filas[k][i];
+        out[i] = (unsigned char)((s + (1 << (desp - 1))) >> desp);
+    }
+}
+
+#endif
+
+typedef void (*FuncionConvFilaH)(const unsigned char*, int, int, int, const int*, unsigned char*, int32_t*, uint16_t*);
+typedef void (*FuncionConvFilaV)(const uint16_t* const*, int, int, const int*, int32_t*, unsigned char*);
+static FuncionConvFilaH convFilaH = convolucionFilaH;
+static FuncionConvFilaV convFilaV = convolucionFilaV;
+static const char* nombreKernelConv = "escalar";
+static pthread_once_t convOnce = PTHREAD_ONCE_INIT;
+
+static void elegirKernelConv(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpuUsaAVX2()) {
+        convFilaH = convolucionFilaHAVX2;
+        convFilaV = convolucionFilaVAVX2;
+        nombreKernelConv = "AVX2";
+    }
+#endif
+}
+
+// Pasada horizontal de src a tmp.
+void hiloConvolucionHorizontal(void* args, int inicio, int fin) {
+    ConvArgs* a = (ConvArgs*)args;
+    ImagenInfo* src = a->src;
+    int tam = a->tamKernel;
+    int can = src->canales;
+    int n = src->ancho * can;
+    unsigned char* pad = (unsigned char*)malloc((size_t)(src->ancho + tam - 1) * BYTES_PIXEL(src));
+    int32_t* acc = (int32_t*)malloc((size_t)n * sizeof(int32_t));
+    if (!pad || !acc) {
+        atomic_store(&a->error, 1);
+        free(pad); free(acc);
+        return;
+    }
+    for (int y = inicio; y < fin; y++) {
+        if (src->profundidad == 16) {
+            convolucionFilaH16(FILA16(src, y), src->ancho, can, tam, a->pesos, pad, acc, a->tmp + (size_t)y * n);
+        } else {
+            convFilaH(PIXEL(src, y, 0), src->ancho, can, tam, a->pesos, pad, acc, a->tmp + (size_t)y * n);
+        }
+    }
+    free(pad);
+    free(acc);
+}
+
+// Pasada vertical de tmp a dst; las filas fuera de la imagen se sustituyen por la del borde.
+void hiloConvolucionVertical(void* args, int inicio, int fin) {
+    ConvArgs* a = (ConvArgs*)args;
+    int tam = a->tamKernel;
+    int r = tam / 2;
+    int alto = a->src->alto;
+    int n = a->src->ancho * a->src->canales;
+    int32_t* acc = (int32_t*)malloc((size_t)n * sizeof(int32_t));
+    const uint16_t** filas = (const uint16_t**)malloc((size_t)tam * sizeof(uint16_t*));
+    if (!acc || !filas) {
+        atomic_store(&a->error, 1);
+        free(acc); free(filas);
+        return;
+    }
+    for (int y = inicio; y < fin; y++) {
+        for (int k = 0; k < tam; k++) filas[k] = a->tmp + (size_t)clampInt(y + k - r, 0, alto - 1) * n;
+        if (a->dst->profundidad == 16) convolucionFilaV16(filas, n, tam, a->pesos, acc, FILA16(a->dst, y));
+        else convFilaV(filas, n, tam, a->pesos, acc, PIXEL(a->dst, y, 0));
+    }
+    free(acc);
+    free(filas);
+}
+
+//  APROXIMACION POR CAJAS
+
+// Radios de tres cajas cuya composicion tiene la varianza de una gaussiana de sigma.
+static void radiosCajasGaussiana(float sigma, int radios[3]) {
+    const int n = 3;
+    double wIdeal = sqrt(12.0 * sigma * sigma / n + 1.0);
+    int wl = (int)floor(wIdeal);
+    if (wl % 2 == 0) wl--;
+    int wu = wl + 2;
+    double mIdeal = (12.0 * sigma * sigma - n * wl * wl - 4.0 * n * wl - 3.0 * n) / (-4.0 * wl - 4.0);
+    int m = (int)lround(mIdeal);
+    for (int i = 0; i < n; i++) radios[i] = ((i < m ? wl : wu) - 1) / 2;
+}
+
+typedef struct {
+    ImagenInfo* src;
+    ImagenInfo* dst;
+    int radios[3];
+    atomic_int error;
+} CajasArgs;
+
+// Media movil de ancho 2r+1 sobre una fila ya rellenada con r pixeles por lado.
+static void cajaFila(const unsigned char* pad, int ancho, int canales, int r, unsigned char* out) {
+    uint32_t w = 2 * r + 1;
+    uint32_t inv = ((1u << BITS_RECIPROCO) + w / 2) / w;
+    for (int c = 0; c < canales; c++) {
+        uint32_t suma = 0;
+        for (int k = 0; k < (int)w; k++) suma += pad[(size_t)k * canales + c];
+        for (int x = 0; x < ancho; x++) {
+            out[(size_t)x * canales + c] = (unsigned char)((suma * inv + (1u << (BITS_RECIPROCO - 1))) >> BITS_RECIPROCO);
+            suma += pad[(size_t)(x + w) * canales + c];
+            suma -= pad[(size_t)x * canales + c];
+        }
+    }
+}
+
+// Las tres cajas horizontales de cada fila, de src a dst.
+void hiloCajasHorizontal(void* args, int inicio, int fin) {
+    CajasArgs* a = (CajasArgs*)args;
+    int ancho = a->src->ancho;
+    int can = a->src->canales;
+    int rmax = a->radios[0] > a->radios[2] ? a->radios[0] : a->radios[2];
+    unsigned char* pad = (unsigned char*)malloc((size_t)(ancho + 2 * rmax + 1) * can);
+    unsigned char* fila = (unsigned char*)malloc((size_t)ancho * can);
+    if (!pad || !fila) {
+        atomic_store(&a->error, 1);
+        free(pad); free(fila);
+        return;
+    }
+    for (int y = inicio; y < fin; y++) {
+        const unsigned char* entrada = PIXEL(a->src, y, 0);
+        for (int p = 0; p < 3; p++) {
+            unsigned char* salida = p == 2 ? PIXEL(a->dst, y, 0) : fila;
+            rellenarFilaReplicada(entrada, ancho, can, a->radios[p], pad);
+            cajaFila(pad, ancho, can, a->radios[p], salida);
+            entrada = fila;
+        }
+    }
+    free(pad);
+    free(fila);
+}
+
+// Una caja vertical de radio radios[0] con suma deslizante por columnas, de src a dst.
+void hiloCajaVertical(void* args, int inicio, int fin) {
+    CajasArgs* a = (CajasArgs*)args;
+    int r = a->radios[0];
+    int alto = a->src->alto;
+    int n = a->src->ancho * a->src->canales;
+    uint32_t w = 2 * r + 1;
+    uint32_t inv = ((1u << BITS_RECIPROCO) + w / 2) / w;
+    uint32_t* suma = (uint32_t*)calloc((size_t)n, sizeof(uint32_t));
+    if (!suma) {
+        atomic_store(&a->error, 1);
+        return;
+    }
+    for (int k = -r; k <= r; k++) {
+        const unsigned char* s = PIXEL(a->src, clampInt(inicio + k, 0, alto - 1), 0);
+        for (int i = 0; i < n; i++) suma[i] += s[i];
+    }
+    for (int y = inicio; y < fin; y++) {
+        unsigned char* out = PIXEL(a->dst, y, 0);
+        const unsigned char* entra = PIXEL(a->src, clampInt(y + r + 1, 0, alto - 1), 0);
+        const unsigned char* sale = PIXEL(a->src, clampInt(y - r, 0, alto - 1), 0);
+        for (int i = 0; i < n; i++) {
+            out[i] = (unsigned char)((suma[i] * inv + (1u << (BITS_RECIPROCO - 1))) >> BITS_RECIPROCO);
+            suma[i] += entra[i];
+            suma[i] -= sale[i];
+        }
+    }
+    free(suma);
+}
+
+static int blurCajas(ImagenInfo* info, ImagenInfo* dst, float sigma, int numHilos) {
+    CajasArgs args;
+    radiosCajasGaussiana(sigma, args.radios);
+    int radios[3];
+    memcpy(radios, args.radios, sizeof(radios));
+    ImagenInfo tmp = *info;
+    tmp.pixeles = asignarPixeles(info->alto, info->ancho, info->canales, &tmp.stride);
+    if (!tmp.pixeles) return 0;
+    atomic_init(&args.error, 0);
+    int grano = granoFilas(info->ancho, info->canales, 1);
+
+    // Horizontal info -> tmp, luego verticales tmp -> dst -> tmp -> dst.
+    args.src = info;
+    args.dst = &tmp;
+    paraleloFilas(info->alto, grano, numHilos, hiloCajasHorizontal, &args);
+    ImagenInfo* fases[3][2] = { { &tmp, dst }, { dst, &tmp }, { &tmp, dst } };
+    for (int f = 0; f < 3; f++) {
+        args.src = fases[f][0];
+        args.dst = fases[f][1];
+        args.radios[0] = radios[f];
+        // Cada porcion arranca su suma con 2r+1 filas; porciones mas altas lo amortizan.
+        paraleloFilas(info->alto, granoFilas(info->ancho, info->canales, 2 * (2 * radios[f] + 1)),
+                      numHilos, hiloCajaVertical, &args);
+    }
+    liberarPixelesMem(tmp.pixeles);
+    return !atomic_load(&args.error);
+}
+
+// Las cajas aproximan la gaussiana completa: solo valen si el kernel no la trunca.
+static ModoBlur resolverModoBlur(int tamKernel, float sigma, ModoBlur modo) {
+    if (modo != BLUR_AUTO) return modo;
+    return (sigma >= SIGMA_MIN_CAJAS && tamKernel / 2 >= 2.5f * sigma) ? BLUR_CAJAS : BLUR_EXACTO;
+}
+
+int aplicarConvolucionGaussianaModo(ImagenInfo* info, int tamKernel, float sigma, int numHilos,
+                                     ModoBlur modo) {
+    if (!info->pixeles) {
+        printf("No hay imagen cargada.\n");
+        return 0;
+    }
+    if (tamKernel % 2 == 0 || tamKernel < 3) {
+        printf("Tamano de kernel invalido. Use un numero impar >= 3.\n");
+        return 0;
+    }
+    if (sigma <= 0.0f) {
+        printf("Sigma debe ser > 0.\n");
+        return 0;
+    }
+    modo = resolverModoBlur(tamKernel, sigma, modo);
+    // Las cajas acumulan en 8 bits: con 16 se usa siempre el separable.
+    int bits16 = info->profundidad == 16;
+    if (bits16) modo = BLUR_EXACTO;
+    pthread_once(&convOnce, elegirKernelConv);
+
+    ImagenInfo dst = *info;
+    dst.pixeles = asignarPixeles(info->alto, info->ancho, (int)BYTES_PIXEL(info), &dst.stride);
+    if (!dst.pixeles) {
+        fprintf(stderr, "Error al asignar memoria para imagen destino (convolucion).\n");
+        return 0;
+    }
+
+    if (numHilos < 1) numHilos = 1;
+    premultiplicarAlfa(info, 0, numHilos);
+
+    int ok = 1;
+    if (modo == BLUR_CAJAS) {
+        ok = blurCajas(info, &dst, sigma, numHilos);
+    } else {
+        float* kernel = generarKernelGaussiano(tamKernel, sigma);
+        int* pesos = kernel ? kernelAPuntoFijo(kernel, tamKernel) : NULL;
+        ConvArgs args = { info, &dst, NULL, tamKernel, pesos, 0 };
+        args.tmp = (uint16_t*)malloc((size_t)info->alto * info->ancho * info->canales * sizeof(uint16_t));
+        ok = pesos && args.tmp;
+        if (ok) {
+            int grano = granoFilas(info->ancho, info->canales, 1);
+            numHilos = paraleloFilas(info->alto, grano, numHilos, hiloConvolucionHorizontal, &args);
+            paraleloFilas(info->alto, grano, numHilos, hiloConvolucionVertical, &args);
+            ok = !atomic_load(&args.error);
+        }
+        free(kernel);
+        free(pesos);
+        free(args.tmp);
+    }
+    if (!ok) {
+        fprintf(stderr, "Error de memoria durante la convolucion.\n");
+        liberarPixelesMem(dst.pixeles);
+        premultiplicarAlfa(info, 1, numHilos);
+        return 0;
+    }
+
+    reemplazarImagen(info, &dst);
+    premultiplicarAlfa(info, 1, numHilos);
+    informar("Convolucion Gaussiana aplicada (kernel=%d, sigma=%.2f, %s, kernel %s) con %d hilos.\n", tamKernel,
+             sigma, modo == BLUR_CAJAS ? "3 cajas" : "separable",
+             modo == BLUR_CAJAS || bits16 ? "escalar" : nombreKernelConv, numHilos);
+    return 1;
+}
+
+int aplicarConvolucionGaussiana(ImagenInfo* info, int tamKernel, float sigma, int numHilos) {
+    return aplicarConvolucionGaussianaModo(info, tamKernel, sigma, numHilos, BLUR_AUTO);
+}
+
+//  CONVOLUCION GENERAL
+
+// Kernels arbitrarios de tamano impar: enfocar, relieve, desenfoque de movimiento o
+// una matriz leida de un fichero. Si el kernel es de rango 1 (columna x fila) se
+// aplica en dos pasadas 1D; si no, en una 2D que acumula fila de kernel a fila de
+// kernel sobre un anillo de filas ya replicadas. Los pesos pasan a int16 en punto
+// fijo y se acumulan en int32 con madd, dos taps por instruccion; 3, 5 y 7 taps
+// tienen el bucle desenrollado. Antes de aplicar se acota el error del redondeo de
+// los pesos y, si pudiera pasar de medio nivel respecto al calculo en float, se usa
+// la pasada en float; asi el resultado nunca se aleja mas de 1 de ella.
+
+#define TAM_MAX_KERNEL 31
+#define TOLERANCIA_SEPARABLE 1e-6
+// Bits fraccionarios del intermedio int16 de la pasada separable (255 << 6 cabe con margen).
+#define BITS_INTERMEDIO_CONV 6
+
+typedef struct {
+    int tam;
+    float pesos[TAM_MAX_KERNEL * TAM_MAX_KERNEL];   // ya divididos por el divisor
+    float desplazamiento;                            // se suma al resultado
+    char nombre[48];
+} KernelConvolucion;
+
+typedef enum {
+    CONV_SEPARABLE,     // dos pasadas 1D en punto fijo
+    CONV_2D,            // una pasada 2D en punto fijo
+    CONV_FLOAT          // pasada 2D en float, de referencia
+} ModoConvolucion;
+
+// Suma ponderada de tam bytes separados can posiciones: la version escalar y la AVX2
+// se escriben una vez con tam como parametro y se instancian con tam constante.
+static inline __attribute__((always_inline))
+void acumularFilaBase(const unsigned char* pad, int n, int can, int tam, const int16_t* w, int32_t* acc) {
+    for (int i = 0; i < n; i++) {
+        int32_t s = acc[i];
+        for (int k = 0; k < tam; k++) s += w[k] * pad[i + k * can];
+        acc[i] = s;
+    }
+}
+
+static inline __attribute__((always_inline))
+void acumularColumnaBase(const int16_t* const* filas, int n, int tam, const int16_t* w, int32_t* acc) {
+    for (int i = 0; i < n; i++) {
+        int32_t s = 0;
+        for (int k = 0; k < tam; k++) s += w[k] * filas[k][i];
+        acc[i] = s;
+    }
+}
+
+static void acumularFila3(const unsigned char* p, int n, int can, int tam, const int16_t* w, int32_t* acc) {
+    (void)tam;
+    acumularFilaBase(p, n, can, 3, w, acc);
+}
+static void acumularFila5(const unsigned char* p, int n, int can, int tam, const int16_t* w, int32_t* acc) {
+    (void)tam;
+    acumularFilaBase(p, n, can, 5, w, acc);
+}
+static void acumularFila7(const unsigned char* p, int n, int can, int tam, const int16_t* w, int32_t* acc) {
+    (void)tam;
+    acumularFilaBase(p, n, can, 7, w, acc);
+}
+static void acumularFilaN(const unsigned char* p, int n, int can, int tam, const int16_t* w, int32_t* acc) {
+    acumularFilaBase(p, n, can, tam, w, acc);
+}
+static void acumularColumna3(const int16_t* const* f, int n, int tam, const int16_t* w, int32_t* acc) {
+    (void)tam;
+    acumularColumnaBase(f, n, 3, w, acc);
+}
+static void acumularColumna5(const int16_t* const* f, int n, int tam, const int16_t* w, int32_t* acc) {
+    (void)tam;
+    acumularColumnaBase(f, n, 5, w, acc);
+}
+static void acumularColumna7(const int16_t* const* f, int n, int tam, const int16_t* w, int32_t* acc) {
+    (void)tam;
+    acumularColumnaBase(f, n, 7, w, acc);
+}
+static void acumularColumnaN(const int16_t* const* f, int n, int tam, const int16_t* w, int32_t* acc) {
+    acumularColumnaBase(f, n, tam, w, acc);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// 16 valores por vuelta; los taps van de dos en dos intercalados para madd.
+static inline __attribute__((always_inline, target("avx2")))
+void acumularFilaBaseAVX2(const unsigned char* pad, int n, int can, int tam, const int16_t* w, int32_t* acc) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        // madd sobre unpacklo/hi agrupa por carriles de 128 bits: 0-3 y 8-11 en lo,
+        // 4-7 y 12-15 en hi; acc se carga y se guarda en ese orden.
+        __m256i a0 = _mm256_loadu_si256((const __m256i*)(acc + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i*)(acc + i + 8));
+        __m256i lo = _mm256_permute2x128_si256(a0, a1, 0x20);
+        __m256i hi = _mm256_permute2x128_si256(a0, a1, 0x31);
+        for (int k = 0; k < tam; k += 2) {
+            const unsigned char* p = pad + i + (size_t)k * can;
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));
+            __m256i b = _mm256_setzero_si256();
+            uint32_t par = (uint16_t)w[k];
+            if (k + 1 < tam) {
+                b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(p + can)));
+                par |= (uint32_t)(uint16_t)w[k + 1] << 16;
+            }
+            __m256i pw = _mm256_set1_epi32((int)par);
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), pw));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), pw));
+        }
+        _mm256_storeu_si256((__m256i*)(acc + i), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i*)(acc + i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    acumularFilaBase(pad + i, n - i, can, tam, w, acc + i);
+}
+
+static inline __attribute__((always_inline, target("avx2")))
+void acumularColumnaBaseAVX2(const int16_t* const* filas, int n, int tam, const int16_t* w, int32_t* acc) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i lo = _mm256_setzero_si256(), hi = _mm256_setzero_si256();
+        for (int k = 0; k < tam; k += 2) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(filas[k] + i));
+            __m256i b = _mm256_setzero_si256();
+            uint32_t par = (uint16_t)w[k];
+            if (k + 1 < tam) {
+                b = _mm256_loadu_si256((const __m256i*)(filas[k + 1] + i));
+                par |= (uint32_t)(uint16_t)w[k + 1] << 16;
+            }
+            __m256i pw = _mm256_set1_epi32((int)par);
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), pw));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), pw));
+        }
+        _mm256_storeu_si256((__m256i*)(acc + i), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i*)(acc + i + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    const int16_t* resto[TAM_MAX_KERNEL];
+    for (int k = 0; k < tam; k++) resto[k] = filas[k] + i;
+    acumularColumnaBase(resto, n - i, tam, w, acc + i);
+}
+
+__attribute__((target("avx2")))
+static void acumularFila3AVX2(const unsigned char* p, int n, int can, int tam, const int16_t* w, int32_t* acc) {
+    (void)tam;
+    acumularFilaBaseAVX2(p, n, can, 3, w, acc);
+}
+__attribute__((target("avx2")))
+static void acumularFila5AVX2(const unsigned char* p, int n, int can, int tam, const int16_t* w, int32_t* acc) {
+    (void)tam;
+    acumularFilaBaseAVX2(p, n, can, 5, w, acc);
+}
+__attribute__((target("avx2")))
+static void acumularFila7AVX2(const unsigned char* p, int n, int can, int tam, const int16_t* w, int32_t* acc) {
+    (void)tam;
+    acumularFilaBaseAVX2(p, n, can, 7, w, acc);
+}
+__attribute__((target("avx2")))
+static void acumularFilaNAVX2(const unsigned char* p, int n, int can, int tam, const int16_t* w, int32_t* acc) {
+    acumularFilaBaseAVX2(p, n, can, tam, w, acc);
+}
+__attribute__((target("avx2")))
+static void acumularColumna3AVX2(const int16_t* const* f, int n, int tam, const int16_t* w, int32_t* acc) {
+    (void)tam;
+    acumularColumnaBaseAVX2(f, n, 3, w, acc);
+}
+__attribute__((target("avx2")))
+static void acumularColumna5AVX2(const int16_t* const* f, int n, int tam, const int16_t* w, int32_t* acc) {
+    (void)tam;
+    acumularColumnaBaseAVX2(f, n, 5, w, acc);
+}
+__attribute__((target("avx2")))
+static void acumularColumna7AVX2(const int16_t* const* f, int n, int tam, const int16_t* w, int32_t* acc) {
+    (void)tam;
+    acumularColumnaBaseAVX2(f, n, 7, w, acc);
+}
+__attribute__((target("avx2")))
+static void acumularColumnaNAVX2(const int16_t* const* f, int n, int tam, const int16_t* w, int32_t* acc) {
+    acumularColumnaBaseAVX2(f, n, tam, w, acc);
+}
+
+#endif
+
+typedef void (*FuncionAcumularFila)(const unsigned char*, int, int, int, const int16_t*, int32_t*);
+typedef void (*FuncionAcumularColumna)(const int16_t* const*, int, int, const int16_t*, int32_t*);
+// Indice 0: tam generico; 1, 2, 3: tam 3, 5, 7.
+static FuncionAcumularFila acumularFilaConv[4] = { acumularFilaN, acumularFila3, acumularFila5, acumularFila7 };
+static FuncionAcumularColumna acumularColumnaConv[4] = { acumularColumnaN, acumularColumna3, acumularColumna5,
+                                                         acumularColumna7 };
+static const char* nombreKernelConvGeneral = "escalar";
+static pthread_once_t convGeneralOnce = PTHREAD_ONCE_INIT;
+
+static void elegirKernelConvGeneral(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpuUsaAVX2()) {
+        FuncionAcumularFila f[4] = { acumularFilaNAVX2, acumularFila3AVX2, acumularFila5AVX2, acumularFila7AVX2 };
+        FuncionAcumularColumna c[4] = { acumularColumnaNAVX2, acumularColumna3AVX2, acumularColumna5AVX2,
+                                        acumularColumna7AVX2 };
+        memcpy(acumularFilaConv, f, sizeof(f));
+        memcpy(acumularColumnaConv, c, sizeof(c));
+        nombreKernelConvGeneral = "AVX2";
+    }
+#endif
+}
+
+static inline int indiceTamConv(int tam) {
+    return tam == 3 ? 1 : tam == 5 ? 2 : tam == 7 ? 3 : 0;
+}
+
+// Pesos a int16 con los bits fraccionarios que quepan: cada peso en int16 y la suma de
+// |peso| * maximo en int32. Devuelve los bits (-1 si no caben) y deja en error la cota
+// del error que el redondeo de los pesos puede introducir con entradas de hasta maximo.
+static int cuantizarPesos(const double* v, int n, double maximo, int16_t* w, double* error) {
+    double mayor = 0.0, suma = 0.0;
+    for (int i = 0; i < n; i++) {
+        mayor = fmax(mayor, fabs(v[i]));
+        suma += fabs(v[i]);
+    }
+    int bits = 14;
+    while (bits > 0 && (mayor * (1 << bits) > 32767.0 || (suma + n) * maximo * (1 << bits) > 2147483647.0 / 2)) bits--;
+    if (bits < 1) return -1;
+    *error = 0.0;
+    for (int i = 0; i < n; i++) {
+        w[i] = (int16_t)lround(v[i] * (1 << bits));
+        *error += fabs(v[i] - (double)w[i] / (1 << bits)) * maximo;
+    }
+    return bits;
+}
+
+typedef struct {
+    const ImagenInfo* src;
+    ImagenInfo* dst;
+    const KernelConvolucion* k;
+    int tam;
+    int16_t pesos[TAM_MAX_KERNEL * TAM_MAX_KERNEL];   // 2D, fila a fila
+    int16_t fila[TAM_MAX_KERNEL], columna[TAM_MAX_KERNEL];
+    int bits, bitsFila;
+    int32_t sesgo;             // redondeo y desplazamiento, en la escala del acumulador
+    int16_t* tmp;              // separable: intermedio de alto * ancho * canales
+    atomic_int error;
+} ConvGeneralArgs;
+
+static inline void volcarAcumulador(const int32_t* acc, int n, int32_t sesgo, int bits, unsigned char* out) {
+    for (int i = 0; i < n; i++) out[i] = clamp255((acc[i] + sesgo) >> bits);
+}
+
+// Pasada 2D: un anillo de tam filas replicadas; cada fila nueva de la porcion mete una.
+void hiloConvGeneral2D(void* arg, int inicio, int fin) {
+    ConvGeneralArgs* a = (ConvGeneralArgs*)arg;
+    const ImagenInfo* src = a->src;
+    int tam = a->tam, r = tam / 2, can = src->canales, n = src->ancho * can;
+    size_t largo = (size_t)(src->ancho + tam - 1) * can + 16;
+    unsigned char* anillo = (unsigned char*)malloc(largo * tam);
+    int32_t* acc = (int32_t*)malloc((size_t)n * sizeof(int32_t));
+    if (!anillo || !acc) {
+        atomic_store(&a->error, 1);
+        free(anillo); free(acc);
+        return;
+    }
+    FuncionAcumularFila acumular = acumularFilaConv[indiceTamConv(tam)];
+    for (int yy = inicio - r; yy < inicio + r; yy++) {
+        rellenarFilaReplicada(PIXEL(src, clampInt(yy, 0, src->alto - 1), 0), src->ancho, can, r,
+                              anillo + (size_t)((yy % tam + tam) % tam) * largo);
+    }
+    for (int y = inicio; y < fin; y++) {
+        int yy = y + r;
+        rellenarFilaReplicada(PIXEL(src, clampInt(yy, 0, src->alto - 1), 0), src->ancho, can, r,
+                              anillo + (size_t)((yy % tam + tam) % tam) * largo);
+        memset(acc, 0, (size_t)n * sizeof(int32_t));
+        for (int ky = 0; ky < tam; ky++) {
+            int f = y - r + ky;
+            acumular(anillo + (size_t)((f % tam + tam) % tam) * largo, n, can, tam, a->pesos + ky * tam, acc);
+        }
+        volcarAcumulador(acc, n, a->sesgo, a->bits, PIXEL(a->dst, y, 0));
+    }
+    free(anillo);
+    free(acc);
+}
+
+// Pasada horizontal separable: src -> tmp en int16 con BITS_INTERMEDIO_CONV fraccionarios.
+void hiloConvGeneralH(void* arg, int inicio, int fin) {
+    ConvGeneralArgs* a = (ConvGeneralArgs*)arg;
+    const ImagenInfo* src = a->src;
+    int tam = a->tam, can = src->canales, n = src->ancho * can;
+    int desp = a->bitsFila - BITS_INTERMEDIO_CONV;
+    unsigned char* pad = (unsigned char*)malloc((size_t)(src->ancho + tam - 1) * can + 16);
+    int32_t* acc = (int32_t*)malloc((size_t)n * sizeof(int32_t));
+    if (!pad || !acc) {
+        atomic_store(&a->error, 1);
+        free(pad); free(acc);
+        return;
+    }
+    FuncionAcumularFila acumular = acumularFilaConv[indiceTamConv(tam)];
+    for (int y = inicio; y < fin; y++) {
+        rellenarFilaReplicada(PIXEL(src, y, 0), src->ancho, can, tam / 2, pad);
+        memset(acc, 0, (size_t)n * sizeof(int32_t));
+        acumular(pad, n, can, tam, a->fila, acc);
+        int16_t* t = a->tmp + (size_t)y * n;
+        for (int i = 0; i < n; i++) t[i] = (int16_t)((acc[i] + (1 << (desp - 1))) >> desp);
+    }
+    free(pad);
+    free(acc);
+}
+
+// Pasada vertical separable: tmp -> dst, con las filas de fuera sustituidas por la del borde.
+void hiloConvGeneralV(void* arg, int inicio, int fin) {
+    ConvGeneralArgs* a = (ConvGeneralArgs*)arg;
+    int tam = a->tam, r = tam / 2, alto = a->src->alto, n = a->src->ancho * a->src->canales;
+    int32_t* acc = (int32_t*)malloc((size_t)n * sizeof(int32_t));
+    if (!acc) {
+        atomic_store(&a->error, 1);
+        return;
+    }
+    FuncionAcumularColumna acumular = acumularColumnaConv[indiceTamConv(tam)];
+    const int16_t* filas[TAM_MAX_KERNEL];
+    for (int y = inicio; y < fin; y++) {
+        for (int k = 0; k < tam; k++) filas[k] = a->tmp + (size_t)clampInt(y + k - r, 0, alto - 1) * n;
+        acumular(filas, n, tam, a->columna, acc);
+        volcarAcumulador(acc, n, a->sesgo, a->bits, PIXEL(a->dst, y, 0));
+    }
+    free(acc);
+}
+
+// Referencia en float, pixel a pixel con el borde replicado.
+// Tambien es el camino de las imagenes de 16 bits (el desplazamiento del kernel esta en
+// la escala de 8 y se multiplica por 257). El alfa no recibe el desplazamiento.
+void hiloConvGeneralFloat(void* arg, int inicio, int fin) {
+    ConvGeneralArgs* a = (ConvGeneralArgs*)arg;
+    const ImagenInfo* src = a->src;
+    int tam = a->tam, r = tam / 2, can = src->canales, bits16 = src->profundidad == 16;
+    float maximo = bits16 ? 65535.0f : 255.0f;
+    float desplazamiento = a->k->desplazamiento * (bits16 ? 257.0f : 1.0f);
+    for (int y = inicio; y < fin; y++) {
+        unsigned char* out = a->dst->pixeles + (size_t)y * a->dst->stride;
+        for (int x = 0; x < src->ancho; x++) {
+            for (int c = 0; c < can; c++) {
+                float s = TIENE_ALFA(src) && c == can - 1 ? 0.0f : desplazamiento;
+                for (int ky = 0; ky < tam; ky++) {
+                    const unsigned char* fila =
+                        src->pixeles + (size_t)clampInt(y + ky - r, 0, src->alto - 1) * src->stride;
+                    for (int kx = 0; kx < tam; kx++) {
+                        size_t i = (size_t)clampInt(x + kx - r, 0, src->ancho - 1) * can + c;
+                        s += a->k->pesos[ky * tam + kx] * leerMuestra(fila, i, bits16);
+                    }
+                }
+                int v = s <= 0.0f ? 0 : s >= maximo ? (int)maximo : (int)lrintf(s);
+                escribirMuestra(out, (size_t)x * can + c, v, bits16);
+            }
+        }
+    }
+}
+
+// Rango 1: K[i][j] = columna[i] * fila[j], con la fila normalizada a suma de |.| = 1
+// para que el intermedio quede en [-255, 255].
+static int separarKernel(const KernelConvolucion* k, double* columna, double* fila) {
+    int tam = k->tam, p = 0, q = 0;
+    double mayor = 0.0;
+    for (int i = 0; i < tam * tam; i++) {
+        if (fabs(k->pesos[i]) > mayor) {
+            mayor = fabs(k->pesos[i]);
+            p = i / tam;
+            q = i % tam;
+        }
+    }
+    if (mayor == 0.0) return 0;
+    double suma = 0.0;
+    for (int j = 0; j < tam; j++) {
+        fila[j] = k->pesos[p * tam + j];
+        suma += fabs(fila[j]);
+    }
+    for (int i = 0; i < tam; i++) columna[i] = k->pesos[i * tam + q] / fila[q];
+    for (int i = 0; i < tam; i++) {
+        for (int j = 0; j < tam; j++) {
+            if (fabs(k->pesos[i * tam + j] - columna[i] * fila[j]) > TOLERANCIA_SEPARABLE * mayor) return 0;
+        }
+    }
+    for (int j = 0; j < tam; j++) fila[j] /= suma;
+    for (int i = 0; i < tam; i++) columna[i] *= suma;
+    return 1;
+}
+
+// Elige el modo mas rapido cuyo error de punto fijo queda en medio nivel y prepara args.
+static ModoConvolucion prepararConvGeneral(const KernelConvolucion* k, ConvGeneralArgs* a) {
+    int tam = k->tam;
+    double columna[TAM_MAX_KERNEL] = { 0 }, fila[TAM_MAX_KERNEL] = { 0 };
+    double pesos[TAM_MAX_KERNEL * TAM_MAX_KERNEL];
+    double errorFila, errorColumna, error2D;
+    if (separarKernel(k, columna, fila)) {
+        int bf = cuantizarPesos(fila, tam, 255.0, a->fila, &errorFila);
+        double sumaColumna = 0.0;
+        for (int i = 0; i < tam; i++) sumaColumna += fabs(columna[i]);
+        // El intermedio llega a 255 << BITS_INTERMEDIO_CONV; el redondeo de cada fila
+        // horizontal aporta medio paso del intermedio.
+        int bc = cuantizarPesos(columna, tam, 256.0 * (1 << BITS_INTERMEDIO_CONV), a->columna, &errorColumna);
+        if (bf > BITS_INTERMEDIO_CONV && bc >= 0) {
+            double error = (errorFila + 0.5 / (1 << BITS_INTERMEDIO_CONV)) * sumaColumna +
+                           errorColumna / (1 << BITS_INTERMEDIO_CONV);
+            if (error <= 0.5) {
+                a->bitsFila = bf;
+                a->bits = bc + BITS_INTERMEDIO_CONV;
+                a->sesgo = (int32_t)lround(k->desplazamiento * (1 << a->bits)) + (1 << (a->bits - 1));
+                return CONV_SEPARABLE;
+            }
+        }
+    }
+    for (int i = 0; i < tam * tam; i++) pesos[i] = k->pesos[i];
+    int b = cuantizarPesos(pesos, tam * tam, 255.0, a->pesos, &error2D);
+    if (b >= 0 && error2D <= 0.5) {
+        a->bits = b;
+        a->sesgo = (int32_t)lround(k->desplazamiento * (1 << b)) + (1 << (b - 1));
+        return CONV_2D;
+    }
+    return CONV_FLOAT;
+}
+
+int aplicarConvolucionGeneralModo(ImagenInfo* info, const KernelConvolucion* k, int numHilos, int forzarFloat) {
+    if (!info->pixeles) {
+        printf("No hay imagen cargada.\n");
+        return 0;
+    }
+    pthread_once(&convGeneralOnce, elegirKernelConvGeneral);
+    ConvGeneralArgs* args = (ConvGeneralArgs*)calloc(1, sizeof(ConvGeneralArgs));
+    if (!args) return 0;
+    args->src = info;
+    args->k = k;
+    args->tam = k->tam;
+    // Los modos en punto fijo son de 8 bits y suman el desplazamiento a todos los canales.
+    if (info->profundidad == 16 || (TIENE_ALFA(info) && k->desplazamiento != 0.0f)) forzarFloat = 1;
+    ModoConvolucion modo = forzarFloat ? CONV_FLOAT : prepararConvGeneral(k, args);
+    ImagenInfo dst = *info;
+    dst.pixeles = asignarPixeles(info->alto, info->ancho, (int)BYTES_PIXEL(info), &dst.stride);
+    args->dst = &dst;
+    if (modo == CONV_SEPARABLE) {
+        args->tmp = (int16_t*)malloc((size_t)info->alto * info->ancho * info->canales * sizeof(int16_t));
+    }
+    if (!dst.pixeles || (modo == CONV_SEPARABLE && !args->tmp)) {
+        fprintf(stderr, "Error al asignar memoria para la convolucion.\n");
+        liberarPixelesMem(dst.pixeles);
+        free(args);
+        return 0;
+    }
+    if (numHilos < 1) numHilos = 1;
+    premultiplicarAlfa(info, 0, numHilos);
+    int grano = granoFilas(info->ancho, info->canales, 1);
+    if (modo == CONV_SEPARABLE) {
+        numHilos = paraleloFilas(info->alto, grano, numHilos, hiloConvGeneralH, args);
+        paraleloFilas(info->alto, grano, numHilos, hiloConvGeneralV, args);
+    } else if (modo == CONV_2D) {
+        // Cada porcion rellena tam - 1 filas de anillo antes de producir la primera.
+        numHilos = paraleloFilas(info->alto, granoFilas(info->ancho, info->canales, 2 * k->tam), numHilos,
+                                 hiloConvGeneral2D, args);
+    } else {
+        numHilos = paraleloFilas(info->alto, grano, numHilos, hiloConvGeneralFloat, args);
+    }
+    int ok = !atomic_load(&args->error);
+    free(args->tmp);
+    free(args);
+    if (!ok) {
+        fprintf(stderr, "Error de memoria durante la convolucion.\n");
+        liberarPixelesMem(dst.pixeles);
+        premultiplicarAlfa(info, 1, numHilos);
+        return 0;
+    }
+    reemplazarImagen(info, &dst);
+    premultiplicarAlfa(info, 1, numHilos);
+    static const char* nombresModo[3] = { "separable", "2D", "float" };
+    informar("Convolucion %s %dx%d (%s, kernel %s) aplicada con %d hilos.\n", k->nombre, k->tam, k->tam,
+             nombresModo[modo], modo == CONV_FLOAT ? "escalar" : nombreKernelConvGeneral, numHilos);
+    return 1;
+}
+
+int aplicarConvolucionGeneral(ImagenInfo* info, const KernelConvolucion* k, int numHilos) {
+    return aplicarConvolucionGeneralModo(info, k, numHilos, 0);
+}
+
+// Linea de longitud tam que pasa por el centro con el angulo dado, antialiasada por
+// distancia, y normalizada. A 0 grados es una fila: separable.
+static void kernelMovimiento(KernelConvolucion* k, int tam, double grados) {
+    double rad = grados * M_PI / 180.0, dx = cos(rad), dy = -sin(rad), r = tam / 2, suma = 0.0;
+    for (int i = 0; i < tam; i++) {
+        for (int j = 0; j < tam; j++) {
+            double x = j - r, y = i - r;
+            double a = x * dx + y * dy;             // a lo largo de la linea
+            double d = fabs(-x * dy + y * dx);      // distancia a la linea
+            double w = fabs(a) <= r + 0.5 && d < 1.0 ? 1.0 - d : 0.0;
+            k->pesos[i * tam + j] = (float)w;
+            suma += w;
+        }
+    }
+    for (int i = 0; i < tam * tam; i++) k->pesos[i] = (float)(k->pesos[i] / suma);
+}
+
+// Matriz en texto: numeros separados por espacios (tam x tam con tam impar), lineas
+// con # de comentario y las palabras divisor D y offset O. Sin divisor se divide por
+// la suma de los pesos si no es 0.
+static int leerKernelFichero(const char* ruta, KernelConvolucion* k) {
+    FILE* f = fopen(ruta, "r");
+    if (!f) {
+        fprintf(stderr, "No se pudo abrir el kernel %s: %s\n", ruta, strerror(errno));
+        return 0;
+    }
+    char linea[1024];
+    int n = 0, ok = 1;
+    double divisor = 0.0, suma = 0.0;
+    while (ok && fgets(linea, sizeof(linea), f)) {
+        char* c = strchr(linea, '#');
+        if (c) *c = 0;
+        for (char* tok = strtok(linea, " \t\r\n,;"); tok && ok; tok = strtok(NULL, " \t\r\n,;")) {
+            char* fin;
+            if (!strcasecmp(tok, "divisor") || !strcasecmp(tok, "offset")) {
+                char* valor = strtok(NULL, " \t\r\n,;");
+                double v = valor ? strtod(valor, &fin) : 0.0;
+                ok = valor && !*fin && (tolower((unsigned char)tok[0]) == 'o' || v != 0.0);
+                if (tolower((unsigned char)tok[0]) == 'd') divisor = v;
+                else k->desplazamiento = (float)v;
+                continue;
+            }
+            double v = strtod(tok, &fin);
+            ok = *fin == 0 && n < TAM_MAX_KERNEL * TAM_MAX_KERNEL;
+            if (ok) {
+                k->pesos[n++] = (float)v;
+                suma += v;
+            }
+        }
+    }
+    fclose(f);
+    int tam = (int)lround(sqrt((double)n));
+    if (!ok || tam * tam != n || tam % 2 == 0) {
+        fprintf(stderr, "Kernel invalido en %s: se esperan N x N numeros con N impar de 1 a %d.\n", ruta,
+                TAM_MAX_KERNEL);
+        return 0;
+    }
+    if (divisor == 0.0) divisor = fabs(suma) > 1e-9 ? suma : 1.0;
+    for (int i = 0; i < n; i++) k->pesos[i] = (float)(k->pesos[i] / divisor);
+    k->tam = tam;
+    const char* base = strrchr(ruta, '/');
+    snprintf(k->nombre, sizeof(k->nombre), "%s", base ? base + 1 : ruta);
+    return 1;
+}
+
+// sharpen, emboss, motion:L[:GRADOS] o la ruta de un fichero de kernel.
+int cargarKernelConvolucion(const char* espec, KernelConvolucion* k) {
+    static const float enfocar[9] = { 0, -1, 0, -1, 5, -1, 0, -1, 0 };
+    static const float relieve[9] = { -2, -1, 0, -1, 1, 1, 0, 1, 2 };
+    memset(k, 0, sizeof(*k));
+    if (!strcmp(espec, "sharpen") || !strcmp(espec, "emboss")) {
+        k->tam = 3;
+        memcpy(k->pesos, espec[0] == 's' ? enfocar : relieve, sizeof(enfocar));
+        snprintf(k->nombre, sizeof(k->nombre), "%s", espec[0] == 's' ? "enfocar" : "relieve");
+        return 1;
+    }
+    if (!strncmp(espec, "motion:", 7)) {
+        char* fin;
+        long tam = strtol(espec + 7, &fin, 10);
+        double grados = *fin == ':' ? strtod(fin + 1, &fin) : 0.0;
+        if (*fin || tam < 3 || tam > TAM_MAX_KERNEL || tam % 2 == 0) {
+            fprintf(stderr, "Movimiento invalido (motion:L[:GRADOS] con L impar de 3 a %d): %s\n", TAM_MAX_KERNEL,
+                    espec);
+            return 0;
+        }
+        k->tam = (int)tam;
+        kernelMovimiento(k, k->tam, grados);
+        snprintf(k->nombre, sizeof(k->nombre), "movimiento %ld a %.0f grados", tam, grados);
+        return 1;
+    }
+    return leerKernelFichero(espec, k);
+}
+
+//  MEDIANA
+
+// Filtro de mediana con histogramas por columna (Perreault y Hebert): cada columna
+// guarda el histograma de sus 2r+1 filas y el del kernel se desliza por la fila
+// sumando la columna que entra y restando la que sale, asi que el coste por pixel no
+// depende del radio. Cada histograma tiene 256 contadores finos y 16 gruesos detras;
+// la mediana se busca primero en los gruesos y luego en los 16 finos del tramo.
+// El borde se replica como en getPixelReplicate.
+
+#define BINS_MEDIANA (256 + 16)
+// Con 2r+1 <= 255 el kernel cuenta como mucho 255 * 255 valores: cabe en uint16.
+#define RADIO_MAX_MEDIANA 127
+
+typedef struct {
+    ImagenInfo* src;
+    ImagenInfo* dst;
+    int radio;
+    atomic_int error;
+} MedianaArgs;
+
+// k += mas - menos sobre los BINS_MEDIANA contadores.
+static void deslizarHistograma(uint16_t* k, const uint16_t* mas, const uint16_t* menos) {
+    for (int i = 0; i < BINS_MEDIANA; i++) k[i] = (uint16_t)(k[i] + mas[i] - menos[i]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// 272 contadores = 17 vectores de 16.
+__attribute__((target("avx2")))
+static void deslizarHistogramaAVX2(uint16_t* k, const uint16_t* mas, const uint16_t* menos) {
+    for (int i = 0; i < BINS_MEDIANA; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(k + i));
+        v = _mm256_add_epi16(v, _mm256_loadu_si256((const __m256i*)(mas + i)));
+        v = _mm256_sub_epi16(v, _mm256_loadu_si256((const __m256i*)(menos + i)));
+        _mm256_storeu_si256((__m256i*)(k + i), v);
+    }
+}
+
+#endif
+
+static void (*deslizarHist)(uint16_t*, const uint16_t*, const uint16_t*) = deslizarHistograma;
+static const char* nombreKernelMediana = "escalar";
+static pthread_once_t medianaOnce = PTHREAD_ONCE_INIT;
+
+static void elegirKernelMediana(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpuUsaAVX2()) {
+        deslizarHist = deslizarHistogramaAVX2;
+        nombreKernelMediana = "AVX2";
+    }
+#endif
+}
+
+static inline void contarEnHistograma(uint16_t* h, int v, int delta) {
+    h[v] = (uint16_t)(h[v] + delta);
+    h[256 + (v >> 4)] = (uint16_t)(h[256 + (v >> 4)] + delta);
+}
+
+// Valor de rango rango (desde 0) del histograma: tramo grueso y dentro de el el fino.
+static inline unsigned char buscarMediana(const uint16_t* h, int rango) {
+    int s = 0;
+    for (; s < 15 && rango >= h[256 + s]; s++) rango -= h[256 + s];
+    const uint16_t* fino = h + s * 16;
+    int v = 0;
+    for (; v < 15 && rango >= fino[v]; v++) rango -= fino[v];
+    return (unsigned char)(s * 16 + v);
+}
+
+// Cada porcion rellena los histogramas de columna con las 2r+1 filas de su primera
+// fila y despues los actualiza fila a fila: una resta y una suma por columna.
+void hiloMediana(void* args, int inicio, int fin) {
+    MedianaArgs* a = (MedianaArgs*)args;
+    ImagenInfo* src = a->src;
+    int r = a->radio, ancho = src->ancho, alto = src->alto, can = src->canales;
+    size_t n = (size_t)ancho * can;
+    uint16_t* columnas = (uint16_t*)calloc(n * BINS_MEDIANA, sizeof(uint16_t));
+    uint16_t* kernel = (uint16_t*)malloc((size_t)can * BINS_MEDIANA * sizeof(uint16_t));
+    if (!columnas || !kernel) {
+        atomic_store(&a->error, 1);
+        free(columnas); free(kernel);
+        return;
+    }
+    for (int k = -r; k <= r; k++) {
+        const unsigned char* p = PIXEL(src, clampInt(inicio + k, 0, alto - 1), 0);
+        for (size_t i = 0; i < n; i++) contarEnHistograma(columnas + i * BINS_MEDIANA, p[i], 1);
+    }
+    int rango = ((2 * r + 1) * (2 * r + 1)) / 2;
+    for (int y = inicio; y < fin; y++) {
+        if (y > inicio) {
+            const unsigned char* sale = PIXEL(src, clampInt(y - r - 1, 0, alto - 1), 0);
+            const unsigned char* entra = PIXEL(src, clampInt(y + r, 0, alto - 1), 0);
+            if (sale != entra) {
+                for (size_t i = 0; i < n; i++) {
+                    uint16_t* h = columnas + i * BINS_MEDIANA;
+                    contarEnHistograma(h, sale[i], -1);
+                    contarEnHistograma(h, entra[i], 1);
+                }
+            }
+        }
+        unsigned char* out = PIXEL(a->dst, y, 0);
+        for (int c = 0; c < can; c++) {
+            uint16_t* k = kernel + (size_t)c * BINS_MEDIANA;
+            const uint16_t* col = columnas + (size_t)c * BINS_MEDIANA;
+            const size_t pasoCol = (size_t)can * BINS_MEDIANA;
+            // Columnas -r..r con la 0 repetida r veces por el borde replicado.
+            memset(k, 0, BINS_MEDIANA * sizeof(uint16_t));
+            for (int x = -r; x <= r; x++) {
+                const uint16_t* h = col + (size_t)clampInt(x, 0, ancho - 1) * pasoCol;
+                for (int i = 0; i < BINS_MEDIANA; i++) k[i] = (uint16_t)(k[i] + h[i]);
+            }
+            for (int x = 0; x < ancho; x++) {
+                out[(size_t)x * can + c] = buscarMediana(k, rango);
+                int xe = x + r + 1 < ancho ? x + r + 1 : ancho - 1;
+                int xs = x - r > 0 ? x - r : 0;
+                if (xe != xs) deslizarHist(k, col + (size_t)xe * pasoCol, col + (size_t)xs * pasoCol);
+            }
+        }
+    }
+    free(columnas);
+    free(kernel);
+}
+
+int aplicarMediana(ImagenInfo* info, int radio, int numHilos) {
+    if (!info->pixeles) {
+        printf("No hay imagen cargada.\n");
+        return 0;
+    }
+    if (radio < 1 || radio > RADIO_MAX_MEDIANA) {
+        printf("Radio de mediana invalido. Use un valor de 1 a %d.\n", RADIO_MAX_MEDIANA);
+        return 0;
+    }
+    if (!reducirA8Bits(info, "La mediana", numHilos)) return 0;
+    pthread_once(&medianaOnce, elegirKernelMediana);
+    ImagenInfo dst = *info;
+    dst.pixeles = asignarPixeles(info->alto, info->ancho, info->canales, &dst.stride);
+    if (!dst.pixeles) {
+        fprintf(stderr, "Error al asignar memoria para imagen destino (mediana).\n");
+        return 0;
+    }
+    if (numHilos < 1) numHilos = 1;
+    MedianaArgs args = { info, &dst, radio, 0 };
+    // Cada porcion reserva y arranca sus histogramas de columna con 2r+1 filas, asi que
+    // se reparte en franjas altas: unas cuatro por hilo.
+    int grano = (info->alto + 4 * numHilos - 1) / (4 * numHilos);
+    if (grano < 4 * (2 * radio + 1)) grano = 4 * (2 * radio + 1);
+    numHilos = paraleloFilas(info->alto, grano, numHilos, hiloMediana, &args);
+    if (atomic_load(&args.error)) {
+        fprintf(stderr, "Error de memoria durante el filtro de mediana.\n");
+        liberarPixelesMem(dst.pixeles);
+        return 0;
+    }
+    reemplazarImagen(info, &dst);
+    informar("Filtro de mediana aplicado (radio=%d, kernel %s) con %d hilos.\n", radio, nombreKernelMediana,
+             numHilos);
+    return 1;
+}
+
+//  ROTACIÓN 
+
+// Coordenadas de origen en punto fijo 32.32: el paso por columna se suma sin
+// recalcular senos ni cosenos y el error acumulado en una fila es despreciable.
+#define BITS_COORD 32
+#define UNO_COORD ((int64_t)1 << BITS_COORD)
+// Precision de los pesos bilineales (el producto de dos cabe en int32 con 8 bits de dato).
+#define BITS_BILINEAL 11
+// Lado del bloque de la copia exacta para multiplos de 90 grados.
+#define TAM_BLOQUE_ROT 64
+
+typedef struct {
+    ImagenInfo* src;
+    ImagenInfo* dst;
+    int dstAncho;
+    int dstAlto;
+    double cx_src, cy_src; 
+    double cx_dst, cy_dst;
+    double angleRad; 
+    int64_t pasoX, pasoY;          // avance de (srcx, srcy) por columna de destino
+    const unsigned char* relleno;  // color de lo que cae fuera del origen
+} RotArgs;
+
+static inline int64_t divPiso(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return (a % b != 0 && ((a < 0) != (b < 0))) ? q - 1 : q;
+}
+
+// Recorta [*xa, *xb) a las columnas x con lo <= s0 + x * ds < hi.
+static void recortarIntervalo(int64_t s0, int64_t ds, int64_t lo, int64_t hi, int* xa, int* xb) {
+    int64_t a, b;
+    if (ds == 0) {
+        if (s0 < lo || s0 >= hi) *xb = *xa;
+        return;
+    }
+    if (ds > 0) {
+        a = divPiso(lo - s0 + ds - 1, ds);
+        b = divPiso(hi - s0 + ds - 1, ds);
+    } else {
+        a = divPiso(s0 - hi, -ds) + 1;
+        b = divPiso(s0 - lo, -ds) + 1;
+    }
+    if (a > *xa) *xa = a > INT_MAX ? INT_MAX : (int)a;
+    if (b < *xb) *xb = b < INT_MIN ? INT_MIN : (int)b;
+    if (*xb < *xa) *xb = *xa;
+}
+
+// Bilineal con los cuatro vecinos dentro de la imagen, sin comprobaciones. Con 16 bits
+// el producto de los dos pesos por la muestra no cabe en int32.
+static inline __attribute__((always_inline))
+void muestraBilinealInterior(const ImagenInfo* src, int64_t sx, int64_t sy, unsigned char* out, int can, int bits16) {
+    const int uno = 1 << BITS_BILINEAL;
+    int fx = (int)((sx >> (BITS_COORD - BITS_BILINEAL)) & (uno - 1));
+    int fy = (int)((sy >> (BITS_COORD - BITS_BILINEAL)) & (uno - 1));
+    const unsigned char* p = src->pixeles + (size_t)(sy >> BITS_COORD) * src->stride;
+    const unsigned char* q = p + src->stride;
+    size_t i = (size_t)(sx >> BITS_COORD) * can;
+    for (int c = 0; c < can; c++, i++) {
+        int64_t arriba = leerMuestra(p, i, bits16) * (uno - fx) + leerMuestra(p, i + can, bits16) * fx;
+        int64_t abajo = leerMuestra(q, i, bits16) * (uno - fx) + leerMuestra(q, i + can, bits16) * fx;
+        int64_t v = (arriba * (uno - fy) + abajo * fy + (1 << (2 * BITS_BILINEAL - 1))) >> (2 * BITS_BILINEAL);
+        escribirMuestra(out, (size_t)c, (int)v, bits16);
+    }
+}
+
+// Igual que la interior pero replicando bordes, para la franja de un pixel alrededor.
+static inline __attribute__((always_inline))
+void muestraBilinealBorde(const ImagenInfo* src, int64_t sx, int64_t sy, unsigned char* out, int can, int bits16) {
+    const int uno = 1 << BITS_BILINEAL;
+    int x0 = (int)(sx >> BITS_COORD), y0 = (int)(sy >> BITS_COORD);
+    int fx = (int)((sx >> (BITS_COORD - BITS_BILINEAL)) & (uno - 1));
+    int fy = (int)((sy >> (BITS_COORD - BITS_BILINEAL)) & (uno - 1));
+    const unsigned char* p = src->pixeles + (size_t)clampInt(y0, 0, src->alto - 1) * src->stride;
+    const unsigned char* q = src->pixeles + (size_t)clampInt(y0 + 1, 0, src->alto - 1) * src->stride;
+    size_t i0 = (size_t)clampInt(x0, 0, src->ancho - 1) * can, i1 = (size_t)clampInt(x0 + 1, 0, src->ancho - 1) * can;
+    for (int c = 0; c < can; c++) {
+        int64_t arriba = leerMuestra(p, i0 + c, bits16) * (uno - fx) + leerMuestra(p, i1 + c, bits16) * fx;
+        int64_t abajo = leerMuestra(q, i0 + c, bits16) * (uno - fx) + leerMuestra(q, i1 + c, bits16) * fx;
+        int64_t v = (arriba * (uno - fy) + abajo * fy + (1 << (2 * BITS_BILINEAL - 1))) >> (2 * BITS_BILINEAL);
+        escribirMuestra(out, (size_t)c, (int)v, bits16);
+    }
+}
+
+static void rellenarSpan(unsigned char* out, int desde, int hasta, size_t bpp, const unsigned char* color) {
+    for (int x = desde; x < hasta; x++) memcpy(out + (size_t)x * bpp, color, bpp);
+}
+
+// Cada fila se divide en: fuera del origen (relleno), franja de borde (con clamps)
+// e interior (sin clamps). Las coordenadas avanzan por suma en punto fijo.
+static inline __attribute__((always_inline))
+void rotarFilas(RotArgs* a, int inicio, int fin, int can, int bits16) {
+    ImagenInfo* src = a->src;
+    size_t bpp = (size_t)can * (bits16 ? 2 : 1);
+    int W = a->dstAncho;
+    double c = cos(a->angleRad), s = sin(a->angleRad);
+    // El relleno viene en 8 bits.
+    unsigned char color[8];
+    for (int k = 0; k < can; k++)
+        escribirMuestra(color, (size_t)k, bits16 ? MUESTRA_A_16(a->relleno[k]) : a->relleno[k], bits16);
+    for (int y = inicio; y < fin; y++) {
+        double dx = -a->cx_dst;
+        double dy = y - a->cy_dst;
+        int64_t sx0 = (int64_t)llround((dx * c + dy * s + a->cx_src) * UNO_COORD);
+        int64_t sy0 = (int64_t)llround((-dx * s + dy * c + a->cy_src) * UNO_COORD);
+        unsigned char* out = a->dst->pixeles + (size_t)y * a->dst->stride;
+
+        // Algun vecino dentro: (-1, ancho) x (-1, alto). Todos dentro: [0, ancho-1) x [0, alto-1).
+        int xa = 0, xb = W;
+        recortarIntervalo(sx0, a->pasoX, -UNO_COORD + 1, (int64_t)src->ancho * UNO_COORD, &xa, &xb);
+        recortarIntervalo(sy0, a->pasoY, -UNO_COORD + 1, (int64_t)src->alto * UNO_COORD, &xa, &xb);
+        int ia = xa, ib = xb;
+        recortarIntervalo(sx0, a->pasoX, 0, (int64_t)(src->ancho - 1) * UNO_COORD, &ia, &ib);
+        recortarIntervalo(sy0, a->pasoY, 0, (int64_t)(src->alto - 1) * UNO_COORD, &ia, &ib);
+        if (ib <= ia) ia = ib = xb;
+
+        rellenarSpan(out, 0, xa, bpp, color);
+        int64_t sx = sx0 + xa * a->pasoX, sy = sy0 + xa * a->pasoY;
+        int x = xa;
+        for (; x < ia; x++, sx += a->pasoX, sy += a->pasoY)
+            muestraBilinealBorde(src, sx, sy, out + x * bpp, can, bits16);
+        for (; x < ib; x++, sx += a->pasoX, sy += a->pasoY)
+            muestraBilinealInterior(src, sx, sy, out + x * bpp, can, bits16);
+        for (; x < xb; x++, sx += a->pasoX, sy += a->pasoY)
+            muestraBilinealBorde(src, sx, sy, out + x * bpp, can, bits16);
+        rellenarSpan(out, xb, W, bpp, color);
+    }
+}
+
+void hiloRotacion(void* arg, int inicio, int fin) {
+    RotArgs* a = (RotArgs*)arg;
+    SEGUN_FORMATO(a->src->canales, a->src->profundidad == 16, rotarFilas, a, inicio, fin);
+}
+
+typedef struct {
+    const ImagenInfo* src;
+    ImagenInfo* dst;
+    ptrdiff_t base;     // desplazamiento en src del pixel destino (0, 0)
+    ptrdiff_t pasoX;    // bytes en src al avanzar una columna de destino
+    ptrdiff_t pasoY;    // bytes en src al avanzar una fila de destino
+} RotExactaArgs;
+
+// Copia por bloques de TAM_BLOQUE_ROT columnas para que las filas de origen que
+// recorre una columna de destino sigan en cache.
+void hiloRotacionExacta(void* arg, int inicio, int fin) {
+    RotExactaArgs* a = (RotExactaArgs*)arg;
+    int can = (int)BYTES_PIXEL(a->dst);   // bytes por pixel
+    for (int bx = 0; bx < a->dst->ancho; bx += TAM_BLOQUE_ROT) {
+        int ex = bx + TAM_BLOQUE_ROT < a->dst->ancho ? bx + TAM_BLOQUE_ROT : a->dst->ancho;
+        for (int y = inicio; y < fin; y++) {
+            const unsigned char* s = a->src->pixeles + a->base + y * a->pasoY + bx * a->pasoX;
+            unsigned char* d = a->dst->pixeles + (size_t)y * a->dst->stride + (size_t)bx * can;
+            if (can == 1) {
+                for (int x = bx; x < ex; x++, s += a->pasoX) *d++ = *s;
+            } else if (can == 3) {
+                for (int x = bx; x < ex; x++, s += a->pasoX, d += 3) { d[0] = s[0]; d[1] = s[1]; d[2] = s[2]; }
+            } else {
+                for (int x = bx; x < ex; x++, s += a->pasoX, d += can) memcpy(d, s, can);
+            }
+        }
+    }
+}
+
+// cuadrante: giro en multiplos de 90 grados (0..3) con el mismo sentido que el general.
+static int rotarExacta(ImagenInfo* info, ImagenInfo* dst, int cuadrante, int numHilos) {
+    ptrdiff_t can = (ptrdiff_t)BYTES_PIXEL(info), st = (ptrdiff_t)info->stride;
+    ptrdiff_t W = info->ancho, H = info->alto;
+    RotExactaArgs args = { info, dst, 0, can, st };
+    switch (cuadrante) {
+        case 1: args.base = (W - 1) * can;              args.pasoX = st;   args.pasoY = -can; break;
+        case 2: args.base = (H - 1) * st + (W - 1) * can; args.pasoX = -can; args.pasoY = -st;  break;
+        case 3: args.base = (H - 1) * st;               args.pasoX = -st;  args.pasoY = can;  break;
+        default: break;
+    }
+    return paraleloFilas(dst->alto, TAM_BLOQUE_ROT, numHilos, hiloRotacionExacta, &args);
+}
+
+// relleno: color (canales bytes, en 8 bits) para lo que queda fuera de la imagen original.
+int rotarImagenRelleno(ImagenInfo* info, double anguloGrados, int numHilos, const unsigned char* relleno) {
+    if (!info->pixeles) { printf("No hay imagen cargada.\n"); return 0; }
+
+    double ang = fmod(anguloGrados, 360.0);
+    double rad = ang * M_PI / 180.0;
+    double cosA = fabs(cos(rad));
+    double sinA = fabs(sin(rad));
+    int newW = (int)ceil(info->ancho * cosA + info->alto * sinA);
+    int newH = (int)ceil(info->ancho * sinA + info->alto * cosA);
+
+    // Multiplos de 90: tamano exacto y copia sin interpolar.
+    double cuartos = ang / 90.0;
+    int cuadrante = -1;
+    if (fabs(cuartos - round(cuartos)) < 1e-9) {
+        cuadrante = (((int)lround(cuartos)) % 4 + 4) % 4;
+        newW = cuadrante % 2 ? info->alto : info->ancho;
+        newH = cuadrante % 2 ? info->ancho : info->alto;
+    }
+
+    ImagenInfo dst = { newW, newH, info->canales, 0, NULL, info->profundidad };
+    dst.pixeles = asignarPixeles(newH, newW, (int)BYTES_PIXEL(info), &dst.stride);
+    if (!dst.pixeles) { fprintf(stderr, "Error al asignar memoria para rotacion.\n"); return 0; }
+
+    if (cuadrante >= 0) {
+        numHilos = rotarExacta(info, &dst, cuadrante, numHilos);
+    } else {
+        premultiplicarAlfa(info, 0, numHilos);
+        double cx_src = (info->ancho - 1) / 2.0;
+        double cy_src = (info->alto - 1) / 2.0;
+        double cx_dst = (newW - 1) / 2.0;
+        double cy_dst = (newH - 1) / 2.0;
+
+        double invRad = -rad;
+
+        RotArgs args = { info, &dst, newW, newH, cx_src, cy_src, cx_dst, cy_dst, invRad,
+                         (int64_t)llround(cos(invRad) * UNO_COORD), (int64_t)llround(-sin(invRad) * UNO_COORD),
+                         relleno };
+        // Porciones pequenas: las filas de los extremos caen casi enteras fuera del origen.
+        numHilos = paraleloFilas(newH, granoFilas(newW, info->canales, 1), numHilos, hiloRotacion, &args);
+    }
+
+    reemplazarImagen(info, &dst);
+    if (cuadrante < 0) premultiplicarAlfa(info, 1, numHilos);
+
+    informar("Imagen rotada %.2f grados%s. Nuevo tamaño: %dx%d (hilos=%d)\n", anguloGrados,
+             cuadrante >= 0 ? " (exacta)" : "", info->ancho, info->alto, numHilos);
+    return 1;
+}
+
+int rotarImagen(ImagenInfo* info, double anguloGrados, int numHilos) {
+    static const unsigned char negro[4] = { 0, 0, 0, 0 };
+    return rotarImagenRelleno(info, anguloGrados, numHilos, negro);
+}
+
+//  SOBEL 
+
+// Luma BT.601 en enteros: (77 R + 150 G + 29 B) / 256.
+static inline unsigned char rgbToGrayPixel(unsigned char r, unsigned char g, unsigned char b) {
+    return (unsigned char)((77 * r + 150 * g + 29 * b + 128) >> 8);
+}
+
+typedef enum {
+    SOBEL_L2,       // sqrt(gx^2 + gy^2), exacto
+    SOBEL_L1        // |gx| + |gy|, aproximado y sin raiz
+} MagnitudSobel;
+
+typedef struct {
+    ImagenInfo* src;
+    ImagenInfo* dst; 
+    MagnitudSobel magnitud;
+    atomic_int error;
+} SobelArgs;
+
+// Fila de luma en int16 con una columna replicada a cada lado (g[-1] y g[ancho]).
+// El alfa no cuenta.
+static void filaGris(const unsigned char* p, int ancho, int canales, int16_t* g) {
+    if (canales == 1) {
+        for (int x = 0; x < ancho; x++) g[x] = p[x];
+    } else if (canales == 2) {
+        for (int x = 0; x < ancho; x++) g[x] = p[2 * x];
+    } else {
+        for (int x = 0; x < ancho; x++, p += canales) g[x] = rgbToGrayPixel(p[0], p[1], p[2]);
+    }
+    g[-1] = g[0];
+    g[ancho] = g[ancho - 1];
+}
+
+// [1 2 1] x [-1 0 1] sobre tres filas de luma; a es la de arriba y c la de abajo.
+static void sobelFilaEscalar(const int16_t* a, const int16_t* b, const int16_t* c, int ancho,
+                             MagnitudSobel magnitud, unsigned char* out) {
+    for (int x = 0; x < ancho; x++) {
+        int gx = (a[x + 1] - a[x - 1]) + 2 * (b[x + 1] - b[x - 1]) + (c[x + 1] - c[x - 1]);
+        int gy = (c[x - 1] + 2 * c[x] + c[x + 1]) - (a[x - 1] + 2 * a[x] + a[x + 1]);
+        int mag;
+        if (magnitud == SOBEL_L1) {
+            mag = abs(gx) + abs(gy);
+        } else {
+            mag = (int)lrintf(sqrtf((float)(gx * gx + gy * gy)));
+        }
+        out[x] = clamp255(mag);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// 16 pixeles por vuelta en int16; la magnitud L2 pasa a 32 bits con madd para la raiz.
+__attribute__((target("avx2")))
+static void sobelFilaAVX2(const int16_t* a, const int16_t* b, const int16_t* c, int ancho,
+                          MagnitudSobel magnitud, unsigned char* out) {
+    int x = 0;
+    for (; x + 16 <= ancho; x += 16) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i*)(a + x - 1));
+        __m256i a1 = _mm256_loadu_si256((const __m256i*)(a + x));
+        __m256i a2 = _mm256_loadu_si256((const __m256i*)(a + x + 1));
+        __m256i b0 = _mm256_loadu_si256((const __m256i*)(b + x - 1));
+        __m256i b2 = _mm256_loadu_si256((const __m256i*)(b + x + 1));
+        __m256i c0 = _mm256_loadu_si256((const __m256i*)(c + x - 1));
+        __m256i c1 = _mm256_loadu_si256((const __m256i*)(c + x));
+        __m256i c2 = _mm256_loadu_si256((const __m256i*)(c + x + 1));
+
+        __m256i db = _mm256_sub_epi16(b2, b0);
+        __m256i gx = _mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(a2, a0), _mm256_sub_epi16(c2, c0)),
+                                      _mm256_add_epi16(db, db));
+        __m256i sa = _mm256_add_epi16(_mm256_add_epi16(a0, a2), _mm256_add_epi16(a1, a1));
+        __m256i sc = _mm256_add_epi16(_mm256_add_epi16(c0, c2), _mm256_add_epi16(c1, c1));
+        __m256i gy = _mm256_sub_epi16(sc, sa);
+
+        __m256i mag;
+        if (magnitud == SOBEL_L1) {
+            mag = _mm256_adds_epi16(_mm256_abs_epi16(gx), _mm256_abs_epi16(gy));
+        } else {
+            __m256i lo = _mm256_unpacklo_epi16(gx, gy);
+            __m256i hi = _mm256_unpackhi_epi16(gx, gy);
+            __m256 rlo = _mm256_sqrt_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(lo, lo)));
+            __m256 rhi = _mm256_sqrt_ps(_mm256_cvtepi32_ps(_mm256_madd_epi16(hi, hi)));
+            // unpack y packs trabajan por carril de 128 bits, asi que el orden se recupera.
+            mag = _mm256_packs_epi32(_mm256_cvtps_epi32(rlo), _mm256_cvtps_epi32(rhi));
+        }
+        __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(mag, mag), 0x08);
+        _mm_storeu_si128((__m128i*)(out + x), _mm256_castsi256_si128(bytes));
+    }
+    sobelFilaEscalar(a + x, b + x, c + x, ancho - x, magnitud, out + x);
+}
+
+#endif
+
+typedef void (*FuncionSobelFila)(const int16_t*, const int16_t*, const int16_t*, int, MagnitudSobel, unsigned char*);
+static FuncionSobelFila sobelFila = sobelFilaEscalar;
+static const char* nombreKernelSobel = "escalar";
+static pthread_once_t sobelOnce = PTHREAD_ONCE_INIT;
+
+static void elegirKernelSobel(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpuUsaAVX2()) {
+        sobelFila = sobelFilaAVX2;
+        nombreKernelSobel = "AVX2";
+    }
+#endif
+}
+
+// Magnitud de una fila repetida en cada canal de color de out; mag es un buffer de
+// ancho bytes (puede ser NULL si canales == 1). Con alfa, se copia el de la fila origen.
+static void sobelSalida(const int16_t* a, const int16_t* b, const int16_t* c, int ancho,
+                        MagnitudSobel magnitud, int canales, unsigned char* mag, unsigned char* out,
+                        const unsigned char* origen) {
+    if (canales == 1) {
+        sobelFila(a, b, c, ancho, magnitud, out);
+        return;
+    }
+    sobelFila(a, b, c, ancho, magnitud, mag);
+    int color = canales == 2 || canales == 4 ? canales - 1 : canales;
+    for (int x = 0; x < ancho; x++, out += canales) {
+        for (int k = 0; k < color; k++) out[k] = mag[x];
+        if (color < canales) out[color] = origen[(size_t)x * canales + color];
+    }
+}
+
+// La luma de cada fila de la porcion (mas una de halo arriba y abajo) se calcula una vez.
+void hiloSobel(void* arg, int inicio, int fin) {
+    SobelArgs* a = (SobelArgs*)arg;
+    const ImagenInfo* src = a->src;
+    int ancho = src->ancho;
+    int filas = fin - inicio + 2;
+    size_t paso = (size_t)ancho + 2;
+    int16_t* gris = (int16_t*)malloc(paso * filas * sizeof(int16_t));
+    unsigned char* mag = a->dst->canales == 1 ? NULL : (unsigned char*)malloc(ancho);
+    if (!gris || (a->dst->canales != 1 && !mag)) {
+        atomic_store(&a->error, 1);
+        free(gris); free(mag);
+        return;
+    }
+    for (int i = 0; i < filas; i++) {
+        filaGris(PIXEL(src, clampInt(inicio - 1 + i, 0, src->alto - 1), 0), ancho, src->canales,
+                 gris + i * paso + 1);
+    }
+    for (int y = inicio; y < fin; y++) {
+        const int16_t* fa = gris + (size_t)(y - inicio) * paso + 1;
+        sobelSalida(fa, fa + paso, fa + 2 * paso, ancho, a->magnitud, a->dst->canales, mag, PIXEL(a->dst, y, 0),
+                    PIXEL(src, y, 0));
+    }
+    free(gris);
+    free(mag);
+}
+
+// unCanal: el resultado queda en grises (1 canal) en lugar de repetirse en cada canal.
+int detectarBordesSobelModo(ImagenInfo* info, int numHilos, MagnitudSobel magnitud, int unCanal) {
+    if (!info->pixeles) { printf("No hay imagen cargada.\n"); return 0; }
+    if (!reducirA8Bits(info, "Sobel", numHilos)) return 0;
+    pthread_once(&sobelOnce, elegirKernelSobel);
+    ImagenInfo dst = *info;
+    if (unCanal) dst.canales = 1;
+    dst.pixeles = asignarPixeles(dst.alto, dst.ancho, dst.canales, &dst.stride);
+    if (!dst.pixeles) { fprintf(stderr, "Error al asignar memoria para Sobel.\n"); return 0; }
+    SobelArgs args = { info, &dst, magnitud, 0 };
+    // Porciones de al menos 16 filas para que el halo de luma sea poco trabajo extra.
+    numHilos = paraleloFilas(info->alto, granoFilas(info->ancho, info->canales, 16), numHilos, hiloSobel, &args);
+    if (atomic_load(&args.error)) {
+        fprintf(stderr, "Error de memoria durante Sobel.\n");
+        liberarPixelesMem(dst.pixeles);
+        return 0;
+    }
+
+    reemplazarImagen(info, &dst);
+
+    informar("Detector de bordes (Sobel, %s, kernel %s, %d canal(es)) aplicado con %d hilos.\n",
+             magnitud == SOBEL_L1 ? "|gx|+|gy|" : "L2", nombreKernelSobel, info->canales, numHilos);
+    return 1;
+}
+
+void detectarBordesSobel(ImagenInfo* info, int numHilos) {
+    detectarBordesSobelModo(info, numHilos, SOBEL_L2, 0);
+}
+
+//  IMAGEN INTEGRAL
+
+// Tabla de sumas acumuladas: S[y][x] suma los pixeles de [0, x) x [0, y), con una
+// fila y una columna de ceros delante, asi que la suma de cualquier rectangulo sale
+// de cuatro lecturas y las operaciones de abajo cuestan lo mismo con cualquier radio.
+// Se construye en dos pasadas paralelas: prefijo de cada fila (por porciones de filas)
+// y acumulado por columnas (por bloques de columnas, recorriendo todas las filas).
+//
+// Los acumuladores son de 32 bits si la mayor suma que se va a consultar cabe: la
+// aritmetica es modular, asi que la resta de las cuatro esquinas es exacta aunque las
+// entradas de la tabla se hayan desbordado. Solo los cuadrados de ventanas grandes y
+// las imagenes enormes consultadas enteras necesitan 64 bits.
+
+#define COLUMNAS_BLOQUE_INTEGRAL 256
+#define K_SAUVOLA 0.2
+#define RANGO_SAUVOLA 128.0
+
+typedef enum {
+    INTEGRAL_CAJA,          // media de la ventana
+    INTEGRAL_DESVIACION,    // desviacion tipica de la ventana
+    INTEGRAL_UMBRAL         // umbral adaptativo (Sauvola) sobre la luma, salida de un canal
+} OperacionIntegral;
+
+typedef struct {
+    void* datos;
+    int bits64;
+} PlanoIntegral;
+
+typedef struct {
+    int ancho, alto, canales;
+    size_t paso;                 // elementos por fila: (ancho + 1) * canales
+    PlanoIntegral suma;
+    PlanoIntegral cuadrados;     // datos NULL si no se pidieron
+} TablaIntegral;
+
+typedef struct {
+    const ImagenInfo* img;
+    TablaIntegral* t;
+    int gris;                    // la tabla es de la luma de una imagen RGB
+} IntegralArgs;
+
+static int reservarPlano(PlanoIntegral* p, uint64_t maximo, size_t elementos) {
+    p->bits64 = maximo > UINT32_MAX;
+    p->datos = calloc(elementos, p->bits64 ? sizeof(uint64_t) : sizeof(uint32_t));
+    return p->datos != NULL;
+}
+
+// Prefijo de cada fila, por canal; el valor se escribe en la fila y + 1.
+// can (canales de la tabla) es constante en cada instancia; bits16 no se usa, la tabla
+// es siempre de 8 bits.
+static inline __attribute__((always_inline))
+void integralFilas(const IntegralArgs* a, int inicio, int fin, int can, int bits16) {
+    (void)bits16;
+    TablaIntegral* t = a->t;
+    int canSrc = a->img->canales, luma = a->gris && canSrc >= 3;
+    for (int y = inicio; y < fin; y++) {
+        const unsigned char* p = PIXEL(a->img, y, 0);
+        size_t base = (size_t)(y + 1) * t->paso + can;
+        uint64_t s[4] = { 0, 0, 0, 0 }, q[4] = { 0, 0, 0, 0 };
+        for (int x = 0; x < t->ancho; x++, p += canSrc) {
+            for (int c = 0; c < can; c++) {
+                unsigned v = luma ? rgbToGrayPixel(p[0], p[1], p[2]) : p[c];
+                size_t i = base + (size_t)x * can + c;
+                s[c] += v;
+                q[c] += v * v;
+                if (t->suma.bits64) ((uint64_t*)t->suma.datos)[i] = s[c];
+                else ((uint32_t*)t->suma.datos)[i] = (uint32_t)s[c];
+                if (!t->cuadrados.datos) continue;
+                if (t->cuadrados.bits64) ((uint64_t*)t->cuadrados.datos)[i] = q[c];
+                else ((uint32_t*)t->cuadrados.datos)[i] = (uint32_t)q[c];
+            }
+        }
+    }
+}
+
+void hiloIntegralFilas(void* arg, int inicio, int fin) {
+    IntegralArgs* a = (IntegralArgs*)arg;
+    SEGUN_FORMATO(a->t->canales, 0, integralFilas, a, inicio, fin);
+}
+
+static void acumularColumnas(PlanoIntegral* p, size_t paso, int alto, size_t desde, size_t hasta) {
+    if (p->bits64) {
+        uint64_t* d = (uint64_t*)p->datos;
+        for (int y = 1; y <= alto; y++) {
+            uint64_t* fila = d + (size_t)y * paso;
+            const uint64_t* previa = fila - paso;
+            for (size_t i = desde; i < hasta; i++) fila[i] += previa[i];
+        }
+    } else {
+        uint32_t* d = (uint32_t*)p->datos;
+        for (int y = 1; y <= alto; y++) {
+            uint32_t* fila = d + (size_t)y * paso;
+            const uint32_t* previa = fila - paso;
+            for (size_t i = desde; i < hasta; i++) fila[i] += previa[i];
+        }
+    }
+}
+
+// Las porciones cuentan bloques de COLUMNAS_BLOQUE_INTEGRAL elementos de fila.
+void hiloIntegralColumnas(void* arg, int inicio, int fin) {
+    IntegralArgs* a = (IntegralArgs*)arg;
+    TablaIntegral* t = a->t;
+    size_t desde = (size_t)inicio * COLUMNAS_BLOQUE_INTEGRAL;
+    size_t hasta = (size_t)fin * COLUMNAS_BLOQUE_INTEGRAL;
+    if (hasta > t->paso) hasta = t->paso;
+    acumularColumnas(&t->suma, t->paso, t->alto, desde, hasta);
+    if (t->cuadrados.datos) acumularColumnas(&t->cuadrados, t->paso, t->alto, desde, hasta);
+}
+
+void liberarTablaIntegral(TablaIntegral* t) {
+    free(t->suma.datos);
+    free(t->cuadrados.datos);
+    t->suma.datos = t->cuadrados.datos = NULL;
+}
+
+// radio limita las consultas a ventanas de (2 radio + 1)^2 pixeles, lo que decide el
+// ancho de los acumuladores; gris construye la tabla de la luma en vez de por canal
+// (en grises, del canal 0: el alfa nunca entra).
+int construirTablaIntegral(const ImagenInfo* img, int radio, int cuadrados, int gris, int numHilos,
+                           TablaIntegral* t) {
+    memset(t, 0, sizeof(*t));
+    gris = gris && img->canales > 1;
+    t->ancho = img->ancho;
+    t->alto = img->alto;
+    t->canales = gris ? 1 : img->canales;
+    t->paso = (size_t)(t->ancho + 1) * t->canales;
+    uint64_t lado = 2 * (uint64_t)radio + 1;
+    uint64_t area = lado * lado;
+    if (area > (uint64_t)img->ancho * img->alto) area = (uint64_t)img->ancho * img->alto;
+    size_t elementos = t->paso * (size_t)(t->alto + 1);
+    if (!reservarPlano(&t->suma, area * 255, elementos) ||
+        (cuadrados && !reservarPlano(&t->cuadrados, area * 255 * 255, elementos))) {
+        liberarTablaIntegral(t);
+        return 0;
+    }
+    IntegralArgs args = { img, t, gris };
+    numHilos = paraleloFilas(img->alto, granoFilas(img->ancho, img->canales, 1), numHilos, hiloIntegralFilas, &args);
+    int bloques = (int)((t->paso + COLUMNAS_BLOQUE_INTEGRAL - 1) / COLUMNAS_BLOQUE_INTEGRAL);
+    paraleloFilas(bloques, 1, numHilos, hiloIntegralColumnas, &args);
+    return 1;
+}
+
+// Suma del rectangulo [x0, x1) x [y0, y1) del canal c.
+static inline uint64_t sumaRectangulo(const PlanoIntegral* p, size_t paso, int can, int c, int x0, int y0,
+                                      int x1, int y1) {
+    size_t a = (size_t)y0 * paso + (size_t)x0 * can + c, b = (size_t)y0 * paso + (size_t)x1 * can + c;
+    size_t d = (size_t)y1 * paso + (size_t)x0 * can + c, e = (size_t)y1 * paso + (size_t)x1 * can + c;
+    if (p->bits64) {
+        const uint64_t* s = (const uint64_t*)p->datos;
+        return s[e] - s[b] - s[d] + s[a];
+    }
+    const uint32_t* s = (const uint32_t*)p->datos;
+    return (uint32_t)(s[e] - s[b] - s[d] + s[a]);
+}
+
+// Media y varianza de la ventana de radio r centrada en (x, y), recortada a la imagen.
+void mediaVarianzaLocal(const TablaIntegral* t, int x, int y, int r, int c, double* media, double* varianza) {
+    int x0 = x - r > 0 ? x - r : 0, x1 = x + r + 1 < t->ancho ? x + r + 1 : t->ancho;
+    int y0 = y - r > 0 ? y - r : 0, y1 = y + r + 1 < t->alto ? y + r + 1 : t->alto;
+    double n = (double)(x1 - x0) * (y1 - y0);
+    double m = (double)sumaRectangulo(&t->suma, t->paso, t->canales, c, x0, y0, x1, y1) / n;
+    *media = m;
+    if (!varianza) return;
+    double q = (double)sumaRectangulo(&t->cuadrados, t->paso, t->canales, c, x0, y0, x1, y1) / n;
+    *varianza = q > m * m ? q - m * m : 0.0;
+}
+
+typedef struct {
+    const ImagenInfo* src;
+    ImagenInfo* dst;
+    const TablaIntegral* t;
+    OperacionIntegral op;
+    int radio;
+    double k;
+} FiltroIntegralArgs;
+
+// La caja trabaja sobre el alfa premultiplicado como un canal mas; desviacion y umbral
+// dejan el alfa de origen.
+void hiloFiltroIntegral(void* arg, int inicio, int fin) {
+    FiltroIntegralArgs* a = (FiltroIntegralArgs*)arg;
+    const TablaIntegral* t = a->t;
+    int can = a->dst->canales, canSrc = a->src->canales;
+    int alfa = TIENE_ALFA(a->src) && a->op != INTEGRAL_CAJA ? can - 1 : -1;
+    for (int y = inicio; y < fin; y++) {
+        unsigned char* out = PIXEL(a->dst, y, 0);
+        const unsigned char* p = PIXEL(a->src, y, 0);
+        for (int x = 0; x < t->ancho; x++, out += can, p += canSrc) {
+            for (int c = 0; c < can; c++) {
+                double m, v;
+                if (c == alfa) {
+                    out[c] = p[canSrc - 1];
+                } else if (a->op == INTEGRAL_CAJA) {
+                    mediaVarianzaLocal(t, x, y, a->radio, c, &m, NULL);
+                    out[c] = (unsigned char)(m + 0.5);
+                } else if (a->op == INTEGRAL_DESVIACION) {
+                    mediaVarianzaLocal(t, x, y, a->radio, c, &m, &v);
+                    out[c] = clampRedondeo(sqrt(v));
+                } else {
+                    mediaVarianzaLocal(t, x, y, a->radio, 0, &m, &v);
+                    double umbral = m * (1.0 + a->k * (sqrt(v) / RANGO_SAUVOLA - 1.0));
+                    int luma = canSrc >= 3 ? rgbToGrayPixel(p[0], p[1], p[2]) : p[0];
+                    out[c] = luma > umbral ? 255 : 0;
+                }
+            }
+        }
+    }
+}
+
+// Caja, desviacion tipica local o umbral adaptativo con ventana de (2 radio + 1)^2
+// recortada en los bordes; k es la sensibilidad de Sauvola (solo para el umbral).
+int aplicarFiltroIntegral(ImagenInfo* info, OperacionIntegral op, int radio, double k, int numHilos) {
+    if (!info->pixeles) {
+        printf("No hay imagen cargada.\n");
+        return 0;
+    }
+    if (radio < 1) {
+        printf("Radio invalido. Use un valor >= 1.\n");
+        return 0;
+    }
+    if (numHilos < 1) numHilos = 1;
+    static const char* nombres[3] = { "Caja", "Desviacion tipica local", "Umbral adaptativo" };
+    if (!reducirA8Bits(info, nombres[op], numHilos)) return 0;
+    double t0 = ahoraSeg();
+    int premultiplicar = op == INTEGRAL_CAJA && TIENE_ALFA(info);
+    if (premultiplicar) premultiplicarAlfa(info, 0, numHilos);
+    TablaIntegral t;
+    if (!construirTablaIntegral(info, radio, op != INTEGRAL_CAJA, op == INTEGRAL_UMBRAL, numHilos, &t)) {
+        fprintf(stderr, "Error de memoria al construir la imagen integral.\n");
+        if (premultiplicar) premultiplicarAlfa(info, 1, numHilos);
+        return 0;
+    }
+    double tTabla = ahoraSeg() - t0;
+    ImagenInfo dst = *info;
+    // El umbral sale en grises, con el alfa de origen si lo hay.
+    dst.canales = t.canales + (op == INTEGRAL_UMBRAL && TIENE_ALFA(info));
+    dst.pixeles = asignarPixeles(dst.alto, dst.ancho, dst.canales, &dst.stride);
+    if (!dst.pixeles) {
+        fprintf(stderr, "Error al asignar memoria para imagen destino (imagen integral).\n");
+        liberarTablaIntegral(&t);
+        if (premultiplicar) premultiplicarAlfa(info, 1, numHilos);
+        return 0;
+    }
+    FiltroIntegralArgs args = { info, &dst, &t, op, radio, k };
+    numHilos = paraleloFilas(info->alto, granoFilas(info->ancho, info->canales, 1), numHilos, hiloFiltroIntegral,
+                             &args);
+    informar("%s por imagen integral (radio=%d, acumuladores de %d bits) con %d hilos: tabla %.3f s, total %.3f s.\n",
+             nombres[op], radio, t.cuadrados.datos && t.cuadrados.bits64 ? 64 : t.suma.bits64 ? 64 : 32, numHilos,
+             tTabla, ahoraSeg() - t0);
+    liberarTablaIntegral(&t);
+    reemplazarImagen(info, &dst);
+    if (premultiplicar) premultiplicarAlfa(info, 1, numHilos);
+    return 1;
+}
+
+//REDIMENSIONAR 
+
+// Remuestreo separable: primero horizontal (filas de origen -> tmp de ancho final)
+// y luego vertical (tmp -> destino). Indices y pesos de cada eje se calculan una vez.
+
+// Pesos de remuestreo en punto fijo; suman exactamente 1 << BITS_PESO_RESIZE.
+#define BITS_PESO_RESIZE 14
+// Bits fraccionarios del intermedio int16 (Lanczos puede salirse de [0, 255]). Con 16
+// bits el intermedio es int32 y guarda la muestra redondeada.
+#define BITS_INTERMEDIO_RESIZE 6
+
+typedef enum {
+    FILTRO_VECINO,
+    FILTRO_BILINEAL,
+    FILTRO_AREA,        // media ponderada por superficie cubierta
+    FILTRO_LANCZOS3
+} FiltroResize;
+
+static const char* nombresFiltro[] = { "vecino", "bilineal", "area", "Lanczos3" };
+
+// Para cada muestra de salida i: taps pesos consecutivos desde el indice inicio[i].
+typedef struct {
+    int taps;
+    int* inicio;
+    int16_t* pesos;     // pesos[i * taps + k]
+} TablaCoeficientes;
+
+static double sinc(double x) {
+    if (fabs(x) < 1e-8) return 1.0;
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+// Peso del pixel de origen j para una salida centrada en centro (coordenadas de centro de pixel).
+static double pesoFiltro(FiltroResize filtro, double j, double centro, double ancho) {
+    double d = j - centro;
+    switch (filtro) {
+        case FILTRO_BILINEAL: {
+            double t = 1.0 - fabs(d);
+            return t > 0.0 ? t : 0.0;
+        }
+        case FILTRO_AREA: {
+            double a = fmax(j - 0.5, centro - ancho / 2.0);
+            double b = fmin(j + 0.5, centro + ancho / 2.0);
+            return b > a ? b - a : 0.0;
+        }
+        case FILTRO_LANCZOS3: {
+            double t = d / ancho;
+            return fabs(t) < 3.0 ? sinc(t) * sinc(t / 3.0) : 0.0;
+        }
+        default:
+            return 0.0;
+    }
+}
+
+static void liberarTabla(TablaCoeficientes* t) {
+    free(t->inicio);
+    free(t->pesos);
+    t->inicio = NULL;
+    t->pesos = NULL;
+}
+
+// Tabla de un eje de tamSrc a tamDst muestras con bordes replicados.
+static int construirTabla(TablaCoeficientes* t, FiltroResize filtro, int tamSrc, int tamDst) {
+    double escala = (double)tamSrc / tamDst;
+    // Al reducir, el filtro se estira para promediar todo lo que cae bajo la muestra.
+    double ancho = filtro == FILTRO_BILINEAL ? 1.0 : fmax(escala, 1.0);
+    double soporte = filtro == FILTRO_VECINO ? 0.5 : filtro == FILTRO_BILINEAL ? 1.0 :
+                     filtro == FILTRO_AREA ? ancho / 2.0 + 0.5 : 3.0 * ancho;
+    int taps = filtro == FILTRO_VECINO ? 1 : (int)ceil(2.0 * soporte) + 1;
+    if (taps > tamSrc) taps = tamSrc;
+    t->taps = taps;
+    t->inicio = (int*)malloc(tamDst * sizeof(int));
+    t->pesos = (int16_t*)calloc((size_t)tamDst * taps, sizeof(int16_t));
+    double* w = (double*)malloc(taps * sizeof(double));
+    if (!t->inicio || !t->pesos || !w) {
+        liberarTabla(t);
+        free(w);
+        return 0;
+    }
+    for (int i = 0; i < tamDst; i++) {
+        double centro = (i + 0.5) * escala - 0.5;
+        int16_t* p = t->pesos + (size_t)i * taps;
+        if (filtro == FILTRO_VECINO) {
+            t->inicio[i] = clampInt((int)floor((i + 0.5) * escala), 0, tamSrc - 1);
+            p[0] = 1 << BITS_PESO_RESIZE;
+            continue;
+        }
+        int lo = (int)floor(centro - soporte);
+        int hi = (int)ceil(centro + soporte);
+        int desde = clampInt(lo, 0, tamSrc - 1);
+        if (desde > tamSrc - taps) desde = tamSrc - taps;
+        t->inicio[i] = desde;
+        // Los taps fuera de la imagen suman su peso al pixel del borde.
+        for (int k = 0; k < taps; k++) w[k] = 0.0;
+        double suma = 0.0;
+        for (int j = lo; j <= hi; j++) {
+            double v = pesoFiltro(filtro, j, centro, ancho);
+            if (v == 0.0) continue;
+            w[clampInt(j, 0, tamSrc - 1) - desde] += v;
+            suma += v;
+        }
+        int total = 0, kmax = 0;
+        for (int k = 0; k < taps; k++) {
+            p[k] = (int16_t)lround(w[k] / suma * (1 << BITS_PESO_RESIZE));
+            total += p[k];
+            if (p[k] > p[kmax]) kmax = k;
+        }
+        p[kmax] += (1 << BITS_PESO_RESIZE) - total;
+    }
+    free(w);
+    return 1;
+}
+
+typedef struct {
+    ImagenInfo* src;
+    ImagenInfo* dst;
+    int dstAncho;
+    int dstAlto;
+    TablaCoeficientes tx, ty;
+    void* tmp;                     // srcAlto filas de dstAncho * canales: int16, o int32 con 16 bits
+    const unsigned char* filaUsada;  // filas de origen que lee la pasada vertical
+    int factor;                    // reduccion entera (2, 4 u 8) en el camino rapido
+    atomic_int error;              // algun hilo no pudo reservar su acumulador
+} ResizeArgs;
+
+// Con 8 bits el acumulador no pasa de 2^22; con 16, de 2^30 (sumando los lobulos de Lanczos).
+static inline __attribute__((always_inline))
+void resizeHorizontalFilas(ResizeArgs* a, int inicio, int fin, int can, int bits16) {
+    int taps = a->tx.taps;
+    int n = a->dstAncho * can;
+    const int desp = bits16 ? BITS_PESO_RESIZE : BITS_PESO_RESIZE - BITS_INTERMEDIO_RESIZE;
+    for (int y = inicio; y < fin; y++) {
+        if (!a->filaUsada[y]) continue;
+        const unsigned char* fila = a->src->pixeles + (size_t)y * a->src->stride;
+        for (int x = 0; x < a->dstAncho; x++) {
+            size_t s = (size_t)a->tx.inicio[x] * can;
+            const int16_t* w = a->tx.pesos + (size_t)x * taps;
+            for (int c = 0; c < can; c++) {
+                int acc = 0;
+                for (int k = 0; k < taps; k++) acc += w[k] * leerMuestra(fila, s + (size_t)k * can + c, bits16);
+                int v = (acc + (1 << (desp - 1))) >> desp;
+                size_t i = (size_t)y * n + (size_t)x * can + c;
+                if (bits16) ((int32_t*)a->tmp)[i] = v;
+                else ((int16_t*)a->tmp)[i] = (int16_t)v;
+            }
+        }
+    }
+}
+
+void hiloResizeHorizontal(void* arg, int inicio, int fin) {
+    ResizeArgs* a = (ResizeArgs*)arg;
+    SEGUN_FORMATO(a->src->canales, a->src->profundidad == 16, resizeHorizontalFilas, a, inicio, fin);
+}
+
+static inline __attribute__((always_inline))
+void resizeVerticalFilas(ResizeArgs* a, int inicio, int fin, int32_t* acc, int bits16) {
+    int taps = a->ty.taps;
+    int n = a->dstAncho * a->src->canales;
+    const int desp = bits16 ? BITS_PESO_RESIZE : BITS_PESO_RESIZE + BITS_INTERMEDIO_RESIZE;
+    const int maximo = bits16 ? 65535 : 255;
+    for (int y = inicio; y < fin; y++) {
+        const int16_t* w = a->ty.pesos + (size_t)y * taps;
+        size_t base = (size_t)a->ty.inicio[y] * n;
+        memset(acc, 0, (size_t)n * sizeof(int32_t));
+        for (int k = 0; k < taps; k++) {
+            if (w[k] == 0) continue;
+            size_t fila = base + (size_t)k * n;
+            if (bits16) {
+                const int32_t* t = (const int32_t*)a->tmp + fila;
+                for (int i = 0; i < n; i++) acc[i] += w[k] * t[i];
+            } else {
+                const int16_t* t = (const int16_t*)a->tmp + fila;
+                for (int i = 0; i < n; i++) acc[i] += w[k] * t[i];
+            }
+        }
+        unsigned char* out = a->dst->pixeles + (size_t)y * a->dst->stride;
+        for (int i = 0; i < n; i++)
+            escribirMuestra(out, (size_t)i, clampInt((acc[i] + (1 << (desp - 1))) >> desp, 0, maximo), bits16);
+    }
+}
+
+void hiloResizeVertical(void* arg, int inicio, int fin) {
+    ResizeArgs* a = (ResizeArgs*)arg;
+    int32_t* acc = (int32_t*)malloc((size_t)a->dstAncho * a->src->canales * sizeof(int32_t));
+    if (!acc) {
+        atomic_store(&a->error, 1);
+        return;
+    }
+    if (a->src->profundidad == 16) resizeVerticalFilas(a, inicio, fin, acc, 1);
+    else resizeVerticalFilas(a, inicio, fin, acc, 0);
+    free(acc);
+}
+
+// Media de bloques f x f; f y la profundidad son constantes en cada llamada para que el
+// compilador desenrolle.
+static inline __attribute__((always_inline))
+void reducirFila(const ImagenInfo* src, int y, int f, int dstAncho, uint32_t* suma, unsigned char* out, int bits16) {
+    int can = src->canales;
+    int n = dstAncho * can;
+    int log2f = f == 2 ? 1 : (f == 4 ? 2 : 3);
+    memset(suma, 0, (size_t)n * sizeof(uint32_t));
+    for (int k = 0; k < f; k++) {
+        const unsigned char* s = src->pixeles + (size_t)(y * f + k) * src->stride;
+        for (int x = 0; x < dstAncho; x++) {
+            for (int j = 0; j < f; j++) {
+                for (int c = 0; c < can; c++)
+                    suma[x * can + c] += leerMuestra(s, (size_t)(x * f + j) * can + c, bits16);
+            }
+        }
+    }
+    for (int i = 0; i < n; i++)
+        escribirMuestra(out, (size_t)i, (int)((suma[i] + (1u << (2 * log2f - 1))) >> (2 * log2f)), bits16);
+}
+
+void hiloReduccionEntera(void* arg, int inicio, int fin) {
+    ResizeArgs* a = (ResizeArgs*)arg;
+    uint32_t* suma = (uint32_t*)malloc((size_t)a->dstAncho * a->src->canales * sizeof(uint32_t));
+    if (!suma) {
+        atomic_store(&a->error, 1);
+        return;
+    }
+    int b16 = a->src->profundidad == 16;
+    for (int y = inicio; y < fin; y++) {
+        unsigned char* out = a->dst->pixeles + (size_t)y * a->dst->stride;
+        switch (a->factor * 2 + b16) {
+            case 4: reducirFila(a->src, y, 2, a->dstAncho, suma, out, 0); break;
+            case 5: reducirFila(a->src, y, 2, a->dstAncho, suma, out, 1); break;
+            case 8: reducirFila(a->src, y, 4, a->dstAncho, suma, out, 0); break;
+            case 9: reducirFila(a->src, y, 4, a->dstAncho, suma, out, 1); break;
+            case 16: reducirFila(a->src, y, 8, a->dstAncho, suma, out, 0); break;
+            default: reducirFila(a->src, y, 8, a->dstAncho, suma, out, 1); break;
+        }
+    }
+    free(suma);
+}
+
+int redimensionarImagenFiltro(ImagenInfo* info, int nuevoAncho, int nuevoAlto, int numHilos, FiltroResize filtro) {
+    if (!info->pixeles) { printf("No hay imagen cargada.\n"); return 0; }
+    if (nuevoAncho <= 0 || nuevoAlto <= 0) { printf("Tamaño invalido.\n"); return 0; }
+    ImagenInfo dst = { nuevoAncho, nuevoAlto, info->canales, 0, NULL, info->profundidad };
+    dst.pixeles = asignarPixeles(nuevoAlto, nuevoAncho, (int)BYTES_PIXEL(info), &dst.stride);
+    if (!dst.pixeles) { fprintf(stderr, "Error al asignar memoria para resize.\n"); return 0; }
+    // El vecino mas proximo no mezcla pixeles: no hace falta premultiplicar.
+    int premultiplicar = filtro != FILTRO_VECINO && TIENE_ALFA(info);
+    if (premultiplicar) premultiplicarAlfa(info, 0, numHilos);
+
+    ResizeArgs args = { info, &dst, nuevoAncho, nuevoAlto, { 0, NULL, NULL }, { 0, NULL, NULL }, NULL, NULL, 0, 0 };
+    int grano = granoFilas(nuevoAncho, info->canales, 1);
+    const char* camino = "2 pasadas";
+
+    // Reduccion por 2, 4 u 8 en ambos ejes con area: la media de bloques es exacta.
+    int f = info->ancho / nuevoAncho;
+    if (filtro == FILTRO_AREA && (f == 2 || f == 4 || f == 8) &&
+        info->ancho == nuevoAncho * f && info->alto == nuevoAlto * f) {
+        args.factor = f;
+        camino = "bloques";
+        numHilos = paraleloFilas(nuevoAlto, grano, numHilos, hiloReduccionEntera, &args);
+    } else {
+        unsigned char* filaUsada = (unsigned char*)calloc(info->alto, 1);
+        int ok = filaUsada && construirTabla(&args.tx, filtro, info->ancho, nuevoAncho) &&
+                 construirTabla(&args.ty, filtro, info->alto, nuevoAlto);
+        if (ok) {
+            size_t tamMuestra = info->profundidad == 16 ? sizeof(int32_t) : sizeof(int16_t);
+            args.tmp = malloc((size_t)info->alto * nuevoAncho * info->canales * tamMuestra);
+            ok = args.tmp != NULL;
+        }
+        if (!ok) {
+            fprintf(stderr, "Error al asignar memoria para resize.\n");
+            free(filaUsada);
+            liberarTabla(&args.tx);
+            liberarTabla(&args.ty);
+            liberarPixelesMem(dst.pixeles);
+            if (premultiplicar) premultiplicarAlfa(info, 1, numHilos);
+            return 0;
+        }
+        // Al reducir con vecino o bilineal la mayoria de filas de origen no se leen.
+        for (int y = 0; y < nuevoAlto; y++) {
+            for (int k = 0; k < args.ty.taps; k++) {
+                if (args.ty.pesos[(size_t)y * args.ty.taps + k]) filaUsada[args.ty.inicio[y] + k] = 1;
+            }
+        }
+        args.filaUsada = filaUsada;
+        numHilos = paraleloFilas(info->alto, granoFilas(nuevoAncho, info->canales, 1), numHilos,
+                                 hiloResizeHorizontal, &args);
+        paraleloFilas(nuevoAlto, grano, numHilos, hiloResizeVertical, &args);
+        free(filaUsada);
+        free(args.tmp);
+        liberarTabla(&args.tx);
+        liberarTabla(&args.ty);
+    }
+    if (atomic_load(&args.error)) {
+        fprintf(stderr, "Error de memoria durante el resize.\n");
+        liberarPixelesMem(dst.pixeles);
+        if (premultiplicar) premultiplicarAlfa(info, 1, numHilos);
+        return 0;
+    }
+
+    reemplazarImagen(info, &dst);
+    if (premultiplicar) premultiplicarAlfa(info, 1, numHilos);
+
+    informar("Imagen redimensionada a %dx%d (%s, %s) con %d hilos.\n", info->ancho, info->alto,
+             nombresFiltro[filtro], camino, numHilos);
+    return 1;
+}
+
+void redimensionarImagen(ImagenInfo* info, int nuevoAncho, int nuevoAlto, int numHilos) {
+    redimensionarImagenFiltro(info, nuevoAncho, nuevoAlto, numHilos, FILTRO_BILINEAL);
+}
+
+//  GRAFO DE OPERACIONES
+
+// Lista de operaciones pendientes sobre una imagen. Los tramos de ajustes puntuales,
+// blur separable y Sobel consecutivos se ejecutan fusionados fila a fila: cada etapa
+// guarda en un anillo solo las filas de su ventana (2r+1), de modo que los intermedios
+// de una porcion quedan en cache y nunca se crea una imagen completa entre etapas.
+// Rotar, redimensionar y el blur por cajas cortan el tramo y se ejecutan aparte.
+
+#define MAX_ETAPAS_FUSION 16
+
+typedef enum {
+    PASO_PUNTUAL,
+    PASO_BLUR,
+    PASO_ROTAR,
+    PASO_SOBEL,
+    PASO_RESIZE,
+    PASO_HISTOGRAMA,
+    PASO_MEDIANA,
+    PASO_INTEGRAL,
+    PASO_CONVOLUCION
+} TipoPaso;
+
+typedef struct {
+    TipoPaso tipo;
+    int n[2];                  // blur: kernel; resize: ancho, alto; clahe: teselas; mediana, integral: radio
+    double x;                  // blur: sigma; rotar: grados; histograma, integral: parametro
+    int modo;                  // ModoBlur, FiltroResize, MagnitudSobel... segun el tipo
+    int unCanal;
+    CadenaPuntual cadena;
+    KernelConvolucion* kernel; // convolucion: leido al parsear, se libera con liberarPasos
+} PasoPipeline;
+
+typedef struct {
+    TipoPaso tipo;             // PASO_BLUR o PASO_SOBEL
+    int radio;
+    int canalesEnt, canalesSal;
+    int tamKernel;
+    int* pesos;
+    MagnitudSobel magnitud;
+    const unsigned char* lut;  // ajustes puntuales sobre la salida, o NULL
+} EtapaFusion;
+
+typedef struct {
+    const ImagenInfo* src;
+    ImagenInfo* dst;
+    int alto;                  // alto de la imagen completa (src y dst pueden ser solo una franja)
+    int baseSrc, baseDst;      // fila de la imagen que ocupa la fila 0 de src y de dst
+                               // (las porciones de hiloFusion cuentan filas de dst)
+    const unsigned char* lutEntrada;
+    EtapaFusion etapas[MAX_ETAPAS_FUSION];
+    int numEtapas;
+    atomic_int error;
+} FusionArgs;
+
+// Estado de una etapa dentro de una porcion. El anillo guarda filas ya preparadas
+// para la ventana: horizontales en uint16 (blur) o luma en int16 con margen (Sobel).
+typedef struct {
+    void* anillo;
+    size_t paso;               // elementos por fila del anillo
+    int tamAnillo;
+    int siguiente;             // proxima fila de entrada a meter en el anillo (-1: sin empezar)
+    unsigned char* salida;     // ultima fila producida
+    unsigned char* pad;
+    int32_t* acc;
+    const void** filas;
+} EstadoFusion;
+
+static int pasoFusionable(const PasoPipeline* p) {
+    if (p->tipo == PASO_PUNTUAL || p->tipo == PASO_SOBEL) return 1;
+    return p->tipo == PASO_BLUR && resolverModoBlur(p->n[0], (float)p->x, (ModoBlur)p->modo) == BLUR_EXACTO;
+}
+
+static const unsigned char* filaNivel(FusionArgs* a, EstadoFusion* est, int nivel, int y);
+
+// Mete en el anillo de la etapa e las filas de entrada hasta la fila hasta (incluida).
+static void avanzarEtapa(FusionArgs* a, EstadoFusion* est, int e, int hasta) {
+    const EtapaFusion* et = &a->etapas[e];
+    EstadoFusion* s = &est[e + 1];
+    int ancho = a->src->ancho;
+    while (s->siguiente <= hasta) {
+        int j = s->siguiente++;
+        const unsigned char* p = filaNivel(a, est, e, j);
+        size_t slot = (size_t)(j % s->tamAnillo) * s->paso;
+        if (et->tipo == PASO_BLUR) {
+            convFilaH(p, ancho, et->canalesEnt, et->tamKernel, et->pesos, s->pad, s->acc,
+                             (uint16_t*)s->anillo + slot);
+        } else {
+            filaGris(p, ancho, et->canalesEnt, (int16_t*)s->anillo + slot + 1);
+        }
+    }
+}
+
+// Fila y a la salida del nivel indicado: 0 es la imagen de origen y k la salida de la
+// etapa k-1. Las llamadas para un mismo nivel llegan con y creciente.
+static const unsigned char* filaNivel(FusionArgs* a, EstadoFusion* est, int nivel, int y) {
+    int ancho = a->src->ancho;
+    if (nivel == 0) {
+        const unsigned char* p = PIXEL(a->src, y - a->baseSrc, 0);
+        if (!a->lutEntrada) return p;
+        size_t n = (size_t)ancho * a->src->canales;
+        memcpy(est[0].salida, p, n);
+        kernelsPuntuales.lut(est[0].salida, n, a->lutEntrada);
+        return est[0].salida;
+    }
+    int e = nivel - 1;
+    const EtapaFusion* et = &a->etapas[e];
+    EstadoFusion* s = &est[nivel];
+    int alto = a->alto;
+    int r = et->radio;
+    if (s->siguiente < 0) s->siguiente = y - r > 0 ? y - r : 0;
+    avanzarEtapa(a, est, e, y + r < alto - 1 ? y + r : alto - 1);
+
+    for (int k = 0; k < 2 * r + 1; k++) {
+        int j = clampInt(y + k - r, 0, alto - 1);
+        s->filas[k] = (const char*)s->anillo + (size_t)(j % s->tamAnillo) * s->paso *
+                      (et->tipo == PASO_BLUR ? sizeof(uint16_t) : sizeof(int16_t));
+    }
+    if (et->tipo == PASO_BLUR) {
+        convFilaV((const uint16_t* const*)s->filas, ancho * et->canalesEnt, et->tamKernel, et->pesos,
+                         s->acc, s->salida);
+    } else {
+        sobelSalida((const int16_t*)s->filas[0] + 1, (const int16_t*)s->filas[1] + 1,
+                    (const int16_t*)s->filas[2] + 1, ancho, et->magnitud, et->canalesSal, s->pad, s->salida,
+                    NULL);
+    }
+    if (et->lut) kernelsPuntuales.lut(s->salida, (size_t)ancho * et->canalesSal, et->lut);
+    return s->salida;
+}
+
+static void liberarEstadoFusion(EstadoFusion* est, int niveles) {
+    for (int i = 0; i < niveles; i++) {
+        free(est[i].anillo);
+        free(est[i].salida);
+        free(est[i].pad);
+        free(est[i].acc);
+        free(est[i].filas);
+    }
+}
+
+void hiloFusion(void* arg, int inicio, int fin) {
+    FusionArgs* a = (FusionArgs*)arg;
+    int ancho = a->src->ancho;
+    int niveles = a->numEtapas + 1;
+    EstadoFusion est[MAX_ETAPAS_FUSION + 1];
+    memset(est, 0, sizeof(est));
+    int ok = 1;
+    est[0].salida = (unsigned char*)malloc((size_t)ancho * a->src->canales);
+    for (int e = 0; e < a->numEtapas; e++) {
+        const EtapaFusion* et = &a->etapas[e];
+        EstadoFusion* s = &est[e + 1];
+        s->siguiente = -1;
+        s->tamAnillo = 2 * et->radio + 1;
+        if (et->tipo == PASO_BLUR) {
+            s->paso = (size_t)ancho * et->canalesEnt;
+            s->anillo = malloc(s->paso * s->tamAnillo * sizeof(uint16_t));
+            s->pad = (unsigned char*)malloc((size_t)(ancho + et->tamKernel - 1) * et->canalesEnt);
+            s->acc = (int32_t*)malloc(s->paso * sizeof(int32_t));
+        } else {
+            s->paso = (size_t)ancho + 2;
+            s->anillo = malloc(s->paso * s->tamAnillo * sizeof(int16_t));
+            s->pad = (unsigned char*)malloc(ancho);
+            s->acc = (int32_t*)malloc(sizeof(int32_t));
+        }
+        s->salida = (unsigned char*)malloc((size_t)ancho * et->canalesSal);
+        s->filas = (const void**)malloc(s->tamAnillo * sizeof(void*));
+        ok = ok && s->anillo && s->pad && s->acc && s->salida && s->filas;
+    }
+    if (!ok || !est[0].salida) {
+        atomic_store(&a->error, 1);
+        liberarEstadoFusion(est, niveles);
+        return;
+    }
+    // La ultima etapa escribe directamente en el destino; sin etapas ni LUT, se copia.
+    EstadoFusion* ultima = &est[a->numEtapas];
+    unsigned char* propia = ultima->salida;
+    size_t bytesSal = (size_t)ancho * a->dst->canales;
+    for (int y = inicio; y < fin; y++) {
+        ultima->salida = PIXEL(a->dst, y, 0);
+        const unsigned char* f = filaNivel(a, est, a->numEtapas, y + a->baseDst);
+        if (f != ultima->salida) memcpy(ultima->salida, f, bytesSal);
+    }
+    ultima->salida = propia;
+    liberarEstadoFusion(est, niveles);
+}
+
+// Prepara las etapas de pasos[0..n) (todos fusionables) sobre una entrada de canales
+// canales. Devuelve los canales de salida, o 0 sin memoria para los kernels.
+static int prepararFusion(FusionArgs* args, const PasoPipeline* pasos, int n, int canales) {
+    memset(args, 0, sizeof(*args));
+    pthread_once(&convOnce, elegirKernelConv);
+    pthread_once(&sobelOnce, elegirKernelSobel);
+    pthread_once(&kernelsPuntualesOnce, elegirKernelsPuntuales);
+    int ok = 1;
+    for (int i = 0; i < n; i++) {
+        const PasoPipeline* p = &pasos[i];
+        if (p->tipo == PASO_PUNTUAL) {
+            if (args->numEtapas == 0) args->lutEntrada = p->cadena.lut;
+            else args->etapas[args->numEtapas - 1].lut = p->cadena.lut;
+            continue;
+        }
+        EtapaFusion* et = &args->etapas[args->numEtapas++];
+        et->tipo = p->tipo;
+        et->canalesEnt = canales;
+        if (p->tipo == PASO_BLUR) {
+            float* kernel = generarKernelGaussiano(p->n[0], (float)p->x);
+            et->pesos = kernel ? kernelAPuntoFijo(kernel, p->n[0]) : NULL;
+            free(kernel);
+            ok = ok && et->pesos;
+            et->tamKernel = p->n[0];
+            et->radio = p->n[0] / 2;
+        } else {
+            et->radio = 1;
+            et->magnitud = (MagnitudSobel)p->modo;
+            if (p->unCanal) canales = 1;
+        }
+        et->canalesSal = canales;
+    }
+    return ok ? canales : 0;
+}
+
+static void liberarFusion(FusionArgs* args) {
+    for (int e = 0; e < args->numEtapas; e++) free(args->etapas[e].pesos);
+}
+
+// Filas de entrada que necesita cada fila de salida por encima y por debajo.
+static int haloFusion(const FusionArgs* args) {
+    int halo = 0;
+    for (int e = 0; e < args->numEtapas; e++) halo += args->etapas[e].radio;
+    return halo;
+}
+
+// Ejecuta pasos[0..n) (todos fusionables, al menos uno de vecindad) en una sola pasada.
+static int ejecutarFusion(ImagenInfo* info, const PasoPipeline* pasos, int n, int numHilos) {
+    FusionArgs args;
+    int canales = prepararFusion(&args, pasos, n, info->canales);
+    args.src = info;
+    args.alto = info->alto;
+    int ok = canales > 0;
+
+    ImagenInfo dst = { info->ancho, info->alto, canales, 0, NULL, 8 };
+    dst.pixeles = ok ? asignarPixeles(dst.alto, dst.ancho, canales, &dst.stride) : NULL;
+    if (dst.pixeles) {
+        args.dst = &dst;
+        // Cada porcion vuelve a calcular el halo de todas las etapas: porciones de al menos
+        // 16 veces la suma de radios para que sea poco trabajo extra.
+        numHilos = paraleloFilas(info->alto, granoFilas(info->ancho, info->canales, 16 * haloFusion(&args)),
+                                 numHilos, hiloFusion, &args);
+        ok = !atomic_load(&args.error);
+    } else {
+        ok = 0;
+    }
+    liberarFusion(&args);
+    if (!ok) {
+        fprintf(stderr, "Error de memoria en la cadena fusionada.\n");
+        liberarPixelesMem(dst.pixeles);
+        return 0;
+    }
+    reemplazarImagen(info, &dst);
+    informar("Cadena fusionada de %d operacion(es) aplicada por porciones con %d hilos.\n", n, numHilos);
+    return 1;
+}
+
+static void nombrePaso(const PasoPipeline* p, char* nombre, size_t tam) {
+    switch (p->tipo) {
+        case PASO_PUNTUAL:
+            snprintf(nombre, tam, "ajustes puntuales (%d)", p->cadena.numAjustes);
+            break;
+        case PASO_BLUR:
+            snprintf(nombre, tam, "blur %d:%.2f", p->n[0], p->x);
+            break;
+        case PASO_ROTAR:
+            snprintf(nombre, tam, "rotar %.2f", p->x);
+            break;
+        case PASO_SOBEL:
+            snprintf(nombre, tam, "sobel %s%s", p->modo == SOBEL_L1 ? "l1" : "l2", p->unCanal ? " gris" : "");
+            break;
+        case PASO_RESIZE:
+            snprintf(nombre, tam, "resize %dx%d %s", p->n[0], p->n[1], nombresFiltro[p->modo]);
+            break;
+        case PASO_HISTOGRAMA:
+            if (p->modo == HIST_ECUALIZAR) snprintf(nombre, tam, "ecualizar");
+            else if (p->modo == HIST_CLAHE) snprintf(nombre, tam, "clahe %d:%.2f", p->n[0], p->x);
+            else snprintf(nombre, tam, "auto-niveles %.2f%%", p->x);
+            break;
+        case PASO_MEDIANA:
+            snprintf(nombre, tam, "mediana r=%d", p->n[0]);
+            break;
+        case PASO_INTEGRAL:
+            if (p->modo == INTEGRAL_CAJA) snprintf(nombre, tam, "caja r=%d", p->n[0]);
+            else if (p->modo == INTEGRAL_DESVIACION) snprintf(nombre, tam, "desviacion local r=%d", p->n[0]);
+            else snprintf(nombre, tam, "umbral adaptativo r=%d k=%.2f", p->n[0], p->x);
+            break;
+        case PASO_CONVOLUCION:
+            snprintf(nombre, tam, "convolucion %s", p->kernel->nombre);
+            break;
+    }
+}
+
+static int ejecutarPaso(ImagenInfo* img, const PasoPipeline* p, int numHilos) {
+    switch (p->tipo) {
+        case PASO_PUNTUAL:
+            aplicarCadenaPuntual(img, &p->cadena, numHilos);
+            return 1;
+        case PASO_BLUR:
+            return aplicarConvolucionGaussianaModo(img, p->n[0], (float)p->x, numHilos, (ModoBlur)p->modo);
+        case PASO_ROTAR:
+            return rotarImagenRelleno(img, p->x, numHilos, (const unsigned char[4]){ 0, 0, 0, 0 });
+        case PASO_SOBEL:
+            return detectarBordesSobelModo(img, numHilos, (MagnitudSobel)p->modo, p->unCanal);
+        case PASO_RESIZE:
+            return redimensionarImagenFiltro(img, p->n[0], p->n[1], numHilos, (FiltroResize)p->modo);
+        case PASO_HISTOGRAMA:
+            return aplicarHistograma(img, (OperacionHistograma)p->modo, p->n[0], p->x, numHilos);
+        case PASO_MEDIANA:
+            return aplicarMediana(img, p->n[0], numHilos);
+        case PASO_INTEGRAL:
+            return aplicarFiltroIntegral(img, (OperacionIntegral)p->modo, p->n[0], p->x, numHilos);
+        case PASO_CONVOLUCION:
+            return aplicarConvolucionGeneral(img, p->kernel, numHilos);
+    }
+    return 0;
+}
+
+// Aplica los pasos en orden informando el tiempo de cada etapa; con fusionar, los
+// tramos fusionables cuentan como una sola etapa. Devuelve 0 si alguna falla.
+int ejecutarPasos(ImagenInfo* img, const PasoPipeline* pasos, int numPasos, int numHilos, int fusionar) {
+    int etapa = 0;
+    for (int i = 0; i < numPasos;) {
+        int n = 1;
+        // Las etapas fusionadas trabajan con grises o RGB de 8 bits; los pasos pueden cambiar
+        // los canales, asi que se mira la imagen al empezar cada tramo.
+        if (fusionar && img->profundidad != 16 && !TIENE_ALFA(img)) {
+            int vecindad = 0;
+            while (i + n <= numPasos && n <= MAX_ETAPAS_FUSION && pasoFusionable(&pasos[i + n - 1])) {
+                vecindad += pasos[i + n - 1].tipo != PASO_PUNTUAL;
+                n++;
+            }
+            n--;
+            // Sin etapa de vecindad (o con una sola sin puntuales) no hay nada que fusionar.
+            if (vecindad == 0 || n < 2) n = 1;
+        }
+
+        char nombre[256] = "";
+        for (int k = 0; k < n; k++) {
+            size_t usado = strlen(nombre);
+            if (k) usado += snprintf(nombre + usado, sizeof(nombre) - usado, " + ");
+            if (usado < sizeof(nombre)) nombrePaso(&pasos[i + k], nombre + usado, sizeof(nombre) - usado);
+        }
+        abrirEstadisticas(nombre);
+        double t0 = ahoraSeg();
+        long long entrada = (long long)img->alto * img->ancho * BYTES_PIXEL(img);
+        int ok = n > 1 ? ejecutarFusion(img, pasos + i, n, numHilos) : ejecutarPaso(img, &pasos[i], numHilos);
+        anotarTrafico(entrada + (long long)img->alto * img->ancho * BYTES_PIXEL(img));
+        cerrarEstadisticas();
+        etapa++;
+        if (!ok) {
+            fprintf(stderr, "Fallo la etapa %d (%s).\n", etapa, nombre);
+            return 0;
+        }
+        informar("[etapa %d] %s: %.3f s\n", etapa, nombre, ahoraSeg() - t0);
+        i += n;
+    }
+    return 1;
+}
+
+//  ARGUMENTOS
+
+#define SALIDA_ERROR 1      // fallo al cargar, procesar o guardar
+#define SALIDA_USO 2        // argumentos invalidos
+
+static int leerEntero(const char* s, int* v) {
+    char* fin;
+    errno = 0;
+    long l = strtol(s, &fin, 10);
+    if (fin == s || *fin || errno || l < INT_MIN || l > INT_MAX) return 0;
+    *v = (int)l;
+    return 1;
+}
+
+static int leerReal(const char* s, double* v) {
+    char* fin;
+    errno = 0;
+    *v = strtod(s, &fin);
+    return fin != s && !*fin && !errno && isfinite(*v);
+}
+
+// Parte s en hasta max campos separados por sep, sobre una copia en buf.
+static int partirCampos(const char* s, char sep, char* buf, size_t tamBuf, char** campos, int max) {
+    if (strlen(s) >= tamBuf) return 0;
+    strcpy(buf, s);
+    int n = 0;
+    char* p = buf;
+    while (n < max) {
+        campos[n++] = p;
+        p = strchr(p, sep);
+        if (!p) return n;
+        *p++ = 0;
+    }
+    return -1;
+}
+
+// Con IMG_SIN_MAIN definido el fichero se puede incluir desde otro programa (img_bench.c)
+// sin el menu, la linea de comandos ni main.
+#ifndef IMG_SIN_MAIN
+
+//  HISTORIAL DE VERSIONES
+
+// Deshacer y rehacer en el menu. Cada version guarda la imagen en teselas de
+// TAM_TESELA x TAM_TESELA pixeles con contador de referencias. Al registrar una version
+// cada tesela se compara con la misma de la version anterior y, si no cambio, se
+// comparte, asi que un paso cuesta la memoria de las teselas que cambiaron: nada si la
+// operacion deja una zona igual (fondos planos, bordes de relleno, un ajuste que no
+// toca ciertos tonos) y la imagen entera si cambia de tamano. Si las teselas pasan del
+// limite (IMG_HISTORY_MB, 0 lo desactiva) se descartan las versiones mas antiguas,
+// nunca la actual. La imagen de trabajo sigue siendo un buffer contiguo para los filtros.
+
+#define TAM_TESELA 64
+#define LIMITE_HISTORIAL_MB 256
+#define MAX_NOMBRE_VERSION 96
+
+typedef struct {
+    int refs;               // versiones que la usan; solo la toca el hilo del menu
+    size_t bytes;           // lo que ocupa, cabecera incluida
+    unsigned char datos[];  // filas de la tesela, empaquetadas
+} Tesela;
+
+typedef struct {
+    int ancho, alto, canales, profundidad;
+    int teselasX, teselasY;
+    Tesela** teselas;       // por filas de teselas
+    size_t bytesNuevos;     // teselas que no comparte con la version anterior
+    char nombre[MAX_NOMBRE_VERSION];
+} VersionImagen;
+
+typedef struct {
+    VersionImagen** versiones;
+    int num, cap;
+    int actual;             // version que hay en la imagen de trabajo (-1 = ninguna)
+    size_t bytes;           // teselas vivas de todas las versiones
+    size_t limite;          // en bytes; 0 = sin historial
+} Historial;
+
+// Limite de IMG_HISTORY_MB (en MB) o LIMITE_HISTORIAL_MB.
+void iniciarHistorial(Historial* h) {
+    memset(h, 0, sizeof(*h));
+    h->actual = -1;
+    int mb = LIMITE_HISTORIAL_MB;
+    const char* env = getenv("IMG_HISTORY_MB");
+    if (env && (!leerEntero(env, &mb) || mb < 0)) {
+        fprintf(stderr, "IMG_HISTORY_MB no valido: %s (se usan %d MB)\n", env, LIMITE_HISTORIAL_MB);
+        mb = LIMITE_HISTORIAL_MB;
+    }
+    h->limite = (size_t)mb << 20;
+}
+
+static void soltarTesela(Historial* h, Tesela* t) {
+    if (!t || --t->refs > 0) return;
+    h->bytes -= t->bytes;
+    free(t);
+}
+
+static void liberarVersion(Historial* h, VersionImagen* v) {
+    if (!v) return;
+    if (v->teselas) {
+        for (int i = 0; i < v->teselasX * v->teselasY; i++) soltarTesela(h, v->teselas[i]);
+        free(v->teselas);
+    }
+    free(v);
+}
+
+// Descarta las versiones posteriores a la actual (lo que se podia rehacer).
+static void cortarRehacer(Historial* h) {
+    while (h->num > h->actual + 1) liberarVersion(h, h->versiones[--h->num]);
+}
+
+void vaciarHistorial(Historial* h) {
+    h->actual = -1;
+    cortarRehacer(h);
+    free(h->versiones);
+    h->versiones = NULL;
+    h->cap = 0;
+}
+
+typedef struct {
+    const ImagenInfo* img;
+    VersionImagen* v;
+    const VersionImagen* previa;    // con la misma geometria, o NULL
+    atomic_llong bytesNuevos;
+    atomic_int fallo;
+} InstantaneaArgs;
+
+// Rectangulo de la tesela (tx, ty) en pixeles.
+static void rectanguloTesela(const VersionImagen* v, int tx, int ty, int* x0, int* y0, int* w, int* h) {
+    *x0 = tx * TAM_TESELA;
+    *y0 = ty * TAM_TESELA;
+    *w = v->ancho - *x0 < TAM_TESELA ? v->ancho - *x0 : TAM_TESELA;
+    *h = v->alto - *y0 < TAM_TESELA ? v->alto - *y0 : TAM_TESELA;
+}
+
+// Cada porcion es un rango de filas de teselas: las referencias de una tesela previa
+// solo las toca la porcion de su posicion.
+static void hiloInstantanea(void* args, int inicio, int fin) {
+    InstantaneaArgs* a = (InstantaneaArgs*)args;
+    VersionImagen* v = a->v;
+    size_t bpp = BYTES_PIXEL(a->img);
+    long long nuevos = 0;
+    for (int ty = inicio; ty < fin && !atomic_load(&a->fallo); ty++) {
+        for (int tx = 0; tx < v->teselasX; tx++) {
+            int x0, y0, w, h;
+            rectanguloTesela(v, tx, ty, &x0, &y0, &w, &h);
+            size_t bytesFila = (size_t)w * bpp;
+            const unsigned char* origen = a->img->pixeles + (size_t)y0 * a->img->stride + (size_t)x0 * bpp;
+            Tesela* previa = a->previa ? a->previa->teselas[ty * v->teselasX + tx] : NULL;
+            int igual = previa != NULL;
+            for (int y = 0; y < h && igual; y++) {
+                igual = !memcmp(previa->datos + y * bytesFila, origen + (size_t)y * a->img->stride, bytesFila);
+            }
+            if (igual) {
+                previa->refs++;
+                v->teselas[ty * v->teselasX + tx] = previa;
+                continue;
+            }
+            size_t bytes = sizeof(Tesela) + bytesFila * h;
+            Tesela* t = (Tesela*)malloc(bytes);
+            if (!t) {
+                atomic_store(&a->fallo, 1);
+                break;
+            }
+            t->refs = 1;
+            t->bytes = bytes;
+            for (int y = 0; y < h; y++) memcpy(t->datos + y * bytesFila, origen + (size_t)y * a->img->stride, bytesFila);
+            v->teselas[ty * v->teselasX + tx] = t;
+            nuevos += (long long)bytes;
+        }
+    }
+    atomic_fetch_add(&a->bytesNuevos, nuevos);
+}
+
+void informarHistorial(const Historial* h) {
+    if (h->actual < 0) return;
+    const VersionImagen* v = h->versiones[h->actual];
+    informar("Historial: version %d de %d (%s) | %.1f MB en teselas de %.0f MB | este paso añadió %.1f MB\n",
+             h->actual + 1, h->num, v->nombre, h->bytes / 1048576.0, h->limite / 1048576.0,
+             v->bytesNuevos / 1048576.0);
+}
+
+// Registra img como nueva version actual (tras cargar o tras una operacion). Devuelve 0
+// si no hay memoria; la imagen de trabajo no cambia en ningun caso.
+int registrarVersion(Historial* h, const ImagenInfo* img, const char* nombre, int numHilos) {
+    if (h->limite == 0 || !img->pixeles) return 1;
+    if (numHilos < 1) numHilos = hilosPorDefecto();
+    cortarRehacer(h);
+    if (h->num == h->cap) {
+        int cap = h->cap ? h->cap * 2 : 16;
+        VersionImagen** nuevas = (VersionImagen**)realloc(h->versiones, (size_t)cap * sizeof(VersionImagen*));
+        if (!nuevas) return 0;
+        h->versiones = nuevas;
+        h->cap = cap;
+    }
+    VersionImagen* v = (VersionImagen*)calloc(1, sizeof(VersionImagen));
+    if (!v) return 0;
+    v->ancho = img->ancho;
+    v->alto = img->alto;
+    v->canales = img->canales;
+    v->profundidad = img->profundidad;
+    v->teselasX = (img->ancho + TAM_TESELA - 1) / TAM_TESELA;
+    v->teselasY = (img->alto + TAM_TESELA - 1) / TAM_TESELA;
+    snprintf(v->nombre, sizeof(v->nombre), "%s", nombre);
+    v->teselas = (Tesela**)calloc((size_t)v->teselasX * v->teselasY, sizeof(Tesela*));
+    if (!v->teselas) {
+        free(v);
+        return 0;
+    }
+
+    const VersionImagen* previa = h->actual >= 0 ? h->versiones[h->actual] : NULL;
+    if (previa && (previa->ancho != v->ancho || previa->alto != v->alto || previa->canales != v->canales ||
+                   previa->profundidad != v->profundidad)) {
+        previa = NULL;
+    }
+    InstantaneaArgs a = { img, v, previa, 0, 0 };
+    paraleloFilas(v->teselasY, 1, numHilos, hiloInstantanea, &a);
+    v->bytesNuevos = (size_t)atomic_load(&a.bytesNuevos);
+    h->bytes += v->bytesNuevos;
+    if (atomic_load(&a.fallo)) {
+        liberarVersion(h, v);
+        fprintf(stderr, "Sin memoria para el historial: este paso no se podra deshacer.\n");
+        return 0;
+    }
+    h->versiones[h->num++] = v;
+    h->actual = h->num - 1;
+
+    // Por encima del limite se descartan las mas antiguas; la actual se queda aunque no quepa.
+    int descartadas = 0;
+    while (h->bytes > h->limite && h->actual > 0) {
+        liberarVersion(h, h->versiones[0]);
+        memmove(h->versiones, h->versiones + 1, (size_t)(h->num - 1) * sizeof(VersionImagen*));
+        h->num--;
+        h->actual--;
+        descartadas++;
+    }
+    if (descartadas) informar("Historial: %d version(es) antigua(s) descartada(s) por el limite.\n", descartadas);
+    informarHistorial(h);
+    return 1;
+}
+
+typedef struct {
+    const VersionImagen* v;
+    ImagenInfo* dst;
+} RestaurarArgs;
+
+static void hiloRestaurarVersion(void* args, int inicio, int fin) {
+    RestaurarArgs* a = (RestaurarArgs*)args;
+    size_t bpp = BYTES_PIXEL(a->dst);
+    for (int ty = inicio; ty < fin; ty++) {
+        for (int tx = 0; tx < a->v->teselasX; tx++) {
+            int x0, y0, w, h;
+            rectanguloTesela(a->v, tx, ty, &x0, &y0, &w, &h);
+            const Tesela* t = a->v->teselas[ty * a->v->teselasX + tx];
+            size_t bytesFila = (size_t)w * bpp;
+            for (int y = 0; y < h; y++) {
+                memcpy(a->dst->pixeles + (size_t)(y0 + y) * a->dst->stride + (size_t)x0 * bpp,
+                       t->datos + y * bytesFila, bytesFila);
+            }
+        }
+    }
+}
+
+// Reconstruye la version indice en img y la hace la actual.
+static int restaurarVersion(Historial* h, ImagenInfo* img, int indice) {
+    const VersionImagen* v = h->versiones[indice];
+    ImagenInfo dst = { v->ancho, v->alto, v->canales, 0, NULL, v->profundidad };
+    dst.pixeles = asignarPixeles(v->alto, v->ancho, (int)BYTES_PIXEL(&dst), &dst.stride);
+    if (!dst.pixeles) {
+        fprintf(stderr, "Sin memoria para restaurar la version.\n");
+        return 0;
+    }
+    RestaurarArgs a = { v, &dst };
+    paraleloFilas(v->teselasY, 1, hilosPorDefecto(), hiloRestaurarVersion, &a);
+    reemplazarImagen(img, &dst);
+    h->actual = indice;
+    informarHistorial(h);
+    return 1;
+}
+
+int deshacer(Historial* h, ImagenInfo* img) {
+    if (h->actual <= 0) {
+        printf("No hay nada que deshacer.\n");
+        return 0;
+    }
+    return restaurarVersion(h, img, h->actual - 1);
+}
+
+int rehacer(Historial* h, ImagenInfo* img) {
+    if (h->actual < 0 || h->actual >= h->num - 1) {
+        printf("No hay nada que rehacer.\n");
+        return 0;
+    }
+    return restaurarVersion(h, img, h->actual + 1);
+}
+
+//  MENÚ E INTERFAZ
+
+void mostrarMenu() {
+    printf("\n--- Plataforma de Edición de Imágenes ---\n");
+    printf("1. Cargar imagen PNG\n");
+    printf("2. Mostrar matriz de píxeles\n");
+    printf("3. Guardar como PNG\n");
+    printf("4. Ajustes puntuales (brillo, contraste, gamma, invertir, niveles)\n");
+    printf("5. Aplicar convolucion Gaussiana (blur)\n");
+    printf("6. Rotar imagen (grados, bilinear)\n");
+    printf("7. Detectar bordes (Sobel)\n");
+    printf("8. Redimensionar imagen (vecino, bilineal, area, Lanczos3)\n");
+    printf("9. Histograma (ver, ecualizar, CLAHE, auto-niveles)\n");
+    printf("10. Filtro de mediana (quitar ruido)\n");
+    printf("11. Imagen integral (caja, desviacion local, umbral adaptativo)\n");
+    printf("12. Convolucion con kernel (enfocar, relieve, movimiento, fichero)\n");
+    printf("13. Deshacer\n");
+    printf("14. Rehacer\n");
+    printf("15. Salir\n");
+    printf("Opción: ");
+}
+
+int pedirInt(const char* mensaje) {
+    int val;
+    printf("%s", mensaje);
+    if (scanf("%d", &val) != 1) {
+        while (getchar() != '\n');
+        return INT_MIN;
+    }
+    while (getchar() != '\n');
+    return val;
+}
+
+double pedirDouble(const char* mensaje) {
+    double v;
+    printf("%s", mensaje);
+    if (scanf("%lf", &v) != 1) {
+        while (getchar() != '\n');
+        return NAN;
+    }
+    while (getchar() != '\n');
+    return v;
+}
+
+// Pide ajustes hasta que el usuario elige aplicar; devuelve 0 si se cancela.
+int pedirCadenaPuntual(CadenaPuntual* cadena) {
+    while (1) {
+        printf("\n--- Ajustes puntuales (se combinan en una sola pasada) ---\n");
+        printf("1. Brillo (+/- valor)\n");
+        printf("2. Contraste (factor, 1.0 = sin cambio)\n");
+        printf("3. Gamma (> 0, 1.0 = sin cambio)\n");
+        printf("4. Invertir\n");
+        printf("5. Niveles\n");
+        printf("6. Aplicar (%d ajuste(s))\n", cadena->numAjustes);
+        printf("7. Cancelar\n");
+        int op = pedirInt("Opción: ");
+        switch (op) {
+            case 1: {
+                int delta = pedirInt("Valor de ajuste de brillo (+ para más claro, - para más oscuro): ");
+                if (delta == INT_MIN) { printf("Entrada invalida.\n"); break; }
+                componerBrillo(cadena, delta);
+                break;
+            }
+            case 2: {
+                double f = pedirDouble("Factor de contraste (e.g., 1.5): ");
+                if (isnan(f) || f < 0.0) { printf("Entrada invalida.\n"); break; }
+                componerContraste(cadena, f);
+                break;
+            }
+            case 3: {
+                double g = pedirDouble("Gamma (e.g., 2.2): ");
+                if (isnan(g) || g <= 0.0) { printf("Entrada invalida.\n"); break; }
+                componerGamma(cadena, g);
+                break;
+            }
+            case 4:
+                componerInvertir(cadena);
+                break;
+            case 5: {
+                int ne = pedirInt("Negro de entrada (0-255): ");
+                int be = pedirInt("Blanco de entrada (0-255): ");
+                double g = pedirDouble("Gamma de medios tonos (1.0 = lineal): ");
+                int ns = pedirInt("Negro de salida (0-255): ");
+                int bs = pedirInt("Blanco de salida (0-255): ");
+                if (ne < 0 || be > 255 || ne >= be || isnan(g) || g <= 0.0 || ns < 0 || ns > 255 || bs < 0 || bs > 255) {
+                    printf("Entrada invalida.\n");
+                    break;
+                }
+                componerNiveles(cadena, ne, be, g, ns, bs);
+                break;
+            }
+            case 6:
+                return 1;
+            case 7:
+                return 0;
+            default:
+                printf("Opción inválida.\n");
+        }
+    }
+}
+
+//  PIPELINE POR LINEA DE COMANDOS
+
+// img entrada.png [operaciones...] [--threads N] [-o salida.png]
+// Las operaciones se aplican en el orden dado, sin menu. Los ajustes puntuales
+// consecutivos se componen en una sola LUT y la cadena se ejecuta con ejecutarPasos.
+
+#define PRESUPUESTO_FRANJAS_MB 256
+#define EJECUTORES_SERVIDOR 2       // trabajos a la vez en --serve sin --workers
+
+typedef struct {
+    const char* entrada;
+    const char* salida;
+    int numHilos;              // 0 = uno por nucleo
+    int fusionar;              // tramos de puntuales, blur y Sobel en una sola pasada
+    const char* lote;          // directorio o lista de ficheros (--batch); salida es entonces un directorio
+    int decodificadores, filtros, codificadores;   // hilos por fase del lote (0 = uno por nucleo)
+    int enVuelo;               // imagenes cargadas a la vez como maximo (0 = automatico)
+    int franjas;               // --stream: entrada PPM/PGM leida y escrita por franjas
+    int presupuestoMB;         // memoria para las franjas (0 = PRESUPUESTO_FRANJAS_MB)
+    int arena;                 // buffers de pixeles reutilizados entre operaciones
+    int numa;                  // --numa: imagenes colocadas por franjas en el nodo de su trabajador
+    const char* servidor;      // --serve: socket Unix en el que se atienden trabajos
+} OpcionesPipeline;
+
+static void mostrarUso(const char* prog) {
+    printf("Uso: %s entrada.png [operaciones...] [--threads N] [-o salida.png]\n", prog);
+    printf("     %s --batch DIR|LISTA [operaciones...] -o DIR_SALIDA [opciones de lote]\n", prog);
+    printf("     %s --serve SOCKET [--threads N] [--workers N]\n", prog);
+    printf("     %s --client SOCKET [--repeat N] [--clients C] [--baseline] entrada [operaciones...] -o salida\n",
+           prog);
+    printf("Sin operaciones se abre el menu interactivo.\n\n");
+    printf("Operaciones (se aplican en orden):\n");
+    printf("  --blur K:S[:exacto|cajas]     convolucion Gaussiana, kernel K impar y sigma S\n");
+    printf("  --rotate GRADOS               rotacion con relleno negro\n");
+    printf("  --sobel[=l1][,gris]           bordes; l1 = |gx|+|gy|, gris = salida de un canal\n");
+    printf("  --median R                    mediana en una ventana de (2R+1)x(2R+1), R de 1 a %d\n", RADIO_MAX_MEDIANA);
+    printf("  --box R                       media de la ventana de (2R+1)x(2R+1), coste independiente de R\n");
+    printf("  --local-stddev R              desviacion tipica de cada ventana (mapa de textura)\n");
+    printf("  --threshold R[:K]             umbral adaptativo de Sauvola sobre la luma (K defecto %.1f)\n", K_SAUVOLA);
+    printf("  --convolve KERNEL             sharpen, emboss, motion:L[:GRADOS] o fichero con una matriz NxN\n");
+    printf("  --resize AxB[:filtro]         filtro: vecino, bilineal, area, lanczos3\n");
+    printf("  --brightness N                brillo (+/-)\n");
+    printf("  --contrast F                  contraste (1.0 = sin cambio)\n");
+    printf("  --gamma G                     gamma (> 0)\n");
+    printf("  --invert                      invertir\n");
+    printf("  --levels NE:BE:G:NS:BS        niveles de entrada, gamma y niveles de salida\n");
+    printf("  --equalize                    ecualizacion del histograma\n");
+    printf("  --clahe[=N[:L]]               ecualizacion local en NxN teselas con limite L (defecto %d:%.1f)\n",
+           TESELAS_CLAHE, LIMITE_CLAHE);
+    printf("  --autolevels[=P]              estira el rango recortando P %% por extremo (defecto %.1f)\n",
+           RECORTE_AUTONIVELES);
+    printf("Opciones:\n");
+    printf("  --threads N                   hilos por etapa (0 = todos los nucleos)\n");
+    printf("  --no-fuse                     una pasada completa por operacion, sin fusionar\n");
+    printf("  --no-arena                    reserva y libera cada imagen en lugar de reutilizar buffers\n");
+    printf("  -o, --output RUTA             salida: .png, .qoi, o .ppm/.pgm/.raw sin comprimir (directorio con --batch)\n");
+    printf("  --png-level N                 compresion PNG de 0 a 9 (1 = la mas rapida, defecto 6)\n");
+    printf("  --stats[=json]                desglose de tiempos, hilos y memoria por operacion en stderr\n");
+    printf("                                (tambien IMG_STATS=1|json en el entorno, valido en el menu)\n");
+    printf("  --affinity[=compacta]         fija cada hilo del pool a un nucleo; por defecto reparte los\n");
+    printf("                                hilos entre nodos NUMA (tambien IMG_AFFINITY en el entorno)\n");
+    printf("  --numa                        coloca cada franja de filas en el nodo del hilo que la calcula\n");
+    printf("                                (primer toque; implica --affinity)\n");
+    printf("Imagenes mayores que la memoria:\n");
+    printf("  --stream                      lee un PPM/PGM por franjas y escribe cada franja al terminarla\n");
+    printf("                                (solo ajustes puntuales, blur exacto y Sobel; salida .ppm/.pgm/.png)\n");
+    printf("  --mem-budget MB               memoria para las franjas (defecto %d)\n", PRESUPUESTO_FRANJAS_MB);
+    printf("Lotes:\n");
+    printf("  --batch DIR|LISTA             todas las imagenes de DIR o las rutas de LISTA (una por linea)\n");
+    printf("  --decoders N                  hilos de carga (0 = uno por nucleo)\n");
+    printf("  --workers N                   hilos de filtrado; cada uno con --threads hilos (defecto 1)\n");
+    printf("  --encoders N                  hilos de guardado (0 = uno por nucleo)\n");
+    printf("  --in-flight N                 imagenes en memoria a la vez como maximo\n");
+    printf("Servidor:\n");
+    printf("  --serve SOCKET                atiende trabajos (una linea con entrada, operaciones y -o) en un\n");
+    printf("                                socket Unix; --workers trabajos a la vez (defecto %d)\n",
+           EJECUTORES_SERVIDOR);
+    printf("  --client SOCKET               envia el trabajo N veces desde C conexiones y mide la latencia;\n");
+    printf("                                --baseline la compara con un proceso por trabajo\n");
+    printf("  shm:NOMBRE                    como ruta de entrada o salida: /dev/shm/NOMBRE (usar .raw)\n");
+    printf("Codigos de salida: 0 = exito, %d = error de ejecucion, %d = argumentos invalidos.\n",
+           SALIDA_ERROR, SALIDA_USO);
+}
+
+// Devuelve el ajuste puntual al final de la lista, abriendo uno nuevo si hace falta.
+static CadenaPuntual* cadenaAbierta(PasoPipeline* pasos, int* numPasos) {
+    if (*numPasos == 0 || pasos[*numPasos - 1].tipo != PASO_PUNTUAL) {
+        PasoPipeline* p = &pasos[(*numPasos)++];
+        memset(p, 0, sizeof(*p));
+        p->tipo = PASO_PUNTUAL;
+        iniciarCadenaPuntual(&p->cadena);
+    }
+    return &pasos[*numPasos - 1].cadena;
+}
+
+// Interpreta argv[1..]; devuelve 0 y explica el motivo si algo no es valido.
+static int parsearPipeline(int argc, char* argv[], PasoPipeline* pasos, int* numPasos, OpcionesPipeline* op) {
+    char buf[128];
+    char* campos[5];
+    *numPasos = 0;
+    for (int i = 1; i < argc; i++) {
+        char* arg = argv[i];
+        if (arg[0] != '-' || !arg[1]) {
+            if (op->entrada) { fprintf(stderr, "Sobra el argumento: %s\n", arg); return 0; }
+            op->entrada = arg;
+            continue;
+        }
+        // --opcion=valor equivale a --opcion valor
+        char nombre[32];
+        const char* valor = NULL;
+        const char* igual = strchr(arg, '=');
+        size_t largo = igual ? (size_t)(igual - arg) : strlen(arg);
+        if (largo >= sizeof(nombre)) { fprintf(stderr, "Opcion desconocida: %s\n", arg); return 0; }
+        memcpy(nombre, arg, largo);
+        nombre[largo] = 0;
+        if (igual) valor = igual + 1;
+
+        static const char* conValor[] = { "-o", "--output", "--threads", "--blur", "--rotate", "--resize",
+                                          "--brightness", "--contrast", "--gamma", "--levels", "--batch",
+                                          "--decoders", "--workers", "--encoders", "--in-flight", "--mem-budget",
+                                          "--png-level", "--median", "--box",
+                                          "--local-stddev", "--threshold", "--convolve", "--serve" };
+        int sinValor = !strcmp(nombre, "--invert") || !strcmp(nombre, "--sobel") || !strcmp(nombre, "--no-fuse") ||
+                       !strcmp(nombre, "--stats") || !strcmp(nombre, "--stream") || !strcmp(nombre, "--no-arena") ||
+                       !strcmp(nombre, "--affinity") || !strcmp(nombre, "--numa") ||
+                       !strcmp(nombre, "--equalize") || !strcmp(nombre, "--clahe") || !strcmp(nombre, "--autolevels");
+        int conocida = sinValor;
+        for (size_t k = 0; k < sizeof(conValor) / sizeof(conValor[0]); k++) {
+            if (!strcmp(nombre, conValor[k])) conocida = 1;
+        }
+        if (!conocida) { fprintf(stderr, "Opcion desconocida: %s\n", arg); return 0; }
+        if (!sinValor && !valor) {
+            if (i + 1 >= argc) { fprintf(stderr, "Falta el valor de %s\n", nombre); return 0; }
+            valor = argv[++i];
+        }
+
+        if (!strcmp(nombre, "-o") || !strcmp(nombre, "--output")) {
+            op->salida = valor;
+        } else if (!strcmp(nombre, "--no-fuse")) {
+            if (valor) { fprintf(stderr, "--no-fuse no lleva valor.\n"); return 0; }
+            op->fusionar = 0;
+        } else if (!strcmp(nombre, "--no-arena")) {
+            if (valor) { fprintf(stderr, "--no-arena no lleva valor.\n"); return 0; }
+            op->arena = 0;
+        } else if (!strcmp(nombre, "--stats")) {
+            if (!fijarModoEstadisticas(valor)) { fprintf(stderr, "--stats admite tabla o json.\n"); return 0; }
+        } else if (!strcmp(nombre, "--affinity")) {
+            if (!fijarModoAfinidad(valor)) { fprintf(stderr, "--affinity admite dispersa o compacta.\n"); return 0; }
+        } else if (!strcmp(nombre, "--numa")) {
+            if (valor) { fprintf(stderr, "--numa no lleva valor.\n"); return 0; }
+            op->numa = 1;
+        } else if (!strcmp(nombre, "--stream")) {
+            if (valor) { fprintf(stderr, "--stream no lleva valor.\n"); return 0; }
+            op->franjas = 1;
+        } else if (!strcmp(nombre, "--batch")) {
+            op->lote = valor;
+        } else if (!strcmp(nombre, "--serve")) {
+            op->servidor = valor;
+        } else if (!strcmp(nombre, "--png-level")) {
+            int nivel;
+            if (!leerEntero(valor, &nivel) || !fijarNivelPNG(nivel)) {
+                fprintf(stderr, "Nivel PNG invalido (0-9): %s\n", valor);
+                return 0;
+            }
+        } else if (!strcmp(nombre, "--threads") || !strcmp(nombre, "--decoders") || !strcmp(nombre, "--workers") ||
+                   !strcmp(nombre, "--encoders") || !strcmp(nombre, "--in-flight") || !strcmp(nombre, "--mem-budget")) {
+            int* destino = !strcmp(nombre, "--threads") ? &op->numHilos
+                         : !strcmp(nombre, "--decoders") ? &op->decodificadores
+                         : !strcmp(nombre, "--workers") ? &op->filtros
+                         : !strcmp(nombre, "--encoders") ? &op->codificadores
+                         : !strcmp(nombre, "--in-flight") ? &op->enVuelo : &op->presupuestoMB;
+            if (!leerEntero(valor, destino) || *destino < 0) {
+                fprintf(stderr, "Valor invalido para %s: %s\n", nombre, valor);
+                return 0;
+            }
+        } else if (!strcmp(nombre, "--blur")) {
+            PasoPipeline p = { PASO_BLUR, { 0, 0 }, 0.0, BLUR_AUTO, 0, { { 0 }, 0 }, NULL };
+            int n = partirCampos(valor, ':', buf, sizeof(buf), campos, 3);
+            if (n < 2 || !leerEntero(campos[0], &p.n[0]) || p.n[0] < 3 || p.n[0] % 2 == 0 ||
+                !leerReal(campos[1], &p.x) || p.x <= 0.0) {
+                fprintf(stderr, "Blur invalido (K:S con K impar >= 3 y S > 0): %s\n", valor);
+                return 0;
+            }
+            if (n == 3) {
+                if (!strcmp(campos[2], "exacto")) p.modo = BLUR_EXACTO;
+                else if (!strcmp(campos[2], "cajas")) p.modo = BLUR_CAJAS;
+                else { fprintf(stderr, "Modo de blur desconocido: %s\n", campos[2]); return 0; }
+            }
+            pasos[(*numPasos)++] = p;
+        } else if (!strcmp(nombre, "--rotate")) {
+            PasoPipeline p = { PASO_ROTAR, { 0, 0 }, 0.0, 0, 0, { { 0 }, 0 }, NULL };
+            if (!leerReal(valor, &p.x)) { fprintf(stderr, "Angulo invalido: %s\n", valor); return 0; }
+            pasos[(*numPasos)++] = p;
+        } else if (!strcmp(nombre, "--sobel")) {
+            PasoPipeline p = { PASO_SOBEL, { 0, 0 }, 0.0, SOBEL_L2, 0, { { 0 }, 0 }, NULL };
+            int n = valor ? partirCampos(valor, ',', buf, sizeof(buf), campos, 2) : 0;
+            if (n < 0) { fprintf(stderr, "Sobel invalido: %s\n", valor); return 0; }
+            for (int k = 0; k < n; k++) {
+                if (!strcmp(campos[k], "l1")) p.modo = SOBEL_L1;
+                else if (!strcmp(campos[k], "l2")) p.modo = SOBEL_L2;
+                else if (!strcmp(campos[k], "gris")) p.unCanal = 1;
+                else { fprintf(stderr, "Sobel invalido: %s\n", valor); return 0; }
+            }
+            pasos[(*numPasos)++] = p;
+        } else if (!strcmp(nombre, "--median")) {
+            PasoPipeline p = { PASO_MEDIANA, { 0, 0 }, 0.0, 0, 0, { { 0 }, 0 }, NULL };
+            if (!leerEntero(valor, &p.n[0]) || p.n[0] < 1 || p.n[0] > RADIO_MAX_MEDIANA) {
+                fprintf(stderr, "Radio de mediana invalido (1-%d): %s\n", RADIO_MAX_MEDIANA, valor);
+                return 0;
+            }
+            pasos[(*numPasos)++] = p;
+        } else if (!strcmp(nombre, "--box") || !strcmp(nombre, "--local-stddev") || !strcmp(nombre, "--threshold")) {
+            PasoPipeline p = { PASO_INTEGRAL, { 0, 0 }, K_SAUVOLA, INTEGRAL_CAJA, 0, { { 0 }, 0 }, NULL };
+            if (!strcmp(nombre, "--local-stddev")) p.modo = INTEGRAL_DESVIACION;
+            if (!strcmp(nombre, "--threshold")) p.modo = INTEGRAL_UMBRAL;
+            int n = partirCampos(valor, ':', buf, sizeof(buf), campos, p.modo == INTEGRAL_UMBRAL ? 2 : 1);
+            if (n < 1 || !leerEntero(campos[0], &p.n[0]) || p.n[0] < 1 ||
+                (n == 2 && (!leerReal(campos[1], &p.x) || p.x < 0.0 || p.x > 1.0))) {
+                fprintf(stderr, "Valor invalido para %s (R >= 1%s): %s\n", nombre,
+                        p.modo == INTEGRAL_UMBRAL ? ", K de 0 a 1" : "", valor);
+                return 0;
+            }
+            pasos[(*numPasos)++] = p;
+        } else if (!strcmp(nombre, "--convolve")) {
+            PasoPipeline p = { PASO_CONVOLUCION, { 0, 0 }, 0.0, 0, 0, { { 0 }, 0 }, NULL };
+            p.kernel = (KernelConvolucion*)malloc(sizeof(KernelConvolucion));
+            if (!p.kernel || !cargarKernelConvolucion(valor, p.kernel)) {
+                free(p.kernel);
+                return 0;
+            }
+            pasos[(*numPasos)++] = p;
+        } else if (!strcmp(nombre, "--equalize")) {
+            if (valor) { fprintf(stderr, "--equalize no lleva valor.\n"); return 0; }
+            PasoPipeline p = { PASO_HISTOGRAMA, { 0, 0 }, 0.0, HIST_ECUALIZAR, 0, { { 0 }, 0 }, NULL };
+            pasos[(*numPasos)++] = p;
+        } else if (!strcmp(nombre, "--clahe")) {
+            PasoPipeline p = { PASO_HISTOGRAMA, { TESELAS_CLAHE, 0 }, LIMITE_CLAHE, HIST_CLAHE, 0, { { 0 }, 0 }, NULL };
+            int n = valor ? partirCampos(valor, ':', buf, sizeof(buf), campos, 2) : 0;
+            if (n < 0 || (n >= 1 && (!leerEntero(campos[0], &p.n[0]) || p.n[0] < 1 || p.n[0] > 64)) ||
+                (n == 2 && (!leerReal(campos[1], &p.x) || p.x < 1.0))) {
+                fprintf(stderr, "CLAHE invalido (N:L con N de 1 a 64 y L >= 1): %s\n", valor);
+                return 0;
+            }
+            pasos[(*numPasos)++] = p;
+        } else if (!strcmp(nombre, "--autolevels")) {
+            PasoPipeline p = { PASO_HISTOGRAMA, { 0, 0 }, RECORTE_AUTONIVELES, HIST_AUTONIVELES, 0, { { 0 }, 0 }, NULL };
+            if (valor && (!leerReal(valor, &p.x) || p.x < 0.0 || p.x >= 50.0)) {
+                fprintf(stderr, "Recorte invalido (0 <= P < 50): %s\n", valor);
+                return 0;
+            }
+            pasos[(*numPasos)++] = p;
+        } else if (!strcmp(nombre, "--resize")) {
+            PasoPipeline p = { PASO_RESIZE, { 0, 0 }, 0.0, FILTRO_BILINEAL, 0, { { 0 }, 0 }, NULL };
+            int n = partirCampos(valor, ':', buf, sizeof(buf), campos, 2);
+            char* x = n >= 1 ? strchr(campos[0], 'x') : NULL;
+            if (x) *x = 0;
+            if (!x || !leerEntero(campos[0], &p.n[0]) || !leerEntero(x + 1, &p.n[1]) ||
+                p.n[0] <= 0 || p.n[1] <= 0) {
+                fprintf(stderr, "Tamaño invalido (AxB): %s\n", valor);
+                return 0;
+            }
+            if (n == 2) {
+                int f = -1;
+                for (int k = 0; k < 4; k++) {
+                    if (!strcasecmp(campos[1], nombresFiltro[k])) f = k;
+                }
+                if (f < 0) { fprintf(stderr, "Filtro desconocido: %s\n", campos[1]); return 0; }
+                p.modo = f;
+            }
+            pasos[(*numPasos)++] = p;
+        } else if (!strcmp(nombre, "--brightness")) {
+            int delta;
+            if (!leerEntero(valor, &delta)) { fprintf(stderr, "Brillo invalido: %s\n", valor); return 0; }
+            componerBrillo(cadenaAbierta(pasos, numPasos), delta);
+        } else if (!strcmp(nombre, "--contrast")) {
+            double f;
+            if (!leerReal(valor, &f) || f < 0.0) { fprintf(stderr, "Contraste invalido: %s\n", valor); return 0; }
+            componerContraste(cadenaAbierta(pasos, numPasos), f);
+        } else if (!strcmp(nombre, "--gamma")) {
+            double g;
+            if (!leerReal(valor, &g) || g <= 0.0) { fprintf(stderr, "Gamma invalida: %s\n", valor); return 0; }
+            componerGamma(cadenaAbierta(pasos, numPasos), g);
+        } else if (!strcmp(nombre, "--invert")) {
+            if (valor) { fprintf(stderr, "--invert no lleva valor.\n"); return 0; }
+            componerInvertir(cadenaAbierta(pasos, numPasos));
+        } else if (!strcmp(nombre, "--levels")) {
+            int ne, be, ns, bs;
+            double g;
+            if (partirCampos(valor, ':', buf, sizeof(buf), campos, 5) != 5 ||
+                !leerEntero(campos[0], &ne) || !leerEntero(campos[1], &be) || !leerReal(campos[2], &g) ||
+                !leerEntero(campos[3], &ns) || !leerEntero(campos[4], &bs) ||
+                ne < 0 || be > 255 || ne >= be || g <= 0.0 || ns < 0 || ns > 255 || bs < 0 || bs > 255) {
+                fprintf(stderr, "Niveles invalidos (NE:BE:G:NS:BS): %s\n", valor);
+                return 0;
+            }
+            componerNiveles(cadenaAbierta(pasos, numPasos), ne, be, g, ns, bs);
+        }
+    }
+    if (op->servidor) {
+        // Las entradas, salidas y operaciones llegan despues, con cada trabajo.
+        if (op->entrada || op->salida || op->lote || op->franjas || op->numa || *numPasos > 0) {
+            fprintf(stderr, "--serve solo admite --threads, --workers, --no-fuse, --no-arena, --stats, --affinity "
+                            "y --png-level.\n");
+            return 0;
+        }
+        return 1;
+    }
+    if (op->numa) {
+        if (op->lote || op->franjas) { fprintf(stderr, "--numa no se combina con --batch ni --stream.\n"); return 0; }
+        if (modoAfinidad == AFINIDAD_NO) fijarModoAfinidad(NULL);
+    }
+    if (op->franjas) {
+        if (op->lote) { fprintf(stderr, "--stream no se combina con --batch.\n"); return 0; }
+        if (!op->salida) { fprintf(stderr, "--stream necesita -o salida (.ppm, .pgm o .png).\n"); return 0; }
+    }
+    if (op->lote) {
+        if (op->entrada) { fprintf(stderr, "Con --batch no se indica imagen de entrada: %s\n", op->entrada); return 0; }
+        if (!op->salida) { fprintf(stderr, "--batch necesita -o DIR_SALIDA.\n"); return 0; }
+        return 1;
+    }
+    if (!op->entrada) { fprintf(stderr, "Falta la imagen de entrada.\n"); return 0; }
+    return 1;
+}
+
+// Carga, aplica los pasos en orden y guarda; devuelve el codigo de salida del proceso.
+static void liberarPasos(PasoPipeline* pasos, int numPasos) {
+    for (int i = 0; i < numPasos; i++) free(pasos[i].kernel);
+}
+
+static int ejecutarPipeline(const OpcionesPipeline* op, const PasoPipeline* pasos, int numPasos) {
+    ImagenInfo imagen = {0, 0, 0, 0, NULL, 8};
+    ArenaImagenes* arena = op->arena ? crearArena() : NULL;
+    usarArena(arena);
+    double t0 = ahoraSeg();
+    abrirEstadisticas("cargar");
+    int cargada = cargarImagen(op->entrada, &imagen);
+    cerrarEstadisticas();
+    if (!cargada) {
+        destruirArena(arena);
+        return SALIDA_ERROR;
+    }
+    int numHilos = op->numHilos < 1 ? hilosPorDefecto() : op->numHilos;
+    int codigo = EXIT_SUCCESS;
+    if (op->numa) {
+        // Despues de cargar: la carga la hace el hilo principal y se copia una vez por franjas.
+        fijarPrimerToque(numHilos);
+        abrirEstadisticas("reubicar por nodos");
+        if (!reubicarImagen(&imagen)) codigo = SALIDA_ERROR;
+        cerrarEstadisticas();
+    }
+
+    if (codigo == EXIT_SUCCESS && !ejecutarPasos(&imagen, pasos, numPasos, numHilos, op->fusionar)) {
+        codigo = SALIDA_ERROR;
+    }
+    if (codigo == EXIT_SUCCESS && (op->numa || modoAfinidad != AFINIDAD_NO)) informarColocacion(&imagen);
+    if (codigo == EXIT_SUCCESS) {
+        if (op->salida) {
+            abrirEstadisticas("guardar");
+            if (!guardarPNGHilos(&imagen, op->salida, numHilos)) codigo = SALIDA_ERROR;
+            cerrarEstadisticas();
+        } else {
+            printf("Sin -o: el resultado no se guarda.\n");
+        }
+    }
+    if (codigo == EXIT_SUCCESS) printf("Pipeline completo en %.3f s (%d hilos).\n", ahoraSeg() - t0, numHilos);
+
+    liberarImagen(&imagen);
+    destruirArena(arena);
+    destruirPoolHilos();
+    return codigo;
+}
+
+//  PROCESAMIENTO POR FRANJAS
+
+// Para imagenes mayores que la memoria: la entrada PPM/PGM se lee por franjas
+// horizontales, cada franja pasa por la cadena fusionada y se escribe antes de leer la
+// siguiente. Entre franjas solo se conservan las filas de halo (suma de radios) por
+// encima y por debajo, asi que la memoria depende del ancho y del presupuesto, no del
+// alto. Solo admite pasos fusionables: ajustes puntuales, blur exacto y Sobel.
+
+static int procesarPorFranjas(const OpcionesPipeline* op, const PasoPipeline* pasos, int numPasos) {
+    for (int i = 0; i < numPasos; i++) {
+        if (!pasoFusionable(&pasos[i])) {
+            char nombre[64];
+            nombrePaso(&pasos[i], nombre, sizeof(nombre));
+            fprintf(stderr, "--stream solo admite ajustes puntuales, blur exacto y Sobel (no %s%s).\n", nombre,
+                    pasos[i].tipo == PASO_BLUR ? "; pruebe --blur K:S:exacto" : "");
+            return SALIDA_USO;
+        }
+    }
+    LectorFilas lector;
+    if (!abrirLectorPNM(op->entrada, &lector)) return SALIDA_ERROR;
+    double t0 = ahoraSeg();
+    int numHilos = op->numHilos < 1 ? hilosPorDefecto() : op->numHilos;
+    int ancho = lector.ancho, alto = lector.alto;
+
+    FusionArgs args;
+    int canalesSal = prepararFusion(&args, pasos, numPasos, lector.canales);
+    int halo = haloFusion(&args);
+
+    // Cada hilo guarda ademas los anillos de sus etapas: (2r+1) filas de uint16 o int16.
+    size_t estadoHilo = 0;
+    for (int e = 0; e < args.numEtapas; e++) {
+        estadoHilo += (size_t)(2 * args.etapas[e].radio + 2) * ancho * args.etapas[e].canalesEnt * sizeof(uint16_t);
+    }
+    size_t filaEnt = ((size_t)ancho * lector.canales + ALINEACION_FILAS - 1) & ~(size_t)(ALINEACION_FILAS - 1);
+    size_t filaSal = ((size_t)ancho * canalesSal + ALINEACION_FILAS - 1) & ~(size_t)(ALINEACION_FILAS - 1);
+    size_t presupuesto = (size_t)(op->presupuestoMB > 0 ? op->presupuestoMB : PRESUPUESTO_FRANJAS_MB) << 20;
+    size_t fijo = 2 * (size_t)halo * filaEnt + (size_t)numHilos * estadoHilo;
+    long filasFranja = presupuesto > fijo ? (long)((presupuesto - fijo) / (filaEnt + filaSal)) : 0;
+    if (filasFranja > alto) filasFranja = alto;
+
+    ImagenInfo ventana = { ancho, 0, lector.canales, 0, NULL, 8 };
+    ImagenInfo franja = { ancho, 0, canalesSal, 0, NULL, 8 };
+    EscritorFilas escritor;
+    int ok = canalesSal > 0;
+    if (ok && filasFranja < 1) {
+        fprintf(stderr, "Presupuesto de memoria insuficiente: hacen falta al menos %zu MB para %d columnas.\n",
+                ((fijo + filaEnt + filaSal) >> 20) + 1, ancho);
+        ok = 0;
+    }
+    if (ok) {
+        int filasVentana = (int)(filasFranja + 2 * halo < alto ? filasFranja + 2 * halo : alto);
+        ventana.pixeles = asignarPixeles(filasVentana, ancho, lector.canales, &ventana.stride);
+        franja.pixeles = asignarPixeles((int)filasFranja, ancho, canalesSal, &franja.stride);
+        ok = ventana.pixeles && franja.pixeles;
+        if (!ok) fprintf(stderr, "Error de memoria al reservar las franjas.\n");
+    }
+    ok = ok && abrirEscritorFilas(op->salida, ancho, alto, canalesSal, &escritor);
+    if (!ok) {
+        liberarPixelesMem(ventana.pixeles);
+        liberarPixelesMem(franja.pixeles);
+        liberarFusion(&args);
+        cerrarLectorFilas(&lector);
+        return SALIDA_ERROR;
+    }
+
+    args.src = &ventana;
+    args.dst = &franja;
+    args.alto = alto;
+    int grano = granoFilas(ancho, lector.canales, 16 * halo);
+    int numFranjas = 0;
+    double tLeer = 0.0, tCalculo = 0.0, tEscribir = 0.0;
+    // La ventana guarda las filas [inicioVentana, finVentana) de la entrada.
+    int inicioVentana = 0, finVentana = 0;
+    abrirEstadisticas("franjas");
+    for (int y0 = 0; ok && y0 < alto; y0 += (int)filasFranja) {
+        int y1 = y0 + (int)filasFranja < alto ? y0 + (int)filasFranja : alto;
+        int desde = y0 - halo > 0 ? y0 - halo : 0;
+        int hasta = y1 + halo < alto ? y1 + halo : alto;
+
+        double t = ahoraSeg();
+        if (desde > inicioVentana) {
+            int quedan = finVentana - desde;
+            memmove(ventana.pixeles, PIXEL(&ventana, desde - inicioVentana, 0), (size_t)quedan * ventana.stride);
+            inicioVentana = desde;
+        }
+        ok = leerFilas(&lector, PIXEL(&ventana, finVentana - inicioVentana, 0), ventana.stride, hasta - finVentana);
+        finVentana = hasta;
+        ventana.alto = finVentana - inicioVentana;
+        tLeer += ahoraSeg() - t;
+        if (!ok) break;
+
+        t = ahoraSeg();
+        args.baseSrc = inicioVentana;
+        args.baseDst = y0;
+        franja.alto = y1 - y0;
+        paraleloFilas(y1 - y0, grano, numHilos, hiloFusion, &args);
+        ok = !atomic_load(&args.error);
+        tCalculo += ahoraSeg() - t;
+        if (!ok) {
+            fprintf(stderr, "Error de memoria en la cadena fusionada.\n");
+            break;
+        }
+
+        t = ahoraSeg();
+        ok = escribirFilas(&escritor, franja.pixeles, franja.stride, y1 - y0);
+        tEscribir += ahoraSeg() - t;
+        if (!ok) fprintf(stderr, "Error al escribir %s\n", op->salida);
+        numFranjas++;
+    }
+    ok = cerrarEscritorFilas(&escritor, ok) && ok;
+    cerrarEstadisticas();
+
+    liberarPixelesMem(ventana.pixeles);
+    liberarPixelesMem(franja.pixeles);
+    liberarFusion(&args);
+    cerrarLectorFilas(&lector);
+    destruirPoolHilos();
+    if (!ok) return SALIDA_ERROR;
+    printf("Procesada por franjas: %dx%d en %d franja(s) de hasta %ld filas (halo %d) con %d hilos.\n",
+           ancho, alto, numFranjas, filasFranja, halo, numHilos);
+    printf("Leer %.3f s, calcular %.3f s, escribir %.3f s; total %.3f s, pico RSS %ld KB.\n",
+           tLeer, tCalculo, tEscribir, ahoraSeg() - t0, picoRSSKb());
+    return EXIT_SUCCESS;
+}
+
+//  PROCESAMIENTO POR LOTES
+
+// Tres fases encadenadas: carga -> filtros -> guardado, cada una con sus hilos. Las
+// imagenes pasan entre fases por colas acotadas sin cerrojos (anillo MPMC con numero
+// de secuencia por celda); los semaforos solo duermen a quien no tiene trabajo. Un
+// semaforo global limita las imagenes en vuelo, asi que la carga se frena si el
+// guardado no da abasto.
+
+typedef struct {
+    atomic_size_t secuencia;
+    void* dato;
+} CeldaCola;
+
+typedef struct {
+    CeldaCola* celdas;
+    size_t mascara;
+    atomic_size_t cabeza, cola;
+    sem_t llenos, huecos;
+} ColaLote;
+
+static int iniciarColaLote(ColaLote* q, size_t minimo) {
+    size_t cap = 2;
+    while (cap < minimo) cap *= 2;
+    q->celdas = (CeldaCola*)malloc(cap * sizeof(CeldaCola));
+    if (!q->celdas) return 0;
+    for (size_t i = 0; i < cap; i++) atomic_init(&q->celdas[i].secuencia, i);
+    q->mascara = cap - 1;
+    atomic_init(&q->cabeza, 0);
+    atomic_init(&q->cola, 0);
+    sem_init(&q->llenos, 0, 0);
+    sem_init(&q->huecos, 0, (unsigned)cap);
+    return 1;
+}
+
+static void destruirColaLote(ColaLote* q) {
+    sem_destroy(&q->llenos);
+    sem_destroy(&q->huecos);
+    free(q->celdas);
+}
+
+// Bloquea solo si la cola esta llena.
+static void meterEnColaLote(ColaLote* q, void* dato) {
+    while (sem_wait(&q->huecos) != 0) {}
+    size_t pos = atomic_load_explicit(&q->cola, memory_order_relaxed);
+    CeldaCola* c;
+    while (1) {
+        c = &q->celdas[pos & q->mascara];
+        size_t seq = atomic_load_explicit(&c->secuencia, memory_order_acquire);
+        if (seq == pos &&
+            atomic_compare_exchange_weak_explicit(&q->cola, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+        if (seq != pos) pos = atomic_load_explicit(&q->cola, memory_order_relaxed);
+    }
+    c->dato = dato;
+    atomic_store_explicit(&c->secuencia, pos + 1, memory_order_release);
+    sem_post(&q->llenos);
+}
+
+// Bloquea solo si la cola esta vacia.
+static void* sacarDeColaLote(ColaLote* q) {
+    while (sem_wait(&q->llenos) != 0) {}
+    size_t pos = atomic_load_explicit(&q->cabeza, memory_order_relaxed);
+    CeldaCola* c;
+    while (1) {
+        c = &q->celdas[pos & q->mascara];
+        size_t seq = atomic_load_explicit(&c->secuencia, memory_order_acquire);
+        if (seq == pos + 1 &&
+            atomic_compare_exchange_weak_explicit(&q->cabeza, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+            break;
+        }
+        if (seq != pos + 1) pos = atomic_load_explicit(&q->cabeza, memory_order_relaxed);
+    }
+    void* dato = c->dato;
+    atomic_store_explicit(&c->secuencia, pos + q->mascara + 1, memory_order_release);
+    sem_post(&q->huecos);
+    return dato;
+}
+
+typedef struct {
+    int indice;
+    ImagenInfo img;
+} ImagenLote;
+
+typedef enum { FASE_CARGA, FASE_FILTROS, FASE_GUARDADO, NUM_FASES } FaseLote;
+
+typedef struct {
+    const OpcionesPipeline* op;
+    const PasoPipeline* pasos;
+    int numPasos;
+    char** rutas;
+    char** salidas;                 // nombre de salida de cada ruta, sin directorio
+    int numRutas;
+    atomic_int siguiente;           // proxima ruta a cargar
+    atomic_int vivos[NUM_FASES];    // hilos de cada fase que no han terminado
+    int hilos[NUM_FASES];
+    ColaLote aFiltros, aGuardado;
+    sem_t enVuelo;
+    atomic_llong ocupadoNs[NUM_FASES];
+    atomic_int hechas, fallidas;
+    atomic_llong bytesEntrada;
+} Lote;
+
+static void sumarOcupado(Lote* l, FaseLote f, double desde) {
+    atomic_fetch_add(&l->ocupadoNs[f], (long long)((ahoraSeg() - desde) * 1e9));
+}
+
+// Cuando termina el ultimo hilo de una fase, cada hilo de la siguiente recibe un NULL de fin.
+static void cerrarFase(Lote* l, FaseLote f, ColaLote* siguiente, int hilosSiguiente) {
+    if (atomic_fetch_sub(&l->vivos[f], 1) == 1) {
+        for (int i = 0; i < hilosSiguiente; i++) meterEnColaLote(siguiente, NULL);
+    }
+}
+
+static void* hiloCargaLote(void* arg) {
+    Lote* l = (Lote*)arg;
+    int i;
+    while ((i = atomic_fetch_add(&l->siguiente, 1)) < l->numRutas) {
+        while (sem_wait(&l->enVuelo) != 0) {}
+        double t0 = ahoraSeg();
+        ImagenLote* im = (ImagenLote*)calloc(1, sizeof(ImagenLote));
+        if (!im || !cargarImagen(l->rutas[i], &im->img)) {
+            free(im);
+            atomic_fetch_add(&l->fallidas, 1);
+            sem_post(&l->enVuelo);
+            sumarOcupado(l, FASE_CARGA, t0);
+            continue;
+        }
+        im->indice = i;
+        atomic_fetch_add(&l->bytesEntrada, (long long)im->img.ancho * im->img.alto * im->img.canales);
+        sumarOcupado(l, FASE_CARGA, t0);
+        meterEnColaLote(&l->aFiltros, im);
+    }
+    cerrarFase(l, FASE_CARGA, &l->aFiltros, l->hilos[FASE_FILTROS]);
+    return NULL;
+}
+
+static void* hiloFiltrosLote(void* arg) {
+    Lote* l = (Lote*)arg;
+    ImagenLote* im;
+    // Los buffers de la arena vuelven aqui cuando el hilo de guardado libera la imagen.
+    ArenaImagenes* arena = l->op->arena ? crearArena() : NULL;
+    usarArena(arena);
+    while ((im = (ImagenLote*)sacarDeColaLote(&l->aFiltros)) != NULL) {
+        double t0 = ahoraSeg();
+        int numHilos = l->op->numHilos < 1 ? 1 : l->op->numHilos;
+        if (!ejecutarPasos(&im->img, l->pasos, l->numPasos, numHilos, l->op->fusionar)) {
+            fprintf(stderr, "Fallo al procesar %s\n", l->rutas[im->indice]);
+            atomic_fetch_add(&l->fallidas, 1);
+            liberarImagen(&im->img);
+            free(im);
+            sem_post(&l->enVuelo);
+            sumarOcupado(l, FASE_FILTROS, t0);
+            continue;
+        }
+        sumarOcupado(l, FASE_FILTROS, t0);
+        meterEnColaLote(&l->aGuardado, im);
+    }
+    cerrarFase(l, FASE_FILTROS, &l->aGuardado, l->hilos[FASE_GUARDADO]);
+    destruirArena(arena);
+    return NULL;
+}
+
+static void* hiloGuardadoLote(void* arg) {
+    Lote* l = (Lote*)arg;
+    ImagenLote* im;
+    while ((im = (ImagenLote*)sacarDeColaLote(&l->aGuardado)) != NULL) {
+        double t0 = ahoraSeg();
+        char ruta[PATH_MAX];
+        snprintf(ruta, sizeof(ruta), "%s/%s", l->op->salida, l->salidas[im->indice]);
+        // Cada codificador comprime con --threads hilos, como cada hilo de filtros.
+        if (guardarPNGHilos(&im->img, ruta, l->op->numHilos < 1 ? 1 : l->op->numHilos)) {
+            atomic_fetch_add(&l->hechas, 1);
+        } else {
+            atomic_fetch_add(&l->fallidas, 1);
+        }
+        liberarImagen(&im->img);
+        free(im);
+        sem_post(&l->enVuelo);
+        sumarOcupado(l, FASE_GUARDADO, t0);
+    }
+    atomic_fetch_sub(&l->vivos[FASE_GUARDADO], 1);
+    return NULL;
+}
+
+static int compararRutas(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static int esImagenSoportada(const char* nombre) {
+    static const char* extensiones[] = { "png", "jpg", "jpeg", "bmp", "tga", "pgm", "ppm", "pnm", "raw", "qoi", "gif",
+                                         "psd", "hdr" };
+    const char* punto = strrchr(nombre, '.');
+    if (!punto) return 0;
+    for (size_t i = 0; i < sizeof(extensiones) / sizeof(extensiones[0]); i++) {
+        if (!strcasecmp(punto + 1, extensiones[i])) return 1;
+    }
+    return 0;
+}
+
+static int agregarRuta(char*** rutas, int* n, int* cap, const char* ruta) {
+    if (*n == *cap) {
+        int nuevaCap = *cap ? *cap * 2 : 256;
+        char** nuevas = (char**)realloc(*rutas, nuevaCap * sizeof(char*));
+        if (!nuevas) return 0;
+        *rutas = nuevas;
+        *cap = nuevaCap;
+    }
+    if (!((*rutas)[*n] = strdup(ruta))) return 0;
+    (*n)++;
+    return 1;
+}
+
+typedef struct {
+    char* base;                // nombre sin directorio ni extension
+    int indice;
+} NombreLote;
+
+static int compararNombresLote(const void* a, const void* b) {
+    const NombreLote *x = (const NombreLote*)a, *y = (const NombreLote*)b;
+    int c = strcmp(x->base, y->base);
+    return c ? c : (x->indice > y->indice) - (x->indice < y->indice);
+}
+
+static int compararBaseLote(const void* a, const void* b) {
+    return strcmp(((const NombreLote*)a)->base, ((const NombreLote*)b)->base);
+}
+
+// Nombre de salida de cada entrada: <nombre sin extension>.png. Las entradas que dan el
+// mismo nombre (a.ppm y a.pgm, d1/x.png y d2/x.png) se numeran en orden, a-2.png,
+// a-3.png..., saltando los que ya son nombre de otra entrada: si no, una salida pisaria
+// a otra y ambas contarian como hechas, o dos codificadores escribirian el mismo fichero.
+// Al final se comprueba que no se repite ninguno; si pasara, el lote no empieza.
+static char** nombrarSalidasLote(char** rutas, int n) {
+    NombreLote* nombres = (NombreLote*)calloc((size_t)n, sizeof(NombreLote));
+    char** salidas = (char**)calloc((size_t)n, sizeof(char*));
+    int ok = nombres && salidas;
+    for (int i = 0; ok && i < n; i++) {
+        const char* nombre = strrchr(rutas[i], '/');
+        nombre = nombre ? nombre + 1 : rutas[i];
+        const char* punto = strrchr(nombre, '.');
+        size_t largo = punto && punto != nombre ? (size_t)(punto - nombre) : strlen(nombre);
+        nombres[i].indice = i;
+        ok = (nombres[i].base = strndup(nombre, largo)) != NULL;
+    }
+    if (ok) qsort(nombres, (size_t)n, sizeof(NombreLote), compararNombresLote);
+    char buf[PATH_MAX];
+    int k = 1;                 // ultimo sufijo dado a la base actual; ordenadas, basta uno
+    for (int i = 0; ok && i < n; i++) {
+        const NombreLote* e = &nombres[i];
+        int repetido = i > 0 && !strcmp(e->base, nombres[i - 1].base);
+        if (!repetido) k = 1;
+        snprintf(buf, sizeof(buf), "%s.png", e->base);
+        while (repetido) {
+            k++;
+            snprintf(buf, sizeof(buf), "%s-%d", e->base, k);
+            NombreLote clave = { buf, 0 };
+            if (bsearch(&clave, nombres, (size_t)n, sizeof(NombreLote), compararBaseLote)) continue;
+            fprintf(stderr, "%s y %s darian el mismo nombre: se guarda como %s.png\n",
+                    rutas[nombres[i - 1].indice], rutas[e->indice], buf);
+            strncat(buf, ".png", sizeof(buf) - strlen(buf) - 1);
+            repetido = 0;
+        }
+        ok = (salidas[e->indice] = strdup(buf)) != NULL;
+    }
+    for (int i = 0; nombres && i < n; i++) free(nombres[i].base);
+    free(nombres);
+    char** orden = ok ? (char**)malloc((size_t)n * sizeof(char*)) : NULL;
+    if (!orden) fprintf(stderr, "Error de memoria al nombrar las salidas del lote.\n");
+    ok = orden != NULL;
+    if (ok) {
+        memcpy(orden, salidas, (size_t)n * sizeof(char*));
+        qsort(orden, (size_t)n, sizeof(char*), compararRutas);
+        for (int i = 1; ok && i < n; i++) {
+            if (strcmp(orden[i], orden[i - 1])) continue;
+            fprintf(stderr, "Dos entradas del lote se guardarian como %s.\n", orden[i]);
+            ok = 0;
         }
-        printf("\n");
     }
-    if (info->alto > 10) printf("... (más filas)\n");
+    free(orden);
+    if (!ok && salidas) {
+        for (int i = 0; i < n; i++) free(salidas[i]);
+        free(salidas);
+        salidas = NULL;
+    }
+    return salidas;
 }
 
-// BRILLO 
-
-typedef struct {
-    unsigned char*** pixeles;
-    int inicio;
-    int fin;
-    int ancho;
-    int canales;
-    int delta;
-} BrilloArgs;
-
-void* ajustarBrilloHilo(void* args) {
-    BrilloArgs* bArgs = (BrilloArgs*)args;
-    for (int y = bArgs->inicio; y < bArgs->fin; y++) {
-        for (int x = 0; x < bArgs->ancho; x++) {
-            for (int c = 0; c < bArgs->canales; c++) {
-                int nuevoValor = bArgs->pixeles[y][x][c] + bArgs->delta;
-                bArgs->pixeles[y][x][c] = (unsigned char)(nuevoValor < 0 ? 0 :
-                                                          (nuevoValor > 255 ? 255 : nuevoValor));
-            }
-        }
+static void liberarEntradasLote(Lote* l) {
+    for (int i = 0; i < l->numRutas; i++) {
+        free(l->rutas[i]);
+        if (l->salidas) free(l->salidas[i]);
     }
-    return NULL;
+    free(l->rutas);
+    free(l->salidas);
 }
 
-void ajustarBrilloConcurrente(ImagenInfo* info, int delta) {
-    if (!info->pixeles) {
-        printf("No hay imagen cargada.\n");
-        return;
+// Imagenes de un directorio (ordenadas por nombre) o rutas de un fichero de lista, con
+// el nombre de salida de cada una.
+static int listarEntradasLote(const char* origen, char*** rutas, char*** salidas, int* numRutas) {
+    int cap = 0, ok = 1;
+    *rutas = NULL;
+    *salidas = NULL;
+    *numRutas = 0;
+    struct stat st;
+    if (stat(origen, &st) != 0) {
+        fprintf(stderr, "No existe: %s\n", origen);
+        return 0;
     }
-    const int numHilos = 2;
-    pthread_t hilos[numHilos];
-    BrilloArgs args[numHilos];
-    int filasPorHilo = (int)ceil((double)info->alto / numHilos);
-    for (int i = 0; i < numHilos; i++) {
-        args[i].pixeles = info->pixeles;
-        args[i].inicio = i * filasPorHilo;
-        args[i].fin = (i + 1) * filasPorHilo < info->alto ? (i + 1) * filasPorHilo : info->alto;
-        args[i].ancho = info->ancho;
-        args[i].canales = info->canales;
-        args[i].delta = delta;
-        if (pthread_create(&hilos[i], NULL, ajustarBrilloHilo, &args[i]) != 0) {
-            fprintf(stderr, "Error al crear hilo %d\n", i);
-            return;
+    if (S_ISDIR(st.st_mode)) {
+        DIR* d = opendir(origen);
+        if (!d) { fprintf(stderr, "No se puede abrir el directorio: %s\n", origen); return 0; }
+        struct dirent* e;
+        char ruta[PATH_MAX];
+        while (ok && (e = readdir(d)) != NULL) {
+            if (e->d_name[0] == '.' || !esImagenSoportada(e->d_name)) continue;
+            snprintf(ruta, sizeof(ruta), "%s/%s", origen, e->d_name);
+            if (stat(ruta, &st) == 0 && S_ISREG(st.st_mode)) ok = agregarRuta(rutas, numRutas, &cap, ruta);
         }
+        closedir(d);
+        if (ok) qsort(*rutas, *numRutas, sizeof(char*), compararRutas);
+    } else {
+        FILE* f = fopen(origen, "r");
+        if (!f) { fprintf(stderr, "No se puede leer la lista: %s\n", origen); return 0; }
+        char linea[PATH_MAX];
+        while (ok && fgets(linea, sizeof(linea), f)) {
+            linea[strcspn(linea, "\r\n")] = 0;
+            if (linea[0] && linea[0] != '#') ok = agregarRuta(rutas, numRutas, &cap, linea);
+        }
+        fclose(f);
     }
-    for (int i = 0; i < numHilos; i++) {
-        pthread_join(hilos[i], NULL);
-    }
-    printf("Brillo ajustado concurrentemente con %d hilos (%s).\n", numHilos,
-           info->canales == 1 ? "grises" : "RGB");
+    if (!ok) fprintf(stderr, "Error de memoria al listar %s\n", origen);
+    if (ok && *numRutas > 0) ok = (*salidas = nombrarSalidasLote(*rutas, *numRutas)) != NULL;
+    return ok;
 }
 
-//  FUNCIONES NUEVAS CONCURRENTE
-
-// Helper: clamp
-static inline unsigned char clamp255(int v) {
-    if (v < 0) return 0;
-    if (v > 255) return 255;
-    return (unsigned char)v;
-}
+// Procesa todas las entradas del lote; devuelve el codigo de salida del proceso.
+static int procesarLote(const OpcionesPipeline* op, const PasoPipeline* pasos, int numPasos) {
+    Lote l;
+    memset(&l, 0, sizeof(l));
+    l.op = op;
+    l.pasos = pasos;
+    l.numPasos = numPasos;
+    if (!listarEntradasLote(op->lote, &l.rutas, &l.salidas, &l.numRutas)) {
+        liberarEntradasLote(&l);
+        return SALIDA_ERROR;
+    }
+    if (l.numRutas == 0) {
+        fprintf(stderr, "No hay imagenes en %s\n", op->lote);
+        liberarEntradasLote(&l);
+        return SALIDA_ERROR;
+    }
+    if (mkdir(op->salida, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "No se puede crear el directorio de salida: %s\n", op->salida);
+        liberarEntradasLote(&l);
+        return SALIDA_ERROR;
+    }
 
-//  CONVOLUCIÓN GAUSSIANA 
+    int nucleos = hilosPorDefecto();
+    int pedidos[NUM_FASES] = { op->decodificadores, op->filtros, op->codificadores };
+    for (int f = 0; f < NUM_FASES; f++) {
+        l.hilos[f] = pedidos[f] > 0 ? pedidos[f] : nucleos;
+        if (l.hilos[f] > l.numRutas) l.hilos[f] = l.numRutas;
+        atomic_init(&l.vivos[f], l.hilos[f]);
+    }
+    int enVuelo = op->enVuelo > 0 ? op->enVuelo : 2 * l.hilos[FASE_FILTROS] + l.hilos[FASE_GUARDADO];
+    // Las colas caben todas las imagenes en vuelo mas los NULL de fin: nunca bloquean al meter.
+    int capacidad = enVuelo + l.hilos[FASE_FILTROS] + l.hilos[FASE_GUARDADO];
+    int ok = iniciarColaLote(&l.aFiltros, capacidad);
+    if (ok && !iniciarColaLote(&l.aGuardado, capacidad)) {
+        destruirColaLote(&l.aFiltros);
+        ok = 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Error de memoria al preparar el lote.\n");
+        liberarEntradasLote(&l);
+        return SALIDA_ERROR;
+    }
+    sem_init(&l.enVuelo, 0, (unsigned)enVuelo);
 
+    printf("Lote: %d imagen(es), %d carga / %d filtros (x%d hilos) / %d guardado, %d en vuelo como maximo.\n",
+           l.numRutas, l.hilos[FASE_CARGA], l.hilos[FASE_FILTROS], op->numHilos < 1 ? 1 : op->numHilos,
+           l.hilos[FASE_GUARDADO], enVuelo);
 
-float* generarKernelGaussiano(int tamKernel, float sigma) {
-    int centro = tamKernel / 2;
-    float sum = 0.0f;
-    float* kernel = (float*)malloc(tamKernel * tamKernel * sizeof(float));
-    if (!kernel) return NULL;
-    for (int y = 0; y < tamKernel; y++) {
-        for (int x = 0; x < tamKernel; x++) {
-            int dx = x - centro;
-            int dy = y - centro;
-            float val = expf(-(dx*dx + dy*dy) / (2.0f * sigma * sigma));
-            kernel[y*tamKernel + x] = val;
-            sum += val;
+    static void* (*const funciones[NUM_FASES])(void*) = { hiloCargaLote, hiloFiltrosLote, hiloGuardadoLote };
+    pthread_t* hilos = (pthread_t*)malloc((size_t)(l.hilos[0] + l.hilos[1] + l.hilos[2]) * sizeof(pthread_t));
+    if (!hilos) {
+        fprintf(stderr, "Error de memoria al preparar el lote.\n");
+        exit(SALIDA_ERROR);
+    }
+    silencioso = 1;
+    int lanzados = 0;
+    double t0 = ahoraSeg();
+    // De la ultima fase a la primera, para que cada fase encuentre sus consumidores creados.
+    for (int f = NUM_FASES - 1; f >= 0; f--) {
+        for (int i = 0; i < l.hilos[f]; i++) {
+            if (pthread_create(&hilos[lanzados++], NULL, funciones[f], &l) != 0) {
+                fprintf(stderr, "Error al crear hilo del lote.\n");
+                exit(SALIDA_ERROR);
+            }
         }
     }
-    if (sum != 0.0f) {
-        for (int i = 0; i < tamKernel * tamKernel; i++) kernel[i] /= sum;
+    for (int i = 0; i < lanzados; i++) pthread_join(hilos[i], NULL);
+    double t = ahoraSeg() - t0;
+    silencioso = 0;
+
+    int hechas = atomic_load(&l.hechas), fallidas = atomic_load(&l.fallidas);
+    printf("Lote terminado: %d ok, %d con error en %.3f s: %.1f imagenes/s, %.1f MB/s de pixeles.\n",
+           hechas, fallidas, t, t > 0 ? hechas / t : 0.0,
+           t > 0 ? atomic_load(&l.bytesEntrada) / t / 1e6 : 0.0);
+    static const char* nombresFase[NUM_FASES] = { "carga", "filtros", "guardado" };
+    for (int f = 0; f < NUM_FASES; f++) {
+        double ocupado = atomic_load(&l.ocupadoNs[f]) / 1e9;
+        printf("  %-9s %3d hilo(s): %.3f s ocupados, utilizacion %.0f%%\n", nombresFase[f], l.hilos[f], ocupado,
+               t > 0 ? 100.0 * ocupado / (t * l.hilos[f]) : 0.0);
     }
-    return kernel;
+
+    free(hilos);
+    liberarEntradasLote(&l);
+    destruirColaLote(&l.aFiltros);
+    destruirColaLote(&l.aGuardado);
+    sem_destroy(&l.enVuelo);
+    destruirPoolHilos();
+    return fallidas ? SALIDA_ERROR : EXIT_SUCCESS;
 }
 
+//  SERVIDOR DE TRABAJOS
 
-typedef struct {
-    ImagenInfo* src;
-    unsigned char*** dst;
-    int inicio, fin;
-    int tamKernel;
-    float* kernel;
-} ConvArgs;
+// img --serve RUTA escucha en un socket Unix. Cada linea que llega es un trabajo con la
+// sintaxis de la linea de comandos (entrada, operaciones, -o salida, --threads,
+// --no-fuse) y se contesta con otra: "OK" y los tiempos, o "ERROR codigo motivo" con
+// los codigos de salida del proceso. El pool y la arena de cada ejecutor siguen vivos
+// entre trabajos, asi que un trabajo no paga arranque del proceso, creacion de hilos
+// ni fallos de pagina de buffers nuevos. Con rutas shm:NOMBRE.raw la imagen va y viene
+// por memoria compartida.
+//
+// Cada conexion tiene su cola y sus trabajos se atienden en orden, de uno en uno. Los
+// ejecutores (--workers) eligen la siguiente conexion con trabajo por turno rotatorio,
+// asi que un cliente que encola muchos trabajos no retrasa a los demas: entre dos
+// trabajos suyos pasa como mucho uno de cada una de las otras conexiones.
 
+#define MAX_ARGS_TRABAJO 256
 
-static inline unsigned char getPixelReplicate(ImagenInfo* src, int y, int x, int c) {
-    if (y < 0) y = 0;
-    if (y >= src->alto) y = src->alto - 1;
-    if (x < 0) x = 0;
-    if (x >= src->ancho) x = src->ancho - 1;
-    return src->pixeles[y][x][c];
+typedef struct TrabajoServidor {
+    char* linea;
+    double llegada;
+    struct TrabajoServidor* siguiente;
+} TrabajoServidor;
+
+struct Servidor;
+
+typedef struct ConexionServidor {
+    struct Servidor* servidor;
+    int fd;
+    TrabajoServidor *primero, *ultimo;
+    int ocupada;               // un ejecutor esta con uno de sus trabajos
+    int cerrada;               // el cliente termino de enviar; se libera al vaciar su cola
+    struct ConexionServidor* siguiente;
+} ConexionServidor;
+
+typedef struct Servidor {
+    const OpcionesPipeline* op;
+    pthread_mutex_t m;
+    pthread_cond_t hayTrabajo, sinConexiones;
+    ConexionServidor* conexiones;
+    ConexionServidor* turno;   // por donde empieza a buscar el siguiente ejecutor
+    int numConexiones;
+    int salir;
+    long atendidos, fallidos, descartados;   // descartados: en cola al parar
+} Servidor;
+
+static volatile sig_atomic_t pararServidor = 0;
+
+static void senalParada(int senal) {
+    (void)senal;
+    pararServidor = 1;
 }
 
-void* hiloConvolucion(void* args) {
-    ConvArgs* a = (ConvArgs*)args;
-    int tam = a->tamKernel;
-    int centro = tam / 2;
-    for (int y = a->inicio; y < a->fin; y++) {
-        for (int x = 0; x < a->src->ancho; x++) {
-            for (int c = 0; c < a->src->canales; c++) {
-                float acc = 0.0f;
-                for (int ky = 0; ky < tam; ky++) {
-                    for (int kx = 0; kx < tam; kx++) {
-                        int yy = y + (ky - centro);
-                        int xx = x + (kx - centro);
-                        unsigned char val = getPixelReplicate(a->src, yy, xx, c);
-                        acc += val * a->kernel[ky * tam + kx];
-                    }
-                }
-                int v = (int)roundf(acc);
-                a->dst[y][x][c] = clamp255(v);
+// Parte la linea en argumentos, en el sitio. Las comillas dobles agrupan y \ escapa el
+// caracter siguiente. Devuelve el numero de argumentos o -1.
+static int partirTrabajo(char* s, char** argv, int max) {
+    int n = 0;
+    char* w = s;
+    while (*s) {
+        while (*s == ' ' || *s == '\t') s++;
+        if (!*s) break;
+        if (n == max) return -1;
+        argv[n++] = w;
+        int comillas = 0;
+        while (*s && (comillas || (*s != ' ' && *s != '\t'))) {
+            if (*s == '"') {
+                comillas = !comillas;
+                s++;
+                continue;
             }
+            if (*s == '\\' && s[1]) s++;
+            *w++ = *s++;
         }
+        if (comillas) return -1;
+        int fin = !*s;
+        *w++ = 0;
+        if (!fin) s++;
     }
-    return NULL;
+    return n;
 }
 
-void aplicarConvolucionGaussiana(ImagenInfo* info, int tamKernel, float sigma, int numHilos) {
-    if (!info->pixeles) {
-        printf("No hay imagen cargada.\n");
-        return;
+// Opciones que cambian el estado de todo el proceso: se fijan al arrancar el servidor.
+static int opcionDeServidor(const char* arg) {
+    static const char* prohibidas[] = { "--serve", "--batch", "--stream", "--mem-budget", "--numa", "--affinity",
+                                        "--stats", "--png-level", "--decoders", "--workers", "--encoders",
+                                        "--in-flight", "--no-arena" };
+    size_t largo = strcspn(arg, "=");
+    for (size_t i = 0; i < sizeof(prohibidas) / sizeof(prohibidas[0]); i++) {
+        if (strlen(prohibidas[i]) == largo && !strncmp(arg, prohibidas[i], largo)) return 1;
     }
-    if (tamKernel % 2 == 0 || tamKernel < 3) {
-        printf("Tamano de kernel invalido. Use un numero impar >= 3.\n");
-        return;
+    return 0;
+}
+
+// Ejecuta la linea de un trabajo y deja en respuesta la linea que se devuelve. Los
+// motivos detallados de un error salen por el stderr del servidor, como en la CLI.
+static int ejecutarTrabajo(const OpcionesPipeline* base, char* linea, double llegada, char* respuesta, size_t tam) {
+    double tInicio = ahoraSeg();
+    char* argv[MAX_ARGS_TRABAJO + 1];
+    argv[0] = "trabajo";
+    int argc = partirTrabajo(linea, argv + 1, MAX_ARGS_TRABAJO);
+    if (argc < 0) {
+        snprintf(respuesta, tam, "ERROR %d comillas sin cerrar o mas de %d argumentos", SALIDA_USO, MAX_ARGS_TRABAJO);
+        return SALIDA_USO;
     }
-    if (sigma <= 0.0f) {
-        printf("Sigma debe ser > 0.\n");
-        return;
+    argc++;
+    for (int i = 1; i < argc; i++) {
+        if (opcionDeServidor(argv[i])) {
+            snprintf(respuesta, tam, "ERROR %d %.64s se fija al arrancar el servidor", SALIDA_USO, argv[i]);
+            return SALIDA_USO;
+        }
     }
-    float* kernel = generarKernelGaussiano(tamKernel, sigma);
-    if (!kernel) {
-        fprintf(stderr, "No se pudo generar kernel Gaussiano.\n");
-        return;
+    PasoPipeline* pasos = (PasoPipeline*)malloc((size_t)argc * sizeof(PasoPipeline));
+    if (!pasos) {
+        snprintf(respuesta, tam, "ERROR %d sin memoria", SALIDA_ERROR);
+        return SALIDA_ERROR;
     }
-
- 
-    unsigned char*** dst = asignarPixeles(info->alto, info->ancho, info->canales);
-    if (!dst) {
-        fprintf(stderr, "Error al asignar memoria para imagen destino (convolucion).\n");
-        free(kernel);
-        return;
+    OpcionesPipeline op = { NULL, NULL, base->numHilos, base->fusionar, NULL, 0, 0, 0, 0, 0, 0, base->arena, 0,
+                            NULL };
+    int numPasos = 0;
+    if (!parsearPipeline(argc, argv, pasos, &numPasos, &op)) {
+        liberarPasos(pasos, numPasos);
+        free(pasos);
+        snprintf(respuesta, tam, "ERROR %d argumentos invalidos", SALIDA_USO);
+        return SALIDA_USO;
     }
-
-    if (numHilos < 1) numHilos = 1;
-    if (numHilos > info->alto) numHilos = info->alto;
-    pthread_t* hilos = (pthread_t*)malloc(numHilos * sizeof(pthread_t));
-    ConvArgs* args = (ConvArgs*)malloc(numHilos * sizeof(ConvArgs));
-    int filasPor = (int)ceil((double)info->alto / numHilos);
-
-    for (int i = 0; i < numHilos; i++) {
-        args[i].src = info;
-        args[i].dst = dst;
-        args[i].inicio = i * filasPor;
-        args[i].fin = (i + 1) * filasPor < info->alto ? (i + 1) * filasPor : info->alto;
-        args[i].tamKernel = tamKernel;
-        args[i].kernel = kernel;
-        if (pthread_create(&hilos[i], NULL, hiloConvolucion, &args[i]) != 0) {
-            fprintf(stderr, "Error al crear hilo de convolucion %d\n", i);
-            
-            for (int j = i; j < numHilos; j++) {
-                hiloConvolucion(&args[j]);
-            }
-            break;
-        }
+    int numHilos = op.numHilos < 1 ? hilosPorDefecto() : op.numHilos;
+    ImagenInfo img = {0, 0, 0, 0, NULL, 8};
+    const char* fallo = NULL;
+    double t0 = ahoraSeg(), t1 = t0, t2 = t0;
+    if (!cargarImagen(op.entrada, &img)) {
+        fallo = "no se pudo cargar la entrada";
+    } else {
+        t1 = ahoraSeg();
+        if (!ejecutarPasos(&img, pasos, numPasos, numHilos, op.fusionar)) fallo = "fallo una operacion";
+        t2 = ahoraSeg();
+        if (!fallo && op.salida && !guardarPNGHilos(&img, op.salida, numHilos)) fallo = "no se pudo guardar la salida";
     }
-    for (int i = 0; i < numHilos; i++) {
-        pthread_join(hilos[i], NULL);
+    double t3 = ahoraSeg();
+    if (fallo) {
+        snprintf(respuesta, tam, "ERROR %d %s", SALIDA_ERROR, fallo);
+    } else {
+        snprintf(respuesta, tam, "OK total=%.6f cola=%.6f cargar=%.6f procesar=%.6f guardar=%.6f hilos=%d "
+                 "imagen=%dx%dx%d", t3 - llegada, tInicio - llegada, t1 - t0, t2 - t1, t3 - t2, numHilos, img.ancho,
+                 img.alto, img.canales);
     }
-
-  
-    liberarPixelesMem(info->pixeles, info->alto, info->ancho);
-    info->pixeles = dst;
-
-    free(hilos);
-    free(args);
-    free(kernel);
-    printf("Convolucion Gaussiana aplicada (kernel=%d, sigma=%.2f) con %d hilos.\n", tamKernel, sigma, numHilos);
+    liberarImagen(&img);
+    liberarPasos(pasos, numPasos);
+    free(pasos);
+    return fallo ? SALIDA_ERROR : EXIT_SUCCESS;
 }
 
-//  ROTACIÓN 
-
-void bilinearInterpolate(ImagenInfo* src, double fy, double fx, unsigned char* out) {
-    int x0 = (int)floor(fx);
-    int y0 = (int)floor(fy);
-    int x1 = x0 + 1;
-    int y1 = y0 + 1;
-    double wx = fx - x0;
-    double wy = fy - y0;
-    for (int c = 0; c < src->canales; c++) {
-       
-        int vx00 = getPixelReplicate(src, y0, x0, c);
-        int vx10 = getPixelReplicate(src, y0, x1, c);
-        int vx01 = getPixelReplicate(src, y1, x0, c);
-        int vx11 = getPixelReplicate(src, y1, x1, c);
-        double a = vx00 * (1 - wx) + vx10 * wx;
-        double b = vx01 * (1 - wx) + vx11 * wx;
-        double val = a * (1 - wy) + b * wy;
-        out[c] = clamp255((int)round(val));
+static void enviarLinea(int fd, const char* linea) {
+    char buf[1024];
+    int n = snprintf(buf, sizeof(buf), "%s\n", linea);
+    if (n < 0) return;
+    if ((size_t)n >= sizeof(buf)) n = sizeof(buf) - 1;
+    for (int enviado = 0; enviado < n;) {
+        ssize_t k = send(fd, buf + enviado, (size_t)(n - enviado), MSG_NOSIGNAL);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return;
+        enviado += (int)k;
     }
 }
 
+// Llamar con s->m tomado, cuando la conexion esta cerrada y nadie la atiende. Los
+// trabajos que queden (solo al parar el servidor) se contestan con error sin esperar:
+// con el cerrojo tomado no se puede bloquear en un cliente que no lee.
+static void quitarConexion(Servidor* s, ConexionServidor* c) {
+    ConexionServidor** p = &s->conexiones;
+    while (*p && *p != c) p = &(*p)->siguiente;
+    if (*p) *p = c->siguiente;
+    if (s->turno == c) s->turno = c->siguiente;
+    char error[64];
+    int largo = snprintf(error, sizeof(error), "ERROR %d servidor parado\n", SALIDA_ERROR);
+    while (c->primero) {
+        TrabajoServidor* t = c->primero;
+        c->primero = t->siguiente;
+        if (send(c->fd, error, (size_t)largo, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {}
+        s->descartados++;
+        free(t->linea);
+        free(t);
+    }
+    close(c->fd);
+    free(c);
+    if (--s->numConexiones == 0) pthread_cond_broadcast(&s->sinConexiones);
+}
 
-typedef struct {
-    ImagenInfo* src;
-    unsigned char*** dst;
-    int dstAncho;
-    int dstAlto;
-    double cx_src, cy_src; 
-    double cx_dst, cy_dst;
-    double angleRad; 
-    int inicio, fin; 
-} RotArgs;
-
-void* hiloRotacion(void* arg) {
-    RotArgs* a = (RotArgs*)arg;
-    for (int y = a->inicio; y < a->fin; y++) {
-        for (int x = 0; x < a->dstAncho; x++) {
-          
-            double dx = x - a->cx_dst;
-            double dy = y - a->cy_dst;
-           
-            double srcx = dx * cos(a->angleRad) + dy * sin(a->angleRad) + a->cx_src;
-            double srcy = -dx * sin(a->angleRad) + dy * cos(a->angleRad) + a->cy_src;
-        
-            bilinearInterpolate(a->src, srcy, srcx, a->dst[y][x]);
+// Siguiente conexion con trabajo y sin otro en curso, por turno. Con s->m tomado.
+static ConexionServidor* elegirConexion(Servidor* s) {
+    ConexionServidor* c = s->turno ? s->turno : s->conexiones;
+    for (int k = 0; k < s->numConexiones && c; k++) {
+        if (c->primero && !c->ocupada) {
+            s->turno = c->siguiente;
+            return c;
         }
+        c = c->siguiente ? c->siguiente : s->conexiones;
     }
     return NULL;
 }
 
-void rotarImagen(ImagenInfo* info, double anguloGrados, int numHilos) {
-    if (!info->pixeles) { printf("No hay imagen cargada.\n"); return; }
-
-    double ang = fmod(anguloGrados, 360.0);
-    double rad = ang * M_PI / 180.0;
-    double cosA = fabs(cos(rad));
-    double sinA = fabs(sin(rad));
-    int newW = (int)ceil(info->ancho * cosA + info->alto * sinA);
-    int newH = (int)ceil(info->ancho * sinA + info->alto * cosA);
-
-    unsigned char*** dst = asignarPixeles(newH, newW, info->canales);
-    if (!dst) { fprintf(stderr, "Error al asignar memoria para rotacion.\n"); return; }
+static void* hiloEjecutorServidor(void* arg) {
+    Servidor* s = (Servidor*)arg;
+    // La arena del ejecutor conserva sus buffers de un trabajo al siguiente.
+    ArenaImagenes* arena = s->op->arena ? crearArena() : NULL;
+    usarArena(arena);
+    pthread_mutex_lock(&s->m);
+    while (1) {
+        ConexionServidor* c = NULL;
+        while (!s->salir && (c = elegirConexion(s)) == NULL) pthread_cond_wait(&s->hayTrabajo, &s->m);
+        if (s->salir) break;
+        TrabajoServidor* t = c->primero;
+        c->primero = t->siguiente;
+        if (!c->primero) c->ultimo = NULL;
+        c->ocupada = 1;
+        pthread_mutex_unlock(&s->m);
 
-    double cx_src = (info->ancho - 1) / 2.0;
-    double cy_src = (info->alto - 1) / 2.0;
-    double cx_dst = (newW - 1) / 2.0;
-    double cy_dst = (newH - 1) / 2.0;
+        char respuesta[512];
+        int codigo = ejecutarTrabajo(s->op, t->linea, t->llegada, respuesta, sizeof(respuesta));
+        enviarLinea(c->fd, respuesta);
+        free(t->linea);
+        free(t);
 
-   
-    double invRad = -rad;
+        pthread_mutex_lock(&s->m);
+        s->atendidos++;
+        if (codigo != EXIT_SUCCESS) s->fallidos++;
+        c->ocupada = 0;
+        if (c->cerrada && (!c->primero || s->salir)) quitarConexion(s, c);
+        else if (c->primero) pthread_cond_signal(&s->hayTrabajo);
+    }
+    pthread_mutex_unlock(&s->m);
+    destruirArena(arena);
+    return NULL;
+}
 
-    if (numHilos < 1) numHilos = 1;
-    if (numHilos > newH) numHilos = newH;
-    pthread_t* hilos = (pthread_t*)malloc(numHilos * sizeof(pthread_t));
-    RotArgs* args = (RotArgs*)malloc(numHilos * sizeof(RotArgs));
-    int filasPor = (int)ceil((double)newH / numHilos);
-
-    for (int i = 0; i < numHilos; i++) {
-        args[i].src = info;
-        args[i].dst = dst;
-        args[i].dstAncho = newW;
-        args[i].dstAlto = newH;
-        args[i].cx_src = cx_src;
-        args[i].cy_src = cy_src;
-        args[i].cx_dst = cx_dst;
-        args[i].cy_dst = cy_dst;
-        args[i].angleRad = invRad;
-        args[i].inicio = i * filasPor;
-        args[i].fin = (i + 1) * filasPor < newH ? (i + 1) * filasPor : newH;
-        if (pthread_create(&hilos[i], NULL, hiloRotacion, &args[i]) != 0) {
-            fprintf(stderr, "Error al crear hilo de rotacion %d\n", i);
-            for (int j = i; j < numHilos; j++) hiloRotacion(&args[j]);
+// Lee las lineas de una conexion y las encola; no espera a que se ejecuten.
+static void* hiloLectorServidor(void* arg) {
+    ConexionServidor* c = (ConexionServidor*)arg;
+    Servidor* s = c->servidor;
+    int fd = dup(c->fd);
+    FILE* f = fd >= 0 ? fdopen(fd, "r") : NULL;
+    if (!f && fd >= 0) close(fd);
+    char* linea = NULL;
+    size_t cap = 0;
+    while (f && getline(&linea, &cap, f) >= 0) {
+        linea[strcspn(linea, "\r\n")] = 0;
+        if (!linea[0]) continue;
+        TrabajoServidor* t = (TrabajoServidor*)malloc(sizeof(TrabajoServidor));
+        if (!t || !(t->linea = strdup(linea))) {
+            free(t);
             break;
         }
+        t->llegada = ahoraSeg();
+        t->siguiente = NULL;
+        pthread_mutex_lock(&s->m);
+        if (c->ultimo) c->ultimo->siguiente = t;
+        else c->primero = t;
+        c->ultimo = t;
+        pthread_cond_signal(&s->hayTrabajo);
+        pthread_mutex_unlock(&s->m);
     }
-    for (int i = 0; i < numHilos; i++) pthread_join(hilos[i], NULL);
-
-
-    liberarPixelesMem(info->pixeles, info->alto, info->ancho);
-    info->pixeles = dst;
-    info->ancho = newW;
-    info->alto = newH;
+    free(linea);
+    if (f) fclose(f);
+    pthread_mutex_lock(&s->m);
+    c->cerrada = 1;
+    if (!c->ocupada && (!c->primero || s->salir)) quitarConexion(s, c);
+    pthread_mutex_unlock(&s->m);
+    return NULL;
+}
 
-    free(hilos);
-    free(args);
-    printf("Imagen rotada %.2f grados. Nuevo tamaño: %dx%d (hilos=%d)\n", anguloGrados, info->ancho, info->alto, numHilos);
+// Socket escuchando en ruta. Un fichero que ya existe solo se reemplaza si nadie
+// responde en el: un servidor vivo no se pisa.
+static int abrirSocketServidor(const char* ruta) {
+    struct sockaddr_un dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.sun_family = AF_UNIX;
+    if (strlen(ruta) >= sizeof(dir.sun_path)) {
+        fprintf(stderr, "Ruta de socket demasiado larga: %s\n", ruta);
+        return -1;
+    }
+    strcpy(dir.sun_path, ruta);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "No se pudo crear el socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&dir, sizeof(dir)) == 0) {
+        fprintf(stderr, "Ya hay un servidor escuchando en %s\n", ruta);
+        close(fd);
+        return -1;
+    }
+    unlink(ruta);
+    if (bind(fd, (struct sockaddr*)&dir, sizeof(dir)) != 0 || listen(fd, 64) != 0) {
+        fprintf(stderr, "No se pudo escuchar en %s: %s\n", ruta, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
-//  SOBEL 
+// Atiende trabajos hasta SIGINT o SIGTERM; devuelve el codigo de salida del proceso.
+static int servirTrabajos(const OpcionesPipeline* op) {
+    int escucha = abrirSocketServidor(op->servidor);
+    if (escucha < 0) return SALIDA_ERROR;
 
-unsigned char rgbToGrayPixel(unsigned char r, unsigned char g, unsigned char b) {
-    return (unsigned char)round((r + g + b) / 3.0);
-}
+    Servidor s;
+    memset(&s, 0, sizeof(s));
+    s.op = op;
+    pthread_mutex_init(&s.m, NULL);
+    pthread_cond_init(&s.hayTrabajo, NULL);
+    pthread_cond_init(&s.sinConexiones, NULL);
 
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = senalParada;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-typedef struct {
-    ImagenInfo* src;
-    unsigned char*** dst; 
-    int inicio, fin;
-} SobelArgs;
+    // Hilos del pool creados antes del primer trabajo.
+    int hilosTrabajo = op->numHilos < 1 ? hilosPorDefecto() : op->numHilos;
+    iniciarPoolHilos(hilosTrabajo);
+    int numEjecutores = op->filtros > 0 ? op->filtros : EJECUTORES_SERVIDOR;
+    pthread_t* ejecutores = (pthread_t*)malloc((size_t)numEjecutores * sizeof(pthread_t));
+    int lanzados = 0;
+    while (ejecutores && lanzados < numEjecutores &&
+           pthread_create(&ejecutores[lanzados], NULL, hiloEjecutorServidor, &s) == 0) {
+        lanzados++;
+    }
+    if (lanzados == 0) {
+        fprintf(stderr, "No se pudieron crear los ejecutores del servidor.\n");
+        free(ejecutores);
+        close(escucha);
+        unlink(op->servidor);
+        return SALIDA_ERROR;
+    }
+    silencioso = 1;
+    printf("Servidor en %s: %d ejecutor(es) x %d hilos. Ctrl+C para parar.\n", op->servidor, lanzados, hilosTrabajo);
+    fflush(stdout);
 
-void* hiloSobel(void* arg) {
-    SobelArgs* a = (SobelArgs*)arg;
-    
-    int Gx[3][3] = {
-        {-1, 0, 1},
-        {-2, 0, 2},
-        {-1, 0, 1}
-    };
-    int Gy[3][3] = {
-        {-1, -2, -1},
-        { 0,  0,  0},
-        { 1,  2,  1}
-    };
-    for (int y = a->inicio; y < a->fin; y++) {
-        for (int x = 0; x < a->src->ancho; x++) {
-          
-            float sumx = 0.0f, sumy = 0.0f;
-            for (int ky = -1; ky <= 1; ky++) {
-                for (int kx = -1; kx <= 1; kx++) {
-                    int yy = y + ky;
-                    int xx = x + kx;
-                    
-                    if (yy < 0) yy = 0;
-                    if (yy >= a->src->alto) yy = a->src->alto - 1;
-                    if (xx < 0) xx = 0;
-                    if (xx >= a->src->ancho) xx = a->src->ancho - 1;
-                    unsigned char gval;
-                    if (a->src->canales == 1) {
-                        gval = a->src->pixeles[yy][xx][0];
-                    } else {
-                        gval = rgbToGrayPixel(a->src->pixeles[yy][xx][0], a->src->pixeles[yy][xx][1], a->src->pixeles[yy][xx][2]);
-                    }
-                    sumx += Gx[ky+1][kx+1] * gval;
-                    sumy += Gy[ky+1][kx+1] * gval;
-                }
-            }
-            int mag = (int)round(sqrtf(sumx*sumx + sumy*sumy));
-            unsigned char v = clamp255(mag);
-           
-            for (int c = 0; c < a->src->canales; c++) {
-                a->dst[y][x][c] = v;
+    double t0 = ahoraSeg();
+    while (!pararServidor) {
+        // poll con plazo: la senal puede llegar a cualquier hilo, no solo a este.
+        struct pollfd pfd = { escucha, POLLIN, 0 };
+        if (poll(&pfd, 1, 250) <= 0) continue;
+        int fd = accept4(escucha, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        ConexionServidor* c = (ConexionServidor*)calloc(1, sizeof(ConexionServidor));
+        pthread_t lector;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (c) {
+            c->servidor = &s;
+            c->fd = fd;
+            pthread_mutex_lock(&s.m);
+            c->siguiente = s.conexiones;
+            s.conexiones = c;
+            s.numConexiones++;
+            if (pthread_create(&lector, &attr, hiloLectorServidor, c) != 0) {
+                c->cerrada = 1;
+                quitarConexion(&s, c);
+                c = NULL;
             }
+            pthread_mutex_unlock(&s.m);
+        } else {
+            close(fd);
         }
+        pthread_attr_destroy(&attr);
+        if (!c) fprintf(stderr, "No se pudo atender una conexion.\n");
     }
-    return NULL;
-}
 
-void detectarBordesSobel(ImagenInfo* info, int numHilos) {
-    if (!info->pixeles) { printf("No hay imagen cargada.\n"); return; }
-    unsigned char*** dst = asignarPixeles(info->alto, info->ancho, info->canales);
-    if (!dst) { fprintf(stderr, "Error al asignar memoria para Sobel.\n"); return; }
-    if (numHilos < 1) numHilos = 1;
-    if (numHilos > info->alto) numHilos = info->alto;
-    pthread_t* hilos = (pthread_t*)malloc(numHilos * sizeof(pthread_t));
-    SobelArgs* args = (SobelArgs*)malloc(numHilos * sizeof(SobelArgs));
-    int filasPor = (int)ceil((double)info->alto / numHilos);
-    for (int i = 0; i < numHilos; i++) {
-        args[i].src = info;
-        args[i].dst = dst;
-        args[i].inicio = i * filasPor;
-        args[i].fin = (i + 1) * filasPor < info->alto ? (i + 1) * filasPor : info->alto;
-        if (pthread_create(&hilos[i], NULL, hiloSobel, &args[i]) != 0) {
-            fprintf(stderr, "Error al crear hilo Sobel %d\n", i);
-            for (int j = i; j < numHilos; j++) hiloSobel(&args[j]);
-            break;
-        }
+    // Parada: los ejecutores acaban y contestan el trabajo en curso; los lectores ven fin de fichero.
+    close(escucha);
+    unlink(op->servidor);
+    pthread_mutex_lock(&s.m);
+    s.salir = 1;
+    pthread_cond_broadcast(&s.hayTrabajo);
+    for (ConexionServidor* c = s.conexiones; c; c = c->siguiente) shutdown(c->fd, SHUT_RD);
+    pthread_mutex_unlock(&s.m);
+    for (int i = 0; i < lanzados; i++) pthread_join(ejecutores[i], NULL);
+    pthread_mutex_lock(&s.m);
+    // Sin ejecutores, las conexiones ya cerradas con trabajos en cola no las quita nadie.
+    for (ConexionServidor *c = s.conexiones, *sig; c; c = sig) {
+        sig = c->siguiente;
+        if (c->cerrada && !c->ocupada) quitarConexion(&s, c);
     }
-    for (int i = 0; i < numHilos; i++) pthread_join(hilos[i], NULL);
+    while (s.numConexiones > 0) pthread_cond_wait(&s.sinConexiones, &s.m);
+    pthread_mutex_unlock(&s.m);
+    silencioso = 0;
 
-    liberarPixelesMem(info->pixeles, info->alto, info->ancho);
-    info->pixeles = dst;
-
-    free(hilos);
-    free(args);
-    printf("Detector de bordes (Sobel) aplicado con %d hilos.\n", numHilos);
+    printf("Servidor parado tras %.1f s: %ld trabajo(s), %ld con error, %ld descartado(s) en cola.\n",
+           ahoraSeg() - t0, s.atendidos, s.fallidos, s.descartados);
+    free(ejecutores);
+    pthread_mutex_destroy(&s.m);
+    pthread_cond_destroy(&s.hayTrabajo);
+    pthread_cond_destroy(&s.sinConexiones);
+    destruirPoolHilos();
+    return EXIT_SUCCESS;
 }
 
-//REDIMENSIONAR 
+//  CLIENTE DEL SERVIDOR
+
+// img --client RUTA [--repeat N] [--clients C] [--baseline] trabajo...
+// C conexiones envian N veces el mismo trabajo, esperando cada respuesta antes del
+// siguiente, y se informa de la latencia vista por el cliente. --baseline repite la
+// medicion lanzando un proceso img por trabajo, lo que cuesta sin servidor.
 
 typedef struct {
-    ImagenInfo* src;
-    unsigned char*** dst;
-    int dstAncho;
-    int dstAlto;
-    int inicio, fin;
-} ResizeArgs;
+    const char* ruta;
+    const char* linea;
+    char* const* argvProceso;  // con --baseline: argumentos de cada proceso
+    int repeticiones;
+    double* latencias;         // en segundos, de los trabajos con respuesta
+    int medidas;
+    int errores;
+    char ultimoError[256];
+} ClienteCarga;
 
-void* hiloResize(void* arg) {
-    ResizeArgs* a = (ResizeArgs*)arg;
-    double scaleX = (double)a->src->ancho / a->dstAncho;
-    double scaleY = (double)a->src->alto / a->dstAlto;
-    for (int y = a->inicio; y < a->fin; y++) {
-        for (int x = 0; x < a->dstAncho; x++) {
-            double srcx = (x + 0.5) * scaleX - 0.5;
-            double srcy = (y + 0.5) * scaleY - 0.5;
-            bilinearInterpolate(a->src, srcy, srcx, a->dst[y][x]);
-        }
+static int conectarServidor(const char* ruta) {
+    struct sockaddr_un dir;
+    memset(&dir, 0, sizeof(dir));
+    dir.sun_family = AF_UNIX;
+    if (strlen(ruta) >= sizeof(dir.sun_path)) return -1;
+    strcpy(dir.sun_path, ruta);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&dir, sizeof(dir)) != 0) {
+        close(fd);
+        fd = -1;
     }
-    return NULL;
+    return fd;
 }
 
-void redimensionarImagen(ImagenInfo* info, int nuevoAncho, int nuevoAlto, int numHilos) {
-    if (!info->pixeles) { printf("No hay imagen cargada.\n"); return; }
-    if (nuevoAncho <= 0 || nuevoAlto <= 0) { printf("Tamaño invalido.\n"); return; }
-    unsigned char*** dst = asignarPixeles(nuevoAlto, nuevoAncho, info->canales);
-    if (!dst) { fprintf(stderr, "Error al asignar memoria para resize.\n"); return; }
-    if (numHilos < 1) numHilos = 1;
-    if (numHilos > nuevoAlto) numHilos = nuevoAlto;
-    pthread_t* hilos = (pthread_t*)malloc(numHilos * sizeof(pthread_t));
-    ResizeArgs* args = (ResizeArgs*)malloc(numHilos * sizeof(ResizeArgs));
-    int filasPor = (int)ceil((double)nuevoAlto / numHilos);
-    for (int i = 0; i < numHilos; i++) {
-        args[i].src = info;
-        args[i].dst = dst;
-        args[i].dstAncho = nuevoAncho;
-        args[i].dstAlto = nuevoAlto;
-        args[i].inicio = i * filasPor;
-        args[i].fin = (i + 1) * filasPor < nuevoAlto ? (i + 1) * filasPor : nuevoAlto;
-        if (pthread_create(&hilos[i], NULL, hiloResize, &args[i]) != 0) {
-            fprintf(stderr, "Error al crear hilo Resize %d\n", i);
-            for (int j = i; j < numHilos; j++) hiloResize(&args[j]);
+static void* hiloClienteSocket(void* arg) {
+    ClienteCarga* c = (ClienteCarga*)arg;
+    int fd = conectarServidor(c->ruta);
+    FILE* f = fd >= 0 ? fdopen(dup(fd), "r") : NULL;
+    if (!f) {
+        snprintf(c->ultimoError, sizeof(c->ultimoError), "no se pudo conectar a %s", c->ruta);
+        c->errores = c->repeticiones;
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    char* respuesta = NULL;
+    size_t cap = 0;
+    for (int i = 0; i < c->repeticiones; i++) {
+        double t0 = ahoraSeg();
+        enviarLinea(fd, c->linea);
+        if (getline(&respuesta, &cap, f) < 0) {
+            snprintf(c->ultimoError, sizeof(c->ultimoError), "el servidor cerro la conexion");
+            c->errores += c->repeticiones - i;
             break;
         }
+        c->latencias[c->medidas++] = ahoraSeg() - t0;
+        if (strncmp(respuesta, "OK", 2) != 0) {
+            respuesta[strcspn(respuesta, "\n")] = 0;
+            snprintf(c->ultimoError, sizeof(c->ultimoError), "%s", respuesta);
+            c->errores++;
+        }
     }
-    for (int i = 0; i < numHilos; i++) pthread_join(hilos[i], NULL);
-
-    liberarPixelesMem(info->pixeles, info->alto, info->ancho);
-    info->pixeles = dst;
-    info->ancho = nuevoAncho;
-    info->alto = nuevoAlto;
+    free(respuesta);
+    fclose(f);
+    close(fd);
+    return NULL;
+}
 
-    free(hilos);
-    free(args);
-    printf("Imagen redimensionada a %dx%d con %d hilos.\n", info->ancho, info->alto, numHilos);
+static void* hiloClienteProceso(void* arg) {
+    ClienteCarga* c = (ClienteCarga*)arg;
+    for (int i = 0; i < c->repeticiones; i++) {
+        double t0 = ahoraSeg();
+        pid_t pid = fork();
+        if (pid == 0) {
+            int nulo = open("/dev/null", O_WRONLY);
+            if (nulo >= 0) dup2(nulo, STDOUT_FILENO);
+            execv("/proc/self/exe", c->argvProceso);
+            _exit(127);
+        }
+        int estado = 0;
+        if (pid < 0 || waitpid(pid, &estado, 0) < 0 || !WIFEXITED(estado) || WEXITSTATUS(estado) != 0) {
+            snprintf(c->ultimoError, sizeof(c->ultimoError), "el proceso termino con error");
+            c->errores++;
+        }
+        c->latencias[c->medidas++] = ahoraSeg() - t0;
+    }
+    return NULL;
 }
 
-//  MENÚ E INTERFAZ
+// Lanza los clientes, espera y resume; devuelve los trabajos con error.
+static int medirClientes(ClienteCarga* clientes, int numClientes, void* (*fn)(void*), const char* titulo,
+                         double* mediana) {
+    pthread_t* hilos = (pthread_t*)malloc((size_t)numClientes * sizeof(pthread_t));
+    if (!hilos) return -1;
+    double t0 = ahoraSeg();
+    int lanzados = 0;
+    while (lanzados < numClientes && pthread_create(&hilos[lanzados], NULL, fn, &clientes[lanzados]) == 0) lanzados++;
+    for (int i = 0; i < lanzados; i++) pthread_join(hilos[i], NULL);
+    double total = ahoraSeg() - t0;
+    free(hilos);
 
-void mostrarMenu() {
-    printf("\n--- Plataforma de Edición de Imágenes ---\n");
-    printf("1. Cargar imagen PNG\n");
-    printf("2. Mostrar matriz de píxeles\n");
-    printf("3. Guardar como PNG\n");
-    printf("4. Ajustar brillo (+/- valor) concurrentemente\n");
-    printf("5. Aplicar convolucion Gaussiana (blur)\n");
-    printf("6. Rotar imagen (grados, bilinear)\n");
-    printf("7. Detectar bordes (Sobel)\n");
-    printf("8. Redimensionar imagen (resize bilinear)\n");
-    printf("9. Salir\n");
-    printf("Opción: ");
+    double* todas = (double*)malloc((size_t)lanzados * (size_t)clientes[0].repeticiones * sizeof(double));
+    if (!todas) return -1;
+    int n = 0, errores = 0;
+    printf("%s\n", titulo);
+    for (int i = 0; i < lanzados; i++) {
+        ClienteCarga* c = &clientes[i];
+        int m = c->medidas;
+        memcpy(todas + n, c->latencias, (size_t)m * sizeof(double));
+        n += m;
+        qsort(c->latencias, (size_t)m, sizeof(double), compararDobles);
+        printf("  cliente %-3d mediana %8.2f ms  p95 %8.2f ms  errores %d\n", i,
+               m ? percentil(c->latencias, m, 50) * 1e3 : 0.0, m ? percentil(c->latencias, m, 95) * 1e3 : 0.0,
+               c->errores);
+        if (c->errores) printf("              ultimo error: %s\n", c->ultimoError);
+        errores += c->errores;
+    }
+    qsort(todas, (size_t)n, sizeof(double), compararDobles);
+    *mediana = n ? percentil(todas, n, 50) : 0.0;
+    printf("  total       mediana %8.2f ms  p95 %8.2f ms  %.1f trabajos/s\n", *mediana * 1e3,
+           n ? percentil(todas, n, 95) * 1e3 : 0.0, total > 0.0 ? n / total : 0.0);
+    free(todas);
+    if (lanzados < numClientes) fprintf(stderr, "Solo se lanzaron %d de %d clientes.\n", lanzados, numClientes);
+    return errores;
 }
 
-int pedirInt(const char* mensaje) {
-    int val;
-    printf("%s", mensaje);
-    if (scanf("%d", &val) != 1) {
-        while (getchar() != '\n');
-        return INT_MIN;
+static int ejecutarCliente(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Uso: %s --client RUTA [--repeat N] [--clients C] [--baseline] trabajo...\n", argv[0]);
+        return SALIDA_USO;
     }
-    while (getchar() != '\n');
-    return val;
-}
+    const char* ruta = argv[2];
+    int repeticiones = 20, numClientes = 1, base = 0, i = 3;
+    for (; i < argc; i++) {
+        if (!strcmp(argv[i], "--repeat") || !strcmp(argv[i], "--clients")) {
+            int* destino = !strcmp(argv[i], "--repeat") ? &repeticiones : &numClientes;
+            if (i + 1 >= argc || !leerEntero(argv[i + 1], destino) || *destino < 1) {
+                fprintf(stderr, "Valor invalido para %s\n", argv[i]);
+                return SALIDA_USO;
+            }
+            i++;
+        } else if (!strcmp(argv[i], "--baseline")) {
+            base = 1;
+        } else {
+            break;
+        }
+    }
+    if (i == argc) { fprintf(stderr, "Falta el trabajo a enviar.\n"); return SALIDA_USO; }
 
-double pedirDouble(const char* mensaje) {
-    double v;
-    printf("%s", mensaje);
-    if (scanf("%lf", &v) != 1) {
-        while (getchar() != '\n');
-        return NAN;
+    // El trabajo viaja como una linea: cada argumento entre comillas y con \ ante " y \.
+    size_t tam = 1;
+    for (int k = i; k < argc; k++) tam += 2 * strlen(argv[k]) + 3;
+    char* linea = (char*)malloc(tam);
+    char** argvProceso = (char**)calloc((size_t)(argc - i + 2), sizeof(char*));
+    ClienteCarga* clientes = (ClienteCarga*)calloc((size_t)numClientes, sizeof(ClienteCarga));
+    double* latencias = (double*)calloc((size_t)numClientes * (size_t)repeticiones, sizeof(double));
+    if (!linea || !argvProceso || !clientes || !latencias) {
+        free(linea);
+        free(argvProceso);
+        free(clientes);
+        free(latencias);
+        return SALIDA_ERROR;
     }
-    while (getchar() != '\n');
-    return v;
+    char* w = linea;
+    for (int k = i; k < argc; k++) {
+        if (k > i) *w++ = ' ';
+        *w++ = '"';
+        for (const char* s = argv[k]; *s; s++) {
+            if (*s == '"' || *s == '\\') *w++ = '\\';
+            *w++ = *s;
+        }
+        *w++ = '"';
+    }
+    *w = 0;
+    argvProceso[0] = argv[0];
+    for (int k = i; k < argc; k++) argvProceso[k - i + 1] = argv[k];
+
+    for (int k = 0; k < numClientes; k++) {
+        clientes[k].ruta = ruta;
+        clientes[k].linea = linea;
+        clientes[k].argvProceso = argvProceso;
+        clientes[k].repeticiones = repeticiones;
+        clientes[k].latencias = latencias + (size_t)k * (size_t)repeticiones;
+    }
+    printf("%d cliente(s) x %d trabajo(s): %s\n", numClientes, repeticiones, linea);
+    double medianaServidor, medianaProcesos;
+    int errores = medirClientes(clientes, numClientes, hiloClienteSocket, "Servidor:", &medianaServidor);
+    if (errores == 0 && base) {
+        for (int k = 0; k < numClientes; k++) clientes[k].errores = clientes[k].medidas = 0;
+        errores = medirClientes(clientes, numClientes, hiloClienteProceso, "Un proceso por trabajo:",
+                                &medianaProcesos);
+        if (errores == 0 && medianaServidor > 0.0) {
+            printf("Mediana con servidor %.2fx menor (%.2f ms menos por trabajo).\n",
+                   medianaProcesos / medianaServidor, (medianaProcesos - medianaServidor) * 1e3);
+        }
+    }
+    free(linea);
+    free(argvProceso);
+    free(clientes);
+    free(latencias);
+    return errores == 0 ? EXIT_SUCCESS : SALIDA_ERROR;
 }
 
 int main(int argc, char* argv[]) {
-    ImagenInfo imagen = {0, 0, 0, NULL};
+    ImagenInfo imagen = {0, 0, 0, 0, NULL, 8};
     char ruta[512] = {0};
 
+    const char* envStats = getenv("IMG_STATS");
+    if (envStats && !fijarModoEstadisticas(envStats)) fprintf(stderr, "IMG_STATS no valido: %s (se ignora)\n", envStats);
+    const char* envAfinidad = getenv("IMG_AFFINITY");
+    if (envAfinidad && !fijarModoAfinidad(envAfinidad)) {
+        fprintf(stderr, "IMG_AFFINITY no valido: %s (se ignora)\n", envAfinidad);
+    }
+    // La umask se lee antes de que haya hilos que creen ficheros.
+    pthread_once(&umaskLeida, leerUmask);
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            mostrarUso(argv[0]);
+            return EXIT_SUCCESS;
+        }
+    }
+    if (argc > 1 && !strcmp(argv[1], "--client")) return ejecutarCliente(argc, argv);
+    // Con alguna opcion en la linea de comandos se ejecuta el pipeline sin menu.
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && argv[i][1]) {
+            PasoPipeline* pasos = (PasoPipeline*)malloc((size_t)argc * sizeof(PasoPipeline));
+            OpcionesPipeline op = { NULL, NULL, 0, 1, NULL, 0, 0, 0, 0, 0, 0, 1, 0, NULL };
+            int numPasos = 0;
+            if (!pasos) return SALIDA_ERROR;
+            int codigo = SALIDA_USO;
+            if (parsearPipeline(argc, argv, pasos, &numPasos, &op)) {
+                codigo = op.servidor ? servirTrabajos(&op)
+                       : op.lote ? procesarLote(&op, pasos, numPasos)
+                       : op.franjas ? procesarPorFranjas(&op, pasos, numPasos)
+                       : ejecutarPipeline(&op, pasos, numPasos);
+            } else {
+                fprintf(stderr, "Use %s --help para ver las opciones.\n", argv[0]);
+            }
+            liberarPasos(pasos, numPasos);
+            free(pasos);
+            return codigo;
+        }
+    }
+
+    // La sesion interactiva reutiliza los buffers de pixeles de una operacion a otra.
+    ArenaImagenes* arena = crearArena();
+    usarArena(arena);
+    Historial historial;
+    iniciarHistorial(&historial);
     if (argc > 1) {
         strncpy(ruta, argv[1], sizeof(ruta) - 1);
         if (!cargarImagen(ruta, &imagen)) return EXIT_FAILURE;
+        registrarVersion(&historial, &imagen, "cargar", 0);
     }
 
     int opcion;
     while (1) {
+        // Cada operacion que cambia la imagen deja aqui su nombre para el historial.
+        char paso[MAX_NOMBRE_VERSION] = "";
+        int hecho = 0;
         mostrarMenu();
         if (scanf("%d", &opcion) != 1) {
             while (getchar() != '\n');
@@ -669,8 +7486,14 @@ int main(int argc, char* argv[]) {
                 printf("Ingresa la ruta del archivo PNG: ");
                 if (fgets(ruta, sizeof(ruta), stdin) == NULL) { printf("Error al leer ruta.\n"); continue; }
                 ruta[strcspn(ruta, "\n")] = 0;
-                liberarImagen(&imagen);
-                if (!cargarImagen(ruta, &imagen)) continue;
+                // Si la carga falla se conserva la imagen actual, que sigue siendo la del historial.
+                ImagenInfo cargada = {0, 0, 0, 0, NULL, 8};
+                if (!cargarImagen(ruta, &cargada)) continue;
+                reemplazarImagen(&imagen, &cargada);
+                // Otra imagen empieza un historial nuevo.
+                vaciarHistorial(&historial);
+                snprintf(paso, sizeof(paso), "cargar");
+                hecho = 1;
                 break;
             }
             case 2:
@@ -684,12 +7507,15 @@ int main(int argc, char* argv[]) {
                 guardarPNG(&imagen, salida);
                 break;
             }
-            case 4: {
-                int delta;
-                printf("Valor de ajuste de brillo (+ para más claro, - para más oscuro): ");
-                if (scanf("%d", &delta) != 1) { while (getchar() != '\n'); printf("Entrada inválida.\n"); continue; }
-                while (getchar() != '\n');
-                ajustarBrilloConcurrente(&imagen, delta);
+            case 4: { // Ajustes puntuales encadenados
+                if (!imagen.pixeles) { printf("No hay imagen cargada.\n"); break; }
+                CadenaPuntual cadena;
+                iniciarCadenaPuntual(&cadena);
+                if (!pedirCadenaPuntual(&cadena)) break;
+                abrirEstadisticas("ajustes puntuales");
+                hecho = aplicarCadenaPuntual(&imagen, &cadena, 0) > 0.0;
+                cerrarEstadisticas();
+                snprintf(paso, sizeof(paso), "ajustes puntuales (%d)", cadena.numAjustes);
                 break;
             }
             case 5: { // Convolucion Gaussiana
@@ -700,7 +7526,10 @@ int main(int argc, char* argv[]) {
                 if (isnan(sigma)) { printf("Entrada invalida.\n"); break; }
                 int nh = pedirInt("Numero de hilos a usar: ");
                 if (nh == INT_MIN) { printf("Entrada invalida.\n"); break; }
-                aplicarConvolucionGaussiana(&imagen, tam, (float)sigma, nh);
+                abrirEstadisticas("blur");
+                hecho = aplicarConvolucionGaussiana(&imagen, tam, (float)sigma, nh);
+                cerrarEstadisticas();
+                snprintf(paso, sizeof(paso), "blur %d:%.2f", tam, sigma);
                 break;
             }
             case 6: { // Rotar
@@ -709,14 +7538,24 @@ int main(int argc, char* argv[]) {
                 if (isnan(ang)) { printf("Entrada invalida.\n"); break; }
                 int nh = pedirInt("Numero de hilos a usar: ");
                 if (nh == INT_MIN) { printf("Entrada invalida.\n"); break; }
-                rotarImagen(&imagen, ang, nh);
+                abrirEstadisticas("rotar");
+                hecho = rotarImagen(&imagen, ang, nh);
+                cerrarEstadisticas();
+                snprintf(paso, sizeof(paso), "rotar %.2f", ang);
                 break;
             }
             case 7: { // Sobel
                 if (!imagen.pixeles) { printf("No hay imagen cargada.\n"); break; }
+                int mag = pedirInt("Magnitud (1 = exacta L2, 2 = rapida |gx|+|gy|): ");
+                if (mag != 1 && mag != 2) { printf("Entrada invalida.\n"); break; }
+                int unCanal = pedirInt("Salida en un solo canal de grises (1 = si, 0 = no): ");
+                if (unCanal != 0 && unCanal != 1) { printf("Entrada invalida.\n"); break; }
                 int nh = pedirInt("Numero de hilos a usar: ");
                 if (nh == INT_MIN) { printf("Entrada invalida.\n"); break; }
-                detectarBordesSobel(&imagen, nh);
+                abrirEstadisticas("sobel");
+                hecho = detectarBordesSobelModo(&imagen, nh, mag == 2 ? SOBEL_L1 : SOBEL_L2, unCanal);
+                cerrarEstadisticas();
+                snprintf(paso, sizeof(paso), "sobel %s", mag == 2 ? "l1" : "l2");
                 break;
             }
             case 8: { // Resize
@@ -725,20 +7564,117 @@ int main(int argc, char* argv[]) {
                 if (nw == INT_MIN) { printf("Entrada invalida.\n"); break; }
                 int nhgt = pedirInt("Nuevo alto: ");
                 if (nhgt == INT_MIN) { printf("Entrada invalida.\n"); break; }
+                int filtro = pedirInt("Filtro (1 = vecino, 2 = bilineal, 3 = area, 4 = Lanczos3): ");
+                if (filtro < 1 || filtro > 4) { printf("Entrada invalida.\n"); break; }
+                int nh = pedirInt("Numero de hilos a usar: ");
+                if (nh == INT_MIN) { printf("Entrada invalida.\n"); break; }
+                abrirEstadisticas("resize");
+                hecho = redimensionarImagenFiltro(&imagen, nw, nhgt, nh, (FiltroResize)(filtro - 1));
+                cerrarEstadisticas();
+                snprintf(paso, sizeof(paso), "resize %dx%d %s", nw, nhgt, nombresFiltro[filtro - 1]);
+                break;
+            }
+            case 9: { // Histograma
+                if (!imagen.pixeles) { printf("No hay imagen cargada.\n"); break; }
+                mostrarHistograma(&imagen, 0);
+                int op = pedirInt("1 = ecualizar, 2 = CLAHE, 3 = auto-niveles, 0 = volver: ");
+                if (op == 0) break;
+                if (op < 1 || op > 3) { printf("Entrada invalida.\n"); break; }
+                int teselas = 0;
+                double parametro = 0.0;
+                if (op == 2) {
+                    teselas = pedirInt("Teselas por lado (e.g., 8): ");
+                    if (teselas < 1 || teselas > 64) { printf("Entrada invalida.\n"); break; }
+                    parametro = pedirDouble("Limite de recorte (e.g., 2.0): ");
+                    if (isnan(parametro) || parametro < 1.0) { printf("Entrada invalida.\n"); break; }
+                } else if (op == 3) {
+                    parametro = pedirDouble("Porcentaje recortado por extremo (e.g., 0.5): ");
+                    if (isnan(parametro) || parametro < 0.0 || parametro >= 50.0) { printf("Entrada invalida.\n"); break; }
+                }
+                static const OperacionHistograma ops[3] = { HIST_ECUALIZAR, HIST_CLAHE, HIST_AUTONIVELES };
+                static const char* nombres[3] = { "ecualizar", "clahe", "auto-niveles" };
+                abrirEstadisticas(nombres[op - 1]);
+                hecho = aplicarHistograma(&imagen, ops[op - 1], teselas, parametro, 0);
+                cerrarEstadisticas();
+                snprintf(paso, sizeof(paso), "%s", nombres[op - 1]);
+                break;
+            }
+            case 10: { // Mediana
+                if (!imagen.pixeles) { printf("No hay imagen cargada.\n"); break; }
+                int radio = pedirInt("Radio (1 = ventana 3x3, 2 = 5x5, ...): ");
+                if (radio < 1 || radio > RADIO_MAX_MEDIANA) { printf("Entrada invalida.\n"); break; }
+                int nh = pedirInt("Numero de hilos a usar: ");
+                if (nh == INT_MIN) { printf("Entrada invalida.\n"); break; }
+                abrirEstadisticas("mediana");
+                hecho = aplicarMediana(&imagen, radio, nh);
+                cerrarEstadisticas();
+                snprintf(paso, sizeof(paso), "mediana %d", radio);
+                break;
+            }
+            case 11: { // Imagen integral
+                if (!imagen.pixeles) { printf("No hay imagen cargada.\n"); break; }
+                int op = pedirInt("1 = caja, 2 = desviacion tipica local, 3 = umbral adaptativo: ");
+                if (op < 1 || op > 3) { printf("Entrada invalida.\n"); break; }
+                int radio = pedirInt("Radio de la ventana: ");
+                if (radio < 1) { printf("Entrada invalida.\n"); break; }
+                double k = K_SAUVOLA;
+                if (op == 3) {
+                    k = pedirDouble("Sensibilidad K (e.g., 0.2): ");
+                    if (isnan(k) || k < 0.0 || k > 1.0) { printf("Entrada invalida.\n"); break; }
+                }
+                int nh = pedirInt("Numero de hilos a usar: ");
+                if (nh == INT_MIN) { printf("Entrada invalida.\n"); break; }
+                static const char* nombres[3] = { "caja", "desviacion local", "umbral adaptativo" };
+                abrirEstadisticas(nombres[op - 1]);
+                hecho = aplicarFiltroIntegral(&imagen, (OperacionIntegral)(op - 1), radio, k, nh);
+                cerrarEstadisticas();
+                snprintf(paso, sizeof(paso), "%s %d", nombres[op - 1], radio);
+                break;
+            }
+            case 12: { // Convolucion general
+                if (!imagen.pixeles) { printf("No hay imagen cargada.\n"); break; }
+                char espec[512];
+                printf("Kernel (sharpen, emboss, motion:L[:GRADOS] o ruta de un fichero NxN): ");
+                if (fgets(espec, sizeof(espec), stdin) == NULL) { printf("Error al leer el kernel.\n"); continue; }
+                espec[strcspn(espec, "\n")] = 0;
+                KernelConvolucion kernel;
+                if (!cargarKernelConvolucion(espec, &kernel)) break;
                 int nh = pedirInt("Numero de hilos a usar: ");
                 if (nh == INT_MIN) { printf("Entrada invalida.\n"); break; }
-                redimensionarImagen(&imagen, nw, nhgt, nh);
+                abrirEstadisticas("convolucion");
+                hecho = aplicarConvolucionGeneral(&imagen, &kernel, nh);
+                cerrarEstadisticas();
+                snprintf(paso, sizeof(paso), "convolucion %.80s", espec);
                 break;
             }
-            case 9:
+            case 13:
+                deshacer(&historial, &imagen);
+                break;
+            case 14:
+                rehacer(&historial, &imagen);
+                break;
+            case 15:
+                vaciarHistorial(&historial);
                 liberarImagen(&imagen);
+                destruirArena(arena);
+                destruirPoolHilos();
                 printf("¡Adiós!\n");
                 return EXIT_SUCCESS;
             default:
                 printf("Opción inválida.\n");
         }
+        if (hecho) {
+            abrirEstadisticas("historial");
+            registrarVersion(&historial, &imagen, paso, 0);
+            cerrarEstadisticas();
+        }
     }
 
+    vaciarHistorial(&historial);
     liberarImagen(&imagen);
+    destruirArena(arena);
+    destruirPoolHilos();
     return EXIT_SUCCESS;
 }
+
+#endif